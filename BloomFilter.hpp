@@ -0,0 +1,119 @@
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <endian.h>
+
+// Bloom filter over strings, used as the summary of a node's shared file names that
+// peers fetch to decide whether a search is worth sending. Hashing is fixed (FNV-1a
+// mixed with splitmix64, then double hashing) so every build agrees on the bit layout.
+class BloomFilter {
+public:
+    // size bounds for filters we build and accept
+    static constexpr size_t kMinBits = 1024;
+    static constexpr size_t kMaxBits = size_t(64) << 20;
+
+    BloomFilter() : k_(0) {}
+    // sized for `expected` keys at the given false-positive rate
+    BloomFilter(size_t expected, double fp_rate) {
+        double bits = -static_cast<double>(std::max<size_t>(expected, 1)) * std::log(fp_rate) / (std::log(2) * std::log(2));
+        size_t n = kMinBits;
+        while (n < bits && n < kMaxBits) n <<= 1;
+        words_.assign(n / 64, 0);
+        k_ = static_cast<uint8_t>(std::clamp(std::lround(static_cast<double>(n) / std::max<size_t>(expected, 1) * std::log(2)), 1L, 16L));
+    }
+
+    void add(const std::string& key) {
+        uint64_t h1, h2;
+        hash(key, h1, h2);
+        size_t mask = words_.size() * 64 - 1;
+        for (uint8_t i = 0; i < k_; ++i) {
+            size_t bit = (h1 + i * h2) & mask;
+            words_[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+
+    bool maybe_contains(const std::string& key) const {
+        if (words_.empty()) return false;
+        uint64_t h1, h2;
+        hash(key, h1, h2);
+        size_t mask = words_.size() * 64 - 1;
+        for (uint8_t i = 0; i < k_; ++i) {
+            size_t bit = (h1 + i * h2) & mask;
+            if (!(words_[bit / 64] & (uint64_t(1) << (bit % 64)))) return false;
+        }
+        return true;
+    }
+
+    size_t bit_count() const { return words_.size() * 64; }
+    size_t byte_size() const { return words_.size() * 8; }
+
+    // wire form: k (8) | bit_count (32) | bits as 64-bit big-endian words
+    void encode(std::vector<uint8_t>& out) const {
+        out.push_back(k_);
+        uint32_t bits = htobe32(static_cast<uint32_t>(bit_count()));
+        const uint8_t* b = reinterpret_cast<const uint8_t*>(&bits);
+        out.insert(out.end(), b, b + 4);
+        size_t at = out.size();
+        out.resize(at + byte_size());
+        for (uint64_t w : words_) {
+            uint64_t be = htobe64(w);
+            std::memcpy(&out[at], &be, 8);
+            at += 8;
+        }
+    }
+
+    bool decode(const uint8_t* data, size_t len) {
+        if (len < 5) return false;
+        uint32_t bits;
+        std::memcpy(&bits, data + 1, 4);
+        bits = be32toh(bits);
+        // a power of two, so positions can be masked
+        if (bits < kMinBits || bits > kMaxBits || (bits & (bits - 1)) || len - 5 != bits / 8) return false;
+        k_ = data[0];
+        words_.resize(bits / 64);
+        for (size_t i = 0; i < words_.size(); ++i) {
+            uint64_t be;
+            std::memcpy(&be, data + 5 + i * 8, 8);
+            words_[i] = be64toh(be);
+        }
+        return true;
+    }
+
+    // search keys are case-insensitive file names
+    static std::string key_for(const std::string& name) {
+        std::string key = name;
+        for (char& c : key) {
+            if (c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+        }
+        return key;
+    }
+
+private:
+    std::vector<uint64_t> words_;
+    uint8_t k_;
+
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    static void hash(const std::string& key, uint64_t& h1, uint64_t& h2) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (unsigned char c : key) {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+        h1 = mix(h);
+        // odd, so the k probes never collapse onto one bit
+        h2 = mix(h1) | 1;
+    }
+};
+
+#endif // BLOOM_FILTER_HPP
@@ -0,0 +1,636 @@
+#include "ControlServer.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <chrono>
+
+// a watcher that stops reading is dropped once this much output is queued for it
+static constexpr size_t kMaxClientBacklog = 4 << 20;
+// finished jobs remembered for `jobs` and `wait`
+static constexpr size_t kFinishedJobsKept = 1000;
+// descriptors a client may have passed and not yet used
+static constexpr size_t kMaxPassedFds = 4;
+
+static std::string json_str(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char esc[8];
+                    std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+static std::string error_json(const std::string& msg) {
+    return "{\"ok\":false,\"error\":" + json_str(msg) + "}";
+}
+
+static bool job_finished(const std::string& state) {
+    return state != "queued" && state != "requesting" && state != "sending";
+}
+
+static const char* status_name(const DeviceInfo& d) {
+    uint8_t code = d.lastMessage;
+    // listed from the device cache, not heard from yet
+    if (!d.verified) return "unverified";
+    if (code == MessageCodec::MSG_ALIVE) return "alive";
+    if (code == MessageCodec::MSG_SHUTDOWN) return "shutdown";
+    return "unknown";
+}
+
+static std::string device_json(const DeviceInfo& d) {
+    auto age = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - d.lastSeen);
+    char nums[256];
+    std::snprintf(nums, sizeof(nums),
+                  "\"proto\":%u,\"data_port\":%u,\"control_port\":%u,\"active_transfers\":%u,\"free_disk_mb\":%u,"
+                  "\"bandwidth_kbps\":%u,\"rtt_ms\":%.2f,\"jitter_ms\":%.2f,\"loss\":%.4f,\"age_ms\":%lld",
+                  d.proto_version, d.data_port_or_default(), d.control_port_or_default(), d.active_transfers,
+                  d.free_disk_mb, d.bandwidth_kbps, d.path.rtt_ms, d.path.jitter_ms, d.path.loss,
+                  static_cast<long long>(age.count()));
+    return "{\"ip\":" + json_str(d.ip) + ",\"hostname\":" + json_str(d.hostname) + ",\"iface\":" + json_str(d.iface) +
+           ",\"status\":\"" + status_name(d) + "\"," + nums + "}";
+}
+
+static std::string transfer_json(const TransferProgress& t) {
+    int state = t.state.load();
+    char nums[96];
+    std::snprintf(nums, sizeof(nums), "\"total\":%llu,\"done\":%llu", static_cast<unsigned long long>(t.total_bytes),
+                  static_cast<unsigned long long>(t.done_bytes.load()));
+    return std::string("{\"direction\":\"") + (t.outgoing ? "out" : "in") + "\",\"peer\":" + json_str(t.peer_ip) +
+           ",\"file\":" + json_str(t.filename) + "," + nums + ",\"state\":\"" +
+           (state == 0 ? "running" : state > 0 ? "done" : "failed") + "\"}";
+}
+
+static const char* decision_name(int d) {
+    return d < 0 ? "pending" : d ? "accepted" : "rejected";
+}
+
+ControlServer::ControlServer(EventLoop& loop, SubnetListener& listener, FileTransfer& ft, unsigned int send_threads)
+    : loop_(loop), listener_(listener), ft_(ft), send_pool_(send_threads), query_pool_(kQueryThreads),
+      search_(listener, ft), sockfd_(-1), auto_accept_(false), stopping_(false), next_client_(1), next_job_(1),
+      requests_version_seen_(0), last_request_seen_(0),
+      change_queued_(std::make_shared<std::atomic<bool>>(false)) {}
+
+ControlServer::~ControlServer() {
+    stop();
+}
+
+bool ControlServer::start(const std::string& path) {
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::fprintf(stderr, "Control: socket path too long: %s\n", path.c_str());
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    sockfd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd_ < 0) {
+        perror("Control: socket");
+        return false;
+    }
+    // a socket file nobody answers on is left over from a crash; a live one means another daemon
+    if (connect(sockfd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+        std::fprintf(stderr, "Control: %s is in use by another daemon\n", path.c_str());
+        ::close(sockfd_);
+        sockfd_ = -1;
+        return false;
+    }
+    ::unlink(path.c_str());
+    // owner only: anyone who can connect can send files as us
+    mode_t old_mask = umask(077);
+    int r = bind(sockfd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    umask(old_mask);
+    if (r < 0 || listen(sockfd_, 64) < 0) {
+        perror("Control: bind");
+        ::close(sockfd_);
+        sockfd_ = -1;
+        return false;
+    }
+    path_ = path;
+
+    loop_.run_sync([this]() {
+        requests_version_seen_ = ft_.requests_version();
+        decisions_seen_.clear();
+        for (const auto& req : ft_.get_pending_requests()) {
+            last_request_seen_ = req->id;
+            decisions_seen_[req->id] = req->decision.load();
+        }
+        for (const auto& t : ft_.get_transfers()) transfer_states_[t.get()] = t->state.load();
+        loop_.add_fd(sockfd_, EPOLLIN, [this](uint32_t) { on_accept(); });
+    });
+    devices_sub_ = listener_.subscribe([this]() { loop_.post([this]() { on_device_events(); }); });
+    search_.start();
+    // called from any thread and possibly often: coalesce into one pass on the loop
+    auto queued = change_queued_;
+    ft_.set_change_observer([this, queued]() {
+        if (!queued->exchange(true)) loop_.post([this]() { on_transfer_change(); });
+    });
+    return true;
+}
+
+void ControlServer::stop() {
+    if (sockfd_ < 0) return;
+    ft_.set_change_observer(nullptr);
+    // queued sends see stopping_ and cancel; running ones are waited for
+    stopping_.store(true);
+    query_pool_.shutdown();
+    search_.stop();
+    send_pool_.shutdown();
+    // a stream would otherwise run until its producer closes
+    streams_cancel_.cancel();
+    std::map<uint64_t, std::thread> streams;
+    loop_.run_sync([this, &streams]() { streams.swap(streams_); });
+    for (auto& [id, t] : streams) t.join();
+    loop_.run_sync([this]() {
+        devices_sub_.reset();
+        while (!clients_.empty()) close_client(clients_.begin()->first);
+        loop_.remove_fd(sockfd_);
+        ::close(sockfd_);
+        sockfd_ = -1;
+    });
+    // let anything posted from loop callbacks while the sync above waited run before we go
+    loop_.run_sync([]() {});
+    ::unlink(path_.c_str());
+}
+
+void ControlServer::on_accept() {
+    while (true) {
+        int client = accept4(sockfd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) return;
+        clients_[client].id = next_client_++;
+        loop_.add_fd(client, EPOLLIN, [this, client](uint32_t events) { on_client(client, events); });
+    }
+}
+
+void ControlServer::on_client(int fd, uint32_t events) {
+    if (events & EPOLLOUT) {
+        flush(fd);
+        if (clients_.find(fd) == clients_.end()) return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+    char buf[4096];
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxPassedFds)];
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    auto it = clients_.find(fd);
+    // descriptors ride along with the command line that uses them
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); r > 0 && cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < n; ++i) {
+            int passed;
+            std::memcpy(&passed, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (it != clients_.end() && it->second.fds.size() < kMaxPassedFds) it->second.fds.push_back(passed);
+            else ::close(passed);
+        }
+    }
+    if (r <= 0 || (msg.msg_flags & MSG_CTRUNC)) {
+        close_client(fd);
+        return;
+    }
+    if (it == clients_.end()) return;
+    it->second.in.append(buf, r);
+    if (it->second.in.size() > 64 * 1024) {
+        close_client(fd);
+        return;
+    }
+    size_t nl;
+    while ((it = clients_.find(fd)) != clients_.end() && (nl = it->second.in.find('\n')) != std::string::npos) {
+        std::string line = it->second.in.substr(0, nl);
+        it->second.in.erase(0, nl + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        std::string answer = handle(fd, line);
+        if (!answer.empty()) reply(fd, answer);
+    }
+}
+
+void ControlServer::reply(int fd, const std::string& json) {
+    auto it = clients_.find(fd);
+    if (it == clients_.end()) return;
+    Client& c = it->second;
+    if (c.out.size() > kMaxClientBacklog) {
+        close_client(fd);
+        return;
+    }
+    bool idle = c.out.empty();
+    c.out += json;
+    c.out += '\n';
+    if (idle) flush(fd);
+}
+
+void ControlServer::flush(int fd) {
+    auto it = clients_.find(fd);
+    if (it == clients_.end()) return;
+    Client& c = it->second;
+    while (!c.out.empty()) {
+        ssize_t w = send(fd, c.out.data(), c.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            loop_.modify_fd(fd, EPOLLIN | EPOLLOUT);
+            return;
+        }
+        if (w <= 0) {
+            close_client(fd);
+            return;
+        }
+        c.out.erase(0, w);
+    }
+    loop_.modify_fd(fd, EPOLLIN);
+}
+
+void ControlServer::close_client(int fd) {
+    loop_.remove_fd(fd);
+    auto it = clients_.find(fd);
+    if (it != clients_.end()) {
+        for (int passed : it->second.fds) ::close(passed);
+        clients_.erase(it);
+    }
+    ::close(fd);
+}
+
+void ControlServer::broadcast(const std::string& json) {
+    std::vector<int> watchers;
+    for (const auto& [fd, c] : clients_) {
+        if (c.watching) watchers.push_back(fd);
+    }
+    for (int fd : watchers) reply(fd, json);
+}
+
+std::string ControlServer::handle(int fd, const std::string& line) {
+    size_t sp = line.find(' ');
+    std::string cmd = line.substr(0, sp);
+    size_t arg = line.find_first_not_of(' ', sp);
+    std::string rest = arg == std::string::npos ? "" : line.substr(arg);
+    if (cmd == "devices") return cmd_devices();
+    if (cmd == "requests") return cmd_requests();
+    if (cmd == "transfers") return cmd_transfers();
+    if (cmd == "jobs") return cmd_jobs();
+    if (cmd == "accept" || cmd == "reject") {
+        char* end = nullptr;
+        unsigned long long id = std::strtoull(rest.c_str(), &end, 10);
+        if (rest.empty() || *end != '\0' || rest[0] == '-') return error_json("usage: " + cmd + " ID");
+        if (!ft_.decide_request_by_id(id, cmd == "accept")) {
+            return error_json("no request " + rest);
+        }
+        return "{\"ok\":true}";
+    }
+    // IP, then a path that may contain spaces
+    size_t ip_end = rest.find(' ');
+    std::string ip = rest.substr(0, ip_end);
+    size_t tail_at = ip_end == std::string::npos ? std::string::npos : rest.find_first_not_of(' ', ip_end);
+    std::string tail = tail_at == std::string::npos ? "" : rest.substr(tail_at);
+    if (cmd == "send") {
+        if (ip.empty() || tail.empty()) return error_json("usage: send IP PATH");
+        return cmd_send(ip, tail);
+    }
+    if (cmd == "stream") {
+        if (ip.empty() || tail.empty()) return error_json("usage: stream IP NAME");
+        return cmd_stream(fd, ip, tail);
+    }
+    if (cmd == "browse") {
+        if (ip.empty()) return error_json("usage: browse IP [AFTER]");
+        return cmd_browse(fd, ip, tail);
+    }
+    if (cmd == "pull") {
+        if (ip.empty() || tail.empty()) return error_json("usage: pull IP PATH");
+        return cmd_pull(fd, ip, tail);
+    }
+    if (cmd == "wait") {
+        uint64_t id = std::strtoull(rest.c_str(), nullptr, 10);
+        auto it = jobs_.find(id);
+        if (it == jobs_.end()) return error_json("no job " + rest);
+        if (!job_finished(it->second.state)) {
+            // answered by set_job_state()
+            it->second.waiters.push_back({fd, clients_[fd].id});
+            return "";
+        }
+        const std::string& state = it->second.state;
+        return "{\"ok\":" + std::string(state == "done" ? "true" : "false") + ",\"id\":" + std::to_string(id) +
+               ",\"state\":" + json_str(state) + (state == "done" ? "" : ",\"error\":" + json_str(state)) + "}";
+    }
+    if (cmd == "search") {
+        if (rest.empty()) return error_json("usage: search NAME");
+        return cmd_search(fd, rest);
+    }
+    if (cmd == "watch") {
+        clients_[fd].watching = true;
+        return "{\"ok\":true,\"watching\":true}";
+    }
+    if (cmd == "help") {
+        return "{\"ok\":true,\"commands\":[\"devices\",\"requests\",\"accept ID\",\"reject ID\",\"transfers\","
+               "\"send IP PATH\",\"jobs\",\"wait ID\",\"watch\",\"browse IP [AFTER]\",\"pull IP PATH\",\"search NAME\",\"stream IP NAME\"]}";
+    }
+    return error_json("unknown command: " + cmd);
+}
+
+std::string ControlServer::cmd_devices() {
+    std::string out = "{\"ok\":true,\"devices\":[";
+    bool first = true;
+    for (const auto& d : listener_.devices_by_load()) {
+        if (!first) out += ',';
+        first = false;
+        out += device_json(d);
+    }
+    return out + "]}";
+}
+
+std::string ControlServer::cmd_requests() {
+    std::string out = "{\"ok\":true,\"requests\":[";
+    auto reqs = ft_.get_pending_requests();
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        if (i) out += ',';
+        out += "{\"id\":" + std::to_string(reqs[i]->id) + ",\"peer\":" + json_str(reqs[i]->peer_ip) +
+               ",\"file\":" + json_str(reqs[i]->filename) + ",\"decision\":\"" +
+               decision_name(reqs[i]->decision.load()) + "\"}";
+    }
+    return out + "]}";
+}
+
+std::string ControlServer::cmd_transfers() {
+    std::string out = "{\"ok\":true,\"transfers\":[";
+    bool first = true;
+    for (const auto& t : ft_.get_transfers()) {
+        if (!first) out += ',';
+        first = false;
+        out += transfer_json(*t);
+    }
+    return out + "]}";
+}
+
+std::string ControlServer::cmd_jobs() {
+    std::string out = "{\"ok\":true,\"jobs\":[";
+    bool first = true;
+    for (const auto& [id, job] : jobs_) {
+        if (!first) out += ',';
+        first = false;
+        out += "{\"id\":" + std::to_string(id) + ",\"ip\":" + json_str(job.ip) + ",\"path\":" + json_str(job.path) +
+               ",\"state\":" + json_str(job.state) + "}";
+    }
+    return out + "]}";
+}
+
+std::string ControlServer::cmd_send(const std::string& ip, const std::string& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return error_json("not a regular file: " + path);
+    if (::access(path.c_str(), R_OK) != 0) return error_json("not readable: " + path);
+
+    uint64_t id = next_job_++;
+    jobs_[id] = SendJob{ip, path, "queued", {}};
+    broadcast("{\"event\":\"job\",\"id\":" + std::to_string(id) + ",\"state\":\"queued\"}");
+    send_pool_.submit([this, id, ip, path]() {
+        auto state = [this, id](const char* s) { loop_.post([this, id, s]() { set_job_state(id, s); }); };
+        if (stopping_.load()) {
+            state("cancelled");
+            return;
+        }
+        DeviceInfo target = target_for(ip);
+        auto slash = path.find_last_of('/');
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+        state("requesting");
+        if (!ft_.request_send(ip, target.control_port_or_default(), name, 30000, target.iface)) {
+            state("rejected");
+            return;
+        }
+        state("sending");
+        bool ok = ft_.send_file(ip, target.data_port_or_default(), path, target.iface, target.path,
+                                target.flags & MessageCodec::BEACON_FLAG_SPARSE);
+        state(ok ? "done" : "failed");
+    });
+    return "{\"ok\":true,\"id\":" + std::to_string(id) + "}";
+}
+
+std::string ControlServer::cmd_stream(int fd, const std::string& ip, const std::string& name) {
+    Client& c = clients_[fd];
+    if (c.fds.empty()) return error_json("stream needs a descriptor passed with the command");
+    int in = c.fds.front();
+    c.fds.erase(c.fds.begin());
+    DeviceInfo target = target_for(ip);
+    if (!(target.flags & MessageCodec::BEACON_FLAG_STREAM)) {
+        ::close(in);
+        return error_json("peer does not take streams: " + ip);
+    }
+    if (streams_.size() >= kMaxStreams || stopping_.load()) {
+        ::close(in);
+        return error_json("too many streams running");
+    }
+
+    uint64_t id = next_job_++;
+    jobs_[id] = SendJob{ip, name, "queued", {}};
+    broadcast("{\"event\":\"job\",\"id\":" + std::to_string(id) + ",\"state\":\"queued\"}");
+    streams_[id] = std::thread([this, id, target, name, in]() {
+        auto state = [this, id](const char* s) { loop_.post([this, id, s]() { set_job_state(id, s); }); };
+        // the last thing the thread does: the loop joins it
+        auto finish = [this, id, state](const char* s) {
+            state(s);
+            loop_.post([this, id]() {
+                auto it = streams_.find(id);
+                if (it == streams_.end()) return;
+                it->second.join();
+                streams_.erase(it);
+            });
+        };
+        state("requesting");
+        if (!ft_.request_send(target.ip, target.control_port_or_default(), name, 30000, target.iface,
+                              &streams_cancel_)) {
+            ::close(in);
+            finish(streams_cancel_.cancelled() ? "cancelled" : "rejected");
+            return;
+        }
+        state("sending");
+        bool ok = ft_.send_pipe(target.ip, target.data_port_or_default(), in, name, target.iface, target.path,
+                                &streams_cancel_);
+        ::close(in);
+        finish(ok ? "done" : streams_cancel_.cancelled() ? "cancelled" : "failed");
+    });
+    return "{\"ok\":true,\"id\":" + std::to_string(id) + "}";
+}
+
+std::string ControlServer::cmd_browse(int fd, const std::string& ip, const std::string& after) {
+    // a page is one JSON line, so keep it to a size clients read comfortably
+    constexpr size_t kBrowsePage = 500;
+    DeviceInfo target = target_for(ip);
+    reply_later(fd, [this, target, after]() {
+        CatalogPage page;
+        if (!ft_.fetch_catalog(target.ip, target.control_port_or_default(), after, kBrowsePage, page, 10000,
+                               target.iface)) {
+            return error_json("no shared folder at " + target.ip);
+        }
+        std::string out = "{\"ok\":true,\"total\":" + std::to_string(page.total) + ",\"more\":" +
+                          (page.more ? "true" : "false");
+        if (page.more) out += ",\"next\":" + json_str(page.entries.back().path);
+        out += ",\"files\":[";
+        for (size_t i = 0; i < page.entries.size(); ++i) {
+            const CatalogEntry& e = page.entries[i];
+            if (i) out += ',';
+            out += "{\"path\":" + json_str(e.path) + ",\"size\":" + std::to_string(e.size) +
+                   ",\"mtime\":" + std::to_string(e.mtime) + "}";
+        }
+        return out + "]}";
+    });
+    return "";
+}
+
+std::string ControlServer::cmd_pull(int fd, const std::string& ip, const std::string& path) {
+    DeviceInfo target = target_for(ip);
+    reply_later(fd, [this, target, path]() {
+        if (!ft_.request_pull(target.ip, target.control_port_or_default(), path, 10000, target.iface)) {
+            return error_json("pull refused: " + path);
+        }
+        // the file arrives as a normal receive; watch or transfers shows its progress
+        return std::string("{\"ok\":true,\"pulling\":") + json_str(path) + "}";
+    });
+    return "";
+}
+
+std::string ControlServer::cmd_search(int fd, const std::string& name) {
+    reply_later(fd, [this, name]() {
+        SearchStats stats;
+        auto started = std::chrono::steady_clock::now();
+        auto hits = search_.search(name, 100, 2000, &stats);
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+        char head[160];
+        std::snprintf(head, sizeof(head), "{\"ok\":true,\"sharing\":%zu,\"queried\":%zu,\"fetched\":%zu,\"ms\":%.2f",
+                      stats.sharing, stats.queried, stats.fetched, us.count() / 1000.0);
+        std::string out = std::string(head) + ",\"hits\":[";
+        for (size_t i = 0; i < hits.size(); ++i) {
+            if (i) out += ',';
+            out += "{\"ip\":" + json_str(hits[i].ip) + ",\"hostname\":" + json_str(hits[i].hostname) +
+                   ",\"path\":" + json_str(hits[i].entry.path) + ",\"size\":" + std::to_string(hits[i].entry.size) +
+                   ",\"mtime\":" + std::to_string(hits[i].entry.mtime) + "}";
+        }
+        return out + "]}";
+    });
+    return "";
+}
+
+void ControlServer::reply_later(int fd, std::function<std::string()> work) {
+    uint64_t client_id = clients_[fd].id;
+    query_pool_.submit([this, fd, client_id, work]() {
+        std::string answer = work();
+        loop_.post([this, fd, client_id, answer]() {
+            auto c = clients_.find(fd);
+            if (c != clients_.end() && c->second.id == client_id) reply(fd, answer);
+        });
+    });
+}
+
+DeviceInfo ControlServer::target_for(const std::string& ip) const {
+    // the ports the peer advertises and the interface it was discovered on; unknown or
+    // legacy peers get the defaults
+    DeviceInfo target;
+    target.ip = ip;
+    auto devices = listener_.snapshot();
+    auto it = devices->find(ip);
+    if (it != devices->end()) target = it->second;
+    return target;
+}
+
+void ControlServer::set_job_state(uint64_t id, const std::string& state) {
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) return;
+    SendJob& job = it->second;
+    job.state = state;
+    broadcast("{\"event\":\"job\",\"id\":" + std::to_string(id) + ",\"ip\":" + json_str(job.ip) +
+              ",\"path\":" + json_str(job.path) + ",\"state\":" + json_str(state) + "}");
+    if (!job_finished(state)) return;
+
+    bool done = state == "done";
+    std::string answer = "{\"ok\":" + std::string(done ? "true" : "false") + ",\"id\":" + std::to_string(id) +
+                         ",\"state\":" + json_str(state) + (done ? "" : ",\"error\":" + json_str(state)) + "}";
+    for (const auto& [fd, client_id] : job.waiters) {
+        auto c = clients_.find(fd);
+        if (c != clients_.end() && c->second.id == client_id) reply(fd, answer);
+    }
+    job.waiters.clear();
+
+    // forget the oldest finished jobs (ids grow, so map order is age order)
+    size_t finished = 0;
+    for (const auto& [jid, j] : jobs_) finished += job_finished(j.state);
+    for (auto j = jobs_.begin(); finished > kFinishedJobsKept && j != jobs_.end();) {
+        if (job_finished(j->second.state)) {
+            j = jobs_.erase(j);
+            --finished;
+        } else {
+            ++j;
+        }
+    }
+}
+
+void ControlServer::on_device_events() {
+    if (!devices_sub_) return;
+    for (const auto& e : devices_sub_->drain()) {
+        const char* type = e.type == DeviceEventType::Added     ? "device_added"
+                           : e.type == DeviceEventType::Updated ? "device_updated"
+                           : e.type == DeviceEventType::Expired ? "device_expired"
+                                                                : "device_shutdown";
+        broadcast(std::string("{\"event\":\"") + type + "\",\"device\":" + device_json(e.info) + "}");
+    }
+}
+
+void ControlServer::on_transfer_change() {
+    change_queued_->store(false);
+
+    // progress updates come through here too; the request list only when it changed
+    uint64_t version = ft_.requests_version();
+    if (version != requests_version_seen_) {
+        requests_version_seen_ = version;
+        std::unordered_map<uint64_t, int> seen;
+        for (const auto& req : ft_.get_pending_requests()) {
+            int decision = req->decision.load();
+            auto prev = decisions_seen_.find(req->id);
+            int shown = prev == decisions_seen_.end() ? -1 : prev->second;
+            if (req->id > last_request_seen_) {
+                last_request_seen_ = req->id;
+                broadcast("{\"event\":\"request\",\"id\":" + std::to_string(req->id) + ",\"peer\":" +
+                          json_str(req->peer_ip) + ",\"file\":" + json_str(req->filename) + "}");
+                if (auto_accept_ && decision < 0) ft_.decide_request_by_id(req->id, true);
+            }
+            if (decision >= 0 && shown != decision) {
+                shown = decision;
+                broadcast("{\"event\":\"decision\",\"id\":" + std::to_string(req->id) + ",\"decision\":\"" +
+                          decision_name(decision) + "\"}");
+            }
+            seen[req->id] = shown;
+        }
+        decisions_seen_.swap(seen);
+    }
+
+    std::unordered_map<const TransferProgress*, int> states;
+    for (const auto& t : ft_.get_transfers()) {
+        int state = t->state.load();
+        auto prev = transfer_states_.find(t.get());
+        if (prev == transfer_states_.end() && state == 0) {
+            broadcast("{\"event\":\"transfer_started\",\"transfer\":" + transfer_json(*t) + "}");
+        }
+        if (state != 0 && (prev == transfer_states_.end() || prev->second == 0)) {
+            broadcast("{\"event\":\"transfer_finished\",\"transfer\":" + transfer_json(*t) + "}");
+        }
+        states[t.get()] = state;
+    }
+    transfer_states_.swap(states);
+}
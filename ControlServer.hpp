@@ -0,0 +1,131 @@
+#ifndef CONTROL_SERVER_HPP
+#define CONTROL_SERVER_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include "EventLoop.hpp"
+#include "SubnetListener.hpp"
+#include "FileTransfer.hpp"
+#include "LanSearch.hpp"
+
+// Local control API for the headless daemon, on a Unix-domain stream socket. Clients send
+// one command per line and get one line of JSON back, {"ok":true,...} or
+// {"ok":false,"error":"..."}:
+//
+//   devices                 known peers with ports, load and path estimates
+//   requests                incoming file requests (undecided and the last few decided);
+//                           id, peer, file, decision
+//   accept ID | reject ID   decide request ID
+//   transfers               running and recently finished sends and receives
+//   send IP PATH            queue a send (request, then data); answers with the job id
+//   jobs                    queued sends and their state
+//   wait ID                 answers once job ID has finished
+//   watch                   acknowledges, then streams one JSON event per line
+//   browse IP [AFTER]       a page of the peer's shared folder, paths after AFTER
+//   pull IP PATH            have the peer send PATH from its shared folder to us
+//   search NAME             sharing peers with a file called NAME (or at path NAME)
+//   stream IP NAME          queue a stream job sending everything read from a descriptor
+//                           passed along with the line (SCM_RIGHTS) as NAME; needs a peer
+//                           advertising BEACON_FLAG_STREAM. Answers with the job id
+//
+// Everything runs on the event loop except the sends themselves, which take threads of a
+// pool of their own so a 30 s wait for a peer's decision never holds up receives, and the
+// queries (browse, pull, search), which have another pool so they never wait behind sends.
+// A stream can run for hours, so each gets a thread of its own instead of a pool thread.
+class ControlServer {
+public:
+    // browse, pull and search in flight at once
+    static constexpr unsigned int kQueryThreads = 4;
+    // streams running at once; more are refused
+    static constexpr size_t kMaxStreams = 16;
+
+    ControlServer(EventLoop& loop, SubnetListener& listener, FileTransfer& ft, unsigned int send_threads = 4);
+    ~ControlServer();
+
+    // replaces a stale socket file left by a previous run
+    bool start(const std::string& path);
+    // stops accepting, cancels queued sends and running streams, and waits for running sends
+    void stop();
+    // accept every incoming request as soon as it arrives. Call before start().
+    void set_auto_accept(bool on) { auto_accept_ = on; }
+
+private:
+    struct Client {
+        // unique for the server's lifetime, unlike the fd
+        uint64_t id = 0;
+        std::string in;
+        std::string out;
+        bool watching = false;
+        // descriptors passed with SCM_RIGHTS, oldest first, waiting for a `stream`
+        std::vector<int> fds;
+    };
+    struct SendJob {
+        std::string ip;
+        std::string path;
+        // queued, requesting, sending, done, rejected, failed, cancelled
+        std::string state;
+        // clients blocked in `wait`, as fd and client id
+        std::vector<std::pair<int, uint64_t>> waiters;
+    };
+
+    EventLoop& loop_;
+    SubnetListener& listener_;
+    FileTransfer& ft_;
+    WorkerPool send_pool_;
+    WorkerPool query_pool_;
+    LanSearch search_;
+    std::string path_;
+    int sockfd_;
+    bool auto_accept_;
+    std::atomic<bool> stopping_;
+    // everything below is only touched on the loop thread
+    std::unordered_map<int, Client> clients_;
+    uint64_t next_client_;
+    std::map<uint64_t, SendJob> jobs_;
+    uint64_t next_job_;
+    // stream job id -> its thread, joined once it has posted its last state
+    std::map<uint64_t, std::thread> streams_;
+    TransferCancel streams_cancel_;
+    std::shared_ptr<DeviceSubscription> devices_sub_;
+    // what watchers were last told about requests and transfers
+    uint64_t requests_version_seen_;
+    uint64_t last_request_seen_;
+    std::unordered_map<uint64_t, int> decisions_seen_;
+    std::unordered_map<const TransferProgress*, int> transfer_states_;
+    std::shared_ptr<std::atomic<bool>> change_queued_;
+
+    void on_accept();
+    void on_client(int fd, uint32_t events);
+    void flush(int fd);
+    void close_client(int fd);
+    void reply(int fd, const std::string& json);
+    void broadcast(const std::string& json);
+    std::string handle(int fd, const std::string& line);
+
+    std::string cmd_devices();
+    std::string cmd_requests();
+    std::string cmd_transfers();
+    std::string cmd_jobs();
+    std::string cmd_send(const std::string& ip, const std::string& path);
+    std::string cmd_browse(int fd, const std::string& ip, const std::string& after);
+    std::string cmd_pull(int fd, const std::string& ip, const std::string& path);
+    std::string cmd_search(int fd, const std::string& name);
+    std::string cmd_stream(int fd, const std::string& ip, const std::string& name);
+    // runs blocking `work` on the query pool and answers fd with its result, unless the
+    // client has gone in the meantime
+    void reply_later(int fd, std::function<std::string()> work);
+    // peer as the listener knows it, or just the ip (default ports) if it doesn't
+    DeviceInfo target_for(const std::string& ip) const;
+    void set_job_state(uint64_t id, const std::string& state);
+
+    void on_device_events();
+    void on_transfer_change();
+};
+
+#endif // CONTROL_SERVER_HPP
@@ -0,0 +1,161 @@
+#include "DeviceCache.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+
+namespace {
+
+constexpr char kMagic[4] = {'L', 'S', 'D', 'C'};
+constexpr uint16_t kVersion = 1;
+
+struct Header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t saved_unix;
+};
+
+struct Record {
+    // sin_addr.s_addr
+    uint32_t addr;
+    uint32_t seen_unix;
+    uint16_t data_port;
+    uint16_t control_port;
+    uint8_t proto_version;
+    uint8_t flags;
+    uint8_t hostname_len;
+    uint8_t iface_len;
+    uint32_t bandwidth_kbps;
+    float rtt_ms;
+    char iface[16];
+    char hostname[MessageCodec::BEACON_MAX_HOSTNAME];
+};
+
+static_assert(sizeof(Header) == 16, "cache header layout");
+static_assert(sizeof(Record) == 104, "cache record layout");
+
+} // namespace
+
+std::vector<DeviceInfo> DeviceCache::load(const std::string& path, unsigned int max_age_s) {
+    std::vector<DeviceInfo> out;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return out;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+        ::close(fd);
+        return out;
+    }
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        perror(("DeviceCache: " + path).c_str());
+        return out;
+    }
+
+    const auto* header = static_cast<const Header*>(map);
+    const auto* records = reinterpret_cast<const Record*>(header + 1);
+    if (std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 || header->version != kVersion ||
+        header->record_size != sizeof(Record) || (size - sizeof(Header)) / sizeof(Record) < header->count) {
+        munmap(map, size);
+        return out;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    uint32_t now_unix = static_cast<uint32_t>(std::time(nullptr));
+    out.reserve(header->count);
+    for (uint32_t i = 0; i < header->count; ++i) {
+        const Record& r = records[i];
+        if (r.seen_unix < now_unix && now_unix - r.seen_unix > max_age_s) continue;
+        if (r.hostname_len > sizeof(r.hostname) || r.iface_len >= sizeof(r.iface)) continue;
+        if (!MessageCodec::valid_hostname(r.hostname, r.hostname_len)) continue;
+        DeviceInfo d;
+        struct in_addr a;
+        a.s_addr = r.addr;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &a, ip, sizeof(ip));
+        d.ip = ip;
+        d.hostname.assign(r.hostname, r.hostname_len);
+        d.lastMessage = MessageCodec::MSG_ALIVE;
+        d.lastSeen = now;
+        d.verified = false;
+        d.iface.assign(r.iface, r.iface_len);
+        // interface indexes are not stable across reboots, names mostly are
+        d.ifindex = d.iface.empty() ? 0 : if_nametoindex(d.iface.c_str());
+        d.proto_version = r.proto_version;
+        d.data_port = r.data_port;
+        d.control_port = r.control_port;
+        d.flags = r.flags;
+        d.path.rtt_ms = r.rtt_ms;
+        d.path.rtt_min_ms = r.rtt_ms;
+        d.path.bandwidth_kbps = r.bandwidth_kbps;
+        out.push_back(std::move(d));
+    }
+    munmap(map, size);
+    return out;
+}
+
+bool DeviceCache::save(const std::string& path, const DeviceMap& devices) {
+    auto now = std::chrono::steady_clock::now();
+    time_t now_unix = std::time(nullptr);
+    std::vector<Record> records;
+    records.reserve(devices.size());
+    for (const auto& [ip, d] : devices) {
+        if (!d.verified || d.lastMessage != MessageCodec::MSG_ALIVE) continue;
+        Record r;
+        std::memset(&r, 0, sizeof(r));
+        struct in_addr a;
+        if (inet_pton(AF_INET, ip.c_str(), &a) != 1) continue;
+        r.addr = a.s_addr;
+        auto age = std::chrono::duration_cast<std::chrono::seconds>(now - d.lastSeen).count();
+        r.seen_unix = static_cast<uint32_t>(now_unix - age);
+        r.data_port = d.data_port;
+        r.control_port = d.control_port;
+        r.proto_version = d.proto_version;
+        r.flags = d.flags;
+        r.hostname_len = static_cast<uint8_t>(std::min(d.hostname.size(), sizeof(r.hostname)));
+        std::memcpy(r.hostname, d.hostname.data(), r.hostname_len);
+        r.iface_len = static_cast<uint8_t>(std::min(d.iface.size(), sizeof(r.iface) - 1));
+        std::memcpy(r.iface, d.iface.data(), r.iface_len);
+        r.bandwidth_kbps = d.path.bandwidth_kbps;
+        r.rtt_ms = d.path.rtt_ms;
+        records.push_back(r);
+    }
+
+    Header h;
+    std::memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.version = kVersion;
+    h.record_size = sizeof(Record);
+    h.count = static_cast<uint32_t>(records.size());
+    h.saved_unix = static_cast<uint32_t>(now_unix);
+
+    // readers see the old file or the new one, never a half-written one. The temporary
+    // file gets an unpredictable name (the directory may be shared, e.g. /var/tmp) and is
+    // on disk before it replaces the old one.
+    auto slash = path.rfind('/');
+    std::string tmp = (slash == std::string::npos ? std::string() : path.substr(0, slash + 1)) + ".lanshare-cache.XXXXXX";
+    int fd = mkostemp(&tmp[0], O_CLOEXEC);
+    if (fd < 0) {
+        perror(("DeviceCache: " + tmp).c_str());
+        return false;
+    }
+    size_t body = records.size() * sizeof(Record);
+    bool ok = write(fd, &h, sizeof(h)) == static_cast<ssize_t>(sizeof(h)) &&
+              (body == 0 || write(fd, records.data(), body) == static_cast<ssize_t>(body)) && fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        perror(("DeviceCache: " + path).c_str());
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+#ifndef DEVICE_CACHE_HPP
+#define DEVICE_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "SubnetListener.hpp"
+
+// The device registry saved to disk, so a restart has a peer list before the first beacon
+// arrives. One 16-byte header and a fixed 104-byte record per device (address, ports,
+// capabilities, interface, hostname, last RTT and bandwidth, when last seen), in host byte
+// order: the file is only read back on the machine that wrote it. Loading maps the file
+// and decodes it in place; saving writes a mkstemp file beside it, fsyncs it and renames
+// it over the old one.
+namespace DeviceCache {
+    // entries last seen longer ago than this are not loaded
+    constexpr unsigned int kMaxAgeS = 7 * 24 * 3600;
+
+    // devices from the file, verified = false and lastSeen = now; empty if the file is
+    // missing, truncated or from another format version
+    std::vector<DeviceInfo> load(const std::string& path, unsigned int max_age_s = kMaxAgeS);
+
+    // verified devices only: an entry nothing has confirmed since the last load is dropped
+    bool save(const std::string& path, const DeviceMap& devices);
+}
+
+#endif // DEVICE_CACHE_HPP
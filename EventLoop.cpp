@@ -0,0 +1,342 @@
+#include "EventLoop.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+#include <iostream>
+#include <cstdio>
+#include <cerrno>
+#include <future>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+// epoll data for the loop's own descriptors; registrations start above them
+static const uint64_t kTimerFdId = 1;
+static const uint64_t kWakeFdId = 2;
+
+EventLoop::EventLoop()
+    : epfd_(epoll_create1(EPOLL_CLOEXEC)),
+      timerfd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      wakefd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      loop_thread_(std::thread::id()), stop_requested_(false), running_(false), next_id_(16),
+      armed_for_(Clock::time_point::max()) {
+    if (!valid()) {
+        perror("EventLoop: init");
+        return;
+    }
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = kTimerFdId;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, timerfd_, &ev);
+    ev.data.u64 = kWakeFdId;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+}
+
+EventLoop::~EventLoop() {
+    stop();
+    join();
+    if (epfd_ >= 0) ::close(epfd_);
+    if (timerfd_ >= 0) ::close(timerfd_);
+    if (wakefd_ >= 0) ::close(wakefd_);
+}
+
+bool EventLoop::add_fd(int fd, uint32_t events, std::function<void(uint32_t events)> cb) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t id = next_id_++;
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = id;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("EventLoop: epoll_ctl add");
+        return false;
+    }
+    handlers_[id] = std::make_shared<Handler>(Handler{fd, std::move(cb)});
+    fd_ids_[fd] = id;
+    return true;
+}
+
+bool EventLoop::modify_fd(int fd, uint32_t events) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = fd_ids_.find(fd);
+    if (it == fd_ids_.end()) return false;
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = it->second;
+    return epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::remove_fd(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = fd_ids_.find(fd);
+    if (it == fd_ids_.end()) return;
+    handlers_.erase(it->second);
+    fd_ids_.erase(it);
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+EventLoop::TimerId EventLoop::add_timer(std::chrono::milliseconds delay, std::function<void()> cb,
+                                        std::chrono::milliseconds period) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TimerId id = next_id_++;
+    auto due = Clock::now() + delay;
+    timers_.emplace(std::make_pair(due, id), Timer{std::move(cb), period});
+    timer_due_[id] = due;
+    rearm_locked();
+    return id;
+}
+
+EventLoop::TimerId EventLoop::add_timer_at(Clock::time_point when, std::function<void()> cb) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TimerId id = next_id_++;
+    timers_.emplace(std::make_pair(when, id), Timer{std::move(cb), std::chrono::milliseconds(0)});
+    timer_due_[id] = when;
+    rearm_locked();
+    return id;
+}
+
+void EventLoop::cancel_timer(TimerId id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = timer_due_.find(id);
+    if (it == timer_due_.end()) return;
+    timers_.erase(std::make_pair(it->second, id));
+    timer_due_.erase(it);
+    rearm_locked();
+}
+
+void EventLoop::rearm_locked() {
+    Clock::time_point next = timers_.empty() ? Clock::time_point::max() : timers_.begin()->first.first;
+    if (next == armed_for_) return;
+    armed_for_ = next;
+    struct itimerspec its{};
+    if (next != Clock::time_point::max()) {
+        // steady_clock is CLOCK_MONOTONIC, so its epoch matches an absolute timerfd
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch()).count();
+        if (ns <= 0) ns = 1; // a zero value would disarm
+        its.it_value.tv_sec = ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+    }
+    if (timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &its, nullptr) < 0) perror("EventLoop: timerfd_settime");
+}
+
+void EventLoop::run_timers() {
+    uint64_t expirations;
+    if (read(timerfd_, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("EventLoop: timerfd read");
+    std::unique_lock<std::mutex> lock(mutex_);
+    armed_for_ = Clock::time_point::max();
+    auto now = Clock::now();
+    while (!timers_.empty() && timers_.begin()->first.first <= now) {
+        auto node = timers_.extract(timers_.begin());
+        TimerId id = node.key().second;
+        std::function<void()> cb = node.mapped().cb;
+        if (node.mapped().period.count() > 0) {
+            // re-insert before running so the callback may cancel it
+            auto due = now + node.mapped().period;
+            node.key() = std::make_pair(due, id);
+            timer_due_[id] = due;
+            timers_.insert(std::move(node));
+        } else {
+            timer_due_.erase(id);
+        }
+        lock.unlock();
+        {
+            TRACE_SCOPE("loop", "timer");
+            cb();
+        }
+        lock.lock();
+    }
+    rearm_locked();
+}
+
+void EventLoop::post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (running_) {
+            posted_.push_back(std::move(fn));
+            fn = nullptr;
+        }
+    }
+    if (fn) {
+        fn();
+        return;
+    }
+    wake();
+}
+
+void EventLoop::run_sync(std::function<void()> fn) {
+    if (in_loop_thread()) {
+        fn();
+        return;
+    }
+    std::promise<void> done;
+    auto fut = done.get_future();
+    post([&fn, &done]() {
+        fn();
+        done.set_value();
+    });
+    fut.wait();
+}
+
+void EventLoop::run_posted() {
+    uint64_t v;
+    if (read(wakefd_, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("EventLoop: eventfd read");
+    std::deque<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks.swap(posted_);
+    }
+    TRACE_SCOPE_VAR(span, "loop", "posted");
+    TRACE_SET_ARG(span, tasks.size());
+    for (auto& t : tasks) t();
+}
+
+void EventLoop::wake() {
+    uint64_t one = 1;
+    if (write(wakefd_, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("EventLoop: eventfd write");
+}
+
+void EventLoop::run() {
+    if (!valid()) return;
+    loop_thread_.store(std::this_thread::get_id());
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = true;
+    }
+    struct epoll_event events[64];
+    while (!stop_requested_.load()) {
+        int n = epoll_wait(epfd_, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("EventLoop: epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint64_t id = events[i].data.u64;
+            if (id == kTimerFdId) {
+                run_timers();
+            } else if (id == kWakeFdId) {
+                run_posted();
+            } else {
+                std::shared_ptr<Handler> h;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto it = handlers_.find(id);
+                    if (it != handlers_.end()) h = it->second;
+                }
+                if (h) {
+                    TRACE_SCOPE_VAR(span, "loop", "fd");
+                    TRACE_SET_ARG(span, h->fd);
+                    h->cb(events[i].events);
+                }
+            }
+        }
+    }
+    // anything posted after the last wakeup still runs, here or inline from now on
+    std::deque<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+        tasks.swap(posted_);
+    }
+    for (auto& t : tasks) t();
+    loop_thread_.store(std::thread::id());
+    stop_requested_.store(false);
+}
+
+void EventLoop::stop() {
+    stop_requested_.store(true);
+    if (wakefd_ >= 0) wake();
+}
+
+void EventLoop::start_thread() {
+    {
+        // posts issued before the thread gets going must queue, not run inline
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = true;
+    }
+    thread_ = std::thread(&EventLoop::run, this);
+    pthread_setname_np(thread_.native_handle(), "lanshare-loop");
+}
+
+void EventLoop::join() {
+    if (thread_.joinable() && thread_.get_id() != std::this_thread::get_id()) thread_.join();
+}
+
+bool EventLoop::in_loop_thread() const {
+    return loop_thread_.load() == std::this_thread::get_id();
+}
+
+// summed over all pools in the process
+static Gauge& worker_queue_depth() {
+    static Gauge& g = metrics().gauge("lanshare_worker_queue_depth", "Jobs waiting for a worker pool thread");
+    return g;
+}
+
+static Gauge& worker_threads() {
+    static Gauge& g = metrics().gauge("lanshare_worker_threads", "Worker pool threads started");
+    return g;
+}
+
+WorkerPool::WorkerPool(size_t max_threads)
+    : max_threads_(max_threads > 0 ? max_threads : 1), idle_(0), stopping_(false) {}
+
+WorkerPool::~WorkerPool() {
+    shutdown();
+}
+
+bool WorkerPool::submit(std::function<void()> fn) {
+#ifdef LANSHARE_TRACE
+    // time spent waiting for a thread shows as a span of its own
+    if (Trace::enabled()) {
+        fn = [inner = std::move(fn), queued = Trace::now_ns()]() {
+            Trace::record("pool", "queued", queued, Trace::now_ns() - queued);
+            TRACE_SCOPE("pool", "job");
+            inner();
+        };
+    }
+#endif
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_) return false;
+    queue_.push_back(std::move(fn));
+    worker_queue_depth().add(1);
+    // a notified worker stays counted in idle_ until it has the mutex back, so compare
+    // against the jobs waiting, not zero
+    if (queue_.size() > idle_ && threads_.size() < max_threads_) {
+        threads_.emplace_back(&WorkerPool::worker, this);
+        pthread_setname_np(threads_.back().native_handle(), "lanshare-pool");
+        worker_threads().add(1);
+    }
+    cv_.notify_one();
+    return true;
+}
+
+void WorkerPool::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) {
+        if (t.joinable()) t.join();
+    }
+    worker_threads().add(-static_cast<int64_t>(threads_.size()));
+    threads_.clear();
+}
+
+void WorkerPool::worker() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        while (queue_.empty() && !stopping_) {
+            ++idle_;
+            cv_.wait(lock);
+            --idle_;
+        }
+        if (queue_.empty()) return;
+        auto fn = std::move(queue_.front());
+        queue_.pop_front();
+        worker_queue_depth().add(-1);
+        lock.unlock();
+        fn();
+        lock.lock();
+    }
+}
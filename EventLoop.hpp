@@ -0,0 +1,117 @@
+#ifndef EVENT_LOOP_HPP
+#define EVENT_LOOP_HPP
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+
+// Single-threaded reactor built on epoll, one timerfd for all timers and an eventfd for
+// cross-thread wakeups. SubnetBroadcaster, SubnetListener and FileTransfer register their
+// sockets and timers here instead of running their own sleep/accept loops, so an idle
+// process sleeps in one epoll_wait.
+//
+// Registration, timers and post() may be called from any thread; callbacks always run on
+// the loop thread and must not block (hand long work to a WorkerPool).
+class EventLoop {
+public:
+    using TimerId = uint64_t;
+    using Clock = std::chrono::steady_clock;
+
+    EventLoop();
+    ~EventLoop();
+
+    bool valid() const { return epfd_ >= 0 && timerfd_ >= 0 && wakefd_ >= 0; }
+
+    // events are EPOLLIN/EPOLLOUT...; level-triggered
+    bool add_fd(int fd, uint32_t events, std::function<void(uint32_t events)> cb);
+    bool modify_fd(int fd, uint32_t events);
+    void remove_fd(int fd);
+
+    // one-shot timer, or periodic when period is non-zero
+    TimerId add_timer(std::chrono::milliseconds delay, std::function<void()> cb,
+                      std::chrono::milliseconds period = std::chrono::milliseconds(0));
+    TimerId add_timer_at(Clock::time_point when, std::function<void()> cb);
+    void cancel_timer(TimerId id);
+
+    // run fn on the loop thread; runs inline if the loop is not running
+    void post(std::function<void()> fn);
+    // like post() but waits until fn has run
+    void run_sync(std::function<void()> fn);
+
+    // dispatch until stop(); stop() is safe from any thread, including callbacks
+    void run();
+    void stop();
+    // run() on a dedicated thread / wait for it
+    void start_thread();
+    void join();
+
+    bool in_loop_thread() const;
+
+private:
+    struct Handler {
+        int fd;
+        std::function<void(uint32_t)> cb;
+    };
+    struct Timer {
+        std::function<void()> cb;
+        std::chrono::milliseconds period;
+    };
+
+    int epfd_;
+    int timerfd_;
+    int wakefd_;
+    std::thread thread_;
+    std::atomic<std::thread::id> loop_thread_;
+    std::atomic<bool> stop_requested_;
+
+    std::mutex mutex_;
+    bool running_;
+    // registrations are keyed by id so a late event for a removed fd is ignored
+    uint64_t next_id_;
+    std::unordered_map<uint64_t, std::shared_ptr<Handler>> handlers_;
+    std::unordered_map<int, uint64_t> fd_ids_;
+    std::map<std::pair<Clock::time_point, TimerId>, Timer> timers_;
+    std::unordered_map<TimerId, Clock::time_point> timer_due_;
+    Clock::time_point armed_for_;
+    std::deque<std::function<void()>> posted_;
+
+    void wake();
+    void rearm_locked();
+    void run_timers();
+    void run_posted();
+};
+
+// Fixed-size pool for blocking work (file I/O, transfers). Threads are started lazily on
+// demand, up to max_threads, so an idle process does not pay for them.
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t max_threads = 4);
+    ~WorkerPool();
+
+    // false, and fn is dropped, once shutdown() has begun
+    bool submit(std::function<void()> fn);
+    // finish queued work and join all threads
+    void shutdown();
+
+private:
+    size_t max_threads_;
+    size_t idle_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    std::vector<std::thread> threads_;
+
+    void worker();
+};
+
+#endif // EVENT_LOOP_HPP
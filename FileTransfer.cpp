@@ -6,22 +6,248 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <iostream>
-#include <fstream>
 #include <cstring>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <cerrno>
+#include <algorithm>
 #include <chrono>
 #include "MessageCodec.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+// Pin an outgoing socket to the interface a peer was seen on. Needs CAP_NET_RAW; without
+// it the kernel routing table decides, which is what happened before.
+static void bind_to_interface(int s, const std::string& iface) {
+    if (iface.empty()) return;
+    setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, iface.c_str(), iface.size());
+}
+
+// Data connection: name_len (16) | name | size (64) | data. With the top bit of name_len
+// set the data is instead a list of extents, offset (64) | length (64) | bytes, in
+// increasing offset order and ended by a zero-length extent; everything else is a hole.
+// Senders that see BEACON_FLAG_BATCH may follow with more files on the same connection,
+// named by '/'-separated paths relative to recv/; closing the connection ends the batch.
+// A size of all ones marks a stream (BEACON_FLAG_STREAM): the data follows as chunks,
+// len (32) | bytes, ended by a zero-length chunk.
+static constexpr uint16_t kSparseNameFlag = 0x8000;
+static constexpr uint64_t kStreamSize = UINT64_MAX;
+// larger chunk lengths are taken as a corrupt stream
+static constexpr uint32_t kMaxStreamChunk = 16 << 20;
+// data connections received at once; more wait for a thread
+static constexpr size_t kReceiveThreads = 16;
+// a data connection that sends nothing for this long is dropped (streams excepted)
+static constexpr time_t kReceiveIdleS = 60;
+
+extern char** environ;
+
+// runs `sh -c command` reading from a new pipe; returns the pipe's write end, -1 on failure
+static int spawn_sink(const std::string& command, const std::string& name, const std::string& peer_ip, pid_t& pid) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) != 0) return -1;
+    std::vector<std::string> env_strings = {"LANSHARE_NAME=" + name, "LANSHARE_PEER=" + peer_ip};
+    std::vector<char*> env;
+    for (char** e = environ; *e; ++e) {
+        if (std::strncmp(*e, "LANSHARE_NAME=", 14) != 0 && std::strncmp(*e, "LANSHARE_PEER=", 14) != 0) env.push_back(*e);
+    }
+    for (auto& s : env_strings) env.push_back(&s[0]);
+    env.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, p[0], STDIN_FILENO);
+    // the daemon ignores SIGPIPE and its threads block SIGINT, SIGTERM and SIGUSR*; the
+    // command should get the usual default disposition and an empty mask
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t def;
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    const char* argv[] = {"sh", "-c", command.c_str(), nullptr};
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, const_cast<char* const*>(argv), env.data());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    ::close(p[0]);
+    if (err != 0) {
+        std::cerr << "Receive: cannot run stream command: " << std::strerror(err) << "\n";
+        ::close(p[1]);
+        return -1;
+    }
+    return p[1];
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        data += w;
+        len -= w;
+    }
+    return true;
+}
+
+// a name a peer may write under recv/: relative, and no empty, "." or ".." components
+static bool safe_relative_path(const std::string& p) {
+    if (p.empty() || p[0] == '/') return false;
+    size_t at = 0;
+    while (true) {
+        size_t slash = p.find('/', at);
+        std::string part = p.substr(at, slash == std::string::npos ? std::string::npos : slash - at);
+        if (part.empty() || part == "." || part == "..") return false;
+        if (slash == std::string::npos) return true;
+        at = slash + 1;
+    }
+}
+
+// creates the directories leading up to `path` under `base`
+static bool make_parents(const std::string& base, const std::string& path) {
+    for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        std::string dir = base + "/" + path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+// counts a send or receive as active for the lifetime of the scope
+struct ActiveTransferGuard {
+    std::atomic<int>& n;
+    explicit ActiveTransferGuard(std::atomic<int>& counter) : n(counter) { ++n; }
+    ~ActiveTransferGuard() { --n; }
+};
+
+// indexed by direction: [0] incoming, [1] outgoing
+struct TransferMetrics {
+    Counter* requests[2] = {
+        &metrics().counter("lanshare_control_requests_total", "File requests received and sent", "direction=\"in\""),
+        &metrics().counter("lanshare_control_requests_total", "File requests received and sent", "direction=\"out\""),
+    };
+    Counter& accepted = metrics().counter("lanshare_control_decisions_total", "Answers to incoming file requests",
+                                          "decision=\"accepted\"");
+    Counter& rejected = metrics().counter("lanshare_control_decisions_total", "Answers to incoming file requests",
+                                          "decision=\"rejected\"");
+    Counter& timed_out = metrics().counter("lanshare_control_decisions_total", "Answers to incoming file requests",
+                                           "decision=\"timeout\"");
+    Gauge& waiting = metrics().gauge("lanshare_control_requests_waiting", "Incoming file requests awaiting a decision");
+    Histogram& decision_time = metrics().histogram(
+        "lanshare_control_decision_seconds", "Time from an incoming request to its answer",
+        {0.001, 0.01, 0.1, 0.5, 1, 2.5, 5, 10, 20, 30});
+    Histogram& request_time = metrics().histogram(
+        "lanshare_control_request_seconds", "Round trip of outgoing file requests that got an answer",
+        {0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30});
+    Counter* bytes[2] = {
+        &metrics().counter("lanshare_transfer_bytes_total", "File data moved", "direction=\"in\""),
+        &metrics().counter("lanshare_transfer_bytes_total", "File data moved", "direction=\"out\""),
+    };
+    Counter* completed[2] = {
+        &metrics().counter("lanshare_transfers_total", "Finished transfers", "direction=\"in\",result=\"completed\""),
+        &metrics().counter("lanshare_transfers_total", "Finished transfers", "direction=\"out\",result=\"completed\""),
+    };
+    Counter* failed[2] = {
+        &metrics().counter("lanshare_transfers_total", "Finished transfers", "direction=\"in\",result=\"failed\""),
+        &metrics().counter("lanshare_transfers_total", "Finished transfers", "direction=\"out\",result=\"failed\""),
+    };
+    Histogram* duration[2] = {
+        &metrics().histogram("lanshare_transfer_duration_seconds", "Duration of finished transfers",
+                             {0.01, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 1800, 3600}, "direction=\"in\""),
+        &metrics().histogram("lanshare_transfer_duration_seconds", "Duration of finished transfers",
+                             {0.01, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 1800, 3600}, "direction=\"out\""),
+    };
+    Gauge& active = metrics().gauge("lanshare_transfers_active", "Sends and receives in progress");
+};
+
+static TransferMetrics& transfer_metrics() {
+    static TransferMetrics m;
+    return m;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+// finished transfers kept in get_transfers() after they end
+static constexpr size_t kFinishedTransfersKept = 32;
+// decided requests kept in get_pending_requests()
+static constexpr size_t kDecidedRequestsKept = 32;
+
+struct FileTransfer::ProgressScope {
+    FileTransfer& ft;
+    std::shared_ptr<TransferProgress> progress;
+    bool ok = false;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    Counter& bytes = *transfer_metrics().bytes[progress->outgoing];
+
+    ProgressScope(FileTransfer& owner, bool outgoing, const std::string& ip, const std::string& filename, uint64_t total)
+        : ft(owner), progress(std::make_shared<TransferProgress>(outgoing, ip, filename, total)) {
+        {
+            std::lock_guard<std::mutex> lock(ft.transfers_mutex_);
+            size_t finished = 0;
+            for (const auto& t : ft.transfers_) if (t->state.load() != 0) ++finished;
+            for (auto it = ft.transfers_.begin(); finished >= kFinishedTransfersKept && it != ft.transfers_.end();) {
+                if ((*it)->state.load() != 0) {
+                    it = ft.transfers_.erase(it);
+                    --finished;
+                } else {
+                    ++it;
+                }
+            }
+            ft.transfers_.push_back(progress);
+        }
+        transfer_metrics().active.add(1);
+        ft.notify_changed();
+    }
+    ~ProgressScope() {
+        progress->state.store(ok ? 1 : -1);
+        TransferMetrics& m = transfer_metrics();
+        m.active.add(-1);
+        (ok ? m.completed : m.failed)[progress->outgoing]->add();
+        m.duration[progress->outgoing]->observe(seconds_since(started));
+        ft.notify_changed();
+    }
+    void add(uint64_t n) {
+        progress->done_bytes.fetch_add(n, std::memory_order_relaxed);
+        ft.bytes_moved_.fetch_add(n, std::memory_order_relaxed);
+        bytes.add(n);
+    }
+    // holes: progress without any bytes on the wire or disk
+    void skip(uint64_t n) {
+        progress->done_bytes.fetch_add(n, std::memory_order_relaxed);
+    }
+};
 
 FileTransfer::FileTransfer(uint16_t listen_port)
-    : listen_port_(listen_port), sockfd_(-1), running_(false), control_sockfd_(-1), control_port_(40003) {}
+    : listen_port_(listen_port), sockfd_(-1), running_(false), loop_(nullptr), pool_(nullptr),
+      receive_pool_(kReceiveThreads), control_sockfd_(-1), control_port_(40003),
+      active_transfers_(0), bytes_moved_(0), rate_sample_at_(std::chrono::steady_clock::now()), rate_sample_bytes_(0),
+      link_capacity_kbps_(0), catalog_(nullptr), active_pulls_(0), stream_sink_(StreamSink::File), next_request_id_(1),
+      requests_version_(0) {
+    transfer_metrics();
+}
 
 FileTransfer::~FileTransfer() {
     stop_receiver();
 }
 
+void FileTransfer::set_event_loop(EventLoop* loop) {
+    loop_ = loop;
+}
+
+void FileTransfer::set_worker_pool(WorkerPool* pool) {
+    pool_ = pool;
+}
+
 bool FileTransfer::start_receiver() {
     if (running_) return true;
-    sockfd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockfd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd_ < 0) {
         perror("FileTransfer: socket");
         return false;
@@ -61,186 +287,759 @@ bool FileTransfer::start_receiver() {
         return false;
     }
 
+    // bound here rather than on first use, so control_port() is right as soon as we return
+    if (!open_control_socket()) {
+        ::close(sockfd_);
+        sockfd_ = -1;
+        return false;
+    }
+    mkdir("recv", 0755);
+
+    if (!loop_) {
+        own_loop_.reset(new EventLoop());
+        own_loop_->start_thread();
+        loop_ = own_loop_.get();
+    }
+    if (!pool_) {
+        own_pool_.reset(new WorkerPool(4));
+        pool_ = own_pool_.get();
+    }
     running_ = true;
-    worker_ = std::thread(&FileTransfer::receiver_loop, this);
-    // start control server
-    control_worker_ = std::thread(&FileTransfer::control_loop, this);
+    loop_->add_fd(sockfd_, EPOLLIN, [this](uint32_t) { on_data_accept(); });
+    loop_->add_fd(control_sockfd_, EPOLLIN, [this](uint32_t) { on_control_accept(); });
     return true;
 }
 
 void FileTransfer::stop_receiver() {
-    if (!running_) return;
-    running_ = false;
-    if (sockfd_ >= 0) {
-        ::shutdown(sockfd_, SHUT_RDWR);
+    if (!running_.exchange(false)) return;
+    loop_->run_sync([this]() {
+        loop_->remove_fd(sockfd_);
+        loop_->remove_fd(control_sockfd_);
         ::close(sockfd_);
         sockfd_ = -1;
-    }
-    if (worker_.joinable()) worker_.join();
-    if (control_sockfd_ >= 0) {
-        ::shutdown(control_sockfd_, SHUT_RDWR);
         ::close(control_sockfd_);
         control_sockfd_ = -1;
+        // undecided requests are refused, as on timeout
+        while (!control_conns_.empty()) finish_control(control_conns_.begin()->first, MessageCodec::MSG_FILE_REJECT);
+    });
+    {
+        // unblock receives in progress and wait for the pool to let go of them
+        std::unique_lock<std::mutex> lock(clients_mutex_);
+        for (int fd : data_clients_) ::shutdown(fd, SHUT_RDWR);
+        clients_cv_.wait(lock, [this]() { return data_clients_.empty(); });
+    }
+    if (own_loop_) {
+        own_loop_->stop();
+        own_loop_->join();
+        own_loop_.reset();
+        loop_ = nullptr;
     }
-    if (control_worker_.joinable()) control_worker_.join();
+    if (own_pool_) {
+        own_pool_->shutdown();
+        own_pool_.reset();
+        pool_ = nullptr;
+    }
+}
+
+void TransferCancel::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+    // a connect in progress fails too
+    for (int fd : fds_) ::shutdown(fd, SHUT_RDWR);
 }
 
-bool FileTransfer::request_send(const std::string& remote_ip, uint16_t control_port, const std::string& filename, unsigned int timeout_ms) {
+bool TransferCancel::cancelled() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cancelled_;
+}
+
+bool TransferCancel::add(int s) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cancelled_) return false;
+    fds_.insert(s);
+    return true;
+}
+
+void TransferCancel::remove(int s) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fds_.erase(s);
+}
+
+// unregisters before closing, so a late cancel() cannot shut down a reused descriptor
+static void close_send(int s, TransferCancel* cancel) {
+    if (cancel) cancel->remove(s);
+    ::close(s);
+}
+
+// Connects to a peer's control port within timeout_ms; returns a blocking socket or -1
+static int connect_control(const std::string& remote_ip, uint16_t control_port, unsigned int timeout_ms,
+                           const std::string& iface, TransferCancel* cancel = nullptr) {
     int s = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) return false;
+    if (s < 0) return -1;
+    if (cancel && !cancel->add(s)) { ::close(s); return -1; }
+    bind_to_interface(s, iface);
     struct sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(control_port);
-    if (inet_pton(AF_INET, remote_ip.c_str(), &addr.sin_addr) != 1) { ::close(s); return false; }
+    if (inet_pton(AF_INET, remote_ip.c_str(), &addr.sin_addr) != 1) { close_send(s, cancel); return -1; }
     // set connect timeout via non-blocking connect
     int flags = fcntl(s, F_GETFL, 0);
     fcntl(s, F_SETFL, flags | O_NONBLOCK);
     int res = connect(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
-    if (res < 0 && errno != EINPROGRESS) { ::close(s); return false; }
+    if (res < 0 && errno != EINPROGRESS) { close_send(s, cancel); return -1; }
     fd_set wf;
     struct timeval tv;
     FD_ZERO(&wf);
     FD_SET(s, &wf);
     tv.tv_sec = timeout_ms / 1000;
     tv.tv_usec = (timeout_ms % 1000) * 1000;
-    if (select(s + 1, nullptr, &wf, nullptr, &tv) <= 0) { ::close(s); return false; }
+    if (select(s + 1, nullptr, &wf, nullptr, &tv) <= 0) { close_send(s, cancel); return -1; }
     // check connect result
     int soerr = 0;
     socklen_t len = sizeof(soerr);
     if (getsockopt(s, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0 || soerr != 0) {
-        ::close(s);
-        return false;
+        close_send(s, cancel);
+        return -1;
     }
     // restore flags (make socket blocking again)
     fcntl(s, F_SETFL, flags & ~O_NONBLOCK);
+    return s;
+}
+
+bool FileTransfer::request_send(const std::string& remote_ip, uint16_t control_port, const std::string& filename, unsigned int timeout_ms, const std::string& iface,
+                                TransferCancel* cancel) {
+    transfer_metrics().requests[1]->add();
+    auto started = std::chrono::steady_clock::now();
+    int s = connect_control(remote_ip, control_port, timeout_ms, iface, cancel);
+    if (s < 0) return false;
     // send request: code + filename length + filename
     uint8_t code = MessageCodec::MSG_FILE_REQUEST;
-    if (send(s, &code, sizeof(code), 0) != sizeof(code)) { ::close(s); return false; }
+    if (send(s, &code, sizeof(code), 0) != sizeof(code)) { close_send(s, cancel); return false; }
     uint16_t name_len = filename.size();
     uint16_t name_len_be = htons(name_len);
-    if (send(s, &name_len_be, sizeof(name_len_be), 0) != sizeof(name_len_be)) { ::close(s); return false; }
-    if (send(s, filename.data(), name_len, 0) != (ssize_t)name_len) { ::close(s); return false; }
+    if (send(s, &name_len_be, sizeof(name_len_be), 0) != sizeof(name_len_be)) { close_send(s, cancel); return false; }
+    if (send(s, filename.data(), name_len, 0) != (ssize_t)name_len) { close_send(s, cancel); return false; }
     // wait for accept
     uint8_t resp;
     ssize_t r = recv(s, &resp, sizeof(resp), 0);
-    ::close(s);
+    close_send(s, cancel);
+    if (r == sizeof(resp)) transfer_metrics().request_time.observe(seconds_since(started));
     return r == sizeof(resp) && resp == MessageCodec::MSG_FILE_ACCEPT;
 }
 
-bool FileTransfer::send_file(const std::string& remote_ip, uint16_t port, const std::string& filepath) {
-    int s = ::socket(AF_INET, SOCK_STREAM, 0);
+void FileTransfer::set_stream_sink(StreamSink sink, const std::string& target) {
+    stream_sink_ = sink;
+    stream_target_ = target;
+}
+
+void FileTransfer::set_catalog(SharedCatalog* catalog) {
+    catalog_ = catalog;
+}
+
+// Sends one control request and reads the framed answer (code | body_len (32) | body)
+static bool control_exchange(const std::string& remote_ip, uint16_t control_port, const std::string& req,
+                             uint8_t expect, std::vector<uint8_t>& body, unsigned int timeout_ms,
+                             const std::string& iface) {
+    int s = connect_control(remote_ip, control_port, timeout_ms, iface);
+    if (s < 0) return false;
+    struct timeval tv{static_cast<time_t>(timeout_ms / 1000), static_cast<suseconds_t>((timeout_ms % 1000) * 1000)};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (send(s, req.data(), req.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(req.size())) { ::close(s); return false; }
+
+    uint8_t head[5];
+    if (recv(s, head, sizeof(head), MSG_WAITALL) != sizeof(head) || head[0] != expect) {
+        ::close(s);
+        return false;
+    }
+    uint32_t body_len;
+    std::memcpy(&body_len, head + 1, 4);
+    body_len = ntohl(body_len);
+    // a full page of long paths, or the largest sketch, stays far below this
+    if (body_len > 256u << 20) { ::close(s); return false; }
+    body.resize(body_len);
+    bool ok = recv(s, body.data(), body_len, MSG_WAITALL) == static_cast<ssize_t>(body_len);
+    ::close(s);
+    return ok;
+}
+
+bool FileTransfer::fetch_catalog(const std::string& remote_ip, uint16_t control_port, const std::string& after,
+                                 size_t limit, CatalogPage& page, unsigned int timeout_ms, const std::string& iface) {
+    std::string req(1, static_cast<char>(MessageCodec::MSG_CATALOG_LIST));
+    uint16_t after_len_be = htons(static_cast<uint16_t>(after.size()));
+    uint16_t limit_be = htons(static_cast<uint16_t>(std::min<size_t>(limit, SharedCatalog::kMaxPage)));
+    req.append(reinterpret_cast<const char*>(&after_len_be), 2);
+    req += after;
+    req.append(reinterpret_cast<const char*>(&limit_be), 2);
+    std::vector<uint8_t> body;
+    return control_exchange(remote_ip, control_port, req, MessageCodec::MSG_CATALOG_PAGE, body, timeout_ms, iface) &&
+           SharedCatalog::decode_page(body.data(), body.size(), page);
+}
+
+bool FileTransfer::fetch_sketch(const std::string& remote_ip, uint16_t control_port, uint32_t& version,
+                                BloomFilter& sketch, unsigned int timeout_ms, const std::string& iface) {
+    std::string req(1, static_cast<char>(MessageCodec::MSG_SKETCH_GET));
+    std::vector<uint8_t> body;
+    if (!control_exchange(remote_ip, control_port, req, MessageCodec::MSG_SKETCH, body, timeout_ms, iface) ||
+        body.size() < 4) {
+        return false;
+    }
+    std::memcpy(&version, body.data(), 4);
+    version = ntohl(version);
+    return sketch.decode(body.data() + 4, body.size() - 4);
+}
+
+bool FileTransfer::search_peer(const std::string& remote_ip, uint16_t control_port, const std::string& name,
+                               size_t limit, CatalogPage& page, unsigned int timeout_ms, const std::string& iface) {
+    std::string req(1, static_cast<char>(MessageCodec::MSG_SEARCH));
+    uint16_t limit_be = htons(static_cast<uint16_t>(std::min<size_t>(limit, SharedCatalog::kMaxPage)));
+    uint16_t name_len_be = htons(static_cast<uint16_t>(name.size()));
+    req.append(reinterpret_cast<const char*>(&limit_be), 2);
+    req.append(reinterpret_cast<const char*>(&name_len_be), 2);
+    req += name;
+    std::vector<uint8_t> body;
+    return control_exchange(remote_ip, control_port, req, MessageCodec::MSG_SEARCH_RESULT, body, timeout_ms, iface) &&
+           SharedCatalog::decode_page(body.data(), body.size(), page);
+}
+
+bool FileTransfer::request_pull(const std::string& remote_ip, uint16_t control_port, const std::string& path,
+                                unsigned int timeout_ms, const std::string& iface) {
+    int s = connect_control(remote_ip, control_port, timeout_ms, iface);
     if (s < 0) return false;
+    struct timeval tv{static_cast<time_t>(timeout_ms / 1000), static_cast<suseconds_t>((timeout_ms % 1000) * 1000)};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // code | flags | our data port | path
+    std::string req(1, static_cast<char>(MessageCodec::MSG_FILE_PULL));
+    req += static_cast<char>(MessageCodec::BEACON_FLAG_SPARSE);
+    uint16_t port_be = htons(listen_port_);
+    uint16_t path_len_be = htons(static_cast<uint16_t>(path.size()));
+    req.append(reinterpret_cast<const char*>(&port_be), 2);
+    req.append(reinterpret_cast<const char*>(&path_len_be), 2);
+    req += path;
+    uint8_t resp = 0;
+    bool ok = send(s, req.data(), req.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(req.size()) &&
+              recv(s, &resp, sizeof(resp), 0) == sizeof(resp) && resp == MessageCodec::MSG_FILE_ACCEPT;
+    ::close(s);
+    return ok;
+}
+
+TransferTuning FileTransfer::tuning_for(const PathEstimate& path) {
+    TransferTuning t;
+    if (path.rtt_ms <= 0 || path.bandwidth_kbps == 0) return t;
+    // two bandwidth-delay products keep the pipe full through a loss recovery; bytes =
+    // kbit/s * ms / 8
+    uint64_t bdp = static_cast<uint64_t>(path.bandwidth_kbps * static_cast<double>(path.rtt_ms) / 8);
+    t.socket_buffer = static_cast<int>(std::min<uint64_t>(std::max<uint64_t>(2 * bdp, 64 * 1024), 8 * 1024 * 1024));
+    // lossy paths (Wi-Fi) do better with smaller writes that drain between retransmits
+    size_t chunk = path.loss > 0.02f ? 16 * 1024 : 256 * 1024;
+    t.chunk_bytes = std::min<size_t>(chunk, t.socket_buffer);
+    return t;
+}
+
+// connected data socket with the buffer size tuned for the path, -1 on failure
+static int connect_data(const std::string& remote_ip, uint16_t port, const std::string& iface,
+                        const TransferTuning& tuning, TransferCancel* cancel = nullptr) {
+    int s = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    if (cancel && !cancel->add(s)) { ::close(s); return -1; }
+    bind_to_interface(s, iface);
+    if (tuning.socket_buffer > 0) {
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, &tuning.socket_buffer, sizeof(tuning.socket_buffer));
+    }
 
     struct sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     if (inet_pton(AF_INET, remote_ip.c_str(), &addr.sin_addr) != 1) {
-        ::close(s);
-        return false;
+        close_send(s, cancel);
+        return -1;
     }
 
     if (connect(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
-        ::close(s);
-        return false;
+        close_send(s, cancel);
+        return -1;
     }
+    return s;
+}
 
-    std::ifstream in(filepath, std::ios::binary);
-    if (!in) { ::close(s); return false; }
+bool FileTransfer::send_file(const std::string& remote_ip, uint16_t port, const std::string& filepath, const std::string& iface,
+                             const PathEstimate& path, bool sparse, TransferCancel* cancel) {
+    TransferTuning tuning = tuning_for(path);
+    int s = connect_data(remote_ip, port, iface, tuning, cancel);
+    if (s < 0) return false;
+
+    int in = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) { close_send(s, cancel); return false; }
 
-    // send filename length + filename + file size (8 bytes) + data
     std::string filename;
     auto pos = filepath.find_last_of("/\\");
     filename = (pos == std::string::npos) ? filepath : filepath.substr(pos + 1);
 
     struct stat st;
-    if (stat(filepath.c_str(), &st) != 0) { ::close(s); return false; }
+    bool ok = fstat(in, &st) == 0 && send_stream(s, in, st, remote_ip, filename, tuning, sparse);
+    ::close(in);
+    close_send(s, cancel);
+    return ok;
+}
+
+size_t FileTransfer::send_files(const std::string& remote_ip, uint16_t port, const std::string& root,
+                                const std::vector<std::string>& paths, const std::string& iface,
+                                const PathEstimate& path, bool sparse, TransferCancel* cancel) {
+    TransferTuning tuning = tuning_for(path);
+    int s = connect_data(remote_ip, port, iface, tuning, cancel);
+    if (s < 0) return 0;
+    size_t done = 0;
+    for (; done < paths.size(); ++done) {
+        // the catalog's rule: a symlink in the tree is not followed out of it, and only
+        // regular files are sent (O_NONBLOCK keeps a FIFO from hanging the open)
+        int in = ::open((root + "/" + paths[done]).c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        struct stat st;
+        // gone (or replaced by a directory or a symlink) since it changed: nothing to send
+        if (in < 0) continue;
+        if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(in);
+            continue;
+        }
+        bool ok = send_stream(s, in, st, remote_ip, paths[done], tuning, sparse);
+        ::close(in);
+        if (!ok) break;
+    }
+    close_send(s, cancel);
+    return done;
+}
+
+bool FileTransfer::send_pipe(const std::string& remote_ip, uint16_t port, int fd, const std::string& name,
+                             const std::string& iface, const PathEstimate& path, TransferCancel* cancel) {
+    if (name.empty() || name.size() >= kSparseNameFlag) return false;
+    TransferTuning tuning = tuning_for(path);
+    int s = connect_data(remote_ip, port, iface, tuning, cancel);
+    if (s < 0) return false;
+    ActiveTransferGuard active(active_transfers_);
+    ProgressScope progress(*this, true, remote_ip, name, 0);
+
+    auto send_all = [s](const void* data, size_t len) {
+        return send(s, data, len, MSG_NOSIGNAL) == static_cast<ssize_t>(len);
+    };
+    uint16_t name_len_be = htons(name.size());
+    uint64_t size_be = htobe64(kStreamSize);
+    bool ok = send_all(&name_len_be, sizeof(name_len_be)) && send_all(name.data(), name.size()) &&
+              send_all(&size_be, sizeof(size_be));
+
+    TRACE_SCOPE("transfer", "send_pipe");
+    // the chunk length goes in front of the data in the same buffer: one send per read
+    std::vector<char> buf(4 + tuning.chunk_bytes);
+    while (ok) {
+        ssize_t r;
+        {
+            TRACE_SCOPE("transfer", "pipe read");
+            // an idle producer can keep us here for hours: also wake if the socket fails,
+            // is shut down by cancel, or the receiver closes (it sends nothing mid-stream,
+            // so anything readable means it has gone, e.g. after refusing a busy sink)
+            struct pollfd pfd[2] = {{fd, POLLIN, 0}, {s, POLLIN | POLLRDHUP, 0}};
+            if (poll(pfd, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                ok = false;
+                break;
+            }
+            if (pfd[1].revents) {
+                ok = false;
+                break;
+            }
+            r = read(fd, buf.data() + 4, tuning.chunk_bytes);
+        }
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            ok = false;
+            break;
+        }
+        uint32_t len_be = htonl(static_cast<uint32_t>(r));
+        std::memcpy(buf.data(), &len_be, sizeof(len_be));
+        ok = send_all(buf.data(), 4 + r);
+        // a zero-length chunk was the end marker
+        if (r == 0) break;
+        progress.add(r);
+    }
+    if (ok) {
+        // everything may sit in socket buffers: the receiver closing cleanly once it has
+        // read the end marker is what says it took the stream. One that refused it closes
+        // with our data unread, which resets the connection.
+        char c;
+        ::shutdown(s, SHUT_WR);
+        ok = recv(s, &c, 1, 0) == 0;
+    }
+    close_send(s, cancel);
+    progress.ok = ok;
+    return ok;
+}
+
+bool FileTransfer::send_stream(int s, int in, const struct stat& st, const std::string& remote_ip,
+                               const std::string& filename, const TransferTuning& tuning, bool sparse) {
+    if (filename.size() >= kSparseNameFlag) return false;
+    ActiveTransferGuard active(active_transfers_);
     uint64_t fsize = st.st_size;
+    // fewer blocks allocated than the size needs: there are holes worth skipping
+    sparse = sparse && static_cast<uint64_t>(st.st_blocks) * 512 < fsize;
+    ProgressScope progress(*this, true, remote_ip, filename, fsize);
 
+    auto send_all = [s](const void* data, size_t len) {
+        return send(s, data, len, MSG_NOSIGNAL) == static_cast<ssize_t>(len);
+    };
     uint16_t name_len = filename.size();
-    uint16_t name_len_be = htons(name_len);
-    if (send(s, &name_len_be, sizeof(name_len_be), 0) != sizeof(name_len_be)) { ::close(s); return false; }
-    if (send(s, filename.data(), name_len, 0) != (ssize_t)name_len) { ::close(s); return false; }
-
+    uint16_t name_len_be = htons(sparse ? name_len | kSparseNameFlag : name_len);
     uint64_t fsize_be = htobe64(fsize);
-    if (send(s, &fsize_be, sizeof(fsize_be), 0) != sizeof(fsize_be)) { ::close(s); return false; }
+    if (!send_all(&name_len_be, sizeof(name_len_be)) || !send_all(filename.data(), name_len) ||
+        !send_all(&fsize_be, sizeof(fsize_be))) {
+        return false;
+    }
 
-    char buf[4096];
-    while (in) {
-        in.read(buf, sizeof(buf));
-        std::streamsize r = in.gcount();
-        if (r <= 0) break;
-        if (send(s, buf, r, 0) != r) { ::close(s); return false; }
+    TRACE_SCOPE_VAR(span, "transfer", "send_file");
+    TRACE_SET_ARG(span, fsize);
+    std::vector<char> buf(tuning.chunk_bytes);
+    // streams [offset, offset + len) of the file
+    auto send_range = [&](uint64_t offset, uint64_t len) {
+        while (len > 0) {
+            ssize_t r;
+            {
+                TRACE_SCOPE("transfer", "file read");
+                r = pread(in, buf.data(), std::min<uint64_t>(buf.size(), len), offset);
+            }
+            // the file shrank under us; the receiver would wait for bytes that never come
+            if (r <= 0) return false;
+            ssize_t sent;
+            {
+                TRACE_SCOPE_VAR(io, "transfer", "send");
+                sent = send(s, buf.data(), r, MSG_NOSIGNAL);
+                TRACE_SET_ARG(io, sent > 0 ? sent : 0);
+            }
+            if (sent != r) return false;
+            progress.add(r);
+            offset += r;
+            len -= r;
+        }
+        return true;
+    };
+
+    bool ok = true;
+    if (!sparse) {
+        ok = send_range(0, fsize);
+    } else {
+        uint64_t at = 0;
+        while (ok && at < fsize) {
+            off_t data = lseek(in, at, SEEK_DATA);
+            // ENXIO: only a hole is left; other errors: the filesystem can't tell, send it all
+            if (data < 0 && errno == ENXIO) break;
+            if (data < 0) data = at;
+            off_t hole = lseek(in, data, SEEK_HOLE);
+            uint64_t end = hole < 0 ? fsize : std::min<uint64_t>(hole, fsize);
+            if (static_cast<uint64_t>(data) >= end) break;
+            uint64_t extent[2] = {htobe64(data), htobe64(end - data)};
+            progress.skip(data - at);
+            ok = send_all(extent, sizeof(extent)) && send_range(data, end - data);
+            at = end;
+        }
+        if (ok) {
+            progress.skip(fsize - std::min(at, fsize));
+            uint64_t last[2] = {htobe64(fsize), 0};
+            ok = send_all(last, sizeof(last));
+        }
     }
 
-    ::close(s);
-    return true;
+    progress.ok = ok;
+    return ok;
 }
 
-bool FileTransfer::send_shutdown(const std::string& remote_ip, uint16_t port) {
-    int s = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) return false;
+bool FileTransfer::send_shutdown(const std::string& remote_ip, uint16_t port, const std::string& iface) {
+    auto results = send_shutdown_all({ShutdownTarget{remote_ip, port, iface}});
+    return !results.empty() && results[0].outcome == ShutdownOutcome::Delivered;
+}
 
-    struct sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, remote_ip.c_str(), &addr.sin_addr) != 1) {
-        ::close(s);
-        return false;
+std::vector<ShutdownResult> FileTransfer::send_shutdown_all(const std::vector<ShutdownTarget>& targets, unsigned int deadline_ms) {
+    // stay well inside the default RLIMIT_NOFILE; later targets start as slots free up
+    const size_t kMaxInFlight = 512;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadline_ms);
+
+    std::vector<ShutdownResult> results;
+    results.reserve(targets.size());
+    for (const auto& t : targets) results.push_back({t.ip, ShutdownOutcome::TimedOut, 0});
+
+    // in-flight connects: socket and index into targets
+    std::vector<struct pollfd> fds;
+    std::vector<size_t> owner;
+    size_t next = 0;
+
+    auto finish = [&](size_t slot, ShutdownOutcome outcome, int err) {
+        results[owner[slot]].outcome = outcome;
+        results[owner[slot]].error = err;
+        ::close(fds[slot].fd);
+        fds[slot] = fds.back();
+        owner[slot] = owner.back();
+        fds.pop_back();
+        owner.pop_back();
+    };
+
+    while (true) {
+        // start connects until the in-flight window is full
+        while (next < targets.size() && fds.size() < kMaxInFlight) {
+            const ShutdownTarget& t = targets[next];
+            size_t idx = next++;
+            struct sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(t.port);
+            if (inet_pton(AF_INET, t.ip.c_str(), &addr.sin_addr) != 1) {
+                results[idx] = {t.ip, ShutdownOutcome::Failed, EINVAL};
+                continue;
+            }
+            int s = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (s < 0) {
+                results[idx] = {t.ip, ShutdownOutcome::Failed, errno};
+                continue;
+            }
+            bind_to_interface(s, t.iface);
+            if (connect(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+                int err = errno;
+                ::close(s);
+                results[idx] = {t.ip, err == ECONNREFUSED ? ShutdownOutcome::Refused : ShutdownOutcome::Failed, err};
+                continue;
+            }
+            struct pollfd pfd;
+            pfd.fd = s;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            owner.push_back(idx);
+        }
+        if (fds.empty()) break;
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) break;
+        int wait_ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1;
+        int n = poll(fds.data(), fds.size(), wait_ms);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // walk backwards: finish() swaps the last slot into the current one
+        for (size_t i = fds.size(); i-- > 0;) {
+            if (!fds[i].revents) continue;
+            int soerr = 0;
+            socklen_t len = sizeof(soerr);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0) soerr = errno;
+            if (soerr != 0) {
+                finish(i, soerr == ECONNREFUSED ? ShutdownOutcome::Refused : ShutdownOutcome::Failed, soerr);
+                continue;
+            }
+            uint8_t code = MessageCodec::MSG_SHUTDOWN;
+            ssize_t r = send(fds[i].fd, &code, sizeof(code), MSG_NOSIGNAL);
+            if (r == (ssize_t)sizeof(code)) finish(i, ShutdownOutcome::Delivered, 0);
+            else finish(i, ShutdownOutcome::Failed, errno);
+        }
     }
 
-    if (connect(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
-        ::close(s);
-        return false;
+    // whatever is still connecting missed the deadline
+    for (auto& pfd : fds) ::close(pfd.fd);
+    return results;
+}
+
+void FileTransfer::on_data_accept() {
+    while (true) {
+        int client = accept4(sockfd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) return; // EAGAIN: backlog drained
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex_);
+            data_clients_.insert(client);
+        }
+        // the client socket stays blocking: the transfer owns a receive thread until done,
+        // or until the peer goes quiet, so idle connections cannot hold them all
+        struct timeval idle{kReceiveIdleS, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        bool queued = receive_pool_.submit([this, client]() {
+            receive_files(client);
+            std::lock_guard<std::mutex> lock(clients_mutex_);
+            data_clients_.erase(client);
+            ::close(client);
+            clients_cv_.notify_all();
+        });
+        if (!queued) {
+            std::lock_guard<std::mutex> lock(clients_mutex_);
+            data_clients_.erase(client);
+            ::close(client);
+            clients_cv_.notify_all();
+        }
     }
+}
 
-    uint8_t code = MessageCodec::MSG_SHUTDOWN;
-    ssize_t r = send(s, &code, sizeof(code), 0);
-    ::close(s);
-    return r == (ssize_t)sizeof(code);
+void FileTransfer::receive_files(int client) {
+    std::string peer_ip;
+    struct sockaddr_in peer{};
+    socklen_t plen = sizeof(peer);
+    char ipbuf[INET_ADDRSTRLEN];
+    if (getpeername(client, reinterpret_cast<struct sockaddr*>(&peer), &plen) == 0 &&
+        inet_ntop(AF_INET, &peer.sin_addr, ipbuf, sizeof(ipbuf))) {
+        peer_ip = ipbuf;
+    }
+    while (receive_file(client, peer_ip)) {
+    }
 }
 
-void FileTransfer::receiver_loop() {
-    mkdir("recv", 0755);
-    while (running_) {
-        struct sockaddr_in peer{};
-        socklen_t plen = sizeof(peer);
-        int client = accept(sockfd_, reinterpret_cast<struct sockaddr*>(&peer), &plen);
-        if (client < 0) {
-            if (!running_) break;
-            continue;
+bool FileTransfer::receive_file(int client, const std::string& peer_ip) {
+    // read filename length
+    uint16_t name_len_be;
+    if (recv(client, &name_len_be, sizeof(name_len_be), MSG_WAITALL) != sizeof(name_len_be)) return false;
+    uint16_t name_len = ntohs(name_len_be);
+    bool sparse = name_len & kSparseNameFlag;
+    name_len &= ~kSparseNameFlag;
+    std::string filename(name_len, '\0');
+    if (recv(client, &filename[0], name_len, MSG_WAITALL) != (ssize_t)name_len) return false;
+
+    uint64_t fsize_be;
+    if (recv(client, &fsize_be, sizeof(fsize_be), MSG_WAITALL) != sizeof(fsize_be)) return false;
+    uint64_t fsize = be64toh(fsize_be);
+    if (!safe_relative_path(filename)) {
+        std::cerr << "Receive: refusing file name " << filename << " from " << peer_ip << "\n";
+        return false;
+    }
+    if (fsize == kStreamSize) return !sparse && receive_stream(client, peer_ip, filename);
+
+    std::string outpath = std::string("recv/") + filename;
+    int out = make_parents("recv", filename) ? ::open(outpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    ActiveTransferGuard active(active_transfers_);
+    ProgressScope progress(*this, false, peer_ip, filename, fsize);
+    if (out < 0) return false;
+    TRACE_SCOPE_VAR(span, "transfer", "receive_file");
+    TRACE_SET_ARG(span, fsize);
+    char buf[4096];
+    // writes the next `len` bytes from the socket at `offset`
+    auto recv_range = [&](uint64_t offset, uint64_t len) {
+        while (len > 0) {
+            ssize_t r;
+            {
+                TRACE_SCOPE_VAR(io, "transfer", "recv");
+                r = recv(client, buf, std::min<uint64_t>(sizeof(buf), len), 0);
+                TRACE_SET_ARG(io, r > 0 ? r : 0);
+            }
+            if (r <= 0) return false;
+            {
+                TRACE_SCOPE("transfer", "file write");
+                if (pwrite(out, buf, r, offset) != r) return false;
+            }
+            offset += r;
+            len -= r;
+            progress.add(r);
         }
+        return true;
+    };
 
-        // read filename length
-        uint16_t name_len_be;
-        if (recv(client, &name_len_be, sizeof(name_len_be), MSG_WAITALL) != sizeof(name_len_be)) { ::close(client); continue; }
-        uint16_t name_len = ntohs(name_len_be);
-        std::string filename(name_len, '\0');
-        if (recv(client, &filename[0], name_len, MSG_WAITALL) != (ssize_t)name_len) { ::close(client); continue; }
-
-        uint64_t fsize_be;
-        if (recv(client, &fsize_be, sizeof(fsize_be), MSG_WAITALL) != sizeof(fsize_be)) { ::close(client); continue; }
-        uint64_t fsize = be64toh(fsize_be);
-
-        std::string outpath = std::string("recv/") + filename;
-        std::ofstream out(outpath, std::ios::binary);
-        uint64_t remaining = fsize;
-        char buf[4096];
-        while (remaining > 0) {
-            ssize_t r = recv(client, buf, sizeof(buf), 0);
-            if (r <= 0) break;
-            out.write(buf, r);
-            remaining -= r;
+    bool ok;
+    if (!sparse) {
+        ok = recv_range(0, fsize);
+    } else {
+        // the file starts as one hole of the full size and only extents get blocks; it
+        // was just truncated, so there is nothing stale to punch out
+        ok = ftruncate(out, fsize) == 0;
+        uint64_t at = 0;
+        while (ok) {
+            uint64_t extent[2];
+            if (recv(client, extent, sizeof(extent), MSG_WAITALL) != sizeof(extent)) {
+                ok = false;
+                break;
+            }
+            uint64_t offset = be64toh(extent[0]);
+            uint64_t len = be64toh(extent[1]);
+            if (len == 0) break;
+            if (offset < at || offset > fsize || len > fsize - offset) {
+                ok = false;
+                break;
+            }
+            progress.skip(offset - at);
+            ok = recv_range(offset, len);
+            at = offset + len;
         }
-        out.close();
-        ::close(client);
+        if (ok) progress.skip(fsize - at);
     }
+    if (::close(out) != 0) ok = false;
+    progress.ok = ok;
+    return ok;
 }
 
-void FileTransfer::control_loop() {
-    control_sockfd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+bool FileTransfer::receive_stream(int client, const std::string& peer_ip, const std::string& name) {
+    ActiveTransferGuard active(active_transfers_);
+    ProgressScope progress(*this, false, peer_ip, name, 0);
+    // a producer may rightly be quiet for a long time (a dump still planning, a log)
+    struct timeval no_timeout{};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    std::unique_lock<std::mutex> exclusive(stream_sink_mutex_, std::defer_lock);
+    // waiting for the sink would hold this thread until the stream before ends, maybe hours
+    if ((stream_sink_ == StreamSink::Stdout || stream_sink_ == StreamSink::Path) && !exclusive.try_lock()) {
+        std::fprintf(stderr, "Receive: refusing stream %s from %s, the sink is busy\n", name.c_str(), peer_ip.c_str());
+        return false;
+    }
+    int out = -1;
+    pid_t child = -1;
+    switch (stream_sink_) {
+        case StreamSink::File:
+            if (make_parents("recv", name)) {
+                out = ::open(("recv/" + name).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            }
+            break;
+        case StreamSink::Stdout:
+            out = STDOUT_FILENO;
+            break;
+        case StreamSink::Path:
+            out = ::open(stream_target_.c_str(), O_WRONLY | O_CLOEXEC);
+            if (out < 0) perror(("Receive: " + stream_target_).c_str());
+            break;
+        case StreamSink::Command:
+            out = spawn_sink(stream_target_, name, peer_ip, child);
+            break;
+    }
+    if (out < 0) return false;
+
+    TRACE_SCOPE("transfer", "receive_stream");
+    std::vector<char> buf(64 * 1024);
+    bool ok = true;
+    while (ok) {
+        uint32_t len_be;
+        if (recv(client, &len_be, sizeof(len_be), MSG_WAITALL) != sizeof(len_be)) {
+            ok = false;
+            break;
+        }
+        uint32_t len = ntohl(len_be);
+        if (len == 0) break;
+        if (len > kMaxStreamChunk) {
+            ok = false;
+            break;
+        }
+        while (ok && len > 0) {
+            ssize_t r = recv(client, buf.data(), std::min<size_t>(buf.size(), len), 0);
+            if (r <= 0) {
+                ok = false;
+                break;
+            }
+            // blocks while the sink is behind; the sender then waits on a full TCP window
+            TRACE_SCOPE("transfer", "sink write");
+            ok = write_all(out, buf.data(), r);
+            len -= r;
+            progress.add(r);
+        }
+    }
+    if (out != STDOUT_FILENO && ::close(out) != 0) ok = false;
+    if (child > 0) {
+        int status = 0;
+        while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "Receive: stream command for " << name << " failed\n";
+            ok = false;
+        }
+    }
+    progress.ok = ok;
+    return ok;
+}
+
+bool FileTransfer::open_control_socket() {
+    control_sockfd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (control_sockfd_ < 0) {
         perror("Control: socket");
-        return;
+        return false;
     }
     int on = 1;
     setsockopt(control_sockfd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
@@ -256,7 +1055,7 @@ void FileTransfer::control_loop() {
             perror("Control: bind (ephemeral)");
             ::close(control_sockfd_);
             control_sockfd_ = -1;
-            return;
+            return false;
         } else {
             struct sockaddr_in actual{};
             socklen_t alen = sizeof(actual);
@@ -269,71 +1068,351 @@ void FileTransfer::control_loop() {
         perror("Control: listen");
         ::close(control_sockfd_);
         control_sockfd_ = -1;
-        return;
+        return false;
     }
+    return true;
+}
 
-    while (running_) {
+void FileTransfer::on_control_accept() {
+    // a peer gets this long to send its request; the decision timer replaces it
+    constexpr auto kRequestTimeout = std::chrono::milliseconds(10000);
+    while (true) {
         struct sockaddr_in peer{};
         socklen_t plen = sizeof(peer);
-        int client = accept(control_sockfd_, reinterpret_cast<struct sockaddr*>(&peer), &plen);
-        if (client < 0) { if (!running_) break; continue; }
-        uint8_t code;
-        if (recv(client, &code, sizeof(code), MSG_WAITALL) != sizeof(code)) { ::close(client); continue; }
-        if (code == MessageCodec::MSG_FILE_REQUEST) {
-            uint16_t name_len_be;
-            if (recv(client, &name_len_be, sizeof(name_len_be), MSG_WAITALL) != sizeof(name_len_be)) { ::close(client); continue; }
-            uint16_t name_len = ntohs(name_len_be);
-            std::string filename(name_len, '\0');
-            if (recv(client, &filename[0], name_len, MSG_WAITALL) != (ssize_t)name_len) { ::close(client); continue; }
-
-            // enqueue pending request for main thread to handle
-            char ipbuf[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &peer.sin_addr, ipbuf, sizeof(ipbuf));
-            auto req = std::make_shared<PendingRequest>(std::string(ipbuf), filename);
-            {
-                std::lock_guard<std::mutex> lock(pending_mutex_);
-                pending_.push_back(req);
-            }
-            pending_cv_.notify_one();
-
-            // wait for decision with timeout (30s)
-            int waited = 0;
-            const int step = 100;
-            while (req->decision.load() == -1 && waited < 30000) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(step));
-                waited += step;
+        int client = accept4(control_sockfd_, reinterpret_cast<struct sockaddr*>(&peer), &plen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) return;
+        char ipbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer.sin_addr, ipbuf, sizeof(ipbuf));
+        ControlConn& conn = control_conns_[client];
+        conn.peer_ip = ipbuf;
+        conn.timer = loop_->add_timer(kRequestTimeout, [this, client]() {
+            control_conns_[client].timer = 0;
+            finish_control(client, MessageCodec::MSG_FILE_REJECT);
+        });
+        loop_->add_fd(client, EPOLLIN, [this, client](uint32_t events) {
+            if (events & EPOLLOUT) on_control_writable(client);
+            else on_control_readable(client);
+        });
+    }
+}
+
+void FileTransfer::on_control_readable(int fd) {
+    // wait for decision with timeout (30s)
+    constexpr auto kDecisionTimeout = std::chrono::milliseconds(30000);
+    auto it = control_conns_.find(fd);
+    if (it == control_conns_.end()) return;
+    ControlConn& conn = it->second;
+
+    // request: code + filename length + filename
+    uint8_t chunk[512];
+    ssize_t r = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (r <= 0) {
+        finish_control(fd, MessageCodec::MSG_FILE_REJECT);
+        return;
+    }
+    conn.buf.insert(conn.buf.end(), chunk, chunk + r);
+    if (conn.buf[0] == MessageCodec::MSG_CATALOG_LIST) {
+        serve_catalog_list(fd, conn);
+        return;
+    }
+    if (conn.buf[0] == MessageCodec::MSG_FILE_PULL) {
+        serve_pull(fd, conn);
+        return;
+    }
+    if (conn.buf[0] == MessageCodec::MSG_SKETCH_GET) {
+        serve_sketch(fd, conn);
+        return;
+    }
+    if (conn.buf[0] == MessageCodec::MSG_SEARCH) {
+        serve_search(fd, conn);
+        return;
+    }
+    if (conn.buf[0] != MessageCodec::MSG_FILE_REQUEST) {
+        finish_control(fd, MessageCodec::MSG_FILE_REJECT);
+        return;
+    }
+    if (conn.buf.size() < 3) return;
+    size_t name_len = (static_cast<size_t>(conn.buf[1]) << 8) | conn.buf[2];
+    if (conn.buf.size() < 3 + name_len) return;
+
+    // enqueue pending request for main thread to handle
+    std::string filename(reinterpret_cast<const char*>(&conn.buf[3]), name_len);
+    conn.requested_at = std::chrono::steady_clock::now();
+    transfer_metrics().requests[0]->add();
+    TRACE_INSTANT("control", "request received", fd);
+    transfer_metrics().waiting.add(1);
+    conn.buf.clear();
+    loop_->remove_fd(fd);
+    loop_->cancel_timer(conn.timer);
+    conn.timer = loop_->add_timer(kDecisionTimeout, [this, fd]() {
+        control_conns_[fd].timer = 0;
+        finish_control(fd, MessageCodec::MSG_FILE_REJECT);
+    });
+    {
+        TRACE_LOCK(lock, pending_mutex_);
+        // decided requests beyond the last few go, as finished transfers do
+        size_t decided = 0;
+        for (const auto& r : pending_) if (r->decision.load() >= 0) ++decided;
+        for (auto it = pending_.begin(); decided >= kDecidedRequestsKept && it != pending_.end();) {
+            if ((*it)->decision.load() >= 0) {
+                it = pending_.erase(it);
+                --decided;
+            } else {
+                ++it;
             }
+        }
+        conn.req = std::make_shared<PendingRequest>(next_request_id_++, conn.peer_ip, filename);
+        pending_.push_back(conn.req);
+    }
+    requests_version_.fetch_add(1);
+    pending_cv_.notify_one();
+    notify_changed();
+}
+
+bool FileTransfer::serve_catalog_list(int fd, ControlConn& conn) {
+    // code | after_len (16) | after | limit (16)
+    if (conn.buf.size() < 3) return false;
+    size_t after_len = (static_cast<size_t>(conn.buf[1]) << 8) | conn.buf[2];
+    if (conn.buf.size() < 5 + after_len) return false;
+    if (!catalog_ || !catalog_->active()) {
+        finish_control(fd, MessageCodec::MSG_FILE_REJECT);
+        return true;
+    }
+    std::string after(reinterpret_cast<const char*>(&conn.buf[3]), after_len);
+    size_t limit = (static_cast<size_t>(conn.buf[3 + after_len]) << 8) | conn.buf[4 + after_len];
+    conn.buf.clear();
+    std::vector<uint8_t> out(5);
+    SharedCatalog::encode_page(catalog_->list(after, limit), out);
+    reply_framed(fd, MessageCodec::MSG_CATALOG_PAGE, std::move(out));
+    return true;
+}
+
+bool FileTransfer::serve_sketch(int fd, ControlConn& conn) {
+    // code; answered with version (32) | filter
+    conn.buf.clear();
+    if (!catalog_ || !catalog_->active()) {
+        finish_control(fd, MessageCodec::MSG_FILE_REJECT);
+        return true;
+    }
+    uint32_t version;
+    auto sketch = catalog_->sketch(version);
+    std::vector<uint8_t> out(5);
+    uint32_t version_be = htonl(version);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&version_be), reinterpret_cast<uint8_t*>(&version_be) + 4);
+    sketch->encode(out);
+    reply_framed(fd, MessageCodec::MSG_SKETCH, std::move(out));
+    return true;
+}
+
+bool FileTransfer::serve_search(int fd, ControlConn& conn) {
+    // code | limit (16) | name_len (16) | name; answered with a catalog page
+    if (conn.buf.size() < 5) return false;
+    size_t name_len = (static_cast<size_t>(conn.buf[3]) << 8) | conn.buf[4];
+    if (conn.buf.size() < 5 + name_len) return false;
+    if (!catalog_ || !catalog_->active()) {
+        finish_control(fd, MessageCodec::MSG_FILE_REJECT);
+        return true;
+    }
+    size_t limit = (static_cast<size_t>(conn.buf[1]) << 8) | conn.buf[2];
+    std::string name(reinterpret_cast<const char*>(&conn.buf[5]), name_len);
+    conn.buf.clear();
+    std::vector<uint8_t> out(5);
+    SharedCatalog::encode_page(catalog_->find(name, limit), out);
+    reply_framed(fd, MessageCodec::MSG_SEARCH_RESULT, std::move(out));
+    return true;
+}
+
+void FileTransfer::reply_framed(int fd, uint8_t code, std::vector<uint8_t> out) {
+    out[0] = code;
+    uint32_t body_len = htonl(static_cast<uint32_t>(out.size() - 5));
+    std::memcpy(&out[1], &body_len, 4);
+    reply_control(fd, std::move(out));
+}
+
+bool FileTransfer::serve_pull(int fd, ControlConn& conn) {
+    // at most two pulls served at once, so peers cannot fill the shared node pool with
+    // sends (receives have a pool of their own)
+    constexpr int kMaxPulls = 2;
+    // code | flags (8) | data_port (16) | path_len (16) | path
+    if (conn.buf.size() < 6) return false;
+    size_t path_len = (static_cast<size_t>(conn.buf[4]) << 8) | conn.buf[5];
+    if (conn.buf.size() < 6 + path_len) return false;
+    bool sparse = conn.buf[1] & MessageCodec::BEACON_FLAG_SPARSE;
+    uint16_t data_port = static_cast<uint16_t>((conn.buf[2] << 8) | conn.buf[3]);
+    std::string path(reinterpret_cast<const char*>(&conn.buf[6]), path_len);
+    conn.buf.clear();
+    // only what the index holds can be pulled, so paths outside the share never resolve
+    std::string abs = catalog_ ? catalog_->resolve(path) : std::string();
+    if (abs.empty() || active_pulls_.fetch_add(1) >= kMaxPulls) {
+        if (!abs.empty()) active_pulls_.fetch_sub(1);
+        reply_control(fd, {MessageCodec::MSG_FILE_REJECT});
+        return true;
+    }
+    std::string peer_ip = conn.peer_ip;
+    reply_control(fd, {MessageCodec::MSG_FILE_ACCEPT});
+    bool queued = pool_->submit([this, peer_ip, data_port, abs, sparse]() {
+        send_file(peer_ip, data_port, abs, "", PathEstimate(), sparse);
+        active_pulls_.fetch_sub(1);
+    });
+    if (!queued) active_pulls_.fetch_sub(1);
+    return true;
+}
 
-            uint8_t resp = MessageCodec::MSG_FILE_REJECT;
-            int d = req->decision.load();
-            if (d == 1) resp = MessageCodec::MSG_FILE_ACCEPT;
-            // if still -1 or 0 -> reject
-            send(client, &resp, sizeof(resp), 0);
+void FileTransfer::reply_control(int fd, std::vector<uint8_t> bytes) {
+    ControlConn& conn = control_conns_[fd];
+    conn.out = std::move(bytes);
+    conn.out_off = 0;
+    on_control_writable(fd);
+}
+
+void FileTransfer::on_control_writable(int fd) {
+    auto it = control_conns_.find(fd);
+    if (it == control_conns_.end()) return;
+    ControlConn& conn = it->second;
+    while (conn.out_off < conn.out.size()) {
+        ssize_t w = send(fd, conn.out.data() + conn.out_off, conn.out.size() - conn.out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // the request timer still bounds how long a slow reader can hold the connection
+            loop_->modify_fd(fd, EPOLLOUT);
+            return;
+        }
+        if (w <= 0) break;
+        conn.out_off += w;
+    }
+    finish_control(fd, 0);
+}
+
+void FileTransfer::complete_request(const std::shared_ptr<PendingRequest>& req) {
+    for (auto& [fd, conn] : control_conns_) {
+        if (conn.req != req) continue;
+        finish_control(fd, req->decision.load() == 1 ? MessageCodec::MSG_FILE_ACCEPT : MessageCodec::MSG_FILE_REJECT);
+        return;
+    }
+}
+
+void FileTransfer::finish_control(int fd, uint8_t resp) {
+    auto it = control_conns_.find(fd);
+    if (it == control_conns_.end()) return;
+    ControlConn& conn = it->second;
+    if (conn.timer) loop_->cancel_timer(conn.timer);
+    if (conn.req) {
+        // undecided at this point means timed out or shutting down: show it as rejected
+        int undecided = -1;
+        TransferMetrics& m = transfer_metrics();
+        if (conn.req->decision.compare_exchange_strong(undecided, 0)) {
+            m.timed_out.add();
+            requests_version_.fetch_add(1);
+            notify_changed();
+        } else {
+            (undecided == 1 ? m.accepted : m.rejected).add();
         }
-        ::close(client);
+        m.waiting.add(-1);
+        m.decision_time.observe(seconds_since(conn.requested_at));
+        TRACE_INSTANT("control", resp == MessageCodec::MSG_FILE_ACCEPT ? "request accepted" : "request rejected", fd);
+        send(fd, &resp, sizeof(resp), MSG_NOSIGNAL | MSG_DONTWAIT);
+    } else {
+        loop_->remove_fd(fd);
     }
+    ::close(fd);
+    control_conns_.erase(it);
 }
 
 std::vector<std::shared_ptr<PendingRequest>> FileTransfer::get_pending_requests() {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
+    TRACE_LOCK(lock, pending_mutex_);
     return pending_;
 }
 
 bool FileTransfer::decide_request(const std::string& peer_ip, const std::string& filename, bool accept) {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
-    for (auto& p : pending_) {
-        if (p->peer_ip == peer_ip && p->filename == filename) {
-            p->decision.store(accept ? 1 : 0);
-            return true;
+    std::shared_ptr<PendingRequest> req;
+    {
+        TRACE_LOCK(lock, pending_mutex_);
+        for (auto& p : pending_) {
+            if (p->peer_ip == peer_ip && p->filename == filename) {
+                req = p;
+                break;
+            }
         }
     }
-    return false;
+    if (!req) return false;
+    req->decision.store(accept ? 1 : 0);
+    requests_version_.fetch_add(1);
+    if (running_) loop_->post([this, req]() { complete_request(req); });
+    notify_changed();
+    return true;
 }
 
-bool FileTransfer::decide_request_by_index(size_t index, bool accept) {
-    std::lock_guard<std::mutex> lock(pending_mutex_);
-    if (index >= pending_.size()) return false;
-    auto& p = pending_[index];
-    p->decision.store(accept ? 1 : 0);
+bool FileTransfer::decide_request_by_id(uint64_t id, bool accept) {
+    std::shared_ptr<PendingRequest> req;
+    {
+        TRACE_LOCK(lock, pending_mutex_);
+        for (auto& p : pending_) {
+            if (p->id == id) {
+                req = p;
+                break;
+            }
+        }
+    }
+    if (!req) return false;
+    req->decision.store(accept ? 1 : 0);
+    requests_version_.fetch_add(1);
+    if (running_) loop_->post([this, req]() { complete_request(req); });
+    notify_changed();
     return true;
 }
+
+std::vector<std::shared_ptr<TransferProgress>> FileTransfer::get_transfers() {
+    std::lock_guard<std::mutex> lock(transfers_mutex_);
+    return transfers_;
+}
+
+void FileTransfer::set_change_observer(std::function<void()> observer) {
+    std::lock_guard<std::mutex> lock(observer_mutex_);
+    change_observer_ = std::move(observer);
+}
+
+void FileTransfer::notify_changed() {
+    std::lock_guard<std::mutex> lock(observer_mutex_);
+    if (change_observer_) change_observer_();
+}
+
+uint16_t FileTransfer::active_transfers() const {
+    return static_cast<uint16_t>(std::max(0, active_transfers_.load()));
+}
+
+void FileTransfer::set_link_capacity_kbps(uint32_t kbps) {
+    link_capacity_kbps_.store(kbps);
+}
+
+void FileTransfer::fill_capabilities(MessageCodec::Beacon& b) {
+    b.data_port = listen_port_;
+    b.control_port = control_port_.load();
+    b.active_transfers = active_transfers();
+    b.flags |= MessageCodec::BEACON_FLAG_SPARSE | MessageCodec::BEACON_FLAG_BATCH | MessageCodec::BEACON_FLAG_STREAM;
+    if (catalog_ && catalog_->active()) {
+        b.flags |= MessageCodec::BEACON_FLAG_CATALOG;
+        b.sketch_version = catalog_->sketch_version();
+    }
+
+    struct statvfs vfs;
+    if (statvfs("recv", &vfs) == 0 || statvfs(".", &vfs) == 0) {
+        uint64_t free_mb = (static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize) >> 20;
+        b.free_disk_mb = static_cast<uint32_t>(std::min<uint64_t>(free_mb, UINT32_MAX));
+    }
+
+    // spare bandwidth: link capacity minus what our transfers used since the last beacon
+    uint32_t capacity = link_capacity_kbps_.load();
+    if (capacity == 0) {
+        b.bandwidth_kbps = 0;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(rate_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    uint64_t bytes = bytes_moved_.load(std::memory_order_relaxed);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - rate_sample_at_).count();
+    uint64_t used_kbps = ms > 0 ? (bytes - rate_sample_bytes_) * 8 / ms : 0;
+    rate_sample_at_ = now;
+    rate_sample_bytes_ = bytes;
+    b.bandwidth_kbps = used_kbps >= capacity ? 1 : static_cast<uint32_t>(capacity - used_kbps);
+}
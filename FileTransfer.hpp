@@ -7,13 +7,103 @@
 #include <condition_variable>
 #include <memory>
 #include <atomic>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <sys/stat.h>
+#include "MessageCodec.hpp"
+#include "EventLoop.hpp"
+#include "LinkProber.hpp"
+#include "SharedCatalog.hpp"
 
 struct PendingRequest {
+    // stays the same while the request is listed, unlike its position
+    uint64_t id;
     std::string peer_ip;
     std::string filename;
     // -1 undecided, 0 reject, 1 accept
     std::atomic<int> decision;
-    PendingRequest(const std::string& ip, const std::string& fn) : peer_ip(ip), filename(fn), decision(-1) {}
+    PendingRequest(uint64_t n, const std::string& ip, const std::string& fn)
+        : id(n), peer_ip(ip), filename(fn), decision(-1) {}
+};
+
+// Progress of one send or receive. done_bytes is updated by the transfer thread as data
+// moves; the other fields are fixed once the entry is published.
+struct TransferProgress {
+    bool outgoing;
+    std::string peer_ip;
+    std::string filename;
+    // 0 for streams, whose length is not known until they end
+    uint64_t total_bytes;
+    std::atomic<uint64_t> done_bytes;
+    // 0 running, 1 completed, -1 failed
+    std::atomic<int> state;
+    TransferProgress(bool out, const std::string& ip, const std::string& fn, uint64_t total)
+        : outgoing(out), peer_ip(ip), filename(fn), total_bytes(total), done_bytes(0), state(0) {}
+};
+
+// Socket settings for one transfer, picked from the measured path to the peer
+struct TransferTuning {
+    // SO_SNDBUF for the data socket; 0 leaves the kernel's autotuning alone
+    int socket_buffer = 0;
+    // bytes read from the file per send()
+    size_t chunk_bytes = 64 * 1024;
+};
+
+// Where incoming streams (send_pipe, length unknown) are written. Writes block while the
+// sink is slow, which stalls the connection and so the sender: nothing is buffered to disk.
+enum class StreamSink {
+    // recv/NAME, like any other file
+    File,
+    // our standard output; one stream at a time, a second one is refused while it runs
+    Stdout,
+    // a path opened for writing per stream, e.g. a FIFO another process reads; one at a
+    // time, like Stdout
+    Path,
+    // `sh -c COMMAND` per stream with the data on its stdin and LANSHARE_NAME and
+    // LANSHARE_PEER set; the stream fails if the command exits non-zero
+    Command
+};
+
+struct ShutdownTarget {
+    std::string ip;
+    uint16_t port = 40002;
+    std::string iface;
+};
+
+enum class ShutdownOutcome {
+    Delivered,
+    // the peer answered with RST (nothing listening any more)
+    Refused,
+    // no answer before the global deadline (includes targets never started)
+    TimedOut,
+    Failed
+};
+
+struct ShutdownResult {
+    std::string ip;
+    ShutdownOutcome outcome;
+    // errno behind Refused/Failed, 0 otherwise
+    int error;
+};
+
+// Lets another thread abort blocking sends: cancel() shuts down every socket a send
+// registered with it, so the send fails at once, and sends started afterwards fail before
+// connecting. Pass the same one to request_send, send_file and send_files.
+class TransferCancel {
+public:
+    void cancel();
+    bool cancelled();
+    // for the sending side: false once cancelled (the caller closes s and gives up)
+    bool add(int s);
+    void remove(int s);
+
+private:
+    std::mutex mutex_;
+    std::unordered_set<int> fds_;
+    bool cancelled_ = false;
 };
 
 class FileTransfer {
@@ -21,43 +111,182 @@ public:
     FileTransfer(uint16_t listen_port = 40001);
     ~FileTransfer();
 
+    // Accepts and control requests run on `loop`, pulled files are sent from `pool`;
+    // incoming files are written on a pool of our own. Both are optional (a private loop
+    // thread and a small pool are used otherwise); call before start_receiver().
+    void set_event_loop(EventLoop* loop);
+    void set_worker_pool(WorkerPool* pool);
+
     bool start_receiver();
     void stop_receiver();
 
-    // Blocking send of a file to remote_ip:port. Returns true on success.
-    bool send_file(const std::string& remote_ip, uint16_t port, const std::string& filepath);
+    // Outgoing connections take an optional interface name (DeviceInfo::iface) so that
+    // multi-homed hosts reach the peer through the segment it was discovered on.
+
+    // Blocking send of a file to remote_ip:port. Returns true on success. `path` (from
+    // DeviceInfo) sizes the socket buffer to the path's bandwidth-delay product. With
+    // `sparse` (the peer advertises BEACON_FLAG_SPARSE) a file with holes is sent as its
+    // data extents only and the receiver recreates the holes.
+    bool send_file(const std::string& remote_ip, uint16_t port, const std::string& filepath, const std::string& iface = "",
+                   const PathEstimate& path = PathEstimate(), bool sparse = false, TransferCancel* cancel = nullptr);
+    // Blocking send of several files over one data connection, each named by its path
+    // relative to `root` so the peer recreates the tree under recv/. Only for peers that
+    // advertise BEACON_FLAG_BATCH. Files that no longer exist, and anything that is not a
+    // regular file (a symlink is not followed), are skipped. Returns how many entries of
+    // `paths` were dealt with before the connection failed (all of them on success).
+    size_t send_files(const std::string& remote_ip, uint16_t port, const std::string& root,
+                      const std::vector<std::string>& paths, const std::string& iface = "",
+                      const PathEstimate& path = PathEstimate(), bool sparse = false,
+                      TransferCancel* cancel = nullptr);
+    // Blocking send of everything readable from `fd` until EOF (a pipe, stdin, a socket),
+    // framed in chunks since the length is not known up front. Only for peers that
+    // advertise BEACON_FLAG_STREAM. Does not close fd. Waiting for input ends early if the
+    // connection fails or `cancel` is cancelled.
+    bool send_pipe(const std::string& remote_ip, uint16_t port, int fd, const std::string& name,
+                   const std::string& iface = "", const PathEstimate& path = PathEstimate(),
+                   TransferCancel* cancel = nullptr);
+    static TransferTuning tuning_for(const PathEstimate& path);
     // send a single-byte shutdown message via TCP to remote host
-    bool send_shutdown(const std::string& remote_ip, uint16_t port = 40002);
+    bool send_shutdown(const std::string& remote_ip, uint16_t port = 40002, const std::string& iface = "");
+    // Notify many peers concurrently with non-blocking connects; returns once every
+    // target has an outcome or deadline_ms has passed, whichever comes first.
+    std::vector<ShutdownResult> send_shutdown_all(const std::vector<ShutdownTarget>& targets, unsigned int deadline_ms = 1500);
     // request permission to send a file. Connects to control_port on remote and waits for accept.
-    bool request_send(const std::string& remote_ip, uint16_t control_port, const std::string& filename, unsigned int timeout_ms = 30000);
-    // polling API for incoming requests (main thread)
+    bool request_send(const std::string& remote_ip, uint16_t control_port, const std::string& filename, unsigned int timeout_ms = 30000, const std::string& iface = "",
+                      TransferCancel* cancel = nullptr);
+    // polling API for incoming requests (main thread): undecided ones and the last few
+    // decided, oldest first
     std::vector<std::shared_ptr<PendingRequest>> get_pending_requests();
+    // bumped whenever a request arrives or is decided, so pollers can skip unchanged lists
+    uint64_t requests_version() const { return requests_version_.load(); }
     // main thread calls this to decide a pending request; returns true if found and set
     bool decide_request(const std::string& peer_ip, const std::string& filename, bool accept);
-    // decide by index into pending list (0-based)
-    bool decide_request_by_index(size_t index, bool accept);
+    // decide by PendingRequest::id
+    bool decide_request_by_id(uint64_t id, bool accept);
+
+    // sends and receives currently in progress
+    uint16_t active_transfers() const;
+    // running transfers plus the most recently finished ones, oldest first
+    std::vector<std::shared_ptr<TransferProgress>> get_transfers();
+    // Called (from any thread) when a request arrives or is decided and when a transfer
+    // starts or ends; byte counts are not reported, poll get_transfers() for those. Must
+    // not block. Once set_change_observer() returns the previous observer is no longer
+    // running, so pass nullptr before destroying whatever it refers to.
+    void set_change_observer(std::function<void()> observer);
+    // fill our advertised ports and load figures into an outgoing beacon
+    void fill_capabilities(MessageCodec::Beacon& b);
+    // capacity of our link, used to advertise spare bandwidth (0 = unknown)
+    void set_link_capacity_kbps(uint32_t kbps);
+
+    // where incoming streams go (default StreamSink::File); `target` is the path or command.
+    // Call before start_receiver().
+    void set_stream_sink(StreamSink sink, const std::string& target = "");
+
+    // Publish a shared folder: peers may list it and pull files from it without asking
+    // for a decision. Set before start_receiver(); the catalog must outlive the receiver.
+    void set_catalog(SharedCatalog* catalog);
+    // one page of a peer's shared folder: entries after `after` in path order
+    bool fetch_catalog(const std::string& remote_ip, uint16_t control_port, const std::string& after, size_t limit,
+                       CatalogPage& page, unsigned int timeout_ms = 10000, const std::string& iface = "");
+    // Ask a peer to send us one of its shared files. True once it agreed; the file then
+    // arrives on our data port like any other receive.
+    bool request_pull(const std::string& remote_ip, uint16_t control_port, const std::string& path,
+                      unsigned int timeout_ms = 10000, const std::string& iface = "");
+    // a peer's Bloom filter of shared names and the version it belongs to
+    bool fetch_sketch(const std::string& remote_ip, uint16_t control_port, uint32_t& version, BloomFilter& sketch,
+                      unsigned int timeout_ms = 2000, const std::string& iface = "");
+    // files a peer shares under `name` (see SharedCatalog::find)
+    bool search_peer(const std::string& remote_ip, uint16_t control_port, const std::string& name, size_t limit,
+                     CatalogPage& page, unsigned int timeout_ms = 2000, const std::string& iface = "");
 
 private:
+    // a control connection waiting for its request bytes, then for the user's decision
+    struct ControlConn {
+        std::string peer_ip;
+        std::vector<uint8_t> buf;
+        std::shared_ptr<PendingRequest> req;
+        std::chrono::steady_clock::time_point requested_at;
+        EventLoop::TimerId timer = 0;
+        // a catalog page still being written out; the connection closes once it drains
+        std::vector<uint8_t> out;
+        size_t out_off = 0;
+    };
+
     uint16_t listen_port_;
     int sockfd_;
-    std::thread worker_;
-    bool running_;
-    // control server
+    std::atomic<bool> running_;
+    EventLoop* loop_;
+    std::unique_ptr<EventLoop> own_loop_;
+    // pull uploads; shared with the rest of the node
+    WorkerPool* pool_;
+    std::unique_ptr<WorkerPool> own_pool_;
+    // incoming data connections only, so receives never wait behind DNS lookups or pulls
+    WorkerPool receive_pool_;
+    // data connections being received; stop_receiver() shuts them down and waits for the
+    // set to drain
+    std::mutex clients_mutex_;
+    std::condition_variable clients_cv_;
+    std::unordered_set<int> data_clients_;
+    // control server; connections are only touched on the loop thread
     int control_sockfd_;
-    uint16_t control_port_;
+    std::atomic<uint16_t> control_port_;
+    std::unordered_map<int, ControlConn> control_conns_;
+    // load accounting for the capability beacon
+    std::atomic<int> active_transfers_;
+    std::atomic<uint64_t> bytes_moved_;
+    std::mutex rate_mutex_;
+    std::chrono::steady_clock::time_point rate_sample_at_;
+    uint64_t rate_sample_bytes_;
+    std::atomic<uint32_t> link_capacity_kbps_;
+    std::mutex transfers_mutex_;
+    std::vector<std::shared_ptr<TransferProgress>> transfers_;
+    std::mutex observer_mutex_;
+    std::function<void()> change_observer_;
+    SharedCatalog* catalog_;
+    std::atomic<int> active_pulls_;
+    StreamSink stream_sink_;
+    std::string stream_target_;
+    // held for a whole stream by the sinks that take one at a time
+    std::mutex stream_sink_mutex_;
 public:
     // accessors for actual ports (may differ if fallback ephemeral port was used)
     uint16_t listen_port() const { return listen_port_; }
     uint16_t control_port() const { return control_port_; }
-    std::thread control_worker_;
 
     std::mutex pending_mutex_;
     std::vector<std::shared_ptr<PendingRequest>> pending_;
+    uint64_t next_request_id_;
+    std::atomic<uint64_t> requests_version_;
     std::condition_variable pending_cv_;
 
-    void control_loop();
-
-    void receiver_loop();
+private:
+    bool open_control_socket();
+    void on_data_accept();
+    // header and contents of one open file on a connected data socket
+    bool send_stream(int s, int in, const struct stat& st, const std::string& remote_ip, const std::string& filename,
+                     const TransferTuning& tuning, bool sparse);
+    // files until the sender closes the connection
+    void receive_files(int client);
+    bool receive_file(int client, const std::string& peer_ip);
+    // the chunks of a stream, into the configured sink
+    bool receive_stream(int client, const std::string& peer_ip, const std::string& name);
+    void on_control_accept();
+    void on_control_readable(int fd);
+    void on_control_writable(int fd);
+    // catalog list and pull requests are answered at once; false = need more bytes
+    bool serve_catalog_list(int fd, ControlConn& conn);
+    bool serve_pull(int fd, ControlConn& conn);
+    bool serve_sketch(int fd, ControlConn& conn);
+    bool serve_search(int fd, ControlConn& conn);
+    void reply_control(int fd, std::vector<uint8_t> bytes);
+    // code | body_len (32) | body, where out holds 5 placeholder bytes and then the body
+    void reply_framed(int fd, uint8_t code, std::vector<uint8_t> out);
+    // answer a decided (or timed out) request and drop the connection
+    void finish_control(int fd, uint8_t resp);
+    void complete_request(const std::shared_ptr<PendingRequest>& req);
+    // registers a transfer in transfers_ and marks it finished when the scope ends
+    struct ProgressScope;
+    void notify_changed();
 };
 
 #endif // FILE_TRANSFER_HPP
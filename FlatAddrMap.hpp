@@ -0,0 +1,123 @@
+#ifndef FLAT_ADDR_MAP_HPP
+#define FLAT_ADDR_MAP_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+// Hash map from IPv4 addresses (as stored in sin_addr.s_addr) to T, for the beacon hot
+// path. Open addressing with linear probing over a slot array of 8-byte {addr, index}
+// pairs; the values themselves sit in a dense vector, so a lookup touches one cache line
+// of slots plus the value, and iteration is a plain vector walk. Erase moves the last
+// value into the hole and backward-shifts the probe run, so there are no tombstones.
+// References to values are invalidated by insert and erase. Not thread-safe.
+template <typename T>
+class FlatAddrMap {
+public:
+    struct Entry {
+        uint32_t addr;
+        T value;
+    };
+
+    FlatAddrMap() : slots_(kMinSlots, Slot{0, kEmpty}) {}
+
+    T* find(uint32_t addr) {
+        size_t i = locate(addr);
+        return slots_[i].index == kEmpty ? nullptr : &entries_[slots_[i].index].value;
+    }
+    const T* find(uint32_t addr) const { return const_cast<FlatAddrMap*>(this)->find(addr); }
+    bool contains(uint32_t addr) const { return find(addr) != nullptr; }
+
+    // adds `value` under `addr` unless the address is already present; returns the stored value
+    T& insert(uint32_t addr, T value) {
+        if ((entries_.size() + 1) * 2 > slots_.size()) grow();
+        size_t i = locate(addr);
+        if (slots_[i].index != kEmpty) return entries_[slots_[i].index].value;
+        slots_[i] = Slot{addr, static_cast<uint32_t>(entries_.size())};
+        entries_.push_back(Entry{addr, std::move(value)});
+        return entries_.back().value;
+    }
+
+    bool erase(uint32_t addr) {
+        size_t i = locate(addr);
+        uint32_t index = slots_[i].index;
+        if (index == kEmpty) return false;
+        // keep the values dense: the last one takes the freed index
+        if (index + 1 != entries_.size()) {
+            entries_[index] = std::move(entries_.back());
+            slots_[locate(entries_[index].addr)].index = index;
+        }
+        entries_.pop_back();
+        // backward-shift the rest of the probe run into the gap
+        size_t mask = slots_.size() - 1;
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; slots_[j].index != kEmpty; j = (j + 1) & mask) {
+            size_t home = hash(slots_[j].addr) & mask;
+            // move j back unless its home lies cyclically in (hole, j]
+            if (((j - home) & mask) >= ((j - hole) & mask)) {
+                slots_[hole] = slots_[j];
+                hole = j;
+            }
+        }
+        slots_[hole].index = kEmpty;
+        return true;
+    }
+
+    void clear() {
+        entries_.clear();
+        slots_.assign(kMinSlots, Slot{0, kEmpty});
+    }
+
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    typename std::vector<Entry>::iterator begin() { return entries_.begin(); }
+    typename std::vector<Entry>::iterator end() { return entries_.end(); }
+    typename std::vector<Entry>::const_iterator begin() const { return entries_.begin(); }
+    typename std::vector<Entry>::const_iterator end() const { return entries_.end(); }
+
+private:
+    static constexpr uint32_t kEmpty = UINT32_MAX;
+    static constexpr size_t kMinSlots = 16;
+
+    struct Slot {
+        uint32_t addr;
+        uint32_t index;
+    };
+
+    // slot count is a power of two, at most half full
+    std::vector<Slot> slots_;
+    std::vector<Entry> entries_;
+
+    // addresses on one subnet differ in a single byte whichever the byte order, so mix
+    // every bit into the low ones used for the slot
+    static uint32_t hash(uint32_t a) {
+        a ^= a >> 16;
+        a *= 0x45d9f3bu;
+        a ^= a >> 16;
+        a *= 0x45d9f3bu;
+        return a ^ (a >> 16);
+    }
+
+    // the slot holding addr, or the empty slot where it would go
+    size_t locate(uint32_t addr) const {
+        size_t mask = slots_.size() - 1;
+        size_t i = hash(addr) & mask;
+        while (slots_[i].index != kEmpty && slots_[i].addr != addr) i = (i + 1) & mask;
+        return i;
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots_.size() * 2, Slot{0, kEmpty});
+        old.swap(slots_);
+        size_t mask = slots_.size() - 1;
+        for (uint32_t n = 0; n < entries_.size(); ++n) {
+            size_t i = hash(entries_[n].addr) & mask;
+            while (slots_[i].index != kEmpty) i = (i + 1) & mask;
+            slots_[i] = Slot{entries_[n].addr, n};
+        }
+    }
+};
+
+#endif // FLAT_ADDR_MAP_HPP
@@ -0,0 +1,165 @@
+#include "FolderSync.hpp"
+#include "Metrics.hpp"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <algorithm>
+
+// files are picked up when closed after writing or moved in; directories to follow the tree
+static constexpr uint32_t kWatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_ONLYDIR |
+                                       IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+struct SyncMetrics {
+    Counter& sent = metrics().counter("lanshare_sync_batches_total", "Watch-folder batches sent to peers",
+                                      "result=\"sent\"");
+    Counter& failed = metrics().counter("lanshare_sync_batches_total", "Watch-folder batches sent to peers",
+                                        "result=\"failed\"");
+    Counter& files = metrics().counter("lanshare_sync_files_total", "Files sent by watch-folder sync");
+};
+
+static SyncMetrics& sync_metrics() {
+    static SyncMetrics m;
+    return m;
+}
+
+FolderSync::FolderSync(SubnetListener& listener, FileTransfer& ft)
+    : listener_(listener), ft_(ft), tree_("Sync", kWatchMask), loop_(nullptr), flush_timer_(0), pool_(4),
+      stopping_(false) {}
+
+FolderSync::~FolderSync() {
+    stop();
+}
+
+bool FolderSync::start(const std::string& root, const std::vector<std::string>& peers, EventLoop& loop) {
+    loop_ = &loop;
+    sync_metrics();
+    for (const auto& ip : peers) peers_[ip];
+    WatchedTree::Handlers handlers;
+    // whatever a new directory already holds was written before we could watch it; after
+    // an overflow we can no longer tell what changed, so everything goes
+    handlers.scanned = [this](std::vector<WatchedTree::File>& files, bool) {
+        for (const auto& f : files) note_changed(f.path);
+    };
+    handlers.file_event = [this](const std::string& path, uint32_t mask) {
+        if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) note_changed(path);
+    };
+    handlers.dir_removed = [](const std::string&) {};
+    handlers.changed = [this]() { schedule_flush(); };
+    return tree_.start(root, loop, std::move(handlers));
+}
+
+void FolderSync::stop() {
+    if (!tree_.active()) return;
+    stopping_.store(true);
+    tree_.stop();
+    loop_->run_sync([this]() {
+        if (flush_timer_) loop_->cancel_timer(flush_timer_);
+        flush_timer_ = 0;
+        for (auto& [ip, peer] : peers_) {
+            if (peer.retry_timer) loop_->cancel_timer(peer.retry_timer);
+            peer.retry_timer = 0;
+        }
+    });
+    // a batch in flight fails at once instead of waiting out the peer's decision or the
+    // transfer; what it posts back is ignored
+    cancel_.cancel();
+    pool_.shutdown();
+}
+
+void FolderSync::schedule_flush() {
+    if (changed_.empty()) return;
+    // quiet for kQuietMs ends a burst; a storm that never pauses is cut every kMaxDelayMs
+    auto due = std::min(std::chrono::steady_clock::now() + std::chrono::milliseconds(kQuietMs),
+                        first_change_ + std::chrono::milliseconds(kMaxDelayMs));
+    if (flush_timer_) loop_->cancel_timer(flush_timer_);
+    flush_timer_ = loop_->add_timer_at(due, [this]() {
+        flush_timer_ = 0;
+        flush();
+    });
+}
+
+void FolderSync::note_changed(const std::string& path) {
+    if (changed_.empty()) first_change_ = std::chrono::steady_clock::now();
+    changed_.insert(path);
+}
+
+void FolderSync::flush() {
+    for (auto& [ip, peer] : peers_) peer.pending.insert(changed_.begin(), changed_.end());
+    changed_.clear();
+    for (auto& [ip, peer] : peers_) {
+        if (!peer.retry_timer) start_batch(ip);
+    }
+}
+
+void FolderSync::start_batch(const std::string& ip) {
+    Peer& peer = peers_[ip];
+    if (peer.busy || peer.pending.empty() || stopping_.load()) return;
+    std::vector<std::string> files(peer.pending.begin(), peer.pending.end());
+    peer.pending.clear();
+    peer.busy = true;
+    pool_.submit([this, ip, files]() {
+        std::vector<std::string> unsent = run_batch(ip, files);
+        loop_->post([this, ip, unsent]() mutable { batch_done(ip, std::move(unsent)); });
+    });
+}
+
+std::vector<std::string> FolderSync::run_batch(const std::string& ip, const std::vector<std::string>& files) {
+    auto devices = listener_.snapshot();
+    auto it = devices->find(ip);
+    if (it == devices->end()) {
+        sync_metrics().failed.add();
+        return files;
+    }
+    const DeviceInfo& peer = it->second;
+    auto started = std::chrono::steady_clock::now();
+
+    // one decision covers the whole batch
+    const std::string& root = tree_.root();
+    auto slash = root.rfind('/');
+    std::string what = std::to_string(files.size()) + (files.size() == 1 ? " file from " : " files from ") +
+                       (slash == std::string::npos ? root : root.substr(slash + 1));
+    if (!ft_.request_send(ip, peer.control_port_or_default(), what, 30000, peer.iface, &cancel_)) {
+        std::cerr << "Sync: " << ip << " did not accept " << what << "\n";
+        sync_metrics().failed.add();
+        return files;
+    }
+
+    bool sparse = peer.flags & MessageCodec::BEACON_FLAG_SPARSE;
+    size_t done;
+    if (peer.flags & MessageCodec::BEACON_FLAG_BATCH) {
+        done = ft_.send_files(ip, peer.data_port_or_default(), root, files, peer.iface, peer.path, sparse, &cancel_);
+    } else {
+        // an older peer takes one file per connection, flattened into its recv/
+        for (done = 0; done < files.size(); ++done) {
+            std::string abs = root + "/" + files[done];
+            // gone, or not a regular file (a symlink is not followed), as in send_files
+            struct stat st;
+            if (lstat(abs.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (!ft_.send_file(ip, peer.data_port_or_default(), abs, peer.iface, peer.path, sparse, &cancel_)) break;
+        }
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    sync_metrics().files.add(done);
+    (done == files.size() ? sync_metrics().sent : sync_metrics().failed).add();
+    std::cerr << "Sync: " << done << "/" << files.size() << " files to " << ip << " in " << ms.count() << " ms\n";
+    return std::vector<std::string>(files.begin() + done, files.end());
+}
+
+void FolderSync::batch_done(const std::string& ip, std::vector<std::string> unsent) {
+    if (stopping_.load()) return;
+    Peer& peer = peers_[ip];
+    peer.busy = false;
+    if (!unsent.empty()) {
+        peer.pending.insert(unsent.begin(), unsent.end());
+        if (!peer.retry_timer) {
+            peer.retry_timer = loop_->add_timer(std::chrono::milliseconds(kRetryMs), [this, ip]() {
+                peers_[ip].retry_timer = 0;
+                start_batch(ip);
+            });
+        }
+        return;
+    }
+    // whatever changed while this batch was out
+    start_batch(ip);
+}
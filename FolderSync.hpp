@@ -0,0 +1,73 @@
+#ifndef FOLDER_SYNC_HPP
+#define FOLDER_SYNC_HPP
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include "EventLoop.hpp"
+#include "SubnetListener.hpp"
+#include "FileTransfer.hpp"
+#include "WatchedTree.hpp"
+
+// Mirrors a local directory tree to fixed peers. inotify reports files as they are
+// closed after writing or moved in; changes are collected until the tree has been quiet
+// for kQuietMs (or kMaxDelayMs into a write storm), and each peer then gets everything
+// as one batch: a single control request, then one data connection for all the files
+// (send_files). Changes arriving during a batch go out in the next one. Deletions are
+// not mirrored, and files already there at start() are not sent, but everything in a
+// directory created or moved in is, and after an inotify overflow the whole tree is.
+// Watching is WatchedTree's.
+class FolderSync {
+public:
+    static constexpr unsigned int kQuietMs = 500;
+    static constexpr unsigned int kMaxDelayMs = 5000;
+    // a peer that refused, failed or was not around is tried again after this long
+    static constexpr unsigned int kRetryMs = 10000;
+
+    FolderSync(SubnetListener& listener, FileTransfer& ft);
+    ~FolderSync();
+
+    // peers are IPv4 addresses; ports, interface and capabilities come from discovery
+    bool start(const std::string& root, const std::vector<std::string>& peers, EventLoop& loop);
+    void stop();
+    bool active() const { return tree_.active(); }
+    const std::string& root() const { return tree_.root(); }
+
+private:
+    struct Peer {
+        // relative paths waiting for the next batch
+        std::set<std::string> pending;
+        bool busy = false;
+        EventLoop::TimerId retry_timer = 0;
+    };
+
+    SubnetListener& listener_;
+    FileTransfer& ft_;
+    WatchedTree tree_;
+    EventLoop* loop_;
+    // everything below is touched on the loop thread only
+    // changed since the last flush
+    std::set<std::string> changed_;
+    std::chrono::steady_clock::time_point first_change_;
+    EventLoop::TimerId flush_timer_;
+    std::map<std::string, Peer> peers_;
+    WorkerPool pool_;
+    std::atomic<bool> stopping_;
+    // shuts down the sockets of a batch in flight when we stop
+    TransferCancel cancel_;
+
+    void note_changed(const std::string& path);
+    // arm the flush timer for what changed
+    void schedule_flush();
+    // hand what changed to every peer and start the batches that can start
+    void flush();
+    void start_batch(const std::string& ip);
+    // pool thread: request, then send; returns the paths that did not get through
+    std::vector<std::string> run_batch(const std::string& ip, const std::vector<std::string>& files);
+    void batch_done(const std::string& ip, std::vector<std::string> unsent);
+};
+
+#endif // FOLDER_SYNC_HPP
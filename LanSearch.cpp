@@ -0,0 +1,116 @@
+#include "LanSearch.hpp"
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+static bool shares(const DeviceInfo& d) {
+    return (d.flags & MessageCodec::BEACON_FLAG_CATALOG) && d.sketch_version != 0 &&
+           d.lastMessage == MessageCodec::MSG_ALIVE;
+}
+
+LanSearch::LanSearch(SubnetListener& listener, FileTransfer& ft) : listener_(listener), ft_(ft), fetch_pool_(2) {}
+
+LanSearch::~LanSearch() {
+    stop();
+}
+
+void LanSearch::start() {
+    // runs on the listener's loop, so only hand the work over
+    sub_ = listener_.subscribe([this]() { fetch_pool_.submit([this]() { on_device_events(); }); });
+}
+
+void LanSearch::stop() {
+    // jobs copy sub_; once the pool is down nothing reads it and later notifies are dropped
+    fetch_pool_.shutdown();
+    sub_.reset();
+}
+
+void LanSearch::on_device_events() {
+    auto sub = sub_;
+    if (!sub) return;
+    for (const auto& e : sub->drain()) {
+        if (e.type == DeviceEventType::Expired || e.type == DeviceEventType::ShutDown || !shares(e.info)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sketches_.erase(e.info.ip);
+            continue;
+        }
+        bool fetched;
+        sketch_for(e.info, fetched);
+    }
+}
+
+std::shared_ptr<const BloomFilter> LanSearch::sketch_for(const DeviceInfo& peer, bool& fetched) {
+    fetched = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = sketches_.find(peer.ip);
+        if (it != sketches_.end() && it->second.version == peer.sketch_version) return it->second.sketch;
+    }
+    auto sketch = std::make_shared<BloomFilter>();
+    uint32_t version = 0;
+    if (!ft_.fetch_sketch(peer.ip, peer.control_port_or_default(), version, *sketch, 2000, peer.iface)) return nullptr;
+    fetched = true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    sketches_[peer.ip] = Cached{version, sketch};
+    return sketch;
+}
+
+std::vector<SearchHit> LanSearch::search(const std::string& name, size_t limit_per_peer, unsigned int timeout_ms,
+                                         SearchStats* stats) {
+    SearchStats local;
+    SearchStats& st = stats ? *stats : local;
+    st = SearchStats();
+    auto slash = name.rfind('/');
+    std::string key = BloomFilter::key_for(slash == std::string::npos ? name : name.substr(slash + 1));
+
+    // peers whose current sketch rules the name out cost nothing; the rest either match or
+    // need their sketch fetched first
+    std::vector<DeviceInfo> peers;
+    {
+        auto devices = listener_.snapshot();
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [ip, info] : *devices) {
+            if (!shares(info)) continue;
+            ++st.sharing;
+            auto it = sketches_.find(ip);
+            bool current = it != sketches_.end() && it->second.version == info.sketch_version;
+            if (current && !it->second.sketch->maybe_contains(key)) continue;
+            peers.push_back(info);
+        }
+    }
+
+    // up to kMaxSearchThreads peers at a time, so a search takes about one round trip (two
+    // when a sketch was stale) unless an unusual number of sketches say "maybe"
+    std::vector<std::vector<SearchHit>> results(peers.size());
+    std::vector<uint8_t> queried(peers.size()), fetched(peers.size());
+    std::atomic<size_t> next{0};
+    auto ask = [&](size_t i) {
+        bool f;
+        auto sketch = sketch_for(peers[i], f);
+        fetched[i] = f;
+        // no sketch (fetch failed): ask anyway rather than miss the file
+        if (sketch && !sketch->maybe_contains(key)) return;
+        queried[i] = 1;
+        CatalogPage page;
+        if (!ft_.search_peer(peers[i].ip, peers[i].control_port_or_default(), name, limit_per_peer, page,
+                             timeout_ms, peers[i].iface)) {
+            return;
+        }
+        for (auto& e : page.entries) results[i].push_back({peers[i].ip, peers[i].hostname, std::move(e)});
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < std::min(peers.size(), kMaxSearchThreads); ++t) {
+        threads.emplace_back([&]() {
+            for (size_t i; (i = next.fetch_add(1)) < peers.size();) ask(i);
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    std::vector<SearchHit> hits;
+    for (size_t i = 0; i < peers.size(); ++i) {
+        st.queried += queried[i];
+        st.fetched += fetched[i];
+        for (auto& h : results[i]) hits.push_back(std::move(h));
+    }
+    return hits;
+}
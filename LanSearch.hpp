@@ -0,0 +1,65 @@
+#ifndef LAN_SEARCH_HPP
+#define LAN_SEARCH_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "EventLoop.hpp"
+#include "SubnetListener.hpp"
+#include "FileTransfer.hpp"
+#include "BloomFilter.hpp"
+
+struct SearchHit {
+    std::string ip;
+    std::string hostname;
+    CatalogEntry entry;
+};
+
+struct SearchStats {
+    // peers sharing a folder, peers whose sketch matched and were asked, sketches fetched
+    // during the search because the cached one was stale
+    size_t sharing = 0;
+    size_t queried = 0;
+    size_t fetched = 0;
+};
+
+// Finds which peers share a file by name. Every sharing peer's Bloom filter of names is
+// cached here and refetched in the background when its beacon shows a new version, so a
+// search usually costs one round trip to the few peers whose filter says "maybe".
+class LanSearch {
+public:
+    // peers asked in parallel by one search; the rest wait for a free thread
+    static constexpr size_t kMaxSearchThreads = 16;
+
+    LanSearch(SubnetListener& listener, FileTransfer& ft);
+    ~LanSearch();
+
+    // follow the listener for sketch version changes
+    void start();
+    void stop();
+
+    // blocking; peers are asked in parallel and each gets timeout_ms
+    std::vector<SearchHit> search(const std::string& name, size_t limit_per_peer = 100, unsigned int timeout_ms = 2000,
+                                  SearchStats* stats = nullptr);
+
+private:
+    struct Cached {
+        uint32_t version = 0;
+        std::shared_ptr<const BloomFilter> sketch;
+    };
+
+    SubnetListener& listener_;
+    FileTransfer& ft_;
+    WorkerPool fetch_pool_;
+    std::shared_ptr<DeviceSubscription> sub_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, Cached> sketches_;
+
+    void on_device_events();
+    // the cached sketch for a peer, fetched first if the peer advertises a newer one
+    std::shared_ptr<const BloomFilter> sketch_for(const DeviceInfo& peer, bool& fetched);
+};
+
+#endif // LAN_SEARCH_HPP
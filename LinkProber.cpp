@@ -0,0 +1,236 @@
+#include "LinkProber.hpp"
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+// three echoes 20 ms apart, then the pair; replies later than kReplyWaitMs count as lost
+static const unsigned int kEchoCount = 3;
+static const unsigned int kEchoSpacingMs = 20;
+static const unsigned int kReplyWaitMs = 500;
+// background probes started per tick, so a large segment is covered gradually
+static const unsigned int kMaxProbesPerTick = 4;
+
+static uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string describe_path(const PathEstimate& p) {
+    if (p.rtt_ms == 0 && p.jitter_ms == 0 && p.loss == 0 && p.bandwidth_kbps == 0) return "-";
+    char buf[96];
+    int n = 0;
+    if (p.rtt_ms > 0) n += snprintf(buf + n, sizeof(buf) - n, "%.1f ms, ", p.rtt_ms);
+    if (p.bandwidth_kbps > 0) {
+        if (p.bandwidth_kbps >= 10000) n += snprintf(buf + n, sizeof(buf) - n, "%u Mb/s, ", p.bandwidth_kbps / 1000);
+        else n += snprintf(buf + n, sizeof(buf) - n, "%u kb/s, ", p.bandwidth_kbps);
+    }
+    snprintf(buf + n, sizeof(buf) - n, "jitter %.1f ms, %.0f%% loss", p.jitter_ms, p.loss * 100);
+    return buf;
+}
+
+LinkProber::LinkProber(uint16_t port)
+    : port_(port), sockfd_(-1), running_(false), loop_(nullptr), reprobe_ms_(30000), background_timer_(0),
+      next_session_(1) {}
+
+LinkProber::~LinkProber() {
+    stop();
+}
+
+void LinkProber::set_event_loop(EventLoop* loop) {
+    loop_ = loop;
+}
+
+void LinkProber::set_result_observer(std::function<void(const ProbeResult&)> observer) {
+    observer_ = std::move(observer);
+}
+
+void LinkProber::set_targets_provider(std::function<std::vector<std::string>()> provider, unsigned int reprobe_ms) {
+    targets_ = std::move(provider);
+    reprobe_ms_ = reprobe_ms;
+}
+
+bool LinkProber::start() {
+    if (running_) return true;
+    sockfd_ = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd_ < 0) {
+        perror("LinkProber: socket");
+        return false;
+    }
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port_);
+    if (bind(sockfd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        perror("LinkProber: bind");
+        ::close(sockfd_);
+        sockfd_ = -1;
+        return false;
+    }
+
+    if (!loop_) {
+        own_loop_.reset(new EventLoop());
+        own_loop_->start_thread();
+        loop_ = own_loop_.get();
+    }
+    running_ = true;
+    loop_->add_fd(sockfd_, EPOLLIN, [this](uint32_t) { on_readable(); });
+    if (targets_) {
+        auto tick = std::chrono::milliseconds(std::max(1000u, reprobe_ms_ / 8));
+        background_timer_ = loop_->add_timer(tick, [this]() { on_background_timer(); }, tick);
+    }
+    return true;
+}
+
+void LinkProber::stop() {
+    if (!running_.exchange(false)) return;
+    loop_->run_sync([this]() {
+        if (background_timer_) loop_->cancel_timer(background_timer_);
+        background_timer_ = 0;
+        for (auto& [id, s] : sessions_) {
+            for (auto t : s.timers) loop_->cancel_timer(t);
+        }
+        sessions_.clear();
+        loop_->remove_fd(sockfd_);
+        ::close(sockfd_);
+        sockfd_ = -1;
+    });
+    if (own_loop_) {
+        own_loop_->stop();
+        own_loop_->join();
+        own_loop_.reset();
+        loop_ = nullptr;
+    }
+}
+
+void LinkProber::probe(const std::string& ip, uint16_t port) {
+    if (!running_) return;
+    loop_->post([this, ip, port]() {
+        if (running_) start_probe(ip, port);
+    });
+}
+
+void LinkProber::start_probe(const std::string& ip, uint16_t port) {
+    struct sockaddr_in peer{};
+    peer.sin_family = AF_INET;
+    peer.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &peer.sin_addr) != 1) return;
+    // one probe per peer at a time
+    for (const auto& [id, s] : sessions_) {
+        if (s.result.ip == ip) return;
+    }
+    uint16_t id = next_session_++;
+    while (id == 0 || sessions_.count(id)) id = next_session_++;
+    Session& s = sessions_[id];
+    s.result.ip = ip;
+    s.peer = peer;
+    last_probed_[ip] = std::chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < kEchoCount; ++i) {
+        s.timers.push_back(loop_->add_timer(std::chrono::milliseconds(i * kEchoSpacingMs),
+                                            [this, id, i]() { send_probe(id, MessageCodec::PROBE_ECHO, i); }));
+    }
+    const unsigned int pair_at = kEchoCount * kEchoSpacingMs;
+    s.timers.push_back(loop_->add_timer(std::chrono::milliseconds(pair_at), [this, id]() {
+        // back to back: the bottleneck link spreads them apart
+        send_probe(id, MessageCodec::PROBE_PAIR_FIRST, kEchoCount);
+        send_probe(id, MessageCodec::PROBE_PAIR_SECOND, kEchoCount + 1);
+    }));
+    s.timers.push_back(loop_->add_timer(std::chrono::milliseconds(pair_at + kReplyWaitMs),
+                                        [this, id]() { finish_probe(id); }));
+}
+
+void LinkProber::send_probe(uint16_t session, uint8_t kind, uint32_t seq) {
+    auto it = sessions_.find(session);
+    if (it == sessions_.end()) return;
+    uint8_t buf[MessageCodec::PROBE_PAIR_LEN] = {0};
+    MessageCodec::Probe p;
+    p.kind = kind;
+    p.session = session;
+    p.seq = seq;
+    p.t_send_us = now_us();
+    MessageCodec::encode_probe(p, buf);
+    size_t len = kind == MessageCodec::PROBE_ECHO ? MessageCodec::PROBE_HEADER_LEN : MessageCodec::PROBE_PAIR_LEN;
+    ++it->second.result.sent;
+    sendto(sockfd_, buf, len, MSG_DONTWAIT, reinterpret_cast<const struct sockaddr*>(&it->second.peer),
+           sizeof(it->second.peer));
+}
+
+void LinkProber::finish_probe(uint16_t session) {
+    auto it = sessions_.find(session);
+    if (it == sessions_.end()) return;
+    for (auto t : it->second.timers) loop_->cancel_timer(t);
+    ProbeResult result = std::move(it->second.result);
+    sessions_.erase(it);
+    if (observer_) observer_(result);
+}
+
+void LinkProber::on_readable() {
+    uint8_t buf[MessageCodec::PROBE_PAIR_LEN];
+    for (int i = 0; i < 64; ++i) {
+        struct sockaddr_in from{};
+        socklen_t flen = sizeof(from);
+        ssize_t n = recvfrom(sockfd_, buf, sizeof(buf), MSG_DONTWAIT, reinterpret_cast<struct sockaddr*>(&from), &flen);
+        if (n < 0) return;
+        uint64_t now = now_us();
+        MessageCodec::Probe p;
+        if (!MessageCodec::decode_probe(buf, n, p)) continue;
+
+        if (p.code == MessageCodec::MSG_PROBE_REQUEST) {
+            // responder: echo it back, with the pair spacing when this closes a pair
+            auto key = std::make_tuple(from.sin_addr.s_addr, from.sin_port, p.session);
+            p.dispersion_us = 0;
+            if (p.kind == MessageCodec::PROBE_PAIR_FIRST) {
+                if (pair_first_.size() >= 256) pair_first_.clear(); // pairs whose second half never came
+                pair_first_[key] = now;
+            } else if (p.kind == MessageCodec::PROBE_PAIR_SECOND) {
+                auto f = pair_first_.find(key);
+                if (f != pair_first_.end()) {
+                    p.dispersion_us = static_cast<uint32_t>(std::min<uint64_t>(now - f->second, UINT32_MAX));
+                    pair_first_.erase(f);
+                }
+            }
+            p.code = MessageCodec::MSG_PROBE_REPLY;
+            uint8_t out[MessageCodec::PROBE_HEADER_LEN];
+            MessageCodec::encode_probe(p, out);
+            sendto(sockfd_, out, sizeof(out), MSG_DONTWAIT, reinterpret_cast<const struct sockaddr*>(&from), flen);
+            continue;
+        }
+
+        auto it = sessions_.find(p.session);
+        if (it == sessions_.end() || it->second.peer.sin_addr.s_addr != from.sin_addr.s_addr) continue;
+        ProbeResult& r = it->second.result;
+        ++r.received;
+        if (now >= p.t_send_us) r.rtt_ms.push_back((now - p.t_send_us) / 1000.0f);
+        if (p.kind == MessageCodec::PROBE_PAIR_SECOND && p.dispersion_us > 0) {
+            r.bandwidth_kbps = static_cast<uint32_t>(std::min<uint64_t>(
+                MessageCodec::PROBE_PAIR_LEN * 8ull * 1000 / p.dispersion_us, UINT32_MAX));
+        }
+        // everything answered: no need to wait out the timeout
+        if (r.received == kEchoCount + 2) finish_probe(p.session);
+    }
+}
+
+void LinkProber::on_background_timer() {
+    auto targets = targets_();
+    auto now = std::chrono::steady_clock::now();
+    const auto reprobe = std::chrono::milliseconds(reprobe_ms_);
+    // forget peers that are gone
+    for (auto it = last_probed_.begin(); it != last_probed_.end();) {
+        if (std::find(targets.begin(), targets.end(), it->first) == targets.end()) it = last_probed_.erase(it);
+        else ++it;
+    }
+    unsigned int started = 0;
+    for (const auto& ip : targets) {
+        if (started >= kMaxProbesPerTick) break;
+        auto it = last_probed_.find(ip);
+        if (it != last_probed_.end() && now - it->second < reprobe) continue;
+        start_probe(ip, MessageCodec::PROBE_PORT);
+        ++started;
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef LINK_PROBER_HPP
+#define LINK_PROBER_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <netinet/in.h>
+#include "MessageCodec.hpp"
+#include "EventLoop.hpp"
+
+// Quality of the path to one peer; zero means not measured yet. Loss and jitter are
+// passive, from the seq/tx_ms fields of the peer's beacons (and folded in from probes);
+// rtt and bandwidth need an active probe.
+struct PathEstimate {
+    // smoothed round trip (gain 1/8, as TCP's SRTT) and the smallest one seen
+    float rtt_ms = 0;
+    float rtt_min_ms = 0;
+    // RFC 3550 interarrival jitter
+    float jitter_ms = 0;
+    // fraction of beacons/probes lost, smoothed
+    float loss = 0;
+    // packet-pair estimate of the bottleneck rate
+    uint32_t bandwidth_kbps = 0;
+    std::chrono::steady_clock::time_point probed_at;
+};
+
+// short text for device lists, "-" when nothing is known
+std::string describe_path(const PathEstimate& p);
+
+struct ProbeResult {
+    std::string ip;
+    unsigned int sent = 0;
+    unsigned int received = 0;
+    std::vector<float> rtt_ms;
+    // 0 if the pair was lost or the gap was too small to measure
+    uint32_t bandwidth_kbps = 0;
+};
+
+// Answers peers' probes and probes peers: a few spaced echo requests for RTT and loss,
+// then a packet pair whose spacing at the receiver gives the bottleneck bandwidth.
+// Everything runs on the event loop; a probe costs 5 small datagrams and 2 of 1200 bytes.
+class LinkProber {
+public:
+    explicit LinkProber(uint16_t port = MessageCodec::PROBE_PORT);
+    ~LinkProber();
+
+    // call before start(); without one a private loop thread is used
+    void set_event_loop(EventLoop* loop);
+    // called on the loop thread when a probe completes
+    void set_result_observer(std::function<void(const ProbeResult&)> observer);
+    // peers probed in the background, at most one probe per peer every reprobe_ms
+    void set_targets_provider(std::function<std::vector<std::string>()> provider, unsigned int reprobe_ms = 30000);
+
+    bool start();
+    void stop();
+    // on demand, from any thread; the result goes to the observer
+    void probe(const std::string& ip, uint16_t port = MessageCodec::PROBE_PORT);
+
+private:
+    struct Session {
+        ProbeResult result;
+        struct sockaddr_in peer;
+        std::vector<EventLoop::TimerId> timers;
+    };
+
+    uint16_t port_;
+    int sockfd_;
+    std::atomic<bool> running_;
+    EventLoop* loop_;
+    std::unique_ptr<EventLoop> own_loop_;
+    std::function<void(const ProbeResult&)> observer_;
+    std::function<std::vector<std::string>()> targets_;
+    unsigned int reprobe_ms_;
+    EventLoop::TimerId background_timer_;
+    // loop-thread state below
+    uint16_t next_session_;
+    std::unordered_map<uint16_t, Session> sessions_;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> last_probed_;
+    // responder side: arrival time of the first half of a pair, by sender and session
+    std::map<std::tuple<in_addr_t, uint16_t, uint16_t>, uint64_t> pair_first_;
+
+    void start_probe(const std::string& ip, uint16_t port);
+    void send_probe(uint16_t session, uint8_t kind, uint32_t seq);
+    void finish_probe(uint16_t session);
+    void on_readable();
+    void on_background_timer();
+};
+
+#endif // LINK_PROBER_HPP
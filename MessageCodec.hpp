@@ -2,17 +2,36 @@
 #define MESSAGE_CODEC_HPP
 
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
 #include <string>
+#include <arpa/inet.h>
 
 namespace MessageCodec {
     // well-known message codes
     constexpr uint8_t MSG_SHUTDOWN = 0;
     constexpr uint8_t MSG_ALIVE = 1;
     constexpr uint8_t MSG_CUSTOM = 10;
+    // organization-local group used by multicast discovery unless configured otherwise
+    constexpr const char* DEFAULT_MULTICAST_GROUP = "239.255.40.40";
     // file transfer control messages
     constexpr uint8_t MSG_FILE_REQUEST = 20;
     constexpr uint8_t MSG_FILE_ACCEPT = 21;
     constexpr uint8_t MSG_FILE_REJECT = 22;
+    // shared-folder catalog (see SharedCatalog): list a page, answered by a page; pull asks
+    // the owner to send a file to our data port, answered by accept or reject
+    constexpr uint8_t MSG_CATALOG_LIST = 23;
+    constexpr uint8_t MSG_CATALOG_PAGE = 24;
+    constexpr uint8_t MSG_FILE_PULL = 25;
+    // LAN search: fetch a node's Bloom filter of shared names, then ask it for matches
+    constexpr uint8_t MSG_SKETCH_GET = 26;
+    constexpr uint8_t MSG_SKETCH = 27;
+    constexpr uint8_t MSG_SEARCH = 28;
+    constexpr uint8_t MSG_SEARCH_RESULT = 29;
+    // link probes (unicast UDP to PROBE_PORT)
+    constexpr uint8_t MSG_PROBE_REQUEST = 30;
+    constexpr uint8_t MSG_PROBE_REPLY = 31;
+    constexpr uint16_t PROBE_PORT = 40004;
 
     inline std::string name_for(uint8_t code) {
         switch (code) {
@@ -22,9 +41,192 @@ namespace MessageCodec {
             case MSG_FILE_REQUEST: return "file_request";
             case MSG_FILE_ACCEPT: return "file_accept";
             case MSG_FILE_REJECT: return "file_reject";
+            case MSG_CATALOG_LIST: return "catalog_list";
+            case MSG_CATALOG_PAGE: return "catalog_page";
+            case MSG_FILE_PULL: return "file_pull";
+            case MSG_SKETCH_GET: return "sketch_get";
+            case MSG_SKETCH: return "sketch";
+            case MSG_SEARCH: return "search";
+            case MSG_SEARCH_RESULT: return "search_result";
+            case MSG_PROBE_REQUEST: return "probe_request";
+            case MSG_PROBE_REPLY: return "probe_reply";
             default: return "unknown";
         }
     }
+
+    // Binary capability beacon. Fixed little header in network byte order, then the
+    // hostname. Older listeners see the magic as an unknown code; older beacons (one code
+    // byte + raw hostname) never start with the magic since it is not a message code.
+    //
+    //   0  magic            1  version          2  header_len       3  code
+    //   4  data_port (16)   6  control_port     8  active_transfers
+    //   10 hostname_len     11 flags            12 free_disk_mb (32)
+    //   16 bandwidth_kbps (32)                  20 seq (32, v2)
+    //   24 tx_ms (32, v2)                       28 sketch_version (32, v3)
+    //   32 hostname...
+    //
+    // header_len lets newer versions append fields that older parsers skip. seq counts
+    // beacons actually sent and tx_ms is the sender's monotonic clock, so listeners can
+    // derive loss and delay jitter without any extra traffic. flags are capability bits;
+    // older senders leave them zero. sketch_version changes whenever the sender's summary
+    // of its shared files does (0 = none), so peers refetch it only then.
+    constexpr uint8_t BEACON_MAGIC = 0xB5;
+    constexpr uint8_t BEACON_VERSION = 3;
+    constexpr size_t BEACON_V1_HEADER_LEN = 20;
+    constexpr size_t BEACON_V2_HEADER_LEN = 28;
+    constexpr size_t BEACON_V3_HEADER_LEN = 32;
+    constexpr size_t BEACON_MAX_HOSTNAME = 64;
+    constexpr size_t BEACON_MAX_LEN = BEACON_V3_HEADER_LEN + BEACON_MAX_HOSTNAME;
+    // the data port accepts the sparse (extent list) transfer format
+    constexpr uint8_t BEACON_FLAG_SPARSE = 0x01;
+    // a shared folder can be browsed and pulled from over the control port
+    constexpr uint8_t BEACON_FLAG_CATALOG = 0x02;
+    // a data connection may carry several files, named by relative paths (see send_files)
+    constexpr uint8_t BEACON_FLAG_BATCH = 0x04;
+    // the data port takes streams of unknown length (see send_pipe)
+    constexpr uint8_t BEACON_FLAG_STREAM = 0x08;
+
+    struct Beacon {
+        uint8_t version = BEACON_VERSION;
+        uint8_t code = MSG_ALIVE;
+        uint16_t data_port = 0;
+        uint16_t control_port = 0;
+        uint16_t active_transfers = 0;
+        uint32_t free_disk_mb = 0;
+        // spare bandwidth the sender thinks it has; 0 when unknown
+        uint32_t bandwidth_kbps = 0;
+        // BEACON_FLAG_* capability bits
+        uint8_t flags = 0;
+        // timing fields, present when has_timing (v2 and later)
+        bool has_timing = true;
+        uint32_t seq = 0;
+        uint32_t tx_ms = 0;
+        // v3 and later; 0 when absent
+        uint32_t sketch_version = 0;
+        // not NUL-terminated; after decode_beacon it points into the datagram
+        const char* hostname = nullptr;
+        uint8_t hostname_len = 0;
+    };
+
+    inline bool valid_hostname(const char* s, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            unsigned char c = static_cast<unsigned char>(s[i]);
+            if (c < 0x20 || c == 0x7F) return false;
+        }
+        return true;
+    }
+
+    // returns the encoded length, 0 if `cap` is too small
+    inline size_t encode_beacon(const Beacon& b, uint8_t* out, size_t cap) {
+        size_t hlen = b.hostname_len > BEACON_MAX_HOSTNAME ? BEACON_MAX_HOSTNAME : b.hostname_len;
+        size_t total = BEACON_V3_HEADER_LEN + hlen;
+        if (cap < total) return 0;
+        uint16_t u16;
+        uint32_t u32;
+        out[0] = BEACON_MAGIC;
+        out[1] = BEACON_VERSION;
+        out[2] = static_cast<uint8_t>(BEACON_V3_HEADER_LEN);
+        out[3] = b.code;
+        u16 = htons(b.data_port); std::memcpy(out + 4, &u16, 2);
+        u16 = htons(b.control_port); std::memcpy(out + 6, &u16, 2);
+        u16 = htons(b.active_transfers); std::memcpy(out + 8, &u16, 2);
+        out[10] = static_cast<uint8_t>(hlen);
+        out[11] = b.flags;
+        u32 = htonl(b.free_disk_mb); std::memcpy(out + 12, &u32, 4);
+        u32 = htonl(b.bandwidth_kbps); std::memcpy(out + 16, &u32, 4);
+        u32 = htonl(b.seq); std::memcpy(out + 20, &u32, 4);
+        u32 = htonl(b.tx_ms); std::memcpy(out + 24, &u32, 4);
+        u32 = htonl(b.sketch_version); std::memcpy(out + 28, &u32, 4);
+        if (hlen) std::memcpy(out + BEACON_V3_HEADER_LEN, b.hostname, hlen);
+        return total;
+    }
+
+    // Parses in place without allocating. Rejects truncated beacons and hostnames with
+    // control characters.
+    inline bool decode_beacon(const uint8_t* data, size_t len, Beacon& out) {
+        if (len < BEACON_V1_HEADER_LEN || data[0] != BEACON_MAGIC) return false;
+        if (data[1] < 1) return false;
+        size_t header_len = data[2];
+        if (header_len < BEACON_V1_HEADER_LEN) return false;
+        size_t hlen = data[10];
+        if (hlen > BEACON_MAX_HOSTNAME || header_len + hlen > len) return false;
+        uint16_t u16;
+        uint32_t u32;
+        out.version = data[1];
+        out.code = data[3];
+        std::memcpy(&u16, data + 4, 2); out.data_port = ntohs(u16);
+        std::memcpy(&u16, data + 6, 2); out.control_port = ntohs(u16);
+        std::memcpy(&u16, data + 8, 2); out.active_transfers = ntohs(u16);
+        out.flags = data[11];
+        std::memcpy(&u32, data + 12, 4); out.free_disk_mb = ntohl(u32);
+        std::memcpy(&u32, data + 16, 4); out.bandwidth_kbps = ntohl(u32);
+        out.has_timing = header_len >= BEACON_V2_HEADER_LEN;
+        if (out.has_timing) {
+            std::memcpy(&u32, data + 20, 4); out.seq = ntohl(u32);
+            std::memcpy(&u32, data + 24, 4); out.tx_ms = ntohl(u32);
+        } else {
+            out.seq = 0;
+            out.tx_ms = 0;
+        }
+        if (header_len >= BEACON_V3_HEADER_LEN) {
+            std::memcpy(&u32, data + 28, 4); out.sketch_version = ntohl(u32);
+        } else {
+            out.sketch_version = 0;
+        }
+        out.hostname = reinterpret_cast<const char*>(data + header_len);
+        out.hostname_len = static_cast<uint8_t>(hlen);
+        return valid_hostname(out.hostname, hlen);
+    }
+
+    // Link probe. Requests are echoed back with the same session, seq and t_send_us; a
+    // packet pair is two requests sent back to back, padded to PROBE_PAIR_LEN, and the
+    // reply to the second carries the gap the responder measured between them.
+    //
+    //   0  code             1  kind             2  session (16)
+    //   4  seq (32)         8  t_send_us (64)   16 dispersion_us (32)
+    constexpr uint8_t PROBE_ECHO = 0;
+    constexpr uint8_t PROBE_PAIR_FIRST = 1;
+    constexpr uint8_t PROBE_PAIR_SECOND = 2;
+    constexpr size_t PROBE_HEADER_LEN = 20;
+    constexpr size_t PROBE_PAIR_LEN = 1200;
+
+    struct Probe {
+        uint8_t code = MSG_PROBE_REQUEST;
+        uint8_t kind = PROBE_ECHO;
+        uint16_t session = 0;
+        uint32_t seq = 0;
+        uint64_t t_send_us = 0;
+        uint32_t dispersion_us = 0;
+    };
+
+    // writes the header only; callers pad pair probes themselves
+    inline void encode_probe(const Probe& p, uint8_t* out) {
+        uint16_t u16;
+        uint32_t u32;
+        out[0] = p.code;
+        out[1] = p.kind;
+        u16 = htons(p.session); std::memcpy(out + 2, &u16, 2);
+        u32 = htonl(p.seq); std::memcpy(out + 4, &u32, 4);
+        u32 = htonl(static_cast<uint32_t>(p.t_send_us >> 32)); std::memcpy(out + 8, &u32, 4);
+        u32 = htonl(static_cast<uint32_t>(p.t_send_us)); std::memcpy(out + 12, &u32, 4);
+        u32 = htonl(p.dispersion_us); std::memcpy(out + 16, &u32, 4);
+    }
+
+    inline bool decode_probe(const uint8_t* data, size_t len, Probe& out) {
+        if (len < PROBE_HEADER_LEN) return false;
+        if (data[0] != MSG_PROBE_REQUEST && data[0] != MSG_PROBE_REPLY) return false;
+        uint16_t u16;
+        uint32_t hi, lo, u32;
+        out.code = data[0];
+        out.kind = data[1];
+        std::memcpy(&u16, data + 2, 2); out.session = ntohs(u16);
+        std::memcpy(&u32, data + 4, 4); out.seq = ntohl(u32);
+        std::memcpy(&hi, data + 8, 4);
+        std::memcpy(&lo, data + 12, 4);
+        out.t_send_us = (static_cast<uint64_t>(ntohl(hi)) << 32) | ntohl(lo);
+        std::memcpy(&u32, data + 16, 4); out.dispersion_us = ntohl(u32);
+        return true;
+    }
 }
 
 #endif // MESSAGE_CODEC_HPP
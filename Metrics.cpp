@@ -0,0 +1,266 @@
+#include "Metrics.hpp"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+unsigned int next_metric_shard() {
+    static std::atomic<unsigned int> next(0);
+    return next.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const auto& s : shards_) total += s.v.load(std::memory_order_relaxed);
+    return total;
+}
+
+Histogram::Histogram(std::initializer_list<double> bounds) : nbounds_(std::min(bounds.size(), kMaxBuckets)) {
+    std::copy_n(bounds.begin(), nbounds_, bounds_.begin());
+}
+
+Histogram::Totals Histogram::totals() const {
+    Totals t;
+    t.buckets.assign(nbounds_ + 1, 0);
+    int64_t sum_nano = 0;
+    for (const auto& s : shards_) {
+        for (size_t b = 0; b <= nbounds_; ++b) t.buckets[b] += s.buckets[b].load(std::memory_order_relaxed);
+        sum_nano += s.sum_nano.load(std::memory_order_relaxed);
+    }
+    for (uint64_t n : t.buckets) t.count += n;
+    t.sum = sum_nano / 1e9;
+    return t;
+}
+
+MetricsRegistry::Series& MetricsRegistry::series_locked(const std::string& name, const std::string& help, Kind kind,
+                                                        const std::string& labels) {
+    Family* family = nullptr;
+    for (auto& f : families_) {
+        if (f->name == name) {
+            family = f.get();
+            break;
+        }
+    }
+    if (!family) {
+        families_.push_back(std::make_unique<Family>(Family{name, help, kind, {}}));
+        family = families_.back().get();
+    }
+    for (auto& s : family->series) {
+        if (s->labels == labels) return *s;
+    }
+    family->series.push_back(std::make_unique<Series>());
+    family->series.back()->labels = labels;
+    return *family->series.back();
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series& s = series_locked(name, help, Kind::Counter, labels);
+    if (!s.counter) s.counter = std::make_unique<Counter>();
+    return *s.counter;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series& s = series_locked(name, help, Kind::Gauge, labels);
+    if (!s.gauge) s.gauge = std::make_unique<Gauge>();
+    return *s.gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help,
+                                      std::initializer_list<double> bounds, const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series& s = series_locked(name, help, Kind::Histogram, labels);
+    if (!s.histogram) s.histogram = std::make_unique<Histogram>(bounds);
+    return *s.histogram;
+}
+
+static void append_sample(std::string& out, const std::string& name, const std::string& labels,
+                          const std::string& extra_label, double value) {
+    char num[64];
+    std::snprintf(num, sizeof(num), "%.17g", value);
+    out += name;
+    if (!labels.empty() || !extra_label.empty()) {
+        out += '{';
+        out += labels;
+        if (!labels.empty() && !extra_label.empty()) out += ',';
+        out += extra_label;
+        out += '}';
+    }
+    out += ' ';
+    out += num;
+    out += '\n';
+}
+
+std::string MetricsRegistry::render() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out;
+    out.reserve(families_.size() * 256);
+    for (const auto& f : families_) {
+        const char* type = f->kind == Kind::Counter ? "counter" : f->kind == Kind::Gauge ? "gauge" : "histogram";
+        out += "# HELP " + f->name + " " + f->help + "\n";
+        out += "# TYPE " + f->name + " " + type + "\n";
+        for (const auto& s : f->series) {
+            if (s->counter) {
+                append_sample(out, f->name, s->labels, "", static_cast<double>(s->counter->value()));
+            } else if (s->gauge) {
+                append_sample(out, f->name, s->labels, "", static_cast<double>(s->gauge->value()));
+            } else if (s->histogram) {
+                Histogram::Totals t = s->histogram->totals();
+                uint64_t cumulative = 0;
+                char le[48];
+                for (size_t b = 0; b < t.buckets.size(); ++b) {
+                    cumulative += t.buckets[b];
+                    if (b < s->histogram->bound_count()) {
+                        std::snprintf(le, sizeof(le), "le=\"%g\"", s->histogram->bounds()[b]);
+                    } else {
+                        std::snprintf(le, sizeof(le), "le=\"+Inf\"");
+                    }
+                    append_sample(out, f->name + "_bucket", s->labels, le, static_cast<double>(cumulative));
+                }
+                append_sample(out, f->name + "_sum", s->labels, "", t.sum);
+                append_sample(out, f->name + "_count", s->labels, "", static_cast<double>(t.count));
+            }
+        }
+    }
+    return out;
+}
+
+bool MetricsRegistry::dump_to_file(const std::string& path) const {
+    std::string text = render();
+    std::string tmp = path + ".tmp";
+    FILE* f = std::fopen(tmp.c_str(), "w");
+    if (!f) {
+        perror("Metrics: open dump file");
+        return false;
+    }
+    bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        perror("Metrics: write dump file");
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+MetricsRegistry& metrics() {
+    // never destroyed, so objects torn down during exit can still record
+    static MetricsRegistry* registry = new MetricsRegistry;
+    return *registry;
+}
+
+MetricsServer::MetricsServer(EventLoop& loop, MetricsRegistry& registry)
+    : loop_(loop), registry_(registry), sockfd_(-1) {}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+bool MetricsServer::start(uint16_t port, const std::string& bind_addr) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, bind_addr.c_str(), &addr.sin_addr) != 1) {
+        std::fprintf(stderr, "Metrics: bad bind address %s\n", bind_addr.c_str());
+        return false;
+    }
+    sockfd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd_ < 0) {
+        perror("Metrics: socket");
+        return false;
+    }
+    int on = 1;
+    setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(sockfd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 || listen(sockfd_, 16) < 0) {
+        perror("Metrics: bind");
+        ::close(sockfd_);
+        sockfd_ = -1;
+        return false;
+    }
+    return loop_.add_fd(sockfd_, EPOLLIN, [this](uint32_t) { on_accept(); });
+}
+
+void MetricsServer::stop() {
+    if (sockfd_ < 0) return;
+    loop_.run_sync([this]() {
+        while (!clients_.empty()) close_client(clients_.begin()->first);
+        loop_.remove_fd(sockfd_);
+        ::close(sockfd_);
+        sockfd_ = -1;
+    });
+}
+
+void MetricsServer::on_accept() {
+    // a scraper that connects and never finishes its request is dropped after this long
+    constexpr auto kClientTimeout = std::chrono::milliseconds(5000);
+    while (true) {
+        int client = accept4(sockfd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) return;
+        clients_[client].timer = loop_.add_timer(kClientTimeout, [this, client]() {
+            clients_[client].timer = 0;
+            close_client(client);
+        });
+        loop_.add_fd(client, EPOLLIN, [this, client](uint32_t) { on_client(client); });
+    }
+}
+
+void MetricsServer::on_client(int fd) {
+    auto it = clients_.find(fd);
+    if (it == clients_.end()) return;
+    Client& c = it->second;
+
+    if (c.out.empty()) {
+        char buf[1024];
+        ssize_t r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (r <= 0 || c.in.size() + r > 8192) {
+            close_client(fd);
+            return;
+        }
+        c.in.append(buf, r);
+        // only the request line matters; headers are read and ignored
+        if (c.in.find("\r\n\r\n") == std::string::npos && c.in.find("\n\n") == std::string::npos) return;
+
+        std::string status = "200 OK";
+        std::string body;
+        if (c.in.compare(0, 13, "GET /metrics ") == 0 || c.in.compare(0, 14, "GET /metrics? ") == 0 ||
+            c.in.compare(0, 6, "GET / ") == 0) {
+            body = registry_.render();
+        } else if (c.in.compare(0, 4, "GET ") == 0) {
+            status = "404 Not Found";
+            body = "not found\n";
+        } else {
+            status = "405 Method Not Allowed";
+            body = "only GET is supported\n";
+        }
+        c.out = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n" +
+                "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        loop_.modify_fd(fd, EPOLLOUT);
+    }
+
+    // the response usually fits the socket buffer, so the first write is tried right away
+    ssize_t w = send(fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (w <= 0) {
+        close_client(fd);
+        return;
+    }
+    c.sent += w;
+    if (c.sent == c.out.size()) close_client(fd);
+}
+
+void MetricsServer::close_client(int fd) {
+    auto it = clients_.find(fd);
+    if (it != clients_.end()) {
+        if (it->second.timer) loop_.cancel_timer(it->second.timer);
+        loop_.remove_fd(fd);
+        clients_.erase(it);
+    }
+    ::close(fd);
+}
@@ -0,0 +1,162 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <array>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <initializer_list>
+#include "EventLoop.hpp"
+
+// Process-wide counters, gauges and histograms, exported in the Prometheus text format.
+// Recording is lock-free: counters and histograms are split into per-thread shards on
+// separate cache lines, so the hot paths (beacon ingestion, transfer loops) do one relaxed
+// add on a line no other thread writes. Shards are only summed when the metrics are read.
+// Metrics are registered once and live until exit, so references can be kept in statics.
+
+constexpr unsigned int kMetricShards = 16;
+
+// next shard index, handed out round robin to threads on first use
+unsigned int next_metric_shard();
+
+inline unsigned int metric_shard() {
+    thread_local unsigned int shard = kMetricShards;
+    if (shard == kMetricShards) shard = next_metric_shard();
+    return shard;
+}
+
+class Counter {
+public:
+    void add(uint64_t n = 1) { shards_[metric_shard()].v.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> v{0};
+    };
+    Shard shards_[kMetricShards];
+};
+
+// a level (queue depth, devices known); a single atomic, since levels are set rather than summed
+class Gauge {
+public:
+    void set(int64_t v) { v_.store(v, std::memory_order_relaxed); }
+    void add(int64_t d) { v_.fetch_add(d, std::memory_order_relaxed); }
+    int64_t value() const { return v_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> v_{0};
+};
+
+// Fixed buckets chosen at registration (upper bounds, ascending, at most kMaxBuckets).
+// The sum is kept in integer nano-units so it can be a sharded atomic as well.
+class Histogram {
+public:
+    static constexpr size_t kMaxBuckets = 15;
+
+    explicit Histogram(std::initializer_list<double> bounds);
+
+    void observe(double v) {
+        size_t b = 0;
+        while (b < nbounds_ && v > bounds_[b]) ++b;
+        Shard& s = shards_[metric_shard()];
+        s.buckets[b].fetch_add(1, std::memory_order_relaxed);
+        s.sum_nano.fetch_add(static_cast<int64_t>(v * 1e9), std::memory_order_relaxed);
+    }
+
+    struct Totals {
+        // per bucket, not cumulative; the last entry is the +Inf bucket
+        std::vector<uint64_t> buckets;
+        uint64_t count = 0;
+        double sum = 0;
+    };
+    Totals totals() const;
+    const double* bounds() const { return bounds_.data(); }
+    size_t bound_count() const { return nbounds_; }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> buckets[kMaxBuckets + 1] = {};
+        std::atomic<int64_t> sum_nano{0};
+    };
+    std::array<double, kMaxBuckets> bounds_{};
+    size_t nbounds_;
+    Shard shards_[kMetricShards];
+};
+
+// Names follow Prometheus conventions (lanshare_*_total for counters, base units such as
+// seconds and bytes). `labels` is the pre-formatted label list without braces, e.g.
+// `direction="in"`; the same name and labels always return the same metric. Registration
+// takes a mutex, so look metrics up once and keep the reference.
+class MetricsRegistry {
+public:
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    Histogram& histogram(const std::string& name, const std::string& help, std::initializer_list<double> bounds,
+                         const std::string& labels = "");
+
+    // Prometheus text exposition format 0.0.4
+    std::string render() const;
+    // written to a temporary file and renamed over `path`, so readers never see half a dump
+    bool dump_to_file(const std::string& path) const;
+
+private:
+    enum class Kind { Counter, Gauge, Histogram };
+    struct Series {
+        std::string labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+    struct Family {
+        std::string name;
+        std::string help;
+        Kind kind;
+        std::vector<std::unique_ptr<Series>> series;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Family>> families_;
+
+    Series& series_locked(const std::string& name, const std::string& help, Kind kind, const std::string& labels);
+};
+
+// the registry everything in the process records into
+MetricsRegistry& metrics();
+
+// Serves GET /metrics over HTTP/1.0 from the event loop. Meant for a local scraper or
+// curl; by default it binds to the loopback address only.
+class MetricsServer {
+public:
+    MetricsServer(EventLoop& loop, MetricsRegistry& registry = metrics());
+    ~MetricsServer();
+
+    // bind_addr is a dotted IPv4 address; returns false if the port cannot be opened
+    bool start(uint16_t port, const std::string& bind_addr = "127.0.0.1");
+    void stop();
+
+private:
+    struct Client {
+        std::string in;
+        std::string out;
+        size_t sent = 0;
+        EventLoop::TimerId timer = 0;
+    };
+
+    EventLoop& loop_;
+    MetricsRegistry& registry_;
+    int sockfd_;
+    // only touched on the loop thread
+    std::unordered_map<int, Client> clients_;
+
+    void on_accept();
+    void on_client(int fd);
+    void close_client(int fd);
+};
+
+#endif // METRICS_HPP
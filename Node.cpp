@@ -0,0 +1,289 @@
+#include "Node.hpp"
+#include "Trace.hpp"
+#include "DeviceCache.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <vector>
+#include <arpa/inet.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+const char* const kNodeUsage =
+    "[iface[,iface...]] [--discovery=broadcast|multicast|both] [--group=ADDR]\n"
+    "       [--metrics-port=[ADDR:]PORT] [--metrics-file=PATH] [--trace] [--trace-file=PATH]\n"
+    "       [--share=DIR] [--sync=DIR --sync-to=IP[,IP...]] [--stream-sink=-|PATH||COMMAND]\n"
+    "       [--device-cache=PATH]";
+
+int parse_node_option(const std::string& arg, NodeOptions& opts) {
+    if (arg.rfind("--discovery=", 0) == 0) {
+        std::string m = arg.substr(12);
+        if (m == "broadcast") opts.mode = DiscoveryMode::Broadcast;
+        else if (m == "multicast") opts.mode = DiscoveryMode::Multicast;
+        else if (m == "both") opts.mode = DiscoveryMode::Both;
+        else return -1;
+    } else if (arg.rfind("--group=", 0) == 0) {
+        opts.group = arg.substr(8);
+    } else if (arg.rfind("--metrics-port=", 0) == 0) {
+        std::string v = arg.substr(15);
+        auto colon = v.rfind(':');
+        if (colon != std::string::npos) {
+            opts.metrics_addr = v.substr(0, colon);
+            v = v.substr(colon + 1);
+        }
+        opts.metrics_port = std::atoi(v.c_str());
+        if (opts.metrics_port <= 0 || opts.metrics_port > 65535) return -1;
+    } else if (arg.rfind("--metrics-file=", 0) == 0) {
+        opts.metrics_file = arg.substr(15);
+    } else if (arg == "--trace") {
+        opts.trace = true;
+    } else if (arg.rfind("--trace-file=", 0) == 0) {
+        opts.trace_file = arg.substr(13);
+    } else if (arg.rfind("--share=", 0) == 0) {
+        opts.share_dir = arg.substr(8);
+        if (opts.share_dir.empty()) return -1;
+    } else if (arg.rfind("--sync=", 0) == 0) {
+        opts.sync_dir = arg.substr(7);
+        if (opts.sync_dir.empty()) return -1;
+    } else if (arg.rfind("--sync-to=", 0) == 0) {
+        std::string list = arg.substr(10);
+        for (size_t at = 0; at <= list.size();) {
+            size_t comma = list.find(',', at);
+            if (comma == std::string::npos) comma = list.size();
+            std::string ip = list.substr(at, comma - at);
+            struct in_addr addr;
+            if (inet_pton(AF_INET, ip.c_str(), &addr) != 1) return -1;
+            opts.sync_peers.push_back(ip);
+            at = comma + 1;
+        }
+    } else if (arg.rfind("--device-cache=", 0) == 0) {
+        opts.device_cache = arg.substr(15);
+        if (opts.device_cache.empty()) return -1;
+    } else if (arg.rfind("--stream-sink=", 0) == 0) {
+        std::string v = arg.substr(14);
+        if (v.empty()) {
+            return -1;
+        } else if (v == "-") {
+            opts.stream_sink = StreamSink::Stdout;
+        } else if (v[0] == '|') {
+            opts.stream_sink = StreamSink::Command;
+            opts.stream_target = v.substr(1);
+            if (opts.stream_target.empty()) return -1;
+        } else {
+            opts.stream_sink = StreamSink::Path;
+            opts.stream_target = v;
+        }
+    } else if (arg.rfind("--", 0) != 0) {
+        opts.if_name = arg;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+Node::Node(const NodeOptions& opts)
+    : opts_(opts), pool_(4), metrics_server_(loop_), bc_(2000, 40000), listener_(40000), ft_(40001), sync_(listener_, ft_),
+      trace_sigfd_(-1), started_(false) {}
+
+Node::~Node() {
+    stop();
+}
+
+int Node::start() {
+    if (opts_.sync_dir.empty() != opts_.sync_peers.empty()) {
+        std::cerr << "--sync and --sync-to go together\n";
+        return 1;
+    }
+#ifdef LANSHARE_TRACE
+    // delivered through a signalfd on the loop, so they must be blocked before any thread starts
+    sigset_t trace_signals;
+    sigemptyset(&trace_signals);
+    sigaddset(&trace_signals, SIGUSR1);
+    sigaddset(&trace_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &trace_signals, nullptr);
+    trace_sigfd_ = signalfd(-1, &trace_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    Trace::set_enabled(opts_.trace);
+#else
+    if (opts_.trace) std::cerr << "Built without tracing (make clean && make TRACE=1), --trace ignored\n";
+#endif
+    started_ = true;
+    loop_.start_thread();
+
+    if (opts_.metrics_port > 0 && !metrics_server_.start(static_cast<uint16_t>(opts_.metrics_port), opts_.metrics_addr)) {
+        std::cerr << "Metrics endpoint failed to start\n";
+        // continue anyway, without it
+    }
+#ifdef LANSHARE_TRACE
+    if (trace_sigfd_ >= 0) {
+        loop_.add_fd(trace_sigfd_, EPOLLIN, [this](uint32_t) {
+            struct signalfd_siginfo si;
+            while (read(trace_sigfd_, &si, sizeof(si)) == sizeof(si)) {
+                if (si.ssi_signo == SIGUSR2) {
+                    Trace::set_enabled(!Trace::enabled());
+                } else if (Trace::dump_chrome_json(opts_.trace_file)) {
+                    std::cerr << "Trace written to " << opts_.trace_file << "\n";
+                }
+            }
+        });
+    }
+#endif
+    if (!opts_.metrics_file.empty()) {
+        loop_.add_timer(std::chrono::seconds(10), [this]() { metrics().dump_to_file(opts_.metrics_file); },
+                        std::chrono::seconds(10));
+    }
+
+    bc_.set_event_loop(&loop_);
+    bc_.set_discovery(opts_.mode, opts_.group);
+    if (!bc_.init(opts_.if_name)) {
+        std::cerr << "Init failed\n";
+        return 1;
+    }
+
+    listener_.set_event_loop(&loop_);
+    listener_.set_worker_pool(&pool_);
+    // keep expiry in step with the adaptive beacon interval, and let peer beacons
+    // drive the broadcaster's suppression/reset decisions
+    listener_.set_expiry_ms(bc_.recommended_expiry_ms());
+    listener_.set_beacon_observer([this](in_addr_t addr, bool changed) { bc_.note_peer_beacon(addr, changed); });
+    // broadcasts are always received, so multicast and broadcast nodes interoperate
+    if (opts_.mode != DiscoveryMode::Broadcast) {
+        listener_.set_multicast_group(opts_.group);
+        bc_.set_interfaces_observer([this]() { listener_.refresh_multicast_memberships(); });
+    }
+    // last run's peers, listed as unverified until their beacons or probe answers come in
+    std::vector<DeviceInfo> cached;
+    if (!opts_.device_cache.empty()) {
+        auto load_started = std::chrono::steady_clock::now();
+        cached = DeviceCache::load(opts_.device_cache);
+        size_t added = listener_.preload(cached);
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - load_started);
+        std::cerr << "Device cache: " << added << " peer(s) from " << opts_.device_cache << " in " << us.count()
+                  << " us\n";
+    }
+    if (!listener_.start()) {
+        std::cerr << "Listener start failed\n";
+        return 2;
+    }
+
+    if (!opts_.share_dir.empty()) {
+        auto scan_started = std::chrono::steady_clock::now();
+        if (catalog_.start(opts_.share_dir, loop_)) {
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - scan_started);
+            std::cerr << "Sharing " << catalog_.size() << " files from " << catalog_.root() << " (indexed in "
+                      << ms.count() << " ms)\n";
+            ft_.set_catalog(&catalog_);
+        } else {
+            std::cerr << "Shared folder unavailable, continuing without it\n";
+        }
+    }
+
+    // a stream sink that goes away must fail the write, not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+    ft_.set_stream_sink(opts_.stream_sink, opts_.stream_target);
+    ft_.set_event_loop(&loop_);
+    ft_.set_worker_pool(&pool_);
+    if (!ft_.start_receiver()) {
+        std::cerr << "File receiver failed to start\n";
+        // continue anyway
+    }
+
+    // RTT, loss and bandwidth to peers that speak probes (beacon v2), for transfer tuning
+    // and the device lists
+    prober_.set_event_loop(&loop_);
+    prober_.set_result_observer([this](const ProbeResult& r) { listener_.record_probe(r); });
+    prober_.set_targets_provider([this]() {
+        std::vector<std::string> ips;
+        auto ifaces = bc_.interfaces();
+        for (const auto& [ip, info] : *listener_.snapshot()) {
+            if (info.proto_version < 2 || info.lastMessage != MessageCodec::MSG_ALIVE) continue;
+            in_addr_t addr = inet_addr(ip.c_str());
+            bool self = false;
+            for (const auto& itf : *ifaces) self = self || itf.addr == addr;
+            if (!self) ips.push_back(ip);
+        }
+        return ips;
+    });
+    if (!prober_.start()) {
+        std::cerr << "Link prober failed to start\n";
+        // continue anyway, without path estimates
+    } else {
+        // an answer confirms a cached peer without waiting for its next beacon
+        for (const auto& d : cached) {
+            if (d.proto_version >= 2) prober_.probe(d.ip);
+        }
+    }
+    if (!opts_.device_cache.empty()) {
+        // a few KB at most, written on the loop so saves never overlap
+        loop_.add_timer(std::chrono::seconds(30), [this]() { save_device_cache(); }, std::chrono::seconds(30));
+    }
+
+    // advertise our real ports and load in every beacon
+    auto ifaces = bc_.interfaces();
+    if (!ifaces->empty()) ft_.set_link_capacity_kbps(SubnetBroadcaster::link_speed_kbps(ifaces->front().name));
+    bc_.set_capabilities_provider([this](MessageCodec::Beacon& b) { ft_.fill_capabilities(b); });
+    bc_.start(MessageCodec::MSG_ALIVE, MessageCodec::MSG_SHUTDOWN);
+
+    if (!opts_.sync_dir.empty()) {
+        if (sync_.start(opts_.sync_dir, opts_.sync_peers, loop_)) {
+            std::cerr << "Syncing " << sync_.root() << " to " << opts_.sync_peers.size() << " peer(s)\n";
+        } else {
+            std::cerr << "Sync folder unavailable, continuing without it\n";
+        }
+    }
+    return 0;
+}
+
+void Node::notify_peers() {
+    auto devices = listener_.snapshot();
+    std::vector<ShutdownTarget> targets;
+    targets.reserve(devices->size());
+    for (const auto& [ip, info] : *devices) {
+        targets.push_back(ShutdownTarget{ip, 40002, info.iface});
+    }
+    auto results = ft_.send_shutdown_all(targets, 1500);
+    size_t delivered = 0;
+    for (const auto& r : results) {
+        switch (r.outcome) {
+            case ShutdownOutcome::Delivered: ++delivered; break;
+            case ShutdownOutcome::Refused: std::cerr << "  " << r.ip << ": refused\n"; break;
+            case ShutdownOutcome::TimedOut: std::cerr << "  " << r.ip << ": timed out\n"; break;
+            case ShutdownOutcome::Failed: std::cerr << "  " << r.ip << ": " << std::strerror(r.error) << "\n"; break;
+        }
+    }
+    std::cerr << "Notified " << delivered << "/" << results.size() << " peers\n";
+}
+
+void Node::stop() {
+    if (!started_) return;
+    started_ = false;
+    // before our own shutdown beacon comes back and takes this host out of the registry
+    if (!opts_.device_cache.empty()) loop_.run_sync([this]() { save_device_cache(); });
+    sync_.stop();
+    bc_.stop();
+    listener_.stop();
+    ft_.stop_receiver();
+    catalog_.stop();
+    prober_.stop();
+    metrics_server_.stop();
+    if (!opts_.metrics_file.empty()) metrics().dump_to_file(opts_.metrics_file);
+#ifdef LANSHARE_TRACE
+    if (trace_sigfd_ >= 0) {
+        loop_.remove_fd(trace_sigfd_);
+        ::close(trace_sigfd_);
+        trace_sigfd_ = -1;
+    }
+    if (Trace::enabled()) Trace::dump_chrome_json(opts_.trace_file);
+#endif
+    loop_.stop();
+    loop_.join();
+    pool_.shutdown();
+}
+
+void Node::save_device_cache() {
+    auto snap = listener_.snapshot();
+    if (snap == cache_saved_) return;
+    cache_saved_ = snap;
+    DeviceCache::save(opts_.device_cache, *snap);
+}
@@ -0,0 +1,91 @@
+#ifndef NODE_HPP
+#define NODE_HPP
+
+#include <string>
+#include <cstdint>
+#include "EventLoop.hpp"
+#include "Metrics.hpp"
+#include "SubnetBroadcaster.hpp"
+#include "SubnetListener.hpp"
+#include "FileTransfer.hpp"
+#include "LinkProber.hpp"
+#include "SharedCatalog.hpp"
+#include "FolderSync.hpp"
+
+// Command-line options shared by netdemo and lanshared
+struct NodeOptions {
+    // empty = every suitable interface
+    std::string if_name;
+    DiscoveryMode mode = DiscoveryMode::Broadcast;
+    std::string group = MessageCodec::DEFAULT_MULTICAST_GROUP;
+    // Prometheus endpoint (loopback unless an address is given) and/or periodic dump
+    std::string metrics_addr = "127.0.0.1";
+    int metrics_port = 0;
+    std::string metrics_file;
+    // tracing (make TRACE=1): SIGUSR2 toggles recording, SIGUSR1 and exit write the file
+    bool trace = false;
+    std::string trace_file = "lanshare-trace.json";
+    // shared folder peers may browse and pull from; empty = none
+    std::string share_dir;
+    // watch-folder sync: changes under sync_dir are mirrored to sync_peers
+    std::string sync_dir;
+    std::vector<std::string> sync_peers;
+    // where incoming streams go: --stream-sink=- (stdout), PATH, or |COMMAND
+    StreamSink stream_sink = StreamSink::File;
+    std::string stream_target;
+    // registry saved here every 30 s and at exit, and loaded at start; empty = none
+    std::string device_cache;
+};
+
+// usage lines for the options parse_node_option() understands
+extern const char* const kNodeUsage;
+
+// Consumes one argument if it is a node option: returns 1 if it was, 0 if not, -1 if it
+// was but its value is invalid. A bare word is taken as the interface list.
+int parse_node_option(const std::string& arg, NodeOptions& opts);
+
+// Everything a LANShare host runs besides its front end: one event loop thread carrying
+// beacons, discovery and the accept/control servers, a worker pool for pull uploads and
+// slow DNS lookups (incoming files have FileTransfer's own), the link prober, and the
+// optional metrics and tracing outputs.
+class Node {
+public:
+    explicit Node(const NodeOptions& opts);
+    ~Node();
+
+    // 0 on success, otherwise a process exit code (an error has been printed)
+    int start();
+    // tell every known peer we are leaving, all at once under one deadline
+    void notify_peers();
+    // idempotent
+    void stop();
+
+    EventLoop& loop() { return loop_; }
+    WorkerPool& pool() { return pool_; }
+    SubnetBroadcaster& broadcaster() { return bc_; }
+    SubnetListener& listener() { return listener_; }
+    FileTransfer& transfers() { return ft_; }
+    SharedCatalog& catalog() { return catalog_; }
+    FolderSync& folder_sync() { return sync_; }
+
+private:
+    NodeOptions opts_;
+    EventLoop loop_;
+    WorkerPool pool_;
+    MetricsServer metrics_server_;
+    SubnetBroadcaster bc_;
+    SubnetListener listener_;
+    SharedCatalog catalog_;
+    FileTransfer ft_;
+    LinkProber prober_;
+    FolderSync sync_;
+    int trace_sigfd_;
+    bool started_;
+    // snapshot last written to the device cache
+    std::shared_ptr<const DeviceMap> cache_saved_;
+
+    // loop thread; skipped when the registry has not changed since the last save
+    void save_device_cache();
+};
+
+#endif // NODE_HPP
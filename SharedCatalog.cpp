@@ -0,0 +1,248 @@
+#include "SharedCatalog.hpp"
+#include "Metrics.hpp"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <ctime>
+
+static constexpr uint32_t kWatchMask = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+                                       IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+struct CatalogMetrics {
+    Gauge& files = metrics().gauge("lanshare_shared_files", "Files in the shared-folder index");
+};
+
+static CatalogMetrics& catalog_metrics() {
+    static CatalogMetrics m;
+    return m;
+}
+
+static std::string search_key(const std::string& path) {
+    auto slash = path.rfind('/');
+    return BloomFilter::key_for(slash == std::string::npos ? path : path.substr(slash + 1));
+}
+
+SharedCatalog::SharedCatalog()
+    : tree_("Catalog", kWatchMask), loop_(nullptr), sketch_(std::make_shared<BloomFilter>()), sketch_version_(0),
+      rebuild_timer_(0) {}
+
+SharedCatalog::~SharedCatalog() {
+    stop();
+}
+
+bool SharedCatalog::start(const std::string& root, EventLoop& loop) {
+    loop_ = &loop;
+    WatchedTree::Handlers handlers;
+    handlers.scanned = [this](std::vector<WatchedTree::File>& files, bool full) { apply_scan(files, full); };
+    handlers.file_event = [this](const std::string& path, uint32_t mask) { on_file_event(path, mask); };
+    handlers.dir_removed = [this](const std::string& dir) { remove_dir(dir); };
+    handlers.changed = [this]() { index_changed(); };
+    std::vector<WatchedTree::File> first;
+    if (!tree_.start(root, loop, std::move(handlers), &first)) return false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& f : first) insert_locked({std::move(f.path), f.size, f.mtime});
+    }
+    // seeded from the clock so a restarted node never reuses a version peers have cached
+    sketch_version_.store(static_cast<uint32_t>(time(nullptr)));
+    rebuild_sketch();
+    catalog_metrics().files.set(static_cast<int64_t>(size()));
+    return true;
+}
+
+void SharedCatalog::stop() {
+    if (!tree_.active()) return;
+    tree_.stop();
+    loop_->run_sync([this]() {
+        if (rebuild_timer_) loop_->cancel_timer(rebuild_timer_);
+        rebuild_timer_ = 0;
+    });
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    by_name_.clear();
+}
+
+void SharedCatalog::apply_scan(std::vector<WatchedTree::File>& files, bool full) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (full) {
+        entries_.clear();
+        by_name_.clear();
+    }
+    for (auto& f : files) insert_locked({std::move(f.path), f.size, f.mtime});
+}
+
+void SharedCatalog::on_file_event(const std::string& path, uint32_t mask) {
+    if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(path);
+        if (it != entries_.end()) erase_locked(it);
+    } else {
+        update_file(path);
+    }
+}
+
+void SharedCatalog::update_file(const std::string& path) {
+    struct stat st;
+    bool regular = fstatat(AT_FDCWD, (tree_.root() + "/" + path).c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(path);
+    if (!regular) {
+        if (it != entries_.end()) erase_locked(it);
+    } else if (it != entries_.end()) {
+        it->second.size = st.st_size;
+        it->second.mtime = st.st_mtime;
+    } else {
+        insert_locked({path, static_cast<uint64_t>(st.st_size), st.st_mtime});
+    }
+}
+
+void SharedCatalog::insert_locked(CatalogEntry entry) {
+    auto [it, added] = entries_.try_emplace(entry.path);
+    if (added) by_name_.emplace(search_key(entry.path), entry.path);
+    it->second = std::move(entry);
+}
+
+void SharedCatalog::erase_locked(std::map<std::string, CatalogEntry>::iterator it) {
+    auto range = by_name_.equal_range(search_key(it->first));
+    for (auto n = range.first; n != range.second; ++n) {
+        if (n->second == it->first) {
+            by_name_.erase(n);
+            break;
+        }
+    }
+    entries_.erase(it);
+}
+
+void SharedCatalog::remove_dir(const std::string& dir) {
+    std::string prefix = dir + "/";
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto first = entries_.lower_bound(prefix);
+    while (first != entries_.end() && first->first.compare(0, prefix.size(), prefix) == 0) erase_locked(first++);
+}
+
+void SharedCatalog::index_changed() {
+    // a burst of changes (an unpacked archive, a big copy) costs one rebuild
+    constexpr auto kRebuildDelay = std::chrono::milliseconds(2000);
+    catalog_metrics().files.set(static_cast<int64_t>(size()));
+    if (rebuild_timer_) return;
+    rebuild_timer_ = loop_->add_timer(kRebuildDelay, [this]() {
+        rebuild_timer_ = 0;
+        rebuild_sketch();
+    });
+}
+
+void SharedCatalog::rebuild_sketch() {
+    // 1% false positives: a search bothers about one peer in a hundred needlessly
+    constexpr double kFalsePositiveRate = 0.01;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto filter = std::make_shared<BloomFilter>(by_name_.size(), kFalsePositiveRate);
+    for (const auto& [key, path] : by_name_) filter->add(key);
+    sketch_ = std::move(filter);
+    sketch_version_.fetch_add(1);
+}
+
+CatalogPage SharedCatalog::find(const std::string& name, size_t limit) const {
+    if (limit == 0 || limit > kMaxPage) limit = kMaxPage;
+    CatalogPage page;
+    std::lock_guard<std::mutex> lock(mutex_);
+    page.total = static_cast<uint32_t>(entries_.size());
+    if (name.find('/') != std::string::npos) {
+        auto it = entries_.find(name);
+        if (it != entries_.end()) page.entries.push_back(it->second);
+        return page;
+    }
+    auto range = by_name_.equal_range(BloomFilter::key_for(name));
+    for (auto it = range.first; it != range.second; ++it) {
+        if (page.entries.size() == limit) {
+            page.more = true;
+            break;
+        }
+        page.entries.push_back(entries_.at(it->second));
+    }
+    return page;
+}
+
+std::shared_ptr<const BloomFilter> SharedCatalog::sketch(uint32_t& version) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    version = sketch_version_.load();
+    return sketch_;
+}
+
+CatalogPage SharedCatalog::list(const std::string& after, size_t limit) const {
+    if (limit == 0 || limit > kMaxPage) limit = kMaxPage;
+    CatalogPage page;
+    std::lock_guard<std::mutex> lock(mutex_);
+    page.total = static_cast<uint32_t>(entries_.size());
+    auto it = after.empty() ? entries_.begin() : entries_.upper_bound(after);
+    for (; it != entries_.end() && page.entries.size() < limit; ++it) page.entries.push_back(it->second);
+    page.more = it != entries_.end();
+    return page;
+}
+
+std::string SharedCatalog::resolve(const std::string& path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.count(path) ? tree_.root() + "/" + path : std::string();
+}
+
+size_t SharedCatalog::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+void SharedCatalog::encode_page(const CatalogPage& page, std::vector<uint8_t>& out) {
+    auto put = [&out](const void* p, size_t n) {
+        const uint8_t* b = static_cast<const uint8_t*>(p);
+        out.insert(out.end(), b, b + n);
+    };
+    uint32_t total = htobe32(page.total);
+    uint16_t count = htobe16(static_cast<uint16_t>(page.entries.size()));
+    uint8_t more = page.more;
+    put(&total, 4);
+    put(&count, 2);
+    put(&more, 1);
+    for (const auto& e : page.entries) {
+        uint16_t len = htobe16(static_cast<uint16_t>(e.path.size()));
+        uint64_t size = htobe64(e.size);
+        uint64_t mtime = htobe64(static_cast<uint64_t>(e.mtime));
+        put(&len, 2);
+        put(e.path.data(), e.path.size());
+        put(&size, 8);
+        put(&mtime, 8);
+    }
+}
+
+bool SharedCatalog::decode_page(const uint8_t* data, size_t len, CatalogPage& page) {
+    if (len < 7) return false;
+    uint32_t total;
+    uint16_t count;
+    std::memcpy(&total, data, 4);
+    std::memcpy(&count, data + 4, 2);
+    page.total = be32toh(total);
+    page.more = data[6] != 0;
+    page.entries.clear();
+    size_t off = 7;
+    for (uint16_t i = 0; i < be16toh(count); ++i) {
+        if (len - off < 2) return false;
+        uint16_t plen;
+        std::memcpy(&plen, data + off, 2);
+        plen = be16toh(plen);
+        off += 2;
+        if (len - off < static_cast<size_t>(plen) + 16) return false;
+        CatalogEntry e;
+        e.path.assign(reinterpret_cast<const char*>(data + off), plen);
+        off += plen;
+        uint64_t v;
+        std::memcpy(&v, data + off, 8);
+        e.size = be64toh(v);
+        std::memcpy(&v, data + off + 8, 8);
+        e.mtime = static_cast<int64_t>(be64toh(v));
+        off += 16;
+        page.entries.push_back(std::move(e));
+    }
+    return true;
+}
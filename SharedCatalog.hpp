@@ -0,0 +1,91 @@
+#ifndef SHARED_CATALOG_HPP
+#define SHARED_CATALOG_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include "EventLoop.hpp"
+#include "BloomFilter.hpp"
+#include "WatchedTree.hpp"
+
+struct CatalogEntry {
+    // relative to the shared root, '/'-separated
+    std::string path;
+    uint64_t size = 0;
+    // seconds since the epoch
+    int64_t mtime = 0;
+};
+
+// one page of a listing; `more` means entries after the last one remain
+struct CatalogPage {
+    uint32_t total = 0;
+    bool more = false;
+    std::vector<CatalogEntry> entries;
+};
+
+// In-memory index of a shared directory tree: built once by a parallel scan, then kept
+// current from inotify events on the event loop (WatchedTree), so listings never touch
+// the filesystem. Regular files only; symlinks are not followed. After an inotify
+// overflow the old index serves until the rescan replaces it.
+//
+// It also keeps a Bloom filter of the file names for LAN search, rebuilt shortly after
+// the tree changes; its version goes out in our beacons.
+class SharedCatalog {
+public:
+    // a listing returns at most this many entries per page
+    static constexpr size_t kMaxPage = 1000;
+
+    SharedCatalog();
+    ~SharedCatalog();
+
+    bool start(const std::string& root, EventLoop& loop);
+    void stop();
+    bool active() const { return tree_.active(); }
+    const std::string& root() const { return tree_.root(); }
+
+    // entries in path order strictly after `after` ("" = from the start)
+    CatalogPage list(const std::string& after, size_t limit) const;
+    // absolute path of an indexed file, empty if the index doesn't have it
+    std::string resolve(const std::string& path) const;
+    size_t size() const;
+    // files named `name` (case-insensitive), or the file at `name` if it has a '/'
+    CatalogPage find(const std::string& name, size_t limit) const;
+    // current name sketch and its version (never 0 once started)
+    std::shared_ptr<const BloomFilter> sketch(uint32_t& version) const;
+    uint32_t sketch_version() const { return sketch_version_.load(); }
+
+    // wire form of a page on the control channel:
+    //   total (32) | count (16) | more (8) | count x [path_len (16) | path | size (64) | mtime (64)]
+    static void encode_page(const CatalogPage& page, std::vector<uint8_t>& out);
+    static bool decode_page(const uint8_t* data, size_t len, CatalogPage& page);
+
+private:
+    WatchedTree tree_;
+    EventLoop* loop_;
+    mutable std::mutex mutex_;
+    std::map<std::string, CatalogEntry> entries_;
+    // search key (lowercased base name) -> path
+    std::unordered_multimap<std::string, std::string> by_name_;
+    std::shared_ptr<const BloomFilter> sketch_;
+    std::atomic<uint32_t> sketch_version_;
+    EventLoop::TimerId rebuild_timer_;
+
+    // WatchedTree handlers, on the loop
+    void apply_scan(std::vector<WatchedTree::File>& files, bool full);
+    void on_file_event(const std::string& path, uint32_t mask);
+    void update_file(const std::string& path);
+    // drop a directory's entries
+    void remove_dir(const std::string& dir);
+    void insert_locked(CatalogEntry entry);
+    void erase_locked(std::map<std::string, CatalogEntry>::iterator it);
+    // called after changes; rebuilds the sketch once the tree has been quiet for a bit
+    void index_changed();
+    void rebuild_sketch();
+};
+
+#endif // SHARED_CATALOG_HPP
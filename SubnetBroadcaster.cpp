@@ -1,27 +1,86 @@
 #include "SubnetBroadcaster.hpp"
 #include <iostream>
 #include <cstring>
+#include <cstdio>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <net/if.h>
+#include <sys/epoll.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sstream>
+#include <cerrno>
 #include <chrono>
-#include <thread>
+#include <algorithm>
 #include "MessageCodec.hpp"
+#include "Metrics.hpp"
+
+struct BroadcasterMetrics {
+    Counter& sent = metrics().counter("lanshare_beacons_sent_total", "Beacons sent on all interfaces");
+    Counter& errors = metrics().counter("lanshare_beacon_send_errors_total",
+                                        "Beacons that could not be sent on every interface");
+    Counter& suppressed = metrics().counter("lanshare_beacons_suppressed_total",
+                                            "Alive beacons skipped because enough peers were heard (Trickle)");
+};
+
+static BroadcasterMetrics& broadcaster_metrics() {
+    static BroadcasterMetrics m;
+    return m;
+}
+
+// a suppressed beacon is always followed by a real one, which bounds our silence
+static const unsigned int kMaxSuppressedInRow = 1;
 
 SubnetBroadcaster::SubnetBroadcaster(unsigned int interval_ms, uint16_t port)
-    : interval_ms_(interval_ms), port_(port), running_(false), sockfd_(-1), alive_msg_(MessageCodec::MSG_ALIVE), shutdown_msg_(MessageCodec::MSG_SHUTDOWN), include_hostname_(true) {}
+    : interval_ms_(interval_ms), port_(port), mode_(DiscoveryMode::Broadcast),
+      group_(inet_addr(MessageCodec::DEFAULT_MULTICAST_GROUP)), ifaces_(std::make_shared<const std::vector<Interface>>()),
+      alive_msg_(MessageCodec::MSG_ALIVE), shutdown_msg_(MessageCodec::MSG_SHUTDOWN), include_hostname_(true), sockfd_(-1), running_(false),
+      beacon_seq_(0), loop_(nullptr), netlink_fd_(-1), doublings_(2), redundancy_(3), trickle_timer_(0),
+      current_interval_(interval_ms), fired_(false), heard_(0), suppressed_in_row_(0), rng_(std::random_device{}()) {
+    // registered up front so scrapes show them at zero before the first beacon
+    broadcaster_metrics();
+}
 
 SubnetBroadcaster::~SubnetBroadcaster() {
     stop();
 }
 
+void SubnetBroadcaster::set_discovery(DiscoveryMode mode, const std::string& group) {
+    mode_ = mode;
+    struct in_addr a;
+    if (inet_pton(AF_INET, group.c_str(), &a) == 1 && IN_MULTICAST(ntohl(a.s_addr))) {
+        group_ = a.s_addr;
+    } else {
+        std::cerr << "Invalid multicast group " << group << ", using " << MessageCodec::DEFAULT_MULTICAST_GROUP << "\n";
+        group_ = inet_addr(MessageCodec::DEFAULT_MULTICAST_GROUP);
+    }
+}
+
+void SubnetBroadcaster::set_interfaces_observer(std::function<void()> observer) {
+    interfaces_observer_ = std::move(observer);
+}
+
+void SubnetBroadcaster::set_event_loop(EventLoop* loop) {
+    loop_ = loop;
+}
+
 bool SubnetBroadcaster::init(const std::string& if_name) {
-    if (!find_interface_broadcast(if_name, broadcast_addr_)) {
+    if_filter_.clear();
+    std::stringstream ss(if_name);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) if_filter_.push_back(item);
+    }
+
+    auto ifaces = std::make_shared<std::vector<Interface>>();
+    if (!scan_interfaces(*ifaces)) {
         std::cerr << "Не удалось определить широковещательный адрес интерфейса.\n";
         return false;
     }
+    std::atomic_store(&ifaces_, std::shared_ptr<const std::vector<Interface>>(std::move(ifaces)));
 
+    // one unbound socket; each message picks its interface and source via IP_PKTINFO
     sockfd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd_ < 0) {
         perror("socket");
@@ -40,14 +99,31 @@ bool SubnetBroadcaster::init(const std::string& if_name) {
         perror("setsockopt SO_REUSEADDR");
     }
 
-    std::memset(&dest_, 0, sizeof(dest_));
-    dest_.sin_family = AF_INET;
-    dest_.sin_port = htons(port_);
-    if (inet_pton(AF_INET, broadcast_addr_.c_str(), &dest_.sin_addr) != 1) {
-        std::cerr << "inet_pton failed for " << broadcast_addr_ << "\n";
-        ::close(sockfd_);
-        sockfd_ = -1;
-        return false;
+    if (mode_ != DiscoveryMode::Broadcast) {
+        // beacons stay on the local segment; loop them back so our own listener sees them
+        // like it does broadcasts
+        int ttl = 1;
+        if (setsockopt(sockfd_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+            perror("setsockopt IP_MULTICAST_TTL");
+        }
+        if (setsockopt(sockfd_, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on)) < 0) {
+            perror("setsockopt IP_MULTICAST_LOOP");
+        }
+    }
+
+    // address/link notifications; failure only disables hot-plug
+    netlink_fd_ = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (netlink_fd_ >= 0) {
+        struct sockaddr_nl snl{};
+        snl.nl_family = AF_NETLINK;
+        snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+        if (bind(netlink_fd_, reinterpret_cast<struct sockaddr*>(&snl), sizeof(snl)) < 0) {
+            perror("bind netlink");
+            ::close(netlink_fd_);
+            netlink_fd_ = -1;
+        }
+    } else {
+        perror("socket netlink");
     }
 
     return true;
@@ -70,87 +146,328 @@ bool SubnetBroadcaster::start(uint8_t alive_msg, uint8_t shutdown_msg, bool incl
     char hn[256] = {0};
     if (gethostname(hn, sizeof(hn)) == 0) hostname_ = hn;
 
-    worker_ = std::thread(&SubnetBroadcaster::run_loop, this);
+    if (!loop_) {
+        own_loop_.reset(new EventLoop());
+        own_loop_->start_thread();
+        loop_ = own_loop_.get();
+    }
+    if (netlink_fd_ >= 0) {
+        loop_->add_fd(netlink_fd_, EPOLLIN, [this](uint32_t) { on_netlink(); });
+    }
+    // announce immediately, then let Trickle pace us
+    loop_->post([this]() {
+        if (!running_.load()) return;
+        send_alive();
+        std::lock_guard<std::mutex> lock(sched_mutex_);
+        current_interval_ = std::chrono::milliseconds(interval_ms_);
+        begin_interval_locked(std::chrono::steady_clock::now());
+        schedule_locked();
+    });
     return true;
 }
 
 void SubnetBroadcaster::stop() {
-    if (!running_.load()) return;
-    running_.store(false);
-    if (worker_.joinable()) worker_.join();
+    if (!running_.exchange(false)) return;
+    // on the loop thread, so no timer or netlink callback is in flight
+    loop_->run_sync([this]() {
+        {
+            std::lock_guard<std::mutex> lock(sched_mutex_);
+            if (trickle_timer_) loop_->cancel_timer(trickle_timer_);
+            trickle_timer_ = 0;
+        }
+        if (netlink_fd_ >= 0) loop_->remove_fd(netlink_fd_);
+        // send shutdown code if set (0xFF reserved to mean "no shutdown")
+        if (shutdown_msg_ != 0xFF) {
+            if (!send_beacon(shutdown_msg_)) {
+                std::cerr << "Failed to send shutdown message\n";
+            }
+        }
+    });
+    if (own_loop_) {
+        own_loop_->stop();
+        own_loop_->join();
+        own_loop_.reset();
+        loop_ = nullptr;
+    }
     if (sockfd_ >= 0) {
         ::close(sockfd_);
         sockfd_ = -1;
     }
+    if (netlink_fd_ >= 0) {
+        ::close(netlink_fd_);
+        netlink_fd_ = -1;
+    }
 }
 
 bool SubnetBroadcaster::send_now(uint8_t code, const std::string& payload) {
-    if (sockfd_ < 0) return false;
-    if (payload.empty()) {
-        uint8_t buf = code;
-        ssize_t r = sendto(sockfd_, &buf, sizeof(buf), 0,
-                           reinterpret_cast<struct sockaddr*>(&dest_), sizeof(dest_));
-        return r == (ssize_t)sizeof(buf);
-    }
-
     // build buffer: 1 byte code + payload bytes
     std::string out;
     out.reserve(1 + payload.size());
     out.push_back(static_cast<char>(code));
     out.append(payload.data(), payload.size());
+    return send_datagram(reinterpret_cast<const uint8_t*>(out.data()), out.size());
+}
+
+bool SubnetBroadcaster::send_beacon(uint8_t code) {
+    MessageCodec::Beacon b;
+    if (capabilities_) capabilities_(b);
+    b.code = code;
+    b.seq = beacon_seq_.fetch_add(1);
+    b.tx_ms = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+    if (include_hostname_) {
+        b.hostname = hostname_.data();
+        b.hostname_len = static_cast<uint8_t>(std::min(hostname_.size(), MessageCodec::BEACON_MAX_HOSTNAME));
+    } else {
+        b.hostname_len = 0;
+    }
+    uint8_t buf[MessageCodec::BEACON_MAX_LEN];
+    size_t len = MessageCodec::encode_beacon(b, buf, sizeof(buf));
+    bool ok = len > 0 && send_datagram(buf, len);
+    (ok ? broadcaster_metrics().sent : broadcaster_metrics().errors).add();
+    return ok;
+}
+
+void SubnetBroadcaster::set_capabilities_provider(std::function<void(MessageCodec::Beacon&)> provider) {
+    capabilities_ = std::move(provider);
+}
+
+uint32_t SubnetBroadcaster::link_speed_kbps(const std::string& if_name) {
+    std::string path = "/sys/class/net/" + if_name + "/speed";
+    FILE* f = std::fopen(path.c_str(), "r");
+    if (!f) return 0;
+    long mbps = -1;
+    if (std::fscanf(f, "%ld", &mbps) != 1) mbps = -1;
+    std::fclose(f);
+    return mbps > 0 ? static_cast<uint32_t>(mbps * 1000) : 0;
+}
+
+bool SubnetBroadcaster::send_datagram(const uint8_t* data, size_t len) {
+    if (sockfd_ < 0) return false;
+    auto ifaces = interfaces();
+    if (ifaces->empty()) return false;
+
+    // one message per interface and destination, all handed to the kernel in a single
+    // sendmmsg; the interface is picked per message with IP_PKTINFO
+    struct Target {
+        const Interface* itf;
+        in_addr_t dest;
+    };
+    std::vector<Target> targets;
+    targets.reserve(ifaces->size() * 2);
+    const bool bcast = mode_ != DiscoveryMode::Multicast;
+    const bool mcast = mode_ != DiscoveryMode::Broadcast;
+    for (const auto& itf : *ifaces) {
+        if (bcast && itf.bcast != INADDR_ANY) targets.push_back({&itf, itf.bcast});
+        if (mcast && itf.multicast) targets.push_back({&itf, group_});
+    }
+    if (targets.empty()) return false;
 
-    ssize_t r = sendto(sockfd_, out.data(), out.size(), 0,
-                       reinterpret_cast<struct sockaddr*>(&dest_), sizeof(dest_));
-    return r == (ssize_t)out.size();
+    const size_t n = targets.size();
+    constexpr size_t kControlLen = CMSG_SPACE(sizeof(struct in_pktinfo));
+    std::vector<struct sockaddr_in> dests(n);
+    std::vector<struct iovec> iov(n);
+    std::vector<char> control(n * kControlLen, 0);
+    std::vector<struct mmsghdr> msgs(n);
+    for (size_t i = 0; i < n; ++i) {
+        const Interface& itf = *targets[i].itf;
+        dests[i] = sockaddr_in{};
+        dests[i].sin_family = AF_INET;
+        dests[i].sin_port = htons(port_);
+        dests[i].sin_addr.s_addr = targets[i].dest;
+        iov[i].iov_base = const_cast<uint8_t*>(data);
+        iov[i].iov_len = len;
+        std::memset(&msgs[i], 0, sizeof(msgs[i]));
+        struct msghdr& hdr = msgs[i].msg_hdr;
+        hdr.msg_name = &dests[i];
+        hdr.msg_namelen = sizeof(dests[i]);
+        hdr.msg_iov = &iov[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = &control[i * kControlLen];
+        hdr.msg_controllen = kControlLen;
+        struct cmsghdr* c = CMSG_FIRSTHDR(&hdr);
+        c->cmsg_level = IPPROTO_IP;
+        c->cmsg_type = IP_PKTINFO;
+        c->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+        struct in_pktinfo pi{};
+        pi.ipi_ifindex = itf.index;
+        pi.ipi_spec_dst.s_addr = itf.addr;
+        std::memcpy(CMSG_DATA(c), &pi, sizeof(pi));
+    }
+
+    size_t done = 0;
+    while (done < n) {
+        int r = sendmmsg(sockfd_, &msgs[done], n - done, 0);
+        if (r <= 0) {
+            // skip the interface that failed (e.g. went down) and keep going
+            ++done;
+            continue;
+        }
+        done += r;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (msgs[i].msg_len != len) return false;
+    }
+    return true;
+}
+
+std::string SubnetBroadcaster::broadcast_address() const {
+    auto ifaces = interfaces();
+    std::vector<in_addr_t> dests;
+    for (const auto& itf : *ifaces) {
+        if (mode_ != DiscoveryMode::Multicast && itf.bcast != INADDR_ANY) dests.push_back(itf.bcast);
+    }
+    if (mode_ != DiscoveryMode::Broadcast) dests.push_back(group_);
+    std::string out;
+    for (in_addr_t d : dests) {
+        char buf[INET_ADDRSTRLEN];
+        struct in_addr a;
+        a.s_addr = d;
+        if (inet_ntop(AF_INET, &a, buf, sizeof(buf)) == nullptr) continue;
+        if (!out.empty()) out += ",";
+        out += buf;
+    }
+    return out;
 }
 
-std::string SubnetBroadcaster::broadcast_address() const { return broadcast_addr_; }
 uint16_t SubnetBroadcaster::port() const { return port_; }
 
-void SubnetBroadcaster::run_loop() {
-    while (running_.load()) {
-        if (include_hostname_) {
-            if (!send_now(alive_msg_, hostname_)) {
-                std::cerr << "Failed to send alive message\n";
-            }
-        } else {
-            if (!send_now(alive_msg_, std::string())) {
-                std::cerr << "Failed to send alive message\n";
+std::shared_ptr<const std::vector<SubnetBroadcaster::Interface>> SubnetBroadcaster::interfaces() const {
+    return std::atomic_load(&ifaces_);
+}
+
+void SubnetBroadcaster::set_trickle(unsigned int doublings, unsigned int redundancy) {
+    doublings_ = doublings;
+    redundancy_ = redundancy;
+}
+
+unsigned int SubnetBroadcaster::max_silence_ms() const {
+    // a beacon late in one interval, one suppressed interval, then one fired just before
+    // the end of the next: 2.5 intervals at most
+    unsigned int imax = interval_ms_ << doublings_;
+    return redundancy_ == 0 ? imax + imax / 2 : imax * 2 + imax / 2;
+}
+
+unsigned int SubnetBroadcaster::recommended_expiry_ms() const {
+    return max_silence_ms() + (interval_ms_ << doublings_) * 2;
+}
+
+void SubnetBroadcaster::note_peer_beacon(in_addr_t addr, bool changed) {
+    auto ifaces = interfaces();
+    for (const auto& itf : *ifaces) {
+        if (itf.addr == addr) return; // our own beacon looped back
+    }
+    std::lock_guard<std::mutex> lock(sched_mutex_);
+    if (changed) {
+        reset_locked(std::chrono::steady_clock::now());
+    } else {
+        ++heard_;
+    }
+}
+
+void SubnetBroadcaster::reset_schedule() {
+    std::lock_guard<std::mutex> lock(sched_mutex_);
+    reset_locked(std::chrono::steady_clock::now());
+}
+
+void SubnetBroadcaster::begin_interval_locked(std::chrono::steady_clock::time_point now) {
+    auto half = current_interval_.count() / 2;
+    std::uniform_int_distribution<long> dist(half, current_interval_.count() - 1);
+    fire_at_ = now + std::chrono::milliseconds(dist(rng_));
+    interval_end_ = now + current_interval_;
+    fired_ = false;
+    heard_ = 0;
+}
+
+void SubnetBroadcaster::reset_locked(std::chrono::steady_clock::time_point now) {
+    // already at Imin: nothing to speed up
+    if (current_interval_ <= std::chrono::milliseconds(interval_ms_)) return;
+    current_interval_ = std::chrono::milliseconds(interval_ms_);
+    begin_interval_locked(now);
+    schedule_locked();
+}
+
+void SubnetBroadcaster::schedule_locked() {
+    if (!running_.load() || !loop_) return;
+    if (trickle_timer_) loop_->cancel_timer(trickle_timer_);
+    trickle_timer_ = loop_->add_timer_at(fired_ ? interval_end_ : fire_at_, [this]() { on_trickle_timer(); });
+}
+
+void SubnetBroadcaster::send_alive() {
+    if (!send_beacon(alive_msg_)) {
+        std::cerr << "Failed to send alive message\n";
+    }
+}
+
+void SubnetBroadcaster::on_trickle_timer() {
+    bool send = false;
+    {
+        std::lock_guard<std::mutex> lock(sched_mutex_);
+        trickle_timer_ = 0;
+        if (!running_.load()) return;
+        auto now = std::chrono::steady_clock::now();
+        if (!fired_ && now >= fire_at_) {
+            fired_ = true;
+            if (redundancy_ > 0 && heard_ >= redundancy_ && suppressed_in_row_ < kMaxSuppressedInRow) {
+                ++suppressed_in_row_;
+                broadcaster_metrics().suppressed.add();
+            } else {
+                suppressed_in_row_ = 0;
+                send = true;
             }
         }
-        unsigned int waited = 0;
-        const unsigned int step = 50;
-        while (running_.load() && waited < interval_ms_) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(step));
-            waited += step;
+        if (now >= interval_end_) {
+            const auto imax = std::chrono::milliseconds(interval_ms_ << doublings_);
+            current_interval_ = std::min(current_interval_ * 2, imax);
+            begin_interval_locked(now);
         }
+        schedule_locked();
     }
-    // send shutdown code if set (0xFF reserved to mean "no shutdown")
-    if (shutdown_msg_ != 0xFF) {
-        if (include_hostname_) {
-            if (!send_now(shutdown_msg_, hostname_)) {
-                std::cerr << "Failed to send shutdown message\n";
-            }
-        } else {
-            if (!send_now(shutdown_msg_, std::string())) {
-                std::cerr << "Failed to send shutdown message\n";
-            }
+    if (send) send_alive();
+}
+
+void SubnetBroadcaster::on_netlink() {
+    char buf[8192];
+    ssize_t len = recv(netlink_fd_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len <= 0) return;
+    bool relevant = false;
+    for (struct nlmsghdr* nh = reinterpret_cast<struct nlmsghdr*>(buf); NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+        switch (nh->nlmsg_type) {
+            case RTM_NEWADDR: case RTM_DELADDR: case RTM_NEWLINK: case RTM_DELLINK:
+                relevant = true;
+                break;
+            default:
+                break;
         }
     }
+    if (!relevant) return;
+
+    auto ifaces = std::make_shared<std::vector<Interface>>();
+    scan_interfaces(*ifaces);
+    auto old = interfaces();
+    bool same = old->size() == ifaces->size() &&
+                std::equal(old->begin(), old->end(), ifaces->begin(), [](const Interface& a, const Interface& b) {
+                    return a.index == b.index && a.addr == b.addr && a.bcast == b.bcast &&
+                           a.multicast == b.multicast;
+                });
+    if (same) return;
+    std::atomic_store(&ifaces_, std::shared_ptr<const std::vector<Interface>>(std::move(ifaces)));
+    if (interfaces_observer_) interfaces_observer_();
+    // a new segment knows nothing about us yet
+    reset_schedule();
 }
 
-bool SubnetBroadcaster::find_interface_broadcast(const std::string& if_name, std::string& out_bcast) {
+bool SubnetBroadcaster::scan_interfaces(std::vector<Interface>& out) const {
     struct ifaddrs* ifaddr = nullptr;
     if (getifaddrs(&ifaddr) == -1) {
         perror("getifaddrs");
         return false;
     }
 
-    bool found = false;
     for (struct ifaddrs* ifa = ifaddr; ifa != nullptr; ifa = ifa->ifa_next) {
         if (!ifa->ifa_addr) continue;
         if (ifa->ifa_addr->sa_family != AF_INET) continue;
-        if (!if_name.empty() && if_name != ifa->ifa_name) continue;
+        if (!if_filter_.empty() && std::find(if_filter_.begin(), if_filter_.end(), ifa->ifa_name) == if_filter_.end()) continue;
         if (ifa->ifa_flags & IFF_LOOPBACK) continue;
         if (!(ifa->ifa_flags & IFF_UP)) continue;
 
@@ -161,20 +478,28 @@ bool SubnetBroadcaster::find_interface_broadcast(const std::string& if_name, std
         uint32_t ip = ntohl(addr->sin_addr.s_addr);
         uint32_t mask = ntohl(netmask->sin_addr.s_addr);
         uint32_t bcast = (ip & mask) | (~mask);
+        // host routes (e.g. point-to-point VPN /32) have nowhere to broadcast, but may
+        // still carry multicast
+        bool can_bcast = bcast != ip;
+        bool can_mcast = (ifa->ifa_flags & IFF_MULTICAST) != 0;
+        if (mode_ == DiscoveryMode::Broadcast && !can_bcast) continue;
+        if (mode_ == DiscoveryMode::Multicast && !can_mcast) continue;
+        if (!can_bcast && !can_mcast) continue;
 
-        struct in_addr baddr;
-        baddr.s_addr = htonl(bcast);
-        char buf[INET_ADDRSTRLEN];
-        if (inet_ntop(AF_INET, &baddr, buf, sizeof(buf)) == nullptr) continue;
-
-        out_bcast = buf;
-        found = true;
-        break;
+        Interface itf;
+        itf.name = ifa->ifa_name;
+        itf.index = if_nametoindex(ifa->ifa_name);
+        itf.addr = addr->sin_addr.s_addr;
+        itf.bcast = can_bcast ? htonl(bcast) : INADDR_ANY;
+        itf.multicast = can_mcast;
+        out.push_back(itf);
     }
 
     freeifaddrs(ifaddr);
-    if (!found && !if_name.empty()) {
-        std::cerr << "Интерфейс " << if_name << " не найден или не подходит.\n";
+    if (out.empty() && !if_filter_.empty()) {
+        std::cerr << "Интерфейс ";
+        for (size_t i = 0; i < if_filter_.size(); ++i) std::cerr << (i ? "," : "") << if_filter_[i];
+        std::cerr << " не найден или не подходит.\n";
     }
-    return found;
+    return !out.empty();
 }
@@ -2,39 +2,125 @@
 #define SUBNET_BROADCASTER_HPP
 
 #include <string>
-#include <thread>
+#include <vector>
+#include <memory>
 #include <atomic>
+#include <mutex>
+#include <chrono>
+#include <random>
 #include <cstdint>
+#include <functional>
 #include <netinet/in.h>
+#include "MessageCodec.hpp"
+#include "EventLoop.hpp"
 
+// How beacons reach the segment. Multicast lets IGMP-snooping switches deliver beacons
+// only to hosts that joined the group; Both sends each beacon twice so nodes still on
+// broadcast keep seeing us during a migration.
+enum class DiscoveryMode { Broadcast, Multicast, Both };
+
+// Beacons are scheduled with the Trickle algorithm (RFC 6206): each interval starts at
+// interval_ms (Imin) and doubles while the network is stable, up to Imin << doublings.
+// Within an interval the beacon fires at a random point in [I/2, I) and is suppressed when
+// `redundancy` unchanged peer beacons were heard first. Any change resets I to Imin.
 class SubnetBroadcaster {
 public:
+    struct Interface {
+        std::string name;
+        unsigned int index;
+        in_addr_t addr;   // network byte order
+        in_addr_t bcast;  // network byte order, INADDR_ANY if the link cannot broadcast
+        bool multicast;   // IFF_MULTICAST
+    };
+
     SubnetBroadcaster(unsigned int interval_ms = 2000, uint16_t port = 40000);
     ~SubnetBroadcaster();
 
+    // transport for beacons; call before init(). `group` is the IPv4 multicast group used
+    // by Multicast and Both.
+    void set_discovery(DiscoveryMode mode, const std::string& group = MessageCodec::DEFAULT_MULTICAST_GROUP);
+    // called after the interface set changed (e.g. so the listener can join the group there)
+    void set_interfaces_observer(std::function<void()> observer);
+    // run timers and the netlink watcher on a shared loop; call before start(). Without one
+    // the broadcaster runs a private loop thread.
+    void set_event_loop(EventLoop* loop);
+
+    // if_name selects the interfaces to announce on: empty for every eligible IPv4
+    // interface, or a comma-separated list such as "eth0,wlan0"
     bool init(const std::string& if_name = "");
     bool start(uint8_t alive_code = 1, uint8_t shutdown_code = 0, bool include_hostname = true);
     void stop();
+    // raw legacy datagram: one code byte + payload
     bool send_now(uint8_t code, const std::string& payload = std::string());
+    // binary capability beacon carrying `code`, filled by the capabilities provider
+    bool send_beacon(uint8_t code);
+    // called before every beacon to fill ports and load figures; set before start()
+    void set_capabilities_provider(std::function<void(MessageCodec::Beacon&)> provider);
+    // link speed of an interface from sysfs in kbit/s, 0 if unknown (virtual links)
+    static uint32_t link_speed_kbps(const std::string& if_name);
 
+    // comma-separated destinations currently announced on (broadcast addresses and/or group)
     std::string broadcast_address() const;
     uint16_t port() const;
 
+    // Trickle parameters; redundancy 0 disables suppression. Call before start().
+    void set_trickle(unsigned int doublings, unsigned int redundancy);
+    // feed from SubnetListener: a peer beacon arrived, `changed` if it altered our view
+    void note_peer_beacon(in_addr_t addr, bool changed);
+    // local state changed (hostname, ports...): announce it quickly
+    void reset_schedule();
+    // longest gap between two of our beacons; listeners should expire peers well after it
+    unsigned int max_silence_ms() const;
+    // device expiry that tolerates one lost beacon at the longest interval
+    unsigned int recommended_expiry_ms() const;
+    // interfaces currently announced on (refreshed from netlink notifications)
+    std::shared_ptr<const std::vector<Interface>> interfaces() const;
+
 private:
     unsigned int interval_ms_;
     uint16_t port_;
-    std::string broadcast_addr_;
+    std::vector<std::string> if_filter_;
+    DiscoveryMode mode_;
+    in_addr_t group_;
+    std::function<void()> interfaces_observer_;
+    // eligible interfaces, replaced wholesale on netlink changes
+    std::shared_ptr<const std::vector<Interface>> ifaces_;
     uint8_t alive_msg_;
     uint8_t shutdown_msg_;
     std::string hostname_;
     bool include_hostname_;
     int sockfd_;
-    struct sockaddr_in dest_;
     std::atomic<bool> running_;
-    std::thread worker_;
+    // numbers beacons actually sent, so listeners can tell loss from Trickle suppression
+    std::atomic<uint32_t> beacon_seq_;
+    EventLoop* loop_;
+    std::unique_ptr<EventLoop> own_loop_;
+    // rtnetlink watcher for address/link changes
+    int netlink_fd_;
+
+    // Trickle state, guarded by sched_mutex_
+    unsigned int doublings_;
+    unsigned int redundancy_;
+    std::mutex sched_mutex_;
+    EventLoop::TimerId trickle_timer_;
+    std::chrono::milliseconds current_interval_;
+    std::chrono::steady_clock::time_point interval_end_;
+    std::chrono::steady_clock::time_point fire_at_;
+    bool fired_;
+    unsigned int heard_;
+    unsigned int suppressed_in_row_;
+    std::mt19937 rng_;
+
+    void on_trickle_timer();
+    void begin_interval_locked(std::chrono::steady_clock::time_point now);
+    void reset_locked(std::chrono::steady_clock::time_point now);
+    void schedule_locked();
+    std::function<void(MessageCodec::Beacon&)> capabilities_;
 
-    void run_loop();
-    bool find_interface_broadcast(const std::string& if_name, std::string& out_bcast);
+    void send_alive();
+    bool send_datagram(const uint8_t* data, size_t len);
+    void on_netlink();
+    bool scan_interfaces(std::vector<Interface>& out) const;
 };
 
 #endif // SUBNET_BROADCASTER_HPP
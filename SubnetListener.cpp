@@ -1,150 +1,664 @@
 #include "SubnetListener.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
 #include <iostream>
 #include <cstring>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <chrono>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <algorithm>
+#include <cmath>
+
+// recvmmsg batch geometry
+static constexpr unsigned int kRxBatch = 64;
+static constexpr size_t kRxDatagramMax = 1500;
+static constexpr size_t kRxControlLen = CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct in_pktinfo));
+// datagrams waiting for the ingest threads before the receive thread starts dropping; the
+// socket buffer is the backpressure with one thread, this bounds the queue with several
+static constexpr size_t kMaxIngestBacklog = 64 * 1024;
+
+// EWMA gain for loss, one step per expected packet (as RFC 3550 does for jitter)
+static const float kLossGain = 1.0f / 16;
+
+struct ListenerMetrics {
+    Counter& received = metrics().counter("lanshare_beacons_received_total", "Datagrams read from the discovery socket");
+    Counter& ingested = metrics().counter("lanshare_beacons_ingested_total", "Datagrams handed to the device registry");
+    Counter& dropped = metrics().counter("lanshare_beacons_dropped_total",
+                                         "Datagrams dropped on a full receive queue or ingest backlog");
+    Counter& invalid = metrics().counter("lanshare_beacons_invalid_total", "Beacons that failed to decode");
+    Counter* events[4] = {
+        &metrics().counter("lanshare_device_events_total", "Device registry changes", "type=\"added\""),
+        &metrics().counter("lanshare_device_events_total", "Device registry changes", "type=\"updated\""),
+        &metrics().counter("lanshare_device_events_total", "Device registry changes", "type=\"expired\""),
+        &metrics().counter("lanshare_device_events_total", "Device registry changes", "type=\"shutdown\""),
+    };
+    Gauge& devices = metrics().gauge("lanshare_devices", "Devices in the last published snapshot");
+};
+
+static ListenerMetrics& listener_metrics() {
+    static ListenerMetrics m;
+    return m;
+}
+
+static void note_lost(PathEstimate& p, unsigned int n) {
+    p.loss = 1.0f - (1.0f - p.loss) * std::pow(1.0f - kLossGain, static_cast<float>(n));
+}
+
+static void note_received(PathEstimate& p, unsigned int n) {
+    p.loss *= std::pow(1.0f - kLossGain, static_cast<float>(n));
+}
+
+// Passive path figures from the seq/tx_ms fields every v2 beacon carries. Clock offset
+// between the hosts cancels out of the transit difference, so no synchronisation needed.
+static void update_beacon_timing(PathEstimate& path, bool& have_timing, uint32_t& last_seq, int32_t& last_transit_ms,
+                                 const MessageCodec::Beacon& b, std::chrono::steady_clock::time_point now) {
+    if (!b.has_timing) return;
+    uint32_t arrival_ms = static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count());
+    int32_t transit = static_cast<int32_t>(arrival_ms - b.tx_ms);
+    int32_t step = static_cast<int32_t>(b.seq - last_seq);
+    if (!have_timing || step < 0 || step > 1000) {
+        // first beacon, or the peer restarted
+        have_timing = true;
+    } else if (step == 0) {
+        return; // the same beacon on a second transport/interface
+    } else {
+        note_lost(path, step - 1);
+        note_received(path, 1);
+        float d = std::fabs(static_cast<float>(transit - last_transit_ms));
+        path.jitter_ms += (d - path.jitter_ms) / 16;
+    }
+    last_seq = b.seq;
+    last_transit_ms = transit;
+}
 
 SubnetListener::SubnetListener(uint16_t port)
-    : port_(port), sockfd_(-1), running_(false), expiry_ms_(15000), reaper_interval_ms_(2000), shutdown_sockfd_(-1), shutdown_port_(40002) {}
+    : port_(port), rx_threads_(1), multicast_group_(INADDR_ANY), rx_fd_(-1), received_(0), ingested_(0),
+      kernel_drops_(0), backlog_drops_(0), ingest_backlog_(0), running_(false), loop_(nullptr), pool_(nullptr),
+      resolving_(0), shutdown_sockfd_(-1), shutdown_port_(40002), next_expiry_gen_(0), reap_timer_(0),
+      reap_due_(std::chrono::steady_clock::time_point::max()), expiry_ms_(15000), snapshot_(std::make_shared<const DeviceMap>()),
+      dirty_(false), publish_interval_ms_(100), has_subscribers_(false) {
+    listener_metrics();
+}
 
 SubnetListener::~SubnetListener() {
     stop();
 }
 
-bool SubnetListener::start() {
-    sockfd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd_ < 0) {
+void SubnetListener::set_event_loop(EventLoop* loop) {
+    loop_ = loop;
+}
+
+void SubnetListener::set_worker_pool(WorkerPool* pool) {
+    pool_ = pool;
+}
+
+bool SubnetListener::open_socket() {
+    rx_fd_ = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (rx_fd_ < 0) {
         perror("socket");
         return false;
     }
 
     int on = 1;
-    if (setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+    if (setsockopt(rx_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
         perror("setsockopt SO_REUSEADDR");
     }
+    // kernel drop counter and destination address arrive as ancillary data
+    if (setsockopt(rx_fd_, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+        perror("setsockopt SO_RXQ_OVFL");
+    }
+    if (setsockopt(rx_fd_, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) < 0) {
+        perror("setsockopt IP_PKTINFO");
+    }
+    // a larger queue absorbs beacon bursts (capped by net.core.rmem_max)
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(rx_fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
     struct sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(port_);
 
-    if (bind(sockfd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+    if (bind(rx_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
         perror("bind");
-        ::close(sockfd_);
-        sockfd_ = -1;
+        ::close(rx_fd_);
+        rx_fd_ = -1;
         return false;
     }
+    if (multicast_group_ != INADDR_ANY) join_multicast(rx_fd_);
+    return true;
+}
 
-    running_.store(true);
-    worker_ = std::thread(&SubnetListener::listen_loop, this);
-    // start reaper thread
-    reaper_worker_ = std::thread([this]() {
-        while (running_.load()) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(reaper_interval_ms_));
-            auto now = std::chrono::steady_clock::now();
-            std::lock_guard<std::mutex> lock(devices_mutex_);
-            for (auto it = devices_.begin(); it != devices_.end(); ) {
-                auto age = std::chrono::duration_cast<std::chrono::milliseconds>(now - it->second.lastSeen).count();
-                if (age > (long)expiry_ms_) {
-                    it = devices_.erase(it);
-                } else {
-                    ++it;
-                }
-            }
+void SubnetListener::join_multicast(int fd) {
+    // membership is per interface; join on every multicast-capable one
+    struct ifaddrs* ifaddr = nullptr;
+    if (getifaddrs(&ifaddr) == -1) {
+        perror("getifaddrs");
+        return;
+    }
+    for (struct ifaddrs* ifa = ifaddr; ifa != nullptr; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET) continue;
+        if (!(ifa->ifa_flags & IFF_UP) || !(ifa->ifa_flags & IFF_MULTICAST)) continue;
+        struct ip_mreqn mreq{};
+        mreq.imr_multiaddr.s_addr = multicast_group_;
+        mreq.imr_ifindex = if_nametoindex(ifa->ifa_name);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 && errno != EADDRINUSE) {
+            perror("setsockopt IP_ADD_MEMBERSHIP");
         }
-    });
-    // start shutdown TCP server
-    shutdown_worker_ = std::thread(&SubnetListener::shutdown_server_loop, this);
+    }
+    freeifaddrs(ifaddr);
+}
+
+bool SubnetListener::set_multicast_group(const std::string& group) {
+    struct in_addr a;
+    if (inet_pton(AF_INET, group.c_str(), &a) != 1 || !IN_MULTICAST(ntohl(a.s_addr))) {
+        std::cerr << "Invalid multicast group " << group << "\n";
+        return false;
+    }
+    multicast_group_ = a.s_addr;
+    return true;
+}
+
+void SubnetListener::refresh_multicast_memberships() {
+    if (multicast_group_ == INADDR_ANY || !running_.load()) return;
+    join_multicast(rx_fd_);
+}
+
+bool SubnetListener::start() {
+    if (!open_socket()) return false;
+
+    if (!loop_) {
+        own_loop_.reset(new EventLoop());
+        own_loop_->start_thread();
+        loop_ = own_loop_.get();
+    }
+    running_.store(true);
+    // one socket whatever the thread count: SO_REUSEPORT would hand every broadcast to
+    // every socket, so each thread would copy the whole stream and discard most of it
+    for (unsigned int i = 0; rx_threads_ > 1 && i < rx_threads_; ++i) {
+        ingest_loops_.emplace_back(new EventLoop());
+        ingest_loops_.back()->start_thread();
+    }
+    rx_buffers_.resize(kRxBatch * kRxDatagramMax);
+    rx_control_.resize(kRxBatch * kRxControlLen);
+    loop_->add_fd(rx_fd_, EPOLLIN, [this](uint32_t) { drain_socket(); });
+    open_shutdown_server();
+    {
+        // devices preloaded before start() have expiry deadlines waiting
+        TRACE_LOCK(lock, devices_mutex_);
+        arm_reaper_locked();
+    }
     return true;
 }
 
 void SubnetListener::stop() {
-    if (!running_.load()) return;
-    running_.store(false);
-    if (sockfd_ >= 0) {
-        ::shutdown(sockfd_, SHUT_RDWR);
-        ::close(sockfd_);
-        sockfd_ = -1;
-    }
-    if (worker_.joinable()) worker_.join();
-    if (reaper_worker_.joinable()) reaper_worker_.join();
-    if (shutdown_sockfd_ >= 0) {
-        ::shutdown(shutdown_sockfd_, SHUT_RDWR);
-        ::close(shutdown_sockfd_);
-        shutdown_sockfd_ = -1;
+    if (!running_.exchange(false)) return;
+    loop_->run_sync([this]() {
+        loop_->remove_fd(rx_fd_);
+        ::close(rx_fd_);
+        rx_fd_ = -1;
+    });
+    // nothing posts to the ingest loops once the socket is off the loop; stop them before
+    // the reaper below, which their beacons could re-arm
+    for (auto& l : ingest_loops_) {
+        l->stop();
+        l->join();
     }
-    if (shutdown_worker_.joinable()) shutdown_worker_.join();
+    ingest_loops_.clear();
+    ingest_backlog_.store(0);
+    loop_->run_sync([this]() {
+        if (shutdown_sockfd_ >= 0) {
+            loop_->remove_fd(shutdown_sockfd_);
+            ::close(shutdown_sockfd_);
+            shutdown_sockfd_ = -1;
+        }
+        while (!shutdown_clients_.empty()) close_shutdown_client(shutdown_clients_.begin()->first);
+        TRACE_LOCK(lock, devices_mutex_);
+        if (reap_timer_) loop_->cancel_timer(reap_timer_);
+        reap_timer_ = 0;
+        reap_due_ = std::chrono::steady_clock::time_point::max();
+    });
+    if (own_loop_) {
+        own_loop_->stop();
+        own_loop_->join();
+        own_loop_.reset();
+        loop_ = nullptr;
+    }
+    // a lookup still in flight touches the registry when it returns
+    std::unique_lock<std::mutex> lock(resolve_mutex_);
+    resolve_cv_.wait(lock, [this]() { return resolving_ == 0; });
+}
+
+void SubnetListener::set_rx_threads(unsigned int n) {
+    rx_threads_ = n;
+}
+
+void SubnetListener::set_beacon_observer(std::function<void(in_addr_t addr, bool changed)> observer) {
+    beacon_observer_ = std::move(observer);
+}
+
+ListenerStats SubnetListener::stats() const {
+    ListenerStats st;
+    st.received = received_.load(std::memory_order_relaxed);
+    st.ingested = ingested_.load(std::memory_order_relaxed);
+    st.dropped = kernel_drops_.load(std::memory_order_relaxed) + backlog_drops_.load(std::memory_order_relaxed);
+    return st;
 }
 
 void SubnetListener::set_expiry_ms(unsigned int ms) {
-    expiry_ms_ = ms;
+    expiry_ms_.store(ms);
+    // re-arm every device against the new window so a shorter expiry takes effect at once
+    TRACE_LOCK(lock, devices_mutex_);
+    expiry_heap_ = decltype(expiry_heap_)();
+    for (auto& e : devices_) {
+        e.value.expiry_gen = ++next_expiry_gen_;
+        expiry_heap_.push({e.value.info.lastSeen + std::chrono::milliseconds(ms), e.addr, e.value.expiry_gen});
+    }
+    arm_reaper_locked();
 }
 
-void SubnetListener::listen_loop() {
-    uint8_t buffer[1024];
-    struct sockaddr_in sender{};
-    socklen_t sender_len = sizeof(sender);
+void SubnetListener::publish_locked(std::chrono::steady_clock::time_point now) {
+    auto next = std::make_shared<DeviceMap>();
+    next->reserve(devices_.size());
+    for (const auto& e : devices_) next->emplace(e.value.info.ip, e.value.info);
+    std::atomic_store(&snapshot_, std::shared_ptr<const DeviceMap>(std::move(next)));
+    listener_metrics().devices.set(static_cast<int64_t>(devices_.size()));
+    dirty_ = false;
+    last_publish_ = now;
+}
 
-    while (running_.load()) {
-        ssize_t bytes = recvfrom(sockfd_, buffer, sizeof(buffer), 0,
-                                 reinterpret_cast<struct sockaddr*>(&sender), &sender_len);
-        if (bytes <= 0) {
-            if (running_.load()) perror("recvfrom");
-            break;
+void SubnetListener::mark_dirty_locked(std::chrono::steady_clock::time_point now) {
+    // coalesce bursts (e.g. many devices appearing at once): publish at most once per
+    // publish_interval_ms_, leaving the rest to the reaper
+    if (now - last_publish_ >= std::chrono::milliseconds(publish_interval_ms_)) {
+        publish_locked(now);
+        return;
+    }
+    if (!dirty_) {
+        dirty_ = true;
+        arm_reaper_locked();
+    }
+}
+
+void SubnetListener::arm_reaper_locked() {
+    if (!running_.load() || !loop_) return;
+    auto wake = expiry_heap_.empty() ? std::chrono::steady_clock::time_point::max() : expiry_heap_.top().due;
+    if (dirty_) wake = std::min(wake, last_publish_ + std::chrono::milliseconds(publish_interval_ms_));
+    if (wake == reap_due_) return;
+    // nothing to expire and nothing to publish: no timer at all while idle
+    if (reap_timer_) loop_->cancel_timer(reap_timer_);
+    reap_timer_ = 0;
+    reap_due_ = wake;
+    if (wake != std::chrono::steady_clock::time_point::max()) {
+        reap_timer_ = loop_->add_timer_at(wake, [this]() { on_reap_timer(); });
+    }
+}
+
+void SubnetListener::on_reap_timer() {
+    bool have_events;
+    {
+        TRACE_LOCK(lock, devices_mutex_);
+        reap_timer_ = 0;
+        reap_due_ = std::chrono::steady_clock::time_point::max();
+        auto now = std::chrono::steady_clock::now();
+        auto expiry = std::chrono::milliseconds(expiry_ms_.load());
+        // only entries whose deadline has passed are touched
+        while (!expiry_heap_.empty() && expiry_heap_.top().due <= now) {
+            ExpiryEntry e = expiry_heap_.top();
+            expiry_heap_.pop();
+            DeviceRecord* rec = devices_.find(e.addr);
+            if (!rec || rec->expiry_gen != e.gen) continue; // stale entry
+            auto due = rec->info.lastSeen + expiry;
+            if (due <= now) {
+                emit_locked(DeviceEventType::Expired, rec->info);
+                devices_.erase(e.addr);
+                dirty_ = true;
+            } else {
+                // seen again since armed: re-arm at the real deadline
+                e.due = due;
+                expiry_heap_.push(std::move(e));
+            }
+        }
+        if (dirty_ && last_publish_ + std::chrono::milliseconds(publish_interval_ms_) <= now) {
+            publish_locked(now);
         }
+        arm_reaper_locked();
+        have_events = !pending_events_.empty();
+    }
+    if (have_events) dispatch_events();
+}
 
-        // First byte is message code. If there are extra bytes, treat them as sender-provided hostname.
-        uint8_t code = static_cast<uint8_t>(buffer[0]);
+void SubnetListener::drain_socket() {
+    constexpr unsigned int kBatch = kRxBatch;
+    constexpr size_t kDatagramMax = kRxDatagramMax;
+    constexpr size_t kControlLen = kRxControlLen;
+    // a few batches per wakeup, then yield to the other sources on the loop
+    constexpr unsigned int kMaxBatchesPerWake = 4;
 
-        char ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &sender.sin_addr, ip_str, sizeof(ip_str));
-        std::string ip = ip_str;
+    struct sockaddr_in senders[kBatch];
+    struct iovec iov[kBatch];
+    struct mmsghdr msgs[kBatch];
+    const unsigned int nthreads = ingest_loops_.size();
 
-        std::string payload_hostname;
-        if (bytes > 1) {
-            // payload bytes after the first byte represent hostname (no validation currently)
-            payload_hostname.assign(reinterpret_cast<char*>(buffer + 1), bytes - 1);
+    for (unsigned int round = 0; round < kMaxBatchesPerWake; ++round) {
+        for (unsigned int i = 0; i < kBatch; ++i) {
+            iov[i].iov_base = &rx_buffers_[i * kDatagramMax];
+            iov[i].iov_len = kDatagramMax;
+            std::memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &senders[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = &rx_control_[i * kControlLen];
+            msgs[i].msg_hdr.msg_controllen = kControlLen;
         }
 
-        // Получаем hostname via reverse lookup only if payload didn't include it
-        char hostbuf[NI_MAXHOST];
-        if (payload_hostname.empty()) {
-            if (getnameinfo(reinterpret_cast<struct sockaddr*>(&sender), sender_len,
-                            hostbuf, sizeof(hostbuf), nullptr, 0, NI_NAMEREQD) != 0) {
-                std::strcpy(hostbuf, "unknown");
+        // only what is already queued; the loop calls us again while the socket is readable
+        int n = recvmmsg(rx_fd_, msgs, kBatch, MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvmmsg");
+            return;
+        }
+        if (n == 0) return;
+        TRACE_SCOPE_VAR(batch, "discovery", "beacon batch");
+        TRACE_SET_ARG(batch, n);
+        received_.fetch_add(n, std::memory_order_relaxed);
+        listener_metrics().received.add(n);
+
+        uint64_t ingested = 0;
+        uint64_t backlogged = 0;
+        std::vector<std::shared_ptr<IngestBatch>> out(nthreads);
+        for (int i = 0; i < n; ++i) {
+            struct msghdr& hdr = msgs[i].msg_hdr;
+            unsigned int ifindex = 0;
+            for (struct cmsghdr* c = CMSG_FIRSTHDR(&hdr); c != nullptr; c = CMSG_NXTHDR(&hdr, c)) {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+                    uint32_t drops;
+                    std::memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+                    // cumulative per socket; the counter gets the increase
+                    uint32_t prev = kernel_drops_.exchange(drops, std::memory_order_relaxed);
+                    if (drops > prev) listener_metrics().dropped.add(drops - prev);
+                } else if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+                    struct in_pktinfo pi;
+                    std::memcpy(&pi, CMSG_DATA(c), sizeof(pi));
+                    ifindex = pi.ipi_ifindex;
+                }
             }
-        } else {
-            std::strncpy(hostbuf, payload_hostname.c_str(), sizeof(hostbuf) - 1);
-            hostbuf[sizeof(hostbuf) - 1] = '\0';
+            if (msgs[i].msg_len == 0) continue;
+
+            if (nthreads == 0) {
+                handle_beacon(senders[i], ifindex, static_cast<const uint8_t*>(iov[i].iov_base), msgs[i].msg_len);
+                ++ingested;
+                continue;
+            }
+            if (ingest_backlog_.load(std::memory_order_relaxed) + backlogged >= kMaxIngestBacklog) {
+                backlog_drops_.fetch_add(1, std::memory_order_relaxed);
+                listener_metrics().dropped.add();
+                continue;
+            }
+            // one sender always goes to the same thread, so its sequence numbers stay in order
+            uint32_t key = ntohl(senders[i].sin_addr.s_addr) * 2654435761u;
+            auto& b = out[(key >> 16) % nthreads];
+            if (!b) b = std::make_shared<IngestBatch>();
+            b->items.push_back({senders[i], ifindex, static_cast<uint32_t>(b->data.size()), msgs[i].msg_len});
+            b->data.insert(b->data.end(), static_cast<const uint8_t*>(iov[i].iov_base),
+                           static_cast<const uint8_t*>(iov[i].iov_base) + msgs[i].msg_len);
+            ++backlogged;
+        }
+        if (ingested) {
+            ingested_.fetch_add(ingested, std::memory_order_relaxed);
+            listener_metrics().ingested.add(ingested);
+        }
+        for (unsigned int t = 0; t < nthreads; ++t) {
+            if (!out[t]) continue;
+            std::shared_ptr<IngestBatch> b = std::move(out[t]);
+            ingest_backlog_.fetch_add(b->items.size(), std::memory_order_relaxed);
+            ingest_loops_[t]->post([this, b]() { ingest_batch(*b); });
+        }
+        if (static_cast<unsigned int>(n) < kBatch) return;
+    }
+}
+
+void SubnetListener::ingest_batch(const IngestBatch& batch) {
+    for (const auto& item : batch.items) {
+        handle_beacon(item.sender, item.ifindex, &batch.data[item.offset], item.len);
+    }
+    ingest_backlog_.fetch_sub(batch.items.size(), std::memory_order_relaxed);
+    ingested_.fetch_add(batch.items.size(), std::memory_order_relaxed);
+    listener_metrics().ingested.add(batch.items.size());
+}
+
+// true when a beacon repeats what the registry already holds for the device
+static bool same_payload(const DeviceInfo& cur, const MessageCodec::Beacon& b, unsigned int ifindex) {
+    return cur.lastMessage == b.code && cur.proto_version == b.version && cur.flags == b.flags &&
+           cur.sketch_version == b.sketch_version && cur.data_port == b.data_port &&
+           cur.control_port == b.control_port && cur.active_transfers == b.active_transfers &&
+           cur.free_disk_mb == b.free_disk_mb && cur.bandwidth_kbps == b.bandwidth_kbps && cur.ifindex == ifindex &&
+           (b.hostname_len == 0 || (cur.hostname.size() == b.hostname_len &&
+                                    std::memcmp(cur.hostname.data(), b.hostname, b.hostname_len) == 0));
+}
+
+void SubnetListener::handle_beacon(const struct sockaddr_in& sender, unsigned int ifindex, const uint8_t* buffer, size_t bytes) {
+    // Binary capability beacon, or legacy format: first byte is message code and any
+    // extra bytes are the sender-provided hostname.
+    MessageCodec::Beacon beacon;
+    if (buffer[0] == MessageCodec::BEACON_MAGIC) {
+        if (!MessageCodec::decode_beacon(buffer, bytes, beacon)) {
+            listener_metrics().invalid.add();
+            return;
+        }
+    } else {
+        beacon.version = 0;
+        beacon.code = buffer[0];
+        size_t hlen = bytes - 1;
+        if (hlen > MessageCodec::BEACON_MAX_HOSTNAME) hlen = MessageCodec::BEACON_MAX_HOSTNAME;
+        if (!MessageCodec::valid_hostname(reinterpret_cast<const char*>(buffer + 1), hlen)) {
+            listener_metrics().invalid.add();
+            return;
         }
+        beacon.hostname = reinterpret_cast<const char*>(buffer + 1);
+        beacon.hostname_len = static_cast<uint8_t>(hlen);
+    }
+    uint8_t code = beacon.code;
 
-        DeviceInfo info;
-        info.ip = ip;
-        info.hostname = hostbuf;
-        info.lastMessage = code;
-        info.lastSeen = std::chrono::steady_clock::now();
+    in_addr_t addr = sender.sin_addr.s_addr;
 
+    // Получаем hostname via reverse lookup only if payload didn't include it and the
+    // device is not already known (lookups are slow, do them outside the lock). With a
+    // worker pool the device is added as "unknown" and renamed once the lookup returns.
+    std::string resolved;
+    bool resolve_later = false;
+    if (beacon.hostname_len == 0 && code != MessageCodec::MSG_SHUTDOWN) {
+        bool known = false;
         {
-            std::lock_guard<std::mutex> lock(devices_mutex_);
-            devices_[ip] = info;
+            TRACE_LOCK(lock, devices_mutex_);
+            known = devices_.contains(addr);
+        }
+        if (!known && pool_) {
+            resolve_later = true;
+        } else if (!known) {
+            char hostbuf[NI_MAXHOST];
+            if (getnameinfo(reinterpret_cast<const struct sockaddr*>(&sender), sizeof(sender),
+                            hostbuf, sizeof(hostbuf), nullptr, 0, NI_NAMEREQD) != 0) {
+                std::strcpy(hostbuf, "unknown");
+            }
+            resolved = hostbuf;
         }
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    bool changed = false;
+    bool have_events = false;
+    {
+        TRACE_LOCK(lock, devices_mutex_);
+        DeviceRecord* found = devices_.find(addr);
+        if (code == MessageCodec::MSG_SHUTDOWN) {
+            // the peer is leaving: drop it now rather than waiting for expiry
+            if (found) {
+                found->info.lastMessage = code;
+                emit_locked(DeviceEventType::ShutDown, found->info);
+                devices_.erase(addr);
+                mark_dirty_locked(now);
+                changed = true;
+            }
+        } else if (!found) {
+            // the only place a beacon costs allocations: the device's strings are built once
+            DeviceRecord rec;
+            char ip_str[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &sender.sin_addr, ip_str, sizeof(ip_str));
+            rec.info.ip = ip_str;
+            if (beacon.hostname_len) rec.info.hostname.assign(beacon.hostname, beacon.hostname_len);
+            else rec.info.hostname = resolved.empty() ? "unknown" : resolved;
+            rec.info.lastMessage = code;
+            rec.info.lastSeen = now;
+            rec.info.ifindex = ifindex;
+            char ifbuf[IF_NAMESIZE];
+            if (ifindex != 0 && if_indextoname(ifindex, ifbuf) != nullptr) rec.info.iface = ifbuf;
+            rec.info.proto_version = beacon.version;
+            rec.info.data_port = beacon.data_port;
+            rec.info.control_port = beacon.control_port;
+            rec.info.active_transfers = beacon.active_transfers;
+            rec.info.free_disk_mb = beacon.free_disk_mb;
+            rec.info.bandwidth_kbps = beacon.bandwidth_kbps;
+            rec.info.flags = beacon.flags;
+            rec.info.sketch_version = beacon.sketch_version;
+            update_beacon_timing(rec.info.path, rec.have_timing, rec.last_seq, rec.last_transit_ms, beacon, now);
+            rec.expiry_gen = ++next_expiry_gen_;
+            expiry_heap_.push({now + std::chrono::milliseconds(expiry_ms_.load()), addr, rec.expiry_gen});
+            arm_reaper_locked();
+            emit_locked(DeviceEventType::Added, rec.info);
+            devices_.insert(addr, std::move(rec));
+            mark_dirty_locked(now);
+            changed = true;
+        } else {
+            DeviceInfo& cur = found->info;
+            cur.lastSeen = now;
+            update_beacon_timing(cur.path, found->have_timing, found->last_seq, found->last_transit_ms, beacon, now);
+            // a plain refresh stops here, having touched only lastSeen and the timing
+            // estimate; readers are republished on real changes
+            if (!cur.verified || !same_payload(cur, beacon, ifindex)) {
+                if (!cur.verified) {
+                    cur.verified = true;
+                    changed = true;
+                }
+                if (beacon.hostname_len &&
+                    cur.hostname.compare(0, std::string::npos, beacon.hostname, beacon.hostname_len) != 0) {
+                    cur.hostname.assign(beacon.hostname, beacon.hostname_len);
+                    changed = true;
+                }
+                if (cur.lastMessage != code || cur.proto_version != beacon.version ||
+                    cur.data_port != beacon.data_port || cur.control_port != beacon.control_port ||
+                    cur.flags != beacon.flags || cur.sketch_version != beacon.sketch_version) {
+                    cur.lastMessage = code;
+                    cur.proto_version = beacon.version;
+                    cur.flags = beacon.flags;
+                    cur.sketch_version = beacon.sketch_version;
+                    cur.data_port = beacon.data_port;
+                    cur.control_port = beacon.control_port;
+                    changed = true;
+                }
+                // the device moved to another segment (e.g. undocked): re-resolve the name
+                if (cur.ifindex != ifindex) {
+                    cur.ifindex = ifindex;
+                    char ifbuf[IF_NAMESIZE];
+                    cur.iface = (ifindex != 0 && if_indextoname(ifindex, ifbuf) != nullptr) ? ifbuf : "";
+                    changed = true;
+                }
+                // load figures move constantly: republish for readers, but they are not a
+                // topology change for the beacon schedule
+                bool load_changed = cur.active_transfers != beacon.active_transfers ||
+                                    cur.free_disk_mb != beacon.free_disk_mb ||
+                                    cur.bandwidth_kbps != beacon.bandwidth_kbps;
+                if (load_changed) {
+                    cur.active_transfers = beacon.active_transfers;
+                    cur.free_disk_mb = beacon.free_disk_mb;
+                    cur.bandwidth_kbps = beacon.bandwidth_kbps;
+                }
+                if (changed || load_changed) {
+                    emit_locked(DeviceEventType::Updated, cur);
+                    mark_dirty_locked(now);
+                }
+            }
+        }
+        have_events = !pending_events_.empty();
+    }
+    if (have_events) dispatch_events();
+    if (resolve_later) resolve_hostname(sender);
+    if (beacon_observer_) beacon_observer_(sender.sin_addr.s_addr, changed);
 
     /* std::cout << "[RECV] code=" << static_cast<int>(code)
-          << " (" << MessageCodec::name_for(code) << ") from " << ip
-          << " (" << hostbuf << ")" << std::endl; */
+          << " (" << MessageCodec::name_for(code) << ") from " << ip << std::endl; */
+}
+
+void SubnetListener::ingest(const struct sockaddr_in& sender, unsigned int ifindex, const uint8_t* data, size_t len) {
+    if (len == 0) return;
+    handle_beacon(sender, ifindex, data, len);
+}
+
+void SubnetListener::resolve_hostname(const struct sockaddr_in& sender) {
+    {
+        std::lock_guard<std::mutex> lock(resolve_mutex_);
+        ++resolving_;
     }
+    bool queued = pool_->submit([this, sender]() {
+        char hostbuf[NI_MAXHOST];
+        if (getnameinfo(reinterpret_cast<const struct sockaddr*>(&sender), sizeof(sender),
+                        hostbuf, sizeof(hostbuf), nullptr, 0, NI_NAMEREQD) == 0) {
+            bool have_events = false;
+            {
+                TRACE_LOCK(lock, devices_mutex_);
+                DeviceRecord* rec = devices_.find(sender.sin_addr.s_addr);
+                // a beacon may have brought a real hostname meanwhile
+                if (rec && rec->info.hostname == "unknown") {
+                    rec->info.hostname = hostbuf;
+                    emit_locked(DeviceEventType::Updated, rec->info);
+                    mark_dirty_locked(std::chrono::steady_clock::now());
+                }
+                have_events = !pending_events_.empty();
+            }
+            if (have_events) dispatch_events();
+        }
+        std::lock_guard<std::mutex> lock(resolve_mutex_);
+        --resolving_;
+        resolve_cv_.notify_all();
+    });
+    if (!queued) {
+        // the pool is shutting down; the device keeps "unknown"
+        std::lock_guard<std::mutex> lock(resolve_mutex_);
+        --resolving_;
+        resolve_cv_.notify_all();
+    }
+}
+
+std::shared_ptr<const DeviceMap> SubnetListener::snapshot() const {
+    return std::atomic_load(&snapshot_);
+}
+
+DeviceMap SubnetListener::get_devices() {
+    return *snapshot();
 }
 
-std::unordered_map<std::string, DeviceInfo> SubnetListener::get_devices() {
-    std::lock_guard<std::mutex> lock(devices_mutex_);
-    return devices_;
+std::vector<DeviceInfo> SubnetListener::devices_by_load() const {
+    auto devices = snapshot();
+    std::vector<DeviceInfo> out;
+    out.reserve(devices->size());
+    for (const auto& [ip, info] : *devices) out.push_back(info);
+    std::sort(out.begin(), out.end(), less_loaded);
+    return out;
 }
 
-void SubnetListener::shutdown_server_loop() {
-    shutdown_sockfd_ = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (shutdown_sockfd_ < 0) return;
+bool SubnetListener::open_shutdown_server() {
+    shutdown_sockfd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (shutdown_sockfd_ < 0) return false;
 
     int on = 1;
     setsockopt(shutdown_sockfd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
@@ -157,36 +671,239 @@ void SubnetListener::shutdown_server_loop() {
     if (bind(shutdown_sockfd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
         ::close(shutdown_sockfd_);
         shutdown_sockfd_ = -1;
-        return;
+        return false;
     }
 
-    if (listen(shutdown_sockfd_, 4) < 0) {
+    if (listen(shutdown_sockfd_, SOMAXCONN) < 0) {
         ::close(shutdown_sockfd_);
         shutdown_sockfd_ = -1;
-        return;
+        return false;
+    }
+    return loop_->add_fd(shutdown_sockfd_, EPOLLIN, [this](uint32_t) { on_shutdown_accept(); });
+}
+
+void SubnetListener::on_shutdown_accept() {
+    // a peer that connects and never sends its code is dropped after this long
+    constexpr auto kClientTimeout = std::chrono::milliseconds(2000);
+    while (true) {
+        int client = accept4(shutdown_sockfd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) return; // EAGAIN: backlog drained
+        shutdown_clients_[client] = loop_->add_timer(kClientTimeout, [this, client]() {
+            shutdown_clients_[client] = 0; // fired, nothing to cancel
+            close_shutdown_client(client);
+        });
+        loop_->add_fd(client, EPOLLIN, [this, client](uint32_t) { on_shutdown_client(client); });
+        // the code byte usually arrives with the connection
+        on_shutdown_client(client);
     }
+}
 
-    while (running_.load()) {
+void SubnetListener::on_shutdown_client(int fd) {
+    uint8_t code;
+    ssize_t r = recv(fd, &code, sizeof(code), MSG_DONTWAIT);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    if (r == sizeof(code) && code == MessageCodec::MSG_SHUTDOWN) {
         struct sockaddr_in peer{};
         socklen_t plen = sizeof(peer);
-        int client = accept(shutdown_sockfd_, reinterpret_cast<struct sockaddr*>(&peer), &plen);
-        if (client < 0) {
-            if (!running_.load()) break;
+        bool have_peer = getpeername(fd, reinterpret_cast<struct sockaddr*>(&peer), &plen) == 0;
+        // remove device immediately
+        if (have_peer) {
+            TRACE_LOCK(lock, devices_mutex_);
+            DeviceRecord* rec = devices_.find(peer.sin_addr.s_addr);
+            if (rec) {
+                rec->info.lastMessage = code;
+                emit_locked(DeviceEventType::ShutDown, rec->info);
+                devices_.erase(peer.sin_addr.s_addr);
+                mark_dirty_locked(std::chrono::steady_clock::now());
+            }
+        }
+        dispatch_events();
+    }
+    close_shutdown_client(fd);
+}
+
+void SubnetListener::close_shutdown_client(int fd) {
+    auto it = shutdown_clients_.find(fd);
+    if (it != shutdown_clients_.end()) {
+        if (it->second) loop_->cancel_timer(it->second);
+        loop_->remove_fd(fd);
+        shutdown_clients_.erase(it);
+    }
+    ::close(fd);
+}
+
+void SubnetListener::emit_locked(DeviceEventType type, const DeviceInfo& info) {
+    listener_metrics().events[static_cast<int>(type)]->add();
+    if (!has_subscribers_.load(std::memory_order_relaxed)) return;
+    pending_events_.push_back({type, info});
+}
+
+void SubnetListener::dispatch_events() {
+    std::lock_guard<std::mutex> dlock(dispatch_mutex_);
+    std::vector<DeviceEvent> events;
+    {
+        TRACE_LOCK(lock, devices_mutex_);
+        events.swap(pending_events_);
+    }
+    if (events.empty()) return;
+    bool pruned = false;
+    for (auto& weak : subscribers_) {
+        auto sub = weak.lock();
+        if (!sub) {
+            pruned = true;
             continue;
         }
+        for (const auto& e : events) sub->push(e);
+    }
+    if (pruned) {
+        subscribers_.erase(std::remove_if(subscribers_.begin(), subscribers_.end(),
+                                          [](const std::weak_ptr<DeviceSubscription>& w) { return w.expired(); }),
+                           subscribers_.end());
+        has_subscribers_.store(!subscribers_.empty());
+    }
+}
 
-        uint8_t code;
-        ssize_t r = recv(client, &code, sizeof(code), MSG_WAITALL);
-        char ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &peer.sin_addr, ip_str, sizeof(ip_str));
-        std::string peer_ip = ip_str;
+void SubnetListener::record_probe(const ProbeResult& result) {
+    {
+        TRACE_LOCK(lock, devices_mutex_);
+        struct in_addr addr;
+        if (inet_pton(AF_INET, result.ip.c_str(), &addr) != 1) return;
+        DeviceRecord* rec = devices_.find(addr.s_addr);
+        if (!rec) return;
+        auto now = std::chrono::steady_clock::now();
+        if (!rec->info.verified && result.received == 0) {
+            // a cached entry that answers none of the echoes is gone, not merely quiet
+            if (result.sent > 0) {
+                emit_locked(DeviceEventType::Expired, rec->info);
+                devices_.erase(addr.s_addr);
+                mark_dirty_locked(now);
+            }
+        } else {
+            PathEstimate& p = rec->info.path;
+            for (float rtt : result.rtt_ms) {
+                if (p.rtt_ms == 0) {
+                    p.rtt_ms = rtt;
+                    p.rtt_min_ms = rtt;
+                    continue;
+                }
+                // probe RTT variation adds to beacon jitter: a peer that only probes still gets one
+                p.jitter_ms += (std::fabs(rtt - p.rtt_ms) - p.jitter_ms) / 16;
+                p.rtt_ms += (rtt - p.rtt_ms) / 8;
+                p.rtt_min_ms = std::min(p.rtt_min_ms, rtt);
+            }
+            if (result.received < result.sent) note_lost(p, result.sent - result.received);
+            note_received(p, result.received);
+            if (result.bandwidth_kbps > 0) {
+                // a single pair is noisy: average it in
+                p.bandwidth_kbps = p.bandwidth_kbps ? (p.bandwidth_kbps * 3ull + result.bandwidth_kbps) / 4
+                                                    : result.bandwidth_kbps;
+            }
+            p.probed_at = now;
+            // an answer confirms a cached entry as well as a beacon would
+            if (!rec->info.verified) {
+                rec->info.verified = true;
+                rec->info.lastSeen = now;
+            }
+            emit_locked(DeviceEventType::Updated, rec->info);
+            mark_dirty_locked(now);
+        }
+    }
+    dispatch_events();
+}
 
-        if (r == sizeof(code) && code == MessageCodec::MSG_SHUTDOWN) {
-            // remove device immediately
-            std::lock_guard<std::mutex> lock(devices_mutex_);
-            devices_.erase(peer_ip);
+size_t SubnetListener::preload(const std::vector<DeviceInfo>& cached) {
+    size_t added = 0;
+    {
+        TRACE_LOCK(lock, devices_mutex_);
+        auto now = std::chrono::steady_clock::now();
+        for (const DeviceInfo& info : cached) {
+            struct in_addr addr;
+            if (inet_pton(AF_INET, info.ip.c_str(), &addr) != 1 || devices_.contains(addr.s_addr)) continue;
+            DeviceRecord rec;
+            rec.info = info;
+            rec.info.verified = false;
+            rec.info.lastSeen = now;
+            rec.expiry_gen = ++next_expiry_gen_;
+            expiry_heap_.push({now + std::chrono::milliseconds(expiry_ms_.load()), addr.s_addr, rec.expiry_gen});
+            emit_locked(DeviceEventType::Added, rec.info);
+            devices_.insert(addr.s_addr, std::move(rec));
+            ++added;
         }
+        // readers get the list now, not after the publish interval
+        if (added) publish_locked(now);
+        arm_reaper_locked();
+    }
+    dispatch_events();
+    return added;
+}
+
+std::shared_ptr<DeviceSubscription> SubnetListener::subscribe(std::function<void()> notify) {
+    auto sub = std::make_shared<DeviceSubscription>(std::move(notify));
+    std::lock_guard<std::mutex> dlock(dispatch_mutex_);
+    subscribers_.push_back(sub);
+    has_subscribers_.store(true);
+    return sub;
+}
+
+DeviceSubscription::DeviceSubscription(std::function<void()> notify)
+    : notify_(std::move(notify)), efd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (efd_ < 0) perror("eventfd");
+}
 
-        ::close(client);
+DeviceSubscription::~DeviceSubscription() {
+    if (efd_ >= 0) ::close(efd_);
+}
+
+void DeviceSubscription::push(const DeviceEvent& e) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        was_empty = pending_.empty();
+        auto it = pending_.find(e.info.ip);
+        if (it == pending_.end()) {
+            pending_.emplace(e.info.ip, e);
+            order_.push_back(e.info.ip);
+        } else {
+            DeviceEventType prev = it->second.type;
+            bool gone = e.type == DeviceEventType::Expired || e.type == DeviceEventType::ShutDown;
+            bool was_gone = prev == DeviceEventType::Expired || prev == DeviceEventType::ShutDown;
+            if (prev == DeviceEventType::Added && gone) {
+                // came and went between drains: the consumer never needs to know
+                pending_.erase(it);
+            } else if (prev == DeviceEventType::Added) {
+                it->second.info = e.info;
+            } else if (was_gone && e.type == DeviceEventType::Added) {
+                // the consumer still has the old entry
+                it->second = {DeviceEventType::Updated, e.info};
+            } else {
+                it->second = e;
+            }
+        }
+        if (!was_empty || pending_.empty()) return;
+    }
+    if (efd_ >= 0) {
+        uint64_t one = 1;
+        if (write(efd_, &one, sizeof(one)) < 0) perror("eventfd write");
+    }
+    if (notify_) notify_();
+}
+
+std::vector<DeviceEvent> DeviceSubscription::drain() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (efd_ >= 0) {
+        uint64_t v;
+        if (read(efd_, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("eventfd read");
+    }
+    std::vector<DeviceEvent> out;
+    out.reserve(pending_.size());
+    for (const auto& ip : order_) {
+        auto it = pending_.find(ip);
+        if (it == pending_.end()) continue; // coalesced away, or already emitted
+        out.push_back(std::move(it->second));
+        pending_.erase(it);
     }
+    order_.clear();
+    pending_.clear();
+    return out;
 }
@@ -8,13 +8,104 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <queue>
+#include <vector>
+#include <chrono>
+#include <functional>
 #include <netinet/in.h>
+#include "EventLoop.hpp"
+#include "LinkProber.hpp"
+#include "FlatAddrMap.hpp"
 
 struct DeviceInfo {
     std::string ip;
     std::string hostname;
     uint8_t lastMessage;
     std::chrono::steady_clock::time_point lastSeen;
+    // interface the last beacon arrived on, so transfers can be routed through it
+    unsigned int ifindex = 0;
+    std::string iface;
+    // advertised by binary beacons; proto_version 0 means a legacy peer that advertises
+    // nothing (assume the default ports)
+    uint8_t proto_version = 0;
+    uint16_t data_port = 0;
+    uint16_t control_port = 0;
+    uint16_t active_transfers = 0;
+    uint32_t free_disk_mb = 0;
+    uint32_t bandwidth_kbps = 0;
+    // MessageCodec::BEACON_FLAG_* capabilities
+    uint8_t flags = 0;
+    // version of the peer's shared-name sketch (0 = none); see LanSearch
+    uint32_t sketch_version = 0;
+    // measured quality of the path to the peer
+    PathEstimate path;
+    // false for an entry loaded from the device cache (see preload) until a beacon or a
+    // probe answer confirms the peer is still there
+    bool verified = true;
+
+    uint16_t data_port_or_default() const { return data_port ? data_port : 40001; }
+    uint16_t control_port_or_default() const { return control_port ? control_port : 40003; }
+};
+
+// Ordering for choosing a transfer target: fewest active transfers first, then most
+// spare bandwidth, then most free disk. Legacy peers advertise nothing and come last.
+inline bool less_loaded(const DeviceInfo& a, const DeviceInfo& b) {
+    if ((a.proto_version == 0) != (b.proto_version == 0)) return a.proto_version != 0;
+    if (a.active_transfers != b.active_transfers) return a.active_transfers < b.active_transfers;
+    if (a.bandwidth_kbps != b.bandwidth_kbps) return a.bandwidth_kbps > b.bandwidth_kbps;
+    if (a.free_disk_mb != b.free_disk_mb) return a.free_disk_mb > b.free_disk_mb;
+    return a.ip < b.ip;
+}
+
+using DeviceMap = std::unordered_map<std::string, DeviceInfo>;
+
+enum class DeviceEventType {
+    Added,
+    // hostname, status, ports, interface or load changed (not plain lastSeen refreshes)
+    Updated,
+    // not heard from within the expiry window; removed from the registry
+    Expired,
+    // announced it is leaving (shutdown beacon or TCP notice); removed from the registry
+    ShutDown
+};
+
+struct DeviceEvent {
+    DeviceEventType type;
+    DeviceInfo info;
+};
+
+// A consumer's queue of registry changes. Events for the same device are coalesced
+// until drained (e.g. Added followed by Updated drains as a single Added with the latest
+// info), so a slow consumer sees at most one event per device. The eventfd is readable
+// while events are pending; the optional notify callback runs on the listener's event loop
+// when the queue becomes non-empty and must not block.
+class DeviceSubscription {
+public:
+    explicit DeviceSubscription(std::function<void()> notify = nullptr);
+    ~DeviceSubscription();
+
+    int fd() const { return efd_; }
+    std::vector<DeviceEvent> drain();
+    void push(const DeviceEvent& e);
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, DeviceEvent> pending_;
+    std::vector<std::string> order_;
+    std::function<void()> notify_;
+    int efd_;
+};
+
+struct ListenerStats {
+    // datagrams read from the socket
+    uint64_t received;
+    // datagrams handed to the registry
+    uint64_t ingested;
+    // datagrams the kernel dropped because the receive queue was full (SO_RXQ_OVFL), plus
+    // those the receive thread dropped because the ingest threads were too far behind
+    uint64_t dropped;
 };
 
 class SubnetListener {
@@ -22,31 +113,153 @@ public:
     explicit SubnetListener(uint16_t port = 40000);
     ~SubnetListener();
 
+    // sockets, expiry and the shutdown server run on `loop`; call before start(). Without
+    // one the listener runs a private loop thread.
+    void set_event_loop(EventLoop* loop);
+    // reverse DNS lookups for legacy beacons without a hostname go here instead of
+    // blocking the loop. Optional; call before start().
+    void set_worker_pool(WorkerPool* pool);
+
     bool start();
     void stop();
 
-    std::unordered_map<std::string, DeviceInfo> get_devices();
+    // Immutable view of the device registry. Lock-free for readers; a new snapshot is
+    // published only when a device appears, changes or expires, so lastSeen inside a
+    // snapshot may lag behind the most recent beacon.
+    std::shared_ptr<const DeviceMap> snapshot() const;
+    // copy of the current snapshot (kept for callers that want to own the map)
+    DeviceMap get_devices();
+    // snapshot devices ordered by less_loaded(), best transfer target first
+    std::vector<DeviceInfo> devices_by_load() const;
     // set device expiry in milliseconds (devices not seen within this window are removed)
     void set_expiry_ms(unsigned int ms);
+    // also receive beacons sent to this IPv4 multicast group (broadcasts are always
+    // received). Call before start().
+    bool set_multicast_group(const std::string& group);
+    // join the group on interfaces that appeared since start()
+    void refresh_multicast_memberships();
+    // number of ingest threads. The socket is always read on the shared loop; with more
+    // than one, each recvmmsg batch is split by sender and handed to ingest loop threads of
+    // their own, so a device's beacons stay in order. Must be called before start().
+    void set_rx_threads(unsigned int n);
+    ListenerStats stats() const;
+    // called for every ingested beacon with the sender address and whether it added or
+    // changed a device (used to drive the broadcaster's Trickle schedule). Set before start().
+    void set_beacon_observer(std::function<void(in_addr_t addr, bool changed)> observer);
+    // push-based alternative to polling snapshot(); drop the returned pointer to unsubscribe
+    std::shared_ptr<DeviceSubscription> subscribe(std::function<void()> notify = nullptr);
+    // fold a LinkProber result into the device's PathEstimate (publishes an Updated event).
+    // Beacon-derived loss and jitter are updated on every beacon but only reach snapshots
+    // with the next publish.
+    void record_probe(const ProbeResult& result);
+    // seed the registry with devices from a previous run (DeviceCache::load), marked
+    // unverified: each is listed at once, confirmed by its next beacon or probe answer, and
+    // expires like any device if neither comes within the expiry window. Addresses already
+    // known are skipped. Returns how many were added.
+    size_t preload(const std::vector<DeviceInfo>& cached);
+    // run one datagram through the registry as if it had arrived on the socket (used by
+    // bench/listener_bench to time the ingest path alone); works without start()
+    void ingest(const struct sockaddr_in& sender, unsigned int ifindex, const uint8_t* data, size_t len);
 
 private:
+    struct DeviceRecord {
+        DeviceInfo info;
+        // generation of the live expiry heap entry for this device
+        uint64_t expiry_gen;
+        // last beacon timing seen, for passive loss and jitter
+        bool have_timing = false;
+        uint32_t last_seq = 0;
+        int32_t last_transit_ms = 0;
+    };
+
+    struct ExpiryEntry {
+        std::chrono::steady_clock::time_point due;
+        in_addr_t addr;
+        uint64_t gen;
+        bool operator>(const ExpiryEntry& o) const { return due > o.due; }
+    };
+
+    // datagrams copied out of one recvmmsg batch for one ingest thread
+    struct IngestBatch {
+        struct Item {
+            struct sockaddr_in sender;
+            unsigned int ifindex;
+            uint32_t offset;
+            uint32_t len;
+        };
+        std::vector<Item> items;
+        std::vector<uint8_t> data;
+    };
+
     uint16_t port_;
-    int sockfd_;
+    unsigned int rx_threads_;
+    // INADDR_ANY when multicast discovery is off
+    in_addr_t multicast_group_;
+    int rx_fd_;
+    std::vector<uint8_t> rx_buffers_;
+    std::vector<char> rx_control_;
+    std::atomic<uint64_t> received_;
+    std::atomic<uint64_t> ingested_;
+    // last cumulative SO_RXQ_OVFL value reported by the kernel
+    std::atomic<uint32_t> kernel_drops_;
+    std::atomic<uint64_t> backlog_drops_;
+    // empty with one ingest thread: the loop that reads the socket ingests inline
+    std::vector<std::unique_ptr<EventLoop>> ingest_loops_;
+    // datagrams posted to ingest_loops_ and not yet ingested
+    std::atomic<size_t> ingest_backlog_;
     std::atomic<bool> running_;
-    std::thread worker_;
-    std::thread reaper_worker_;
-    // TCP shutdown server
-    std::thread shutdown_worker_;
+    EventLoop* loop_;
+    std::unique_ptr<EventLoop> own_loop_;
+    WorkerPool* pool_;
+    // lookups submitted to pool_ that stop() has to wait for
+    std::mutex resolve_mutex_;
+    std::condition_variable resolve_cv_;
+    unsigned int resolving_;
+    // TCP shutdown server; clients are read on the loop and dropped after an idle timeout
     int shutdown_sockfd_;
     uint16_t shutdown_port_;
+    std::unordered_map<int, EventLoop::TimerId> shutdown_clients_;
+    // writer-side registry keyed by sin_addr.s_addr; readers never touch it directly
     std::mutex devices_mutex_;
-    std::unordered_map<std::string, DeviceInfo> devices_;
-    unsigned int expiry_ms_;
-    unsigned int reaper_interval_ms_;
+    FlatAddrMap<DeviceRecord> devices_;
+    // min-heap of expiry deadlines, one live entry per device
+    std::priority_queue<ExpiryEntry, std::vector<ExpiryEntry>, std::greater<ExpiryEntry>> expiry_heap_;
+    uint64_t next_expiry_gen_;
+    // loop timer for the next expiry or deferred publish, whichever comes first
+    EventLoop::TimerId reap_timer_;
+    std::chrono::steady_clock::time_point reap_due_;
+    std::atomic<unsigned int> expiry_ms_;
+    // snapshot published to readers via atomic shared_ptr swap
+    std::shared_ptr<const DeviceMap> snapshot_;
+    bool dirty_;
+    std::chrono::steady_clock::time_point last_publish_;
+    unsigned int publish_interval_ms_;
+    std::function<void(in_addr_t, bool)> beacon_observer_;
+    // events queued under devices_mutex_, delivered by dispatch_events() outside it;
+    // dispatch_mutex_ keeps deliveries from different threads in order
+    std::vector<DeviceEvent> pending_events_;
+    std::mutex dispatch_mutex_;
+    std::vector<std::weak_ptr<DeviceSubscription>> subscribers_;
+    std::atomic<bool> has_subscribers_;
 
-    void shutdown_server_loop();
+    bool open_shutdown_server();
+    void on_shutdown_accept();
+    void on_shutdown_client(int fd);
+    void close_shutdown_client(int fd);
 
-    void listen_loop();
+    bool open_socket();
+    void join_multicast(int fd);
+    void drain_socket();
+    void ingest_batch(const IngestBatch& batch);
+    void handle_beacon(const struct sockaddr_in& sender, unsigned int ifindex, const uint8_t* data, size_t len);
+    void resolve_hostname(const struct sockaddr_in& sender);
+    void on_reap_timer();
+    // must be called with devices_mutex_ held
+    void publish_locked(std::chrono::steady_clock::time_point now);
+    void mark_dirty_locked(std::chrono::steady_clock::time_point now);
+    void arm_reaper_locked();
+    void emit_locked(DeviceEventType type, const DeviceInfo& info);
+    void dispatch_events();
 };
 
 #endif // SUBNET_LISTENER_HPP
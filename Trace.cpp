@@ -0,0 +1,146 @@
+#include "Trace.hpp"
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdio>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace Trace {
+
+std::atomic<bool> g_enabled(false);
+
+// rings of exited threads are kept for the next dump, and reused past this many
+static constexpr size_t kMaxRings = 64;
+
+struct Ring {
+    std::unique_ptr<Event[]> events;
+    // events ever written; slot = index % kRingEvents. Only the owning thread stores it.
+    std::atomic<uint64_t> head{0};
+    pid_t tid = 0;
+    std::string thread_name;
+    std::atomic<bool> exited{false};
+};
+
+static std::mutex g_rings_mutex;
+static std::vector<std::shared_ptr<Ring>> g_rings;
+
+// marks the thread's ring reusable when the thread exits
+struct RingOwner {
+    std::shared_ptr<Ring> ring;
+    ~RingOwner() {
+        if (ring) ring->exited.store(true);
+    }
+};
+
+static thread_local RingOwner t_owner;
+
+static std::shared_ptr<Ring> acquire_ring() {
+    std::lock_guard<std::mutex> lock(g_rings_mutex);
+    std::shared_ptr<Ring> ring;
+    if (g_rings.size() >= kMaxRings) {
+        for (auto& r : g_rings) {
+            if (r->exited.load()) {
+                ring = r;
+                break;
+            }
+        }
+    }
+    if (!ring) {
+        ring = std::make_shared<Ring>();
+        ring->events.reset(new Event[kRingEvents]);
+        g_rings.push_back(ring);
+    }
+    ring->head.store(0);
+    ring->exited.store(false);
+    ring->tid = static_cast<pid_t>(syscall(SYS_gettid));
+    char name[32] = "";
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    ring->thread_name = name;
+    return ring;
+}
+
+void set_enabled(bool on) {
+    g_enabled.store(on);
+}
+
+void record(const char* category, const char* name, uint64_t start_ns, uint64_t duration_ns, uint64_t arg) {
+    Ring* ring = t_owner.ring.get();
+    if (!ring) {
+        t_owner.ring = acquire_ring();
+        ring = t_owner.ring.get();
+    }
+    uint64_t h = ring->head.load(std::memory_order_relaxed);
+    ring->events[h % kRingEvents] = Event{category, name, start_ns, duration_ns, arg};
+    ring->head.store(h + 1, std::memory_order_release);
+}
+
+static std::string json_escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20) out += c;
+    }
+    return out;
+}
+
+bool dump_chrome_json(const std::string& path) {
+    std::string tmp = path + ".tmp";
+    FILE* f = std::fopen(tmp.c_str(), "w");
+    if (!f) {
+        perror("Trace: open dump file");
+        return false;
+    }
+    const int pid = getpid();
+    std::fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    auto sep = [&]() {
+        if (!first) std::fputs(",\n", f);
+        first = false;
+    };
+    std::vector<Event> copy;
+    std::lock_guard<std::mutex> lock(g_rings_mutex);
+    for (const auto& ring : g_rings) {
+        sep();
+        std::fprintf(f, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid,
+                     ring->tid, json_escape(ring->thread_name).c_str());
+
+        // copy, then keep only what the owner cannot have overwritten meanwhile: it may be
+        // writing slot `after` already, which held event after - kRingEvents
+        uint64_t before = ring->head.load(std::memory_order_acquire);
+        uint64_t from = before > kRingEvents ? before - kRingEvents : 0;
+        copy.clear();
+        for (uint64_t i = from; i < before; ++i) copy.push_back(ring->events[i % kRingEvents]);
+        uint64_t after = ring->head.load(std::memory_order_acquire);
+        uint64_t safe_from = after >= kRingEvents ? after - kRingEvents + 1 : 0;
+
+        for (uint64_t i = std::max(from, safe_from); i < before; ++i) {
+            const Event& e = copy[i - from];
+            sep();
+            if (e.duration_ns) {
+                std::fprintf(f,
+                             "{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                             "\"args\":{\"arg\":%llu}}",
+                             e.category, e.name, pid, ring->tid, e.start_ns / 1000.0, e.duration_ns / 1000.0,
+                             static_cast<unsigned long long>(e.arg));
+            } else {
+                std::fprintf(f,
+                             "{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                             "\"args\":{\"arg\":%llu}}",
+                             e.category, e.name, pid, ring->tid, e.start_ns / 1000.0,
+                             static_cast<unsigned long long>(e.arg));
+            }
+        }
+    }
+    std::fprintf(f, "\n]}\n");
+    bool ok = std::fclose(f) == 0;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        perror("Trace: write dump file");
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace Trace
@@ -0,0 +1,102 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <time.h>
+
+// Spans and instant events recorded into per-thread ring buffers and dumped as Chrome
+// trace JSON (chrome://tracing or ui.perfetto.dev), to see where a slow transfer spent
+// its time: socket calls, file writes, lock waits, queueing for a pool thread.
+//
+// Only built with `make TRACE=1` (-DLANSHARE_TRACE); otherwise the TRACE_* macros expand
+// to nothing. When built in, recording still starts switched off and costs one relaxed
+// load until set_enabled(true). Each thread writes only to its own ring, overwriting its
+// oldest events, so recording takes no lock. Names and categories must be string literals.
+namespace Trace {
+
+// events kept per thread
+constexpr size_t kRingEvents = 1 << 16;
+
+struct Event {
+    const char* category;
+    const char* name;
+    uint64_t start_ns;
+    // 0 for an instant event
+    uint64_t duration_ns;
+    uint64_t arg;
+};
+
+extern std::atomic<bool> g_enabled;
+
+inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+void set_enabled(bool on);
+
+inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// appends to the calling thread's ring (allocated on first use)
+void record(const char* category, const char* name, uint64_t start_ns, uint64_t duration_ns, uint64_t arg = 0);
+
+// Writes every thread's ring as a Chrome trace ("traceEvents" with complete and instant
+// events plus thread names). Safe while threads keep recording; events overwritten during
+// the dump are left out.
+bool dump_chrome_json(const std::string& path);
+
+class Scope {
+public:
+    Scope(const char* category, const char* name, uint64_t arg = 0)
+        : category_(category), name_(name), arg_(arg), start_(enabled() ? now_ns() : 0) {}
+    ~Scope() {
+        if (start_) record(category_, name_, start_, now_ns() - start_, arg_);
+    }
+    void set_arg(uint64_t arg) { arg_ = arg; }
+
+private:
+    const char* category_;
+    const char* name_;
+    uint64_t arg_;
+    uint64_t start_;
+};
+
+// Locks `m`, recording a "lock" span named `name` when the lock was contended
+template <typename Mutex>
+std::unique_lock<Mutex> lock(Mutex& m, const char* name) {
+    std::unique_lock<Mutex> l(m, std::try_to_lock);
+    if (l.owns_lock()) return l;
+    uint64_t start = enabled() ? now_ns() : 0;
+    l.lock();
+    if (start) record("lock", name, start, now_ns() - start);
+    return l;
+}
+
+} // namespace Trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef LANSHARE_TRACE
+// span from here to the end of the enclosing block
+#define TRACE_SCOPE(category, name) Trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(category, name)
+// same, with a named Trace::Scope so the argument can be set later (e.g. bytes moved)
+#define TRACE_SCOPE_VAR(var, category, name) Trace::Scope var(category, name)
+#define TRACE_SET_ARG(var, arg) (var).set_arg(arg)
+#define TRACE_INSTANT(category, name, arg) \
+    do { if (Trace::enabled()) Trace::record(category, name, Trace::now_ns(), 0, arg); } while (0)
+// std::unique_lock on `m` that records contended waits
+#define TRACE_LOCK(var, m) auto var = Trace::lock(m, #m)
+#else
+#define TRACE_SCOPE(category, name) do {} while (0)
+#define TRACE_SCOPE_VAR(var, category, name) do {} while (0)
+#define TRACE_SET_ARG(var, arg) do {} while (0)
+#define TRACE_INSTANT(category, name, arg) do {} while (0)
+#define TRACE_LOCK(var, m) std::unique_lock<std::decay_t<decltype(m)>> var(m)
+#endif
+
+#endif // TRACE_HPP
@@ -2,10 +2,73 @@
 #include <ncurses.h>
 #include <chrono>
 #include <thread>
+#include <mutex>
 #include <iostream>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+struct UI::Notice {
+    std::mutex mutex;
+    std::string text;
+    int efd;
+
+    Notice() : efd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (efd < 0) perror("eventfd");
+    }
+    ~Notice() {
+        if (efd >= 0) ::close(efd);
+    }
+    void wake() {
+        uint64_t one = 1;
+        if (efd >= 0 && write(efd, &one, sizeof(one)) < 0) perror("eventfd write");
+    }
+    void clear_wake() {
+        uint64_t v;
+        if (efd >= 0 && read(efd, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("eventfd read");
+    }
+    void set(const std::string& s) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            text = s;
+        }
+        wake();
+    }
+    std::string get() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return text;
+    }
+};
+
+static std::string format(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static std::string format(const char* fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+static std::string human_bytes(double bytes) {
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    int u = 0;
+    while (bytes >= 1024 && u < 4) {
+        bytes /= 1024;
+        ++u;
+    }
+    return format(u ? "%.1f %s" : "%.0f %s", bytes, units[u]);
+}
 
 UI::UI(SubnetListener& listener, FileTransfer& ft, SubnetBroadcaster& bc)
-    : listener_(listener), ft_(ft), bc_(bc), running_(false) {}
+    : listener_(listener), ft_(ft), bc_(bc), running_(false), notice_(std::make_shared<Notice>()),
+      prompt_(Prompt::None), transfers_running_(false) {}
 
 UI::~UI() {
     endwin();
@@ -17,85 +80,237 @@ bool UI::init() {
     noecho();
     keypad(stdscr, TRUE);
     nodelay(stdscr, TRUE); // non-blocking getch
+    set_escdelay(25);
     curs_set(0);
     return true;
 }
 
-void UI::draw() {
-    clear();
-    mvprintw(0, 0, "LANShare - devices (press q to quit, s to send file)");
+void UI::put_line(int row, const std::string& text) {
+    if (shown_[row] == text) return;
+    move(row, 0);
+    addnstr(text.c_str(), COLS);
+    clrtoeol();
+    shown_[row] = text;
+}
 
-    auto devices = listener_.get_devices();
-    int row = 2;
-    mvprintw(1, 0, "%-16s  %-20s  %s", "IP", "Hostname", "Status");
-    for (const auto& [ip, info] : devices) {
-        mvprintw(row++, 0, "%-16s  %-20s  %s", ip.c_str(), info.hostname.c_str(), MessageCodec::name_for(info.lastMessage).c_str());
+std::string UI::transfer_line(const TransferProgress& t, std::chrono::steady_clock::time_point now) {
+    uint64_t done = t.done_bytes.load(std::memory_order_relaxed);
+    int state = t.state.load();
+    int percent = t.total_bytes ? static_cast<int>(done * 100 / t.total_bytes) : (state == 1 ? 100 : 0);
+    char bar[21];
+    int filled = percent / 5;
+    for (int i = 0; i < 20; ++i) bar[i] = i < filled ? '#' : '.';
+    bar[20] = '\0';
+    std::string head = format("%-7s %-16s %-24.24s [%s] %3d%%", t.outgoing ? "send" : "receive", t.peer_ip.c_str(),
+                              t.filename.c_str(), bar, percent);
+    if (state == 1) return head + "  done";
+    if (state == -1) return head + "  failed";
+
+    // rate over the last second or so, smoothed
+    auto it = rates_.find(&t);
+    if (it == rates_.end()) {
+        rates_[&t] = RateSample{done, now, 0};
+        return head;
+    }
+    RateSample& s = it->second;
+    double dt = std::chrono::duration<double>(now - s.at).count();
+    if (dt >= 0.5) {
+        double inst = (done - s.bytes) / dt;
+        s.bytes_per_s = s.bytes_per_s > 0 ? 0.5 * s.bytes_per_s + 0.5 * inst : inst;
+        s.bytes = done;
+        s.at = now;
     }
+    if (s.bytes_per_s <= 0) return head;
+    // a stream's length is not known up front: no ETA
+    if (t.total_bytes == 0) {
+        return head + format("  %s  %s/s", human_bytes(done).c_str(), human_bytes(s.bytes_per_s).c_str());
+    }
+    uint64_t eta = static_cast<uint64_t>((t.total_bytes - done) / s.bytes_per_s);
+    return head + format("  %s/s  ETA %llu:%02llu", human_bytes(s.bytes_per_s).c_str(),
+                         static_cast<unsigned long long>(eta / 60), static_cast<unsigned long long>(eta % 60));
+}
+
+void UI::draw() {
+    auto now = std::chrono::steady_clock::now();
+    if (shown_.size() != static_cast<size_t>(LINES)) shown_.assign(LINES, std::string());
+    std::vector<std::string> lines;
+    // bottom three rows: blank, status, command help or the open prompt
+    size_t body = LINES > 3 ? LINES - 3 : 0;
 
-    mvprintw(row + 1, 0, "Pending file requests:");
     auto pending = ft_.get_pending_requests();
-    int prow = row + 2;
-    for (size_t i = 0; i < pending.size(); ++i) {
+    auto transfers = ft_.get_transfers();
+    transfers_running_ = false;
+    for (const auto& t : transfers) transfers_running_ = transfers_running_ || t->state.load() == 0;
+    // forget rate samples of transfers that dropped out of the list
+    for (auto it = rates_.begin(); it != rates_.end();) {
+        bool live = false;
+        for (const auto& t : transfers) live = live || t.get() == it->first;
+        if (live) ++it;
+        else it = rates_.erase(it);
+    }
+
+    // requests and transfers get up to a third of the screen each (newest kept), devices
+    // the rest
+    size_t cap = std::max<size_t>(body / 3, 2) - 1;
+    size_t pending_rows = std::min(pending.size(), cap);
+    size_t transfer_rows = std::min(transfers.size(), cap);
+    size_t fixed = 2 + 2 + pending_rows + 2 + transfer_rows;
+    size_t device_rows = body > fixed ? body - fixed : 0;
+
+    lines.push_back("LANShare - devices (press q to quit, s to send file)");
+    // least-loaded peers first: they are the best transfer targets
+    auto devices = listener_.devices_by_load();
+    lines.push_back(format("%-16s  %-20s  %-12s  %-28s  %s", "IP", "Hostname", "Status", "Load", "Link"));
+    for (size_t i = 0; i < devices.size() && i < device_rows; ++i) {
+        const auto& info = devices[i];
+        if (i + 1 == device_rows && devices.size() > device_rows) {
+            lines.push_back(format("  ... %zu more", devices.size() - i));
+            break;
+        }
+        char load[48] = "-";
+        if (info.proto_version > 0) {
+            snprintf(load, sizeof(load), "%u xfer, %u MB free", info.active_transfers, info.free_disk_mb);
+        }
+        // listed from the device cache and not heard from yet
+        std::string status = info.verified ? MessageCodec::name_for(info.lastMessage) : "unverified";
+        lines.push_back(format("%-16s  %-20.20s  %-12s  %-28s  %s", info.ip.c_str(), info.hostname.c_str(),
+                               status.c_str(), load, describe_path(info.path).c_str()));
+    }
+
+    lines.push_back("");
+    lines.push_back("Pending file requests:");
+    for (size_t i = pending.size() - pending_rows; i < pending.size(); ++i) {
         auto& p = pending[i];
         const char* state = (p->decision.load() == -1) ? "awaiting" : (p->decision.load() == 1 ? "accepted" : "rejected");
-        mvprintw(prow + i, 0, "%2zu) %s  %s  [%s]", i + 1, p->peer_ip.c_str(), p->filename.c_str(), state);
+        lines.push_back(format("%2llu) %s  %s  [%s]", static_cast<unsigned long long>(p->id), p->peer_ip.c_str(),
+                               p->filename.c_str(), state));
+    }
+
+    lines.push_back("");
+    lines.push_back("Transfers:");
+    for (size_t i = transfers.size() - transfer_rows; i < transfers.size(); ++i) {
+        lines.push_back(transfer_line(*transfers[i], now));
     }
 
-    mvprintw(LINES - 2, 0, "Commands: q=quit, s=send file, a=accept first, r=reject first, P=operate on index (+n/-n), x=reject all");
+    lines.resize(LINES);
+    if (LINES >= 2) lines[LINES - 2] = notice_->get();
+    std::string prompt_text;
+    switch (prompt_) {
+        case Prompt::TargetIp: prompt_text = "Enter target IP (empty = least loaded peer): "; break;
+        case Prompt::FilePath: prompt_text = "Enter path to file: "; break;
+        case Prompt::RequestIndex: prompt_text = "Enter request number (prefix + to accept, - to reject), e.g. +12 or -3: "; break;
+        case Prompt::None: break;
+    }
+    if (LINES >= 1) {
+        lines[LINES - 1] = prompt_ == Prompt::None
+            ? "Commands: q=quit, s=send file, a=accept first, r=reject first, P=decide by number (+n/-n), x=reject all"
+            : prompt_text + input_ + "  (Esc cancels)";
+    }
+
+    for (int r = 0; r < LINES; ++r) put_line(r, lines[r]);
+    if (prompt_ != Prompt::None) {
+        curs_set(1);
+        move(LINES - 1, std::min<int>(prompt_text.size() + input_.size(), COLS - 1));
+    } else {
+        curs_set(0);
+    }
     refresh();
 }
 
-void UI::process_pending_requests() {
-    auto pending = ft_.get_pending_requests();
-    for (size_t i = 0; i < pending.size(); ++i) {
-        auto& p = pending[i];
-        // if decision already set, skip
-        if (p->decision.load() != -1) continue;
-        // no automatic action here; UI will let user press numeric keys
+std::string UI::least_loaded_peer() {
+    auto ifaces = bc_.interfaces();
+    for (const auto& info : listener_.devices_by_load()) {
+        in_addr_t addr = inet_addr(info.ip.c_str());
+        bool self = false;
+        for (const auto& itf : *ifaces) self = self || itf.addr == addr;
+        if (!self && info.verified && info.lastMessage == MessageCodec::MSG_ALIVE) return info.ip;
+    }
+    return std::string();
+}
+
+void UI::start_send(const std::string& ip, const std::string& path) {
+    // use the ports the peer advertises and route through the interface it was
+    // discovered on; unknown or legacy peers get the default ports
+    DeviceInfo target;
+    target.ip = ip;
+    auto devices = listener_.snapshot();
+    auto it = devices->find(ip);
+    if (it != devices->end()) target = it->second;
+    notice_->set(format("Requesting transfer to %s (control port %u)...", ip.c_str(), target.control_port_or_default()));
+    // detached like the Qt UI's sends: quitting must not wait out a 30 s request. The
+    // thread only touches the shared Notice and ft_, which outlives the UI.
+    std::shared_ptr<Notice> notice = notice_;
+    FileTransfer& ft = ft_;
+    std::thread([notice, &ft, target, path]() {
+        if (!ft.request_send(target.ip, target.control_port_or_default(), path, 30000, target.iface)) {
+            notice->set(format("Request to %s denied or timed out.", target.ip.c_str()));
+            return;
+        }
+        notice->set(format("Request accepted, sending to %s...", target.ip.c_str()));
+        bool sent = ft.send_file(target.ip, target.data_port_or_default(), path, target.iface, target.path,
+                                 target.flags & MessageCodec::BEACON_FLAG_SPARSE);
+        notice->set(format(sent ? "Sent %s to %s." : "Sending %s to %s failed.", path.c_str(), target.ip.c_str()));
+    }).detach();
+}
+
+void UI::submit_prompt() {
+    Prompt p = prompt_;
+    std::string s = input_;
+    prompt_ = Prompt::None;
+    input_.clear();
+    if (p == Prompt::TargetIp) {
+        send_ip_ = s.empty() ? least_loaded_peer() : s;
+        if (send_ip_.empty()) {
+            notice_->set("No peer to send to.");
+            return;
+        }
+        prompt_ = Prompt::FilePath;
+    } else if (p == Prompt::FilePath) {
+        if (!s.empty()) start_send(send_ip_, s);
+    } else if (p == Prompt::RequestIndex && !s.empty()) {
+        bool accept = s[0] == '+';
+        size_t pos = (s[0] == '+' || s[0] == '-') ? 1 : 0;
+        char* end = nullptr;
+        unsigned long long id = strtoull(s.c_str() + pos, &end, 10);
+        if (end == s.c_str() + pos || *end != '\0') {
+            notice_->set("Not a request number: " + s);
+            return;
+        }
+        if (!ft_.decide_request_by_id(id, accept)) notice_->set("No request " + std::to_string(id));
     }
 }
 
-void UI::handle_input() {
-    int ch = getch();
-    if (ch == ERR) return;
+void UI::prompt_key(int ch) {
+    if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) {
+        submit_prompt();
+    } else if (ch == 27) {
+        prompt_ = Prompt::None;
+        input_.clear();
+    } else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+        if (!input_.empty()) input_.pop_back();
+    } else if (ch >= 32 && ch < 127 && input_.size() < 255) {
+        input_.push_back(static_cast<char>(ch));
+    }
+}
+
+bool UI::handle_key(int ch) {
+    if (ch == KEY_RESIZE) {
+        // repaint everything at the new size
+        shown_.clear();
+        clear();
+        return true;
+    }
+    if (prompt_ != Prompt::None) {
+        prompt_key(ch);
+        return true;
+    }
     if (ch == 'q' || ch == 'Q') {
         running_ = false;
-        return;
+        return true;
     }
     if (ch == 's' || ch == 'S') {
-        // prompt for target and path in blocking mode: temporarily enable echo and blocking
-        nodelay(stdscr, FALSE);
-        echo();
-        curs_set(1);
-        char ipbuf[64];
-        char pathbuf[256];
-        mvprintw(LINES - 4, 0, "Enter target IP: ");
-        getnstr(ipbuf, sizeof(ipbuf) - 1);
-        mvprintw(LINES - 3, 0, "Enter path to file: ");
-        getnstr(pathbuf, sizeof(pathbuf) - 1);
-        noecho();
-        curs_set(0);
-        nodelay(stdscr, TRUE);
-        std::string ip = ipbuf;
-        std::string path = pathbuf;
-        if (!ip.empty() && !path.empty()) {
-            uint16_t ctrl = ft_.control_port();
-            mvprintw(LINES - 5, 0, "Requesting transfer to %s (control port %u)...", ip.c_str(), ctrl);
-            refresh();
-            bool ok = ft_.request_send(ip, ctrl, path, 30000);
-            if (!ok) {
-                mvprintw(LINES - 5, 0, "Request denied or timed out.                         ");
-            } else {
-                mvprintw(LINES - 5, 0, "Request accepted — sending...                       ");
-                refresh();
-                bool sent = ft_.send_file(ip, ft_.listen_port(), path);
-                if (sent) mvprintw(LINES - 5, 0, "Send complete.                                     ");
-                else mvprintw(LINES - 5, 0, "Send failed.                                       ");
-            }
-            refresh();
-            std::this_thread::sleep_for(std::chrono::seconds(2));
-        }
-        return;
+        prompt_ = Prompt::TargetIp;
+        return true;
     }
 
     // accept first undecided pending
@@ -103,11 +318,11 @@ void UI::handle_input() {
         auto pending = ft_.get_pending_requests();
         for (size_t i = 0; i < pending.size(); ++i) {
             if (pending[i]->decision.load() == -1) {
-                ft_.decide_request_by_index(i, true);
+                ft_.decide_request_by_id(pending[i]->id, true);
                 break;
             }
         }
-        return;
+        return true;
     }
 
     // reject first undecided pending
@@ -115,52 +330,69 @@ void UI::handle_input() {
         auto pending = ft_.get_pending_requests();
         for (size_t i = 0; i < pending.size(); ++i) {
             if (pending[i]->decision.load() == -1) {
-                ft_.decide_request_by_index(i, false);
+                ft_.decide_request_by_id(pending[i]->id, false);
                 break;
             }
         }
-        return;
+        return true;
     }
 
-    // uppercase 'P' opens prompt to accept/reject a specific index (multi-digit)
+    // uppercase 'P' opens prompt to accept/reject a request by its number (multi-digit)
     if (ch == 'P') {
-        std::string numbuf;
-        nodelay(stdscr, FALSE);
-        echo();
-        mvprintw(LINES - 4, 0, "Enter index to act on (prefix + to accept, - to reject), e.g. +12 or -3: ");
-        char input[64] = {0};
-        getnstr(input, sizeof(input) - 1);
-        noecho();
-        nodelay(stdscr, TRUE);
-        std::string s = input;
-        if (!s.empty()) {
-            bool accept = s[0] == '+';
-            size_t pos = (s[0] == '+' || s[0] == '-') ? 1 : 0;
-            int idx = std::stoi(s.substr(pos)) - 1;
-            auto pending = ft_.get_pending_requests();
-            if (idx >= 0 && (size_t)idx < pending.size()) {
-                ft_.decide_request_by_index((size_t)idx, accept);
-            }
-        }
-        return;
+        prompt_ = Prompt::RequestIndex;
+        return true;
     }
 
     // reject all pending
     if (ch == 'x' || ch == 'X') {
         auto pending = ft_.get_pending_requests();
         for (size_t i = 0; i < pending.size(); ++i) {
-            if (pending[i]->decision.load() == -1) ft_.decide_request_by_index(i, false);
+            if (pending[i]->decision.load() == -1) ft_.decide_request_by_id(pending[i]->id, false);
         }
-        return;
+        return true;
     }
+    return false;
 }
 
 void UI::run() {
     running_ = true;
+    // device changes, new or decided requests and transfer starts/ends are all pushed;
+    // the only periodic redraw is the once-a-second rate/ETA update while data moves
+    auto devices = listener_.subscribe();
+    std::shared_ptr<Notice> notice = notice_;
+    ft_.set_change_observer([notice]() { notice->wake(); });
+    auto last_draw = std::chrono::steady_clock::time_point();
+    bool dirty = true;
     while (running_) {
-        draw();
-        process_pending_requests();
-        handle_input();
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto now = std::chrono::steady_clock::now();
+        if (transfers_running_ && now - last_draw >= std::chrono::seconds(1)) dirty = true;
+        if (dirty) {
+            draw();
+            last_draw = now;
+            dirty = false;
+        }
+        struct pollfd pfd[3];
+        pfd[0].fd = STDIN_FILENO;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = devices->fd();
+        pfd[1].events = POLLIN;
+        pfd[2].fd = notice_->efd;
+        pfd[2].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+        poll(pfd, 3, transfers_running_ ? 1000 : -1);
+        if (pfd[1].revents & POLLIN) {
+            devices->drain();
+            dirty = true;
+        }
+        if (pfd[2].revents & POLLIN) {
+            notice_->clear_wake();
+            dirty = true;
+        }
+        // drain everything curses has buffered, poll() will not report it again
+        int ch;
+        while ((ch = getch()) != ERR) {
+            if (handle_key(ch)) dirty = true;
+        }
     }
+    ft_.set_change_observer(nullptr);
 }
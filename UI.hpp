@@ -4,12 +4,16 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <chrono>
+#include <unordered_map>
 #include "SubnetListener.hpp"
 #include "FileTransfer.hpp"
 #include "SubnetBroadcaster.hpp"
 
-// Minimal ncurses-based UI to display devices and pending requests and allow
-// accepting/rejecting requests and initiating sends.
+// Minimal ncurses-based UI to display devices, pending requests and transfers, accept or
+// reject requests and initiate sends. The screen is redrawn only when something changed
+// (device events, FileTransfer notifications, keys, once a second while a transfer runs)
+// and only rows whose text differs are written, which keeps it cheap over SSH.
 class UI {
 public:
     UI(SubnetListener& listener, FileTransfer& ft, SubnetBroadcaster& bc);
@@ -21,14 +25,40 @@ public:
     void run();
 
 private:
+    // prompts are edited inline, so the screen keeps updating while the user types
+    enum class Prompt { None, TargetIp, FilePath, RequestIndex };
+    // status line and wake-up eventfd, shared with send threads that may outlive the UI
+    struct Notice;
+    struct RateSample {
+        uint64_t bytes;
+        std::chrono::steady_clock::time_point at;
+        double bytes_per_s;
+    };
+
     SubnetListener& listener_;
     FileTransfer& ft_;
     SubnetBroadcaster& bc_;
     bool running_;
+    std::shared_ptr<Notice> notice_;
+    // rows as last written to the terminal
+    std::vector<std::string> shown_;
+    Prompt prompt_;
+    std::string input_;
+    std::string send_ip_;
+    bool transfers_running_;
+    std::unordered_map<const TransferProgress*, RateSample> rates_;
 
     void draw();
-    void handle_input();
-    void process_pending_requests();
+    void put_line(int row, const std::string& text);
+    std::string transfer_line(const TransferProgress& t, std::chrono::steady_clock::time_point now);
+    // returns true if the key was handled (the screen needs a redraw)
+    bool handle_key(int ch);
+    void prompt_key(int ch);
+    void submit_prompt();
+    // request + send on a background thread; progress shows in the transfer panel
+    void start_send(const std::string& ip, const std::string& path);
+    // best transfer target other than ourselves, empty if none
+    std::string least_loaded_peer();
 };
 
 #endif // UI_HPP
@@ -1,41 +1,334 @@
 #include "UIQt.hpp"
 #include <QtWidgets/QApplication>
-#include <QtWidgets/QTableWidgetItem>
 #include <QtWidgets/QInputDialog>
+#include <QtWidgets/QLineEdit>
+#include <QtWidgets/QStyleOption>
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QHeaderView>
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QPainter>
 #include <ifaddrs.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <algorithm>
 #include <set>
+#include <thread>
+
+DeviceTableModel::DeviceTableModel(QObject* parent) : QAbstractTableModel(parent) {}
+
+int DeviceTableModel::rowCount(const QModelIndex& parent) const {
+    return parent.isValid() ? 0 : static_cast<int>(rows_.size());
+}
+
+int DeviceTableModel::columnCount(const QModelIndex& parent) const {
+    return parent.isValid() ? 0 : ColumnCount;
+}
+
+QVariant DeviceTableModel::data(const QModelIndex& index, int role) const {
+    if (role != Qt::DisplayRole || !index.isValid() || index.row() >= static_cast<int>(rows_.size())) return QVariant();
+    const DeviceInfo& info = rows_[index.row()];
+    switch (index.column()) {
+        case ColIp: return QString::fromStdString(info.ip);
+        case ColHostname: return QString::fromStdString(info.hostname);
+        case ColStatus:
+            if (!info.verified) return QString("unverified");
+            return QString::fromStdString(MessageCodec::name_for(info.lastMessage));
+        case ColLoad:
+            if (info.proto_version == 0) return QString("-");
+            return QString("%1 xfer, %2 MB free").arg(info.active_transfers).arg(info.free_disk_mb);
+        case ColLink: return QString::fromStdString(describe_path(info.path));
+    }
+    return QVariant();
+}
+
+QVariant DeviceTableModel::headerData(int section, Qt::Orientation orientation, int role) const {
+    if (role != Qt::DisplayRole || orientation != Qt::Horizontal) return QVariant();
+    static const char* const names[ColumnCount] = {"IP", "Hostname", "Status", "Load", "Link"};
+    return section >= 0 && section < ColumnCount ? QVariant(QString(names[section])) : QVariant();
+}
+
+void DeviceTableModel::reindex(size_t from) {
+    for (size_t i = from; i < rows_.size(); ++i) row_of_[rows_[i].ip] = static_cast<int>(i);
+}
+
+void DeviceTableModel::reset(const DeviceMap& devices, const std::set<std::string>& hidden) {
+    beginResetModel();
+    rows_.clear();
+    row_of_.clear();
+    rows_.reserve(devices.size());
+    for (const auto& [ip, info] : devices) {
+        if (hidden.count(ip)) continue;
+        rows_.push_back(info);
+    }
+    reindex(0);
+    endResetModel();
+}
+
+void DeviceTableModel::apply(const std::vector<DeviceEvent>& events, const std::set<std::string>& hidden) {
+    // updates in place, then removals as contiguous ranges from the bottom up so earlier
+    // rows keep their numbers, then all new devices as one appended block
+    std::vector<int> removed;
+    std::vector<const DeviceInfo*> added;
+    for (const auto& e : events) {
+        auto it = row_of_.find(e.info.ip);
+        bool gone = e.type == DeviceEventType::Expired || e.type == DeviceEventType::ShutDown;
+        if (gone) {
+            if (it != row_of_.end()) removed.push_back(it->second);
+        } else if (it != row_of_.end()) {
+            rows_[it->second] = e.info;
+            emit dataChanged(index(it->second, 0), index(it->second, ColumnCount - 1));
+        } else if (!hidden.count(e.info.ip)) {
+            added.push_back(&e.info);
+        }
+    }
+
+    if (!removed.empty()) {
+        std::sort(removed.begin(), removed.end());
+        for (int r : removed) row_of_.erase(rows_[r].ip);
+        size_t end = removed.size();
+        while (end > 0) {
+            size_t begin = end - 1;
+            while (begin > 0 && removed[begin - 1] == removed[begin] - 1) --begin;
+            int first = removed[begin], last = removed[end - 1];
+            beginRemoveRows(QModelIndex(), first, last);
+            rows_.erase(rows_.begin() + first, rows_.begin() + last + 1);
+            endRemoveRows();
+            end = begin;
+        }
+        reindex(removed.front());
+    }
+
+    if (!added.empty()) {
+        int first = static_cast<int>(rows_.size());
+        beginInsertRows(QModelIndex(), first, first + static_cast<int>(added.size()) - 1);
+        for (const DeviceInfo* info : added) {
+            row_of_[info->ip] = static_cast<int>(rows_.size());
+            rows_.push_back(*info);
+        }
+        endInsertRows();
+    }
+}
+
+bool DeviceSortProxy::lessThan(const QModelIndex& left, const QModelIndex& right) const {
+    auto* model = static_cast<const DeviceTableModel*>(sourceModel());
+    return less_loaded(model->device(left.row()), model->device(right.row()));
+}
+
+RequestTableModel::RequestTableModel(QObject* parent) : QAbstractTableModel(parent) {}
+
+int RequestTableModel::rowCount(const QModelIndex& parent) const {
+    return parent.isValid() ? 0 : static_cast<int>(rows_.size());
+}
+
+int RequestTableModel::columnCount(const QModelIndex& parent) const {
+    return parent.isValid() ? 0 : ColumnCount;
+}
+
+QVariant RequestTableModel::data(const QModelIndex& index, int role) const {
+    if (role != Qt::DisplayRole || !index.isValid() || index.row() >= static_cast<int>(rows_.size())) return QVariant();
+    const PendingRequest& req = *rows_[index.row()];
+    switch (index.column()) {
+        case ColNumber: return static_cast<qulonglong>(req.id);
+        case ColFrom: return QString::fromStdString(req.peer_ip);
+        case ColFile: return QString::fromStdString(req.filename);
+        case ColDecision: {
+            int d = shown_[index.row()];
+            return QString(d == 1 ? "accepted" : d == 0 ? "rejected" : "waiting");
+        }
+    }
+    return QVariant();
+}
+
+QVariant RequestTableModel::headerData(int section, Qt::Orientation orientation, int role) const {
+    if (role != Qt::DisplayRole || orientation != Qt::Horizontal) return QVariant();
+    static const char* const names[ColumnCount] = {"#", "From", "File", "Decision"};
+    return section >= 0 && section < ColumnCount ? QVariant(QString(names[section])) : QVariant();
+}
+
+void RequestTableModel::sync(const std::vector<std::shared_ptr<PendingRequest>>& pending) {
+    size_t common = std::min(rows_.size(), pending.size());
+    bool prefix = pending.size() >= rows_.size() && std::equal(rows_.begin(), rows_.begin() + common, pending.begin());
+    if (!prefix) {
+        // not an append: decided requests were pruned from the front; start over
+        beginResetModel();
+        rows_ = pending;
+        shown_.clear();
+        for (const auto& p : rows_) shown_.push_back(p->decision.load());
+        endResetModel();
+        return;
+    }
+    for (size_t i = 0; i < common; ++i) {
+        int d = rows_[i]->decision.load();
+        if (d == shown_[i]) continue;
+        shown_[i] = d;
+        emit dataChanged(index(static_cast<int>(i), ColDecision), index(static_cast<int>(i), ColDecision));
+    }
+    if (pending.size() > rows_.size()) {
+        beginInsertRows(QModelIndex(), static_cast<int>(rows_.size()), static_cast<int>(pending.size()) - 1);
+        for (size_t i = rows_.size(); i < pending.size(); ++i) {
+            rows_.push_back(pending[i]);
+            shown_.push_back(pending[i]->decision.load());
+        }
+        endInsertRows();
+    }
+}
+
+TransferTableModel::TransferTableModel(QObject* parent) : QAbstractTableModel(parent) {}
+
+int TransferTableModel::rowCount(const QModelIndex& parent) const {
+    return parent.isValid() ? 0 : static_cast<int>(rows_.size());
+}
+
+int TransferTableModel::columnCount(const QModelIndex& parent) const {
+    return parent.isValid() ? 0 : ColumnCount;
+}
+
+QVariant TransferTableModel::data(const QModelIndex& index, int role) const {
+    if (!index.isValid() || index.row() >= static_cast<int>(rows_.size())) return QVariant();
+    const Row& row = rows_[index.row()];
+    const TransferProgress& t = *row.progress;
+    int percent = t.total_bytes ? static_cast<int>(row.done * 100 / t.total_bytes) : (row.state == 1 ? 100 : 0);
+    if (role == ProgressRole) return index.column() == ColProgress ? QVariant(percent) : QVariant();
+    if (role != Qt::DisplayRole) return QVariant();
+    switch (index.column()) {
+        case ColDirection: return QString(t.outgoing ? "send" : "receive");
+        case ColPeer: return QString::fromStdString(t.peer_ip);
+        case ColFile: return QString::fromStdString(t.filename);
+        case ColProgress:
+            if (row.state == -1) return QString("failed at %1%").arg(percent);
+            if (row.state == 1) return QString("done");
+            if (t.total_bytes == 0) return QString("%1 KB streamed").arg(row.done / 1024);
+            return QString("%1% of %2 KB").arg(percent).arg(t.total_bytes / 1024);
+    }
+    return QVariant();
+}
+
+QVariant TransferTableModel::headerData(int section, Qt::Orientation orientation, int role) const {
+    if (role != Qt::DisplayRole || orientation != Qt::Horizontal) return QVariant();
+    static const char* const names[ColumnCount] = {"", "Peer", "File", "Progress"};
+    return section >= 0 && section < ColumnCount ? QVariant(QString(names[section])) : QVariant();
+}
+
+bool TransferTableModel::sync(const std::vector<std::shared_ptr<TransferProgress>>& transfers) {
+    // FileTransfer appends new entries and drops old finished ones, order is kept
+    std::set<const TransferProgress*> live;
+    for (const auto& t : transfers) live.insert(t.get());
+    for (int r = static_cast<int>(rows_.size()) - 1; r >= 0; --r) {
+        if (live.count(rows_[r].progress.get())) continue;
+        beginRemoveRows(QModelIndex(), r, r);
+        rows_.erase(rows_.begin() + r);
+        endRemoveRows();
+    }
+
+    bool running = false;
+    for (size_t i = 0; i < rows_.size(); ++i) {
+        Row& row = rows_[i];
+        uint64_t done = row.progress->done_bytes.load(std::memory_order_relaxed);
+        int state = row.progress->state.load();
+        running = running || state == 0;
+        if (done == row.done && state == row.state) continue;
+        row.done = done;
+        row.state = state;
+        emit dataChanged(index(static_cast<int>(i), ColProgress), index(static_cast<int>(i), ColProgress));
+    }
+
+    std::set<const TransferProgress*> known;
+    for (const auto& row : rows_) known.insert(row.progress.get());
+    std::vector<Row> added;
+    for (const auto& t : transfers) {
+        if (known.count(t.get())) continue;
+        int state = t->state.load();
+        running = running || state == 0;
+        added.push_back(Row{t, t->done_bytes.load(std::memory_order_relaxed), state});
+    }
+    if (!added.empty()) {
+        int first = static_cast<int>(rows_.size());
+        beginInsertRows(QModelIndex(), first, first + static_cast<int>(added.size()) - 1);
+        rows_.insert(rows_.end(), added.begin(), added.end());
+        endInsertRows();
+    }
+    return running;
+}
+
+void ProgressDelegate::paint(QPainter* painter, const QStyleOptionViewItem& option, const QModelIndex& index) const {
+    QVariant percent = index.data(TransferTableModel::ProgressRole);
+    if (!percent.isValid()) {
+        QStyledItemDelegate::paint(painter, option, index);
+        return;
+    }
+    QStyleOptionProgressBar bar;
+    bar.rect = option.rect.adjusted(2, 2, -2, -2);
+    bar.minimum = 0;
+    bar.maximum = 100;
+    bar.progress = percent.toInt();
+    bar.text = index.data(Qt::DisplayRole).toString();
+    bar.textVisible = true;
+    QApplication::style()->drawControl(QStyle::CE_ProgressBar, &bar, painter);
+}
 
 UIQt::UIQt(SubnetListener& listener, FileTransfer& ft, SubnetBroadcaster& bc, QWidget* parent)
-    : QMainWindow(parent), listener_(listener), ft_(ft), bc_(bc) {
+    : QMainWindow(parent), listener_(listener), ft_(ft), bc_(bc), transferChangeQueued_(false) {
     buildUi();
-    refreshTimer_ = new QTimer(this);
-    connect(refreshTimer_, &QTimer::timeout, this, &UIQt::refresh);
-    refreshTimer_->start(1000);
+    refreshLocalAddresses();
+    // subscribe before taking the snapshot so nothing falls between the two
+    deviceEvents_ = listener_.subscribe();
+    deviceNotifier_ = new QSocketNotifier(deviceEvents_->fd(), QSocketNotifier::Read, this);
+    connect(deviceNotifier_, &QSocketNotifier::activated, this, [this]() { onDeviceEvents(); });
+    devicesModel_->reset(*listener_.snapshot(), localIps_);
+
+    progressTimer_ = new QTimer(this);
+    connect(progressTimer_, &QTimer::timeout, this, &UIQt::syncTransfers);
+    // requests and transfer starts/ends are pushed; coalesce them into one GUI-thread sync
+    ft_.set_change_observer([this]() {
+        if (transferChangeQueued_.exchange(true)) return;
+        QMetaObject::invokeMethod(this, [this]() {
+            transferChangeQueued_.store(false);
+            syncTransfers();
+        }, Qt::QueuedConnection);
+    });
+    syncTransfers();
 }
 
-UIQt::~UIQt() {}
+UIQt::~UIQt() {
+    // no notification may run past this point
+    ft_.set_change_observer(nullptr);
+}
+
+QTableView* UIQt::makeView(QAbstractItemModel* model) {
+    auto* view = new QTableView(this);
+    view->setModel(model);
+    view->setSelectionBehavior(QAbstractItemView::SelectRows);
+    view->setSelectionMode(QAbstractItemView::SingleSelection);
+    view->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
+    // fixed row heights keep large tables from measuring every row
+    view->verticalHeader()->setSectionResizeMode(QHeaderView::Fixed);
+    view->verticalHeader()->hide();
+    return view;
+}
 
 void UIQt::buildUi() {
     QWidget* central = new QWidget(this);
     setCentralWidget(central);
     auto* layout = new QVBoxLayout(central);
 
-    devicesTable_ = new QTableWidget(0, 3, this);
-    devicesTable_->setHorizontalHeaderLabels({"IP", "Hostname", "Status"});
-    devicesTable_->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
-    layout->addWidget(devicesTable_);
+    devicesModel_ = new DeviceTableModel(this);
+    devicesProxy_ = new DeviceSortProxy(this);
+    devicesProxy_->setSourceModel(devicesModel_);
+    devicesProxy_->setDynamicSortFilter(true);
+    devicesProxy_->sort(0);
+    devicesView_ = makeView(devicesProxy_);
+    layout->addWidget(devicesView_, 3);
 
-    pendingTable_ = new QTableWidget(0, 3, this);
-    pendingTable_->setHorizontalHeaderLabels({"#", "From", "File"});
-    pendingTable_->horizontalHeader()->setSectionResizeMode(QHeaderView::Stretch);
-    layout->addWidget(pendingTable_);
+    pendingModel_ = new RequestTableModel(this);
+    pendingView_ = makeView(pendingModel_);
+    layout->addWidget(pendingView_, 1);
+
+    transfersModel_ = new TransferTableModel(this);
+    transfersView_ = makeView(transfersModel_);
+    transfersView_->setItemDelegateForColumn(TransferTableModel::ColProgress, new ProgressDelegate(transfersView_));
+    layout->addWidget(transfersView_, 1);
 
     auto* h = new QHBoxLayout();
     acceptBtn_ = new QPushButton("Accept first", this);
@@ -51,54 +344,78 @@ void UIQt::buildUi() {
     connect(acceptBtn_, &QPushButton::clicked, [this]() {
         auto pending = ft_.get_pending_requests();
         int idx = firstUndecidedIndex(pending);
-        if (idx >= 0) ft_.decide_request_by_index(idx, true);
+        if (idx >= 0) ft_.decide_request_by_id(pending[idx]->id, true);
     });
     connect(rejectBtn_, &QPushButton::clicked, [this]() {
         auto pending = ft_.get_pending_requests();
         int idx = firstUndecidedIndex(pending);
-        if (idx >= 0) ft_.decide_request_by_index(idx, false);
+        if (idx >= 0) ft_.decide_request_by_id(pending[idx]->id, false);
     });
     connect(rejectAllBtn_, &QPushButton::clicked, [this]() {
         auto pending = ft_.get_pending_requests();
         for (size_t i = 0; i < pending.size(); ++i) {
-            if (pending[i]->decision.load() == -1) ft_.decide_request_by_index(i, false);
+            if (pending[i]->decision.load() == -1) ft_.decide_request_by_id(pending[i]->id, false);
         }
     });
     connect(sendBtn_, &QPushButton::clicked, [this]() {
-        QString ip = QInputDialog::getText(this, "Target IP", "Enter target IP:");
+        QString ip = QInputDialog::getText(this, "Target IP", "Enter target IP:", QLineEdit::Normal, suggestedTarget());
         if (ip.isEmpty()) return;
         QString path = QFileDialog::getOpenFileName(this, "Select file to send");
         if (path.isEmpty()) return;
-        // run request+send in background to avoid blocking GUI
-        std::thread([this, ip, path]() {
-            bool ok = ft_.request_send(ip.toStdString(), ft_.control_port(), path.toStdString(), 30000);
+        // use the ports the peer advertises and route through the interface it was
+        // discovered on; unknown or legacy peers get the default ports
+        DeviceInfo target;
+        target.ip = ip.toStdString();
+        auto devices = listener_.snapshot();
+        auto it = devices->find(target.ip);
+        if (it != devices->end()) target = it->second;
+        // run request+send in background to avoid blocking GUI; progress shows up in the
+        // transfers table
+        std::thread([this, ip, path, target]() {
+            bool ok = ft_.request_send(ip.toStdString(), target.control_port_or_default(), path.toStdString(), 30000, target.iface);
             if (!ok) {
                 QMetaObject::invokeMethod(this, [this]() {
                     QMessageBox::warning(this, "Request", "Denied or timed out");
                 }, Qt::QueuedConnection);
                 return;
             }
-            bool sent = ft_.send_file(ip.toStdString(), ft_.listen_port(), path.toStdString());
+            bool sent = ft_.send_file(ip.toStdString(), target.data_port_or_default(), path.toStdString(), target.iface,
+                                      target.path, target.flags & MessageCodec::BEACON_FLAG_SPARSE);
             if (!sent) {
                 QMetaObject::invokeMethod(this, [this]() {
                     QMessageBox::warning(this, "Send", "Send failed");
                 }, Qt::QueuedConnection);
-            } else {
-                QMetaObject::invokeMethod(this, [this]() {
-                    QMessageBox::information(this, "Send", "Send complete");
-                }, Qt::QueuedConnection);
             }
         }).detach();
     });
 }
 
+// the selected device, else the least-loaded live peer
+QString UIQt::suggestedTarget() const {
+    QModelIndexList selected = devicesView_->selectionModel()->selectedRows();
+    if (!selected.isEmpty()) {
+        int row = devicesProxy_->mapToSource(selected.front()).row();
+        return QString::fromStdString(devicesModel_->device(row).ip);
+    }
+    for (int r = 0; r < devicesProxy_->rowCount(); ++r) {
+        const DeviceInfo& info = devicesModel_->device(devicesProxy_->mapToSource(devicesProxy_->index(r, 0)).row());
+        if (info.verified && info.lastMessage == MessageCodec::MSG_ALIVE) return QString::fromStdString(info.ip);
+    }
+    return QString();
+}
+
 int UIQt::firstUndecidedIndex(const std::vector<std::shared_ptr<PendingRequest>>& pending) {
     for (size_t i = 0; i < pending.size(); ++i) if (pending[i]->decision.load() == -1) return (int)i;
     return -1;
 }
 
-void UIQt::refresh() {
-    auto devices = listener_.get_devices();
+bool UIQt::refreshLocalAddresses() {
+    // the broadcaster republishes its interface list on every netlink change; anything
+    // else leaves our addresses alone
+    auto ifaces = bc_.interfaces();
+    if (ifaces == localIpsFrom_) return false;
+    localIpsFrom_ = ifaces;
+
     // collect local IPv4 addresses to filter out
     std::set<std::string> local_ips;
     struct ifaddrs* ifa = nullptr;
@@ -114,24 +431,24 @@ void UIQt::refresh() {
         }
         freeifaddrs(ifa);
     }
+    if (local_ips == localIps_) return false;
+    localIps_.swap(local_ips);
+    return true;
+}
 
-    devicesTable_->setRowCount(0);
-    int r = 0;
-    for (const auto& [ip, info] : devices) {
-        if (local_ips.count(ip)) continue; // skip self
-        devicesTable_->insertRow(r);
-        devicesTable_->setItem(r, 0, new QTableWidgetItem(QString::fromStdString(ip)));
-        devicesTable_->setItem(r, 1, new QTableWidgetItem(QString::fromStdString(info.hostname)));
-        devicesTable_->setItem(r, 2, new QTableWidgetItem(QString::fromStdString(MessageCodec::name_for(info.lastMessage))));
-        ++r;
-    }
-
-    auto pending = ft_.get_pending_requests();
-    pendingTable_->setRowCount(0);
-    for (size_t i = 0; i < pending.size(); ++i) {
-        pendingTable_->insertRow((int)i);
-        pendingTable_->setItem((int)i, 0, new QTableWidgetItem(QString::number(i+1)));
-        pendingTable_->setItem((int)i, 1, new QTableWidgetItem(QString::fromStdString(pending[i]->peer_ip)));
-        pendingTable_->setItem((int)i, 2, new QTableWidgetItem(QString::fromStdString(pending[i]->filename)));
+void UIQt::onDeviceEvents() {
+    auto events = deviceEvents_->drain();
+    if (refreshLocalAddresses()) {
+        // rare: an address of ours came or went, re-filter from scratch
+        devicesModel_->reset(*listener_.snapshot(), localIps_);
+        return;
     }
+    devicesModel_->apply(events, localIps_);
+}
+
+void UIQt::syncTransfers() {
+    pendingModel_->sync(ft_.get_pending_requests());
+    bool running = transfersModel_->sync(ft_.get_transfers());
+    if (running && !progressTimer_->isActive()) progressTimer_->start(250);
+    else if (!running) progressTimer_->stop();
 }
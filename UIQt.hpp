@@ -2,14 +2,118 @@
 #define UIQT_HPP
 
 #include <QMainWindow>
-#include <QTableWidget>
+#include <QTableView>
+#include <QAbstractTableModel>
+#include <QSortFilterProxyModel>
+#include <QStyledItemDelegate>
 #include <QPushButton>
 #include <QTimer>
+#include <QSocketNotifier>
+#include <atomic>
 #include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "SubnetListener.hpp"
 #include "FileTransfer.hpp"
 #include "SubnetBroadcaster.hpp"
 
+// The models below are plain QAbstractTableModel subclasses (no Q_OBJECT, so no moc step
+// in the build). They are fed with changes rather than rebuilt, so views keep selection and
+// scroll position and the cost of an update is proportional to what changed.
+
+// Known peers, in arrival order; DeviceSortProxy presents them by load.
+class DeviceTableModel : public QAbstractTableModel {
+public:
+    enum Column { ColIp, ColHostname, ColStatus, ColLoad, ColLink, ColumnCount };
+
+    explicit DeviceTableModel(QObject* parent = nullptr);
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+    QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
+
+    // start over from a registry snapshot, leaving out `hidden` (our own addresses)
+    void reset(const DeviceMap& devices, const std::set<std::string>& hidden);
+    // apply drained subscription events as row inserts, updates and removals
+    void apply(const std::vector<DeviceEvent>& events, const std::set<std::string>& hidden);
+    const DeviceInfo& device(int row) const { return rows_[row]; }
+
+private:
+    std::vector<DeviceInfo> rows_;
+    std::unordered_map<std::string, int> row_of_;
+
+    void reindex(size_t from);
+};
+
+// Orders devices with less_loaded(), best transfer target on top, and keeps that order
+// as rows change.
+class DeviceSortProxy : public QSortFilterProxyModel {
+public:
+    explicit DeviceSortProxy(QObject* parent = nullptr) : QSortFilterProxyModel(parent) {}
+
+protected:
+    bool lessThan(const QModelIndex& left, const QModelIndex& right) const override;
+};
+
+// Incoming file requests. FileTransfer only ever appends to its pending list, so a sync is
+// an append plus dataChanged for requests whose decision moved.
+class RequestTableModel : public QAbstractTableModel {
+public:
+    enum Column { ColNumber, ColFrom, ColFile, ColDecision, ColumnCount };
+
+    explicit RequestTableModel(QObject* parent = nullptr);
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+    QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
+
+    void sync(const std::vector<std::shared_ptr<PendingRequest>>& pending);
+    const std::shared_ptr<PendingRequest>& request(int row) const { return rows_[row]; }
+
+private:
+    std::vector<std::shared_ptr<PendingRequest>> rows_;
+    // decision as last shown, to report only the rows that changed
+    std::vector<int> shown_;
+};
+
+// Running and recently finished transfers. Progress is read from the shared
+// TransferProgress entries on sync(); only rows whose figures moved are reported.
+class TransferTableModel : public QAbstractTableModel {
+public:
+    enum Column { ColDirection, ColPeer, ColFile, ColProgress, ColumnCount };
+    // percent complete, for ProgressDelegate
+    static constexpr int ProgressRole = Qt::UserRole + 1;
+
+    explicit TransferTableModel(QObject* parent = nullptr);
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+    QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
+
+    // returns true while any transfer is still running
+    bool sync(const std::vector<std::shared_ptr<TransferProgress>>& transfers);
+
+private:
+    struct Row {
+        std::shared_ptr<TransferProgress> progress;
+        uint64_t done;
+        int state;
+    };
+    std::vector<Row> rows_;
+};
+
+// Draws TransferTableModel::ProgressRole as a progress bar.
+class ProgressDelegate : public QStyledItemDelegate {
+public:
+    explicit ProgressDelegate(QObject* parent = nullptr) : QStyledItemDelegate(parent) {}
+    void paint(QPainter* painter, const QStyleOptionViewItem& option, const QModelIndex& index) const override;
+};
+
 class UIQt : public QMainWindow {
 public:
     UIQt(SubnetListener& listener, FileTransfer& ft, SubnetBroadcaster& bc, QWidget* parent = nullptr);
@@ -20,16 +124,35 @@ private:
     FileTransfer& ft_;
     SubnetBroadcaster& bc_;
 
-    QTableWidget* devicesTable_;
-    QTableWidget* pendingTable_;
+    DeviceTableModel* devicesModel_;
+    DeviceSortProxy* devicesProxy_;
+    RequestTableModel* pendingModel_;
+    TransferTableModel* transfersModel_;
+    QTableView* devicesView_;
+    QTableView* pendingView_;
+    QTableView* transfersView_;
     QPushButton* acceptBtn_;
     QPushButton* rejectBtn_;
     QPushButton* rejectAllBtn_;
     QPushButton* sendBtn_;
-    QTimer* refreshTimer_;
+    // polls byte counts, only while a transfer is running
+    QTimer* progressTimer_;
+    // device changes are pushed through the listener's event stream
+    std::shared_ptr<DeviceSubscription> deviceEvents_;
+    QSocketNotifier* deviceNotifier_;
+    // set while a FileTransfer change notification is queued to the GUI thread
+    std::atomic<bool> transferChangeQueued_;
+    // our own addresses, recomputed only when the broadcaster's interface list changes
+    std::set<std::string> localIps_;
+    std::shared_ptr<const std::vector<SubnetBroadcaster::Interface>> localIpsFrom_;
 
     void buildUi();
-    void refresh();
+    QTableView* makeView(QAbstractItemModel* model);
+    void onDeviceEvents();
+    void syncTransfers();
+    // true if the local address set changed
+    bool refreshLocalAddresses();
+    QString suggestedTarget() const;
     int firstUndecidedIndex(const std::vector<std::shared_ptr<PendingRequest>>& pending);
 };
 
@@ -0,0 +1,259 @@
+#include "WatchedTree.hpp"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+
+static std::string join(const std::string& dir, const std::string& name) {
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+WatchedTree::WatchedTree(const char* name, uint32_t mask)
+    : name_(name), mask_(mask), loop_(nullptr), inotify_fd_(-1), next_scan_(0), rescanning_(false), scan_pool_(1),
+      stopping_(false) {}
+
+WatchedTree::~WatchedTree() {
+    stop();
+}
+
+bool WatchedTree::start(const std::string& root, EventLoop& loop, Handlers handlers, std::vector<File>* initial) {
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (!realpath(root.c_str(), resolved) || stat(resolved, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        std::fprintf(stderr, "%s: %s is not a directory\n", name_, root.c_str());
+        return false;
+    }
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0) {
+        perror((std::string(name_) + ": inotify_init1").c_str());
+        return false;
+    }
+    root_ = resolved;
+    loop_ = &loop;
+    handlers_ = std::move(handlers);
+    // changes made during the scan queue up on the inotify fd and are applied after it
+    ScanResult first = scan("", initial != nullptr);
+    for (auto& [wd, dir] : first.watched) watches_[wd] = std::move(dir);
+    if (initial) *initial = std::move(first.files);
+    loop_->add_fd(inotify_fd_, EPOLLIN, [this](uint32_t) { on_inotify(); });
+    return true;
+}
+
+void WatchedTree::stop() {
+    if (inotify_fd_ < 0) return;
+    // a scan in flight gives up at its next directory; what it posts back is dropped
+    stopping_.store(true);
+    scan_pool_.shutdown();
+    loop_->run_sync([this]() {
+        scans_.clear();
+        held_.clear();
+        rescanning_ = false;
+        loop_->remove_fd(inotify_fd_);
+        ::close(inotify_fd_);
+        inotify_fd_ = -1;
+        watches_.clear();
+    });
+}
+
+WatchedTree::ScanResult WatchedTree::scan(const std::string& top, bool collect) {
+    struct Queue {
+        std::mutex m;
+        std::condition_variable cv;
+        std::vector<std::string> dirs;
+        size_t busy = 0;
+        ScanResult result;
+    } q;
+    q.dirs.push_back(top);
+
+    auto read_dir = [this, collect](const std::string& dir, ScanResult& out, std::vector<std::string>& subdirs) {
+        if (stopping_.load()) return;
+        std::string abs = dir.empty() ? root_ : root_ + "/" + dir;
+        // watch before listing, so nothing created in between is missed
+        int wd = inotify_add_watch(inotify_fd_, abs.c_str(), mask_);
+        if (wd >= 0) {
+            out.watched.emplace_back(wd, dir);
+        } else if (errno == ENOSPC) {
+            std::fprintf(stderr, "%s: out of inotify watches at %s (raise fs.inotify.max_user_watches)\n", name_,
+                         abs.c_str());
+        }
+        int dfd = ::open(abs.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dfd < 0) return;
+        DIR* d = fdopendir(dfd);
+        if (!d) {
+            ::close(dfd);
+            return;
+        }
+        while (struct dirent* e = readdir(d)) {
+            if (std::strcmp(e->d_name, ".") == 0 || std::strcmp(e->d_name, "..") == 0) continue;
+            if (e->d_type == DT_DIR) {
+                subdirs.push_back(join(dir, e->d_name));
+                continue;
+            }
+            if (e->d_type != DT_UNKNOWN && (e->d_type != DT_REG || !collect)) continue;
+            struct stat st;
+            if (fstatat(dfd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            if (S_ISDIR(st.st_mode)) {
+                subdirs.push_back(join(dir, e->d_name));
+            } else if (S_ISREG(st.st_mode) && collect) {
+                out.files.push_back({join(dir, e->d_name), static_cast<uint64_t>(st.st_size), st.st_mtime});
+            }
+        }
+        closedir(d);
+    };
+
+    // directories are handed out one at a time, so a deep tree spreads across threads
+    auto worker = [&]() {
+        ScanResult mine;
+        std::unique_lock<std::mutex> lock(q.m);
+        while (true) {
+            q.cv.wait(lock, [&]() { return !q.dirs.empty() || q.busy == 0; });
+            if (q.dirs.empty()) break;
+            std::string dir = std::move(q.dirs.back());
+            q.dirs.pop_back();
+            ++q.busy;
+            lock.unlock();
+            std::vector<std::string> subdirs;
+            read_dir(dir, mine, subdirs);
+            lock.lock();
+            for (auto& s : subdirs) q.dirs.push_back(std::move(s));
+            --q.busy;
+            q.cv.notify_all();
+        }
+        auto& files = q.result.files;
+        files.insert(files.end(), std::make_move_iterator(mine.files.begin()), std::make_move_iterator(mine.files.end()));
+        q.result.watched.insert(q.result.watched.end(), mine.watched.begin(), mine.watched.end());
+    };
+
+    // a whole tree is I/O-bound on many directories; a directory created later is usually
+    // small, so it is scanned on one thread
+    unsigned int threads = top.empty() ? std::clamp(std::thread::hardware_concurrency(), 2u, 8u) : 1;
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads; ++i) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+
+    return std::move(q.result);
+}
+
+void WatchedTree::scan_later(const std::string& dir) {
+    uint64_t id = ++next_scan_;
+    scans_[id] = dir;
+    scan_pool_.submit([this, id, dir]() {
+        auto result = std::make_shared<ScanResult>(scan(dir, true));
+        loop_->post([this, id, result]() { apply_scan(id, std::move(*result)); });
+    });
+}
+
+void WatchedTree::apply_scan(uint64_t id, ScanResult result) {
+    if (inotify_fd_ < 0) return;
+    auto it = scans_.find(id);
+    // superseded by a rescan, or the directory left the tree while it was being scanned
+    if (it == scans_.end()) return;
+    bool full = it->second.empty();
+    scans_.erase(it);
+    if (full) {
+        rescanning_ = false;
+        std::unordered_map<int, std::string> watches;
+        for (auto& [wd, dir] : result.watched) watches[wd] = std::move(dir);
+        for (const auto& [wd, dir] : watches_) {
+            if (!watches.count(wd)) inotify_rm_watch(inotify_fd_, wd);
+        }
+        watches_ = std::move(watches);
+    } else {
+        for (auto& [wd, dir] : result.watched) watches_[wd] = std::move(dir);
+    }
+    handlers_.scanned(result.files, full);
+    // what happened in the scanned directories since they were watched; the listing may
+    // already have seen some of it, and the owner gets it again
+    std::vector<HeldEvent> held;
+    held.swap(held_);
+    for (const auto& ev : held) handle_event(ev.wd, ev.mask, ev.name);
+    handlers_.changed();
+}
+
+void WatchedTree::rescan() {
+    std::fprintf(stderr, "%s: inotify events lost, rescanning %s\n", name_, root_.c_str());
+    // the rescan covers whatever the others would have found
+    scans_.clear();
+    held_.clear();
+    rescanning_ = true;
+    scan_later("");
+}
+
+void WatchedTree::on_inotify() {
+    alignas(struct inotify_event) char buf[64 * 1024];
+    bool overflow = false;
+    ssize_t n;
+    while ((n = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n;) {
+            auto* ev = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+            handle_event(ev->wd, ev->mask, ev->len ? std::string(ev->name) : std::string());
+        }
+    }
+    if (overflow) rescan();
+    handlers_.changed();
+}
+
+void WatchedTree::handle_event(int wd, uint32_t mask, const std::string& name) {
+    auto w = watches_.find(wd);
+    // the rescan's listing may predate this event, so it waits; an unknown watch may be
+    // a directory a scan in flight has just watched
+    if (rescanning_ || (w == watches_.end() && !scans_.empty())) {
+        if (held_.size() < kMaxHeldEvents) {
+            held_.push_back({wd, mask, name});
+        } else {
+            rescan();
+        }
+        return;
+    }
+    if (w == watches_.end()) return;
+    if (mask & IN_IGNORED) {
+        watches_.erase(w);
+        return;
+    }
+    if (name.empty()) return;
+    std::string path = join(w->second, name);
+    if (mask & IN_ISDIR) {
+        // gone, or about to reappear under a new name with IN_MOVED_TO
+        if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+            remove_dir(path);
+            handlers_.dir_removed(path);
+        }
+        if (mask & (IN_CREATE | IN_MOVED_TO)) scan_later(path);
+    } else {
+        handlers_.file_event(path, mask);
+    }
+}
+
+void WatchedTree::remove_dir(const std::string& dir) {
+    std::string prefix = dir + "/";
+    auto under = [&](const std::string& d) { return d == dir || d.compare(0, prefix.size(), prefix) == 0; };
+    for (auto it = watches_.begin(); it != watches_.end();) {
+        if (under(it->second)) {
+            inotify_rm_watch(inotify_fd_, it->first);
+            it = watches_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = scans_.begin(); it != scans_.end();) {
+        it = under(it->second) ? scans_.erase(it) : std::next(it);
+    }
+}
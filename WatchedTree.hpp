@@ -0,0 +1,100 @@
+#ifndef WATCHED_TREE_HPP
+#define WATCHED_TREE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include "EventLoop.hpp"
+
+// A directory tree under inotify, shared by SharedCatalog and FolderSync: one watch per
+// directory, symlinks never followed. The owner sees file events with paths relative to
+// the root; directories are handled here. One created or moved in, and the whole tree
+// after an inotify overflow, are scanned on a worker thread and the result applied on
+// the loop. Events from directories whose scan is still in flight (every event, during a
+// full rescan) are held back and replayed once it has been applied.
+class WatchedTree {
+public:
+    // held events beyond this count as another overflow
+    static constexpr size_t kMaxHeldEvents = 16384;
+
+    struct File {
+        // relative to the root, '/'-separated
+        std::string path;
+        uint64_t size = 0;
+        // seconds since the epoch
+        int64_t mtime = 0;
+    };
+
+    // all called on the loop thread
+    struct Handlers {
+        // regular files a scan found; `full` after an overflow, when they replace
+        // everything the owner knew
+        std::function<void(std::vector<File>& files, bool full)> scanned;
+        // inotify event for a file (anything but a directory) in the tree
+        std::function<void(const std::string& path, uint32_t mask)> file_event;
+        // a directory and everything below it left the tree
+        std::function<void(const std::string& dir)> dir_removed;
+        // after each batch of events or applied scan
+        std::function<void()> changed;
+    };
+
+    // `name` prefixes log lines; `mask` is what inotify_add_watch gets for each directory
+    WatchedTree(const char* name, uint32_t mask);
+    ~WatchedTree();
+
+    // watches the tree; with `initial` the files in it are listed there too. Events are
+    // delivered from the next loop iteration on.
+    bool start(const std::string& root, EventLoop& loop, Handlers handlers, std::vector<File>* initial = nullptr);
+    void stop();
+    bool active() const { return inotify_fd_ >= 0; }
+    // the resolved root
+    const std::string& root() const { return root_; }
+
+private:
+    struct ScanResult {
+        std::vector<File> files;
+        std::vector<std::pair<int, std::string>> watched;
+    };
+    // an inotify event for a directory whose scan has not been applied yet
+    struct HeldEvent {
+        int wd;
+        uint32_t mask;
+        std::string name;
+    };
+
+    const char* name_;
+    uint32_t mask_;
+    std::string root_;
+    EventLoop* loop_;
+    int inotify_fd_;
+    Handlers handlers_;
+    // everything below is touched on the loop thread only
+    // watch descriptor -> directory relative to root ("" for the root)
+    std::unordered_map<int, std::string> watches_;
+    // scans in flight, id -> directory ("" for a full rescan)
+    std::map<uint64_t, std::string> scans_;
+    uint64_t next_scan_;
+    std::vector<HeldEvent> held_;
+    // a full rescan is in flight: every event waits for it
+    bool rescanning_;
+    WorkerPool scan_pool_;
+    std::atomic<bool> stopping_;
+
+    // watches `dir` and everything below it; with `collect` the files are listed; any thread
+    ScanResult scan(const std::string& dir, bool collect);
+    // scan on the worker, then apply_scan on the loop
+    void scan_later(const std::string& dir);
+    void apply_scan(uint64_t id, ScanResult result);
+    // start over from the filesystem; the owner keeps its view until the rescan is applied
+    void rescan();
+    void on_inotify();
+    void handle_event(int wd, uint32_t mask, const std::string& name);
+    // drop the watches on `dir` and below it, and the scans in flight there
+    void remove_dir(const std::string& dir);
+};
+
+#endif // WATCHED_TREE_HPP
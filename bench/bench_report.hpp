@@ -0,0 +1,83 @@
+// Machine-readable benchmark results shared by the bench/ programs: one row per measured
+// value, printed as a JSON document or as CSV so runs can be stored and compared.
+#ifndef BENCH_REPORT_HPP
+#define BENCH_REPORT_HPP
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+enum class BenchFormat { Table, Json, Csv };
+
+// parses --format=table|json|csv; returns false for anything else
+inline bool parse_bench_format(const std::string& arg, BenchFormat& out) {
+    if (arg == "--format=table") out = BenchFormat::Table;
+    else if (arg == "--format=json") out = BenchFormat::Json;
+    else if (arg == "--format=csv") out = BenchFormat::Csv;
+    else return false;
+    return true;
+}
+
+class BenchReport {
+public:
+    struct Row {
+        // case being measured, e.g. "throughput", and its parameters as "key=value;..."
+        std::string name;
+        std::string params;
+        std::string metric;
+        double value;
+        std::string unit;
+    };
+
+    explicit BenchReport(const std::string& bench) : bench_(bench) {}
+
+    void add(const std::string& name, const std::string& params, const std::string& metric, double value,
+             const std::string& unit) {
+        rows_.push_back(Row{name, params, metric, value, unit});
+    }
+
+    void write_json(FILE* out) const {
+        char host[256] = "";
+        gethostname(host, sizeof(host) - 1);
+        std::fprintf(out, "{\n  \"bench\": \"%s\",\n  \"host\": \"%s\",\n  \"timestamp\": %lld,\n  \"results\": [\n",
+                     escape(bench_).c_str(), escape(host).c_str(), static_cast<long long>(std::time(nullptr)));
+        for (size_t i = 0; i < rows_.size(); ++i) {
+            const Row& r = rows_[i];
+            std::fprintf(out, "    {\"case\": \"%s\", \"params\": \"%s\", \"metric\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}%s\n",
+                         escape(r.name).c_str(), escape(r.params).c_str(), escape(r.metric).c_str(), r.value,
+                         escape(r.unit).c_str(), i + 1 < rows_.size() ? "," : "");
+        }
+        std::fprintf(out, "  ]\n}\n");
+    }
+
+    void write_csv(FILE* out) const {
+        std::fprintf(out, "bench,case,params,metric,value,unit\n");
+        for (const Row& r : rows_) {
+            std::fprintf(out, "%s,%s,\"%s\",%s,%.6g,%s\n", bench_.c_str(), r.name.c_str(), r.params.c_str(),
+                         r.metric.c_str(), r.value, r.unit.c_str());
+        }
+    }
+
+    // no-op for Table, whose output the caller prints as it goes
+    void write(BenchFormat format, FILE* out = stdout) const {
+        if (format == BenchFormat::Json) write_json(out);
+        else if (format == BenchFormat::Csv) write_csv(out);
+    }
+
+private:
+    std::string bench_;
+    std::vector<Row> rows_;
+
+    static std::string escape(const std::string& s) {
+        std::string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            if (static_cast<unsigned char>(c) >= 0x20) out += c;
+        }
+        return out;
+    }
+};
+
+#endif // BENCH_REPORT_HPP
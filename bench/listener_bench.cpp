@@ -0,0 +1,194 @@
+// Beacon ingestion throughput benchmark for SubnetListener.
+//
+// Simulates many hosts on the 127.0.0.0/8 loopback range blasting alive beacons at a
+// listener and reports how many beacons per second it ingests, for each ingest
+// thread count. It first times the registry alone: beacons fed straight into
+// SubnetListener::ingest() on one thread, i.e. beacons per second per core with no
+// syscalls. Usage:
+//   bench/listener_bench [seconds=3] [hosts=2000] [max_rx_threads=4] [--broadcast]
+//                        [--format=table|json|csv]
+// With json or csv the results go to stdout and the table to stderr.
+#include "SubnetListener.hpp"
+#include "MessageCodec.hpp"
+#include "bench_report.hpp"
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const uint16_t kBenchPort = 41000;
+
+// one sender thread owns a slice of the simulated hosts, one socket per host
+static void sender_loop(unsigned int first_host, unsigned int count, bool broadcast,
+                        std::atomic<bool>& running, std::atomic<uint64_t>& sent) {
+    std::vector<int> socks;
+    for (unsigned int h = first_host; h < first_host + count; ++h) {
+        int s = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (s < 0) continue;
+        int on = 1;
+        if (broadcast) setsockopt(s, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+        struct sockaddr_in src{};
+        src.sin_family = AF_INET;
+        // 127.1.x.y, one address per simulated host
+        src.sin_addr.s_addr = htonl(0x7F010000u + h + 1);
+        if (bind(s, reinterpret_cast<struct sockaddr*>(&src), sizeof(src)) < 0) {
+            ::close(s);
+            continue;
+        }
+        socks.push_back(s);
+    }
+
+    struct sockaddr_in dst{};
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(kBenchPort);
+    inet_pton(AF_INET, broadcast ? "127.255.255.255" : "127.0.0.1", &dst.sin_addr);
+
+    constexpr unsigned int kBatch = 32;
+    std::vector<std::string> payloads;
+    for (size_t i = 0; i < socks.size(); ++i) {
+        std::string p(1, static_cast<char>(MessageCodec::MSG_ALIVE));
+        p += "bench-host-" + std::to_string(first_host + i);
+        payloads.push_back(p);
+    }
+    struct iovec iov[kBatch];
+    struct mmsghdr msgs[kBatch];
+
+    size_t next = 0;
+    while (running.load(std::memory_order_relaxed) && !socks.empty()) {
+        // a few beacons per host per round, batched with sendmmsg
+        size_t idx = next++ % socks.size();
+        for (unsigned int i = 0; i < kBatch; ++i) {
+            iov[i].iov_base = const_cast<char*>(payloads[idx].data());
+            iov[i].iov_len = payloads[idx].size();
+            std::memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &dst;
+            msgs[i].msg_hdr.msg_namelen = sizeof(dst);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = sendmmsg(socks[idx], msgs, kBatch, 0);
+        if (n > 0) sent.fetch_add(n, std::memory_order_relaxed);
+    }
+    for (int s : socks) ::close(s);
+}
+
+// refresh beacons from `hosts` known devices, round robin, fed to ingest() for `seconds`
+static double ingest_rate(unsigned int hosts, unsigned int seconds) {
+    SubnetListener listener(kBenchPort);
+    std::vector<std::vector<uint8_t>> beacons(hosts);
+    std::vector<struct sockaddr_in> senders(hosts);
+    std::vector<std::string> names(hosts);
+    for (unsigned int h = 0; h < hosts; ++h) {
+        names[h] = "bench-host-" + std::to_string(h) + ".lan";
+        MessageCodec::Beacon b;
+        b.data_port = 40001;
+        b.control_port = 40003;
+        b.free_disk_mb = 50000;
+        b.hostname = names[h].data();
+        b.hostname_len = static_cast<uint8_t>(names[h].size());
+        beacons[h].resize(MessageCodec::BEACON_V3_HEADER_LEN + b.hostname_len);
+        MessageCodec::encode_beacon(b, beacons[h].data(), beacons[h].size());
+        senders[h].sin_family = AF_INET;
+        senders[h].sin_addr.s_addr = htonl(0x0A000000u + h + 1);
+        listener.ingest(senders[h], 1, beacons[h].data(), beacons[h].size());
+    }
+    uint64_t done = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    auto end = t0 + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+        for (unsigned int i = 0; i < 4096; ++i) {
+            unsigned int h = static_cast<unsigned int>(done++ % hosts);
+            listener.ingest(senders[h], 1, beacons[h].data(), beacons[h].size());
+        }
+    }
+    return done / std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char* argv[]) {
+    unsigned int seconds = 3;
+    unsigned int hosts = 2000;
+    unsigned int max_rx = 4;
+    bool broadcast = false;
+    BenchFormat format = BenchFormat::Table;
+    std::vector<std::string> pos;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a == "--broadcast") {
+            broadcast = true;
+        } else if (a.rfind("--format=", 0) == 0) {
+            if (!parse_bench_format(a, format)) {
+                std::cerr << "unknown format: " << a << "\n";
+                return 1;
+            }
+        } else {
+            pos.push_back(a);
+        }
+    }
+    if (pos.size() > 0) seconds = std::stoul(pos[0]);
+    if (pos.size() > 1) hosts = std::stoul(pos[1]);
+    if (pos.size() > 2) max_rx = std::stoul(pos[2]);
+
+    unsigned int senders = std::max(2u, std::thread::hardware_concurrency() / 2);
+    BenchReport report("listener");
+    FILE* human = format == BenchFormat::Table ? stdout : stderr;
+    double rate = ingest_rate(hosts, seconds);
+    std::fprintf(human, "ingest path, one thread: %.0f beacons/s (%.0f ns each)\n\n", rate, 1e9 / rate);
+    report.add("ingest", "hosts=" + std::to_string(hosts), "processed", rate, "beacons/s");
+    std::fprintf(human, "%-10s %-12s %-14s %-14s %-10s\n", "rx_threads", "sent/s", "received/s", "ingested/s", "dropped");
+    for (unsigned int rx = 1; rx <= max_rx; rx *= 2) {
+        SubnetListener listener(kBenchPort);
+        listener.set_rx_threads(rx);
+        if (!listener.start()) {
+            std::cerr << "listener start failed\n";
+            return 1;
+        }
+
+        std::atomic<bool> running(true);
+        std::atomic<uint64_t> sent(0);
+        std::vector<std::thread> threads;
+        unsigned int per = (hosts + senders - 1) / senders;
+        for (unsigned int t = 0; t < senders; ++t) {
+            unsigned int first = t * per;
+            if (first >= hosts) break;
+            threads.emplace_back(sender_loop, first, std::min(per, hosts - first), broadcast,
+                                 std::ref(running), std::ref(sent));
+        }
+
+        // warm up so the registry is populated before measuring
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        ListenerStats before = listener.stats();
+        uint64_t sent_before = sent.load();
+        auto t0 = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        ListenerStats after = listener.stats();
+        uint64_t sent_after = sent.load();
+        double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        running.store(false);
+        for (auto& t : threads) t.join();
+        size_t devices = listener.snapshot()->size();
+        listener.stop();
+
+        std::fprintf(human, "%-10u %-12.0f %-14.0f %-14.0f %-10llu (devices=%zu)\n", rx,
+                     (sent_after - sent_before) / dt,
+                     (after.received - before.received) / dt,
+                     (after.ingested - before.ingested) / dt,
+                     static_cast<unsigned long long>(after.dropped - before.dropped), devices);
+        std::string params = "rx_threads=" + std::to_string(rx) + ";hosts=" + std::to_string(hosts) +
+                             ";broadcast=" + (broadcast ? "1" : "0");
+        report.add("ingestion", params, "sent", (sent_after - sent_before) / dt, "beacons/s");
+        report.add("ingestion", params, "received", (after.received - before.received) / dt, "beacons/s");
+        report.add("ingestion", params, "ingested", (after.ingested - before.ingested) / dt, "beacons/s");
+        report.add("ingestion", params, "dropped", static_cast<double>(after.dropped - before.dropped), "beacons");
+        report.add("ingestion", params, "devices", static_cast<double>(devices), "devices");
+    }
+    report.write(format);
+    return 0;
+}
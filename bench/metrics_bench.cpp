@@ -0,0 +1,101 @@
+// Cost of recording metrics on the hot paths.
+//
+// Times Counter::add and Histogram::observe from 1, 2, 4 and 8 threads against a single
+// shared std::atomic (what an unsharded counter would cost), and how long a scrape takes
+// to render the process registry. Contention only shows with at least as many cores as
+// threads. Usage:
+//   bench/metrics_bench [--ops=20000000] [--format=table|json|csv]
+// With json or csv the results go to stdout and the table to stderr.
+#include "Metrics.hpp"
+#include "bench_report.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// runs fn(ops) on `threads` threads at once; returns wall-clock nanoseconds per operation
+// over all threads, so perfect scaling shows as the 1-thread figure divided by the thread
+// count (on as many cores) and contention as a figure that does not drop
+template <typename Fn>
+static double time_threads(unsigned int threads, uint64_t ops, Fn fn) {
+    std::atomic<unsigned int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> pool;
+    for (unsigned int t = 0; t < threads; ++t) {
+        pool.emplace_back([&]() {
+            ++ready;
+            while (!go.load()) std::this_thread::yield();
+            fn(ops);
+        });
+    }
+    while (ready.load() < threads) std::this_thread::yield();
+    auto t0 = Clock::now();
+    go.store(true);
+    for (auto& th : pool) th.join();
+    return std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / (static_cast<double>(ops) * threads);
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t ops = 20000000;
+    BenchFormat format = BenchFormat::Table;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a.rfind("--ops=", 0) == 0) {
+            ops = std::stoull(a.substr(6));
+        } else if (!parse_bench_format(a, format)) {
+            std::cerr << "Usage: " << argv[0] << " [--ops=20000000] [--format=table|json|csv]\n";
+            return 1;
+        }
+    }
+
+    BenchReport report("metrics");
+    FILE* human = format == BenchFormat::Table ? stdout : stderr;
+    Counter& counter = metrics().counter("bench_counter_total", "benchmark counter");
+    Histogram& hist = metrics().histogram("bench_seconds", "benchmark histogram",
+                                          {0.001, 0.01, 0.1, 0.5, 1, 2.5, 5, 10, 20, 30});
+    alignas(64) std::atomic<uint64_t> shared(0);
+
+    std::fprintf(human, "%-18s %-8s %-10s\n", "case", "threads", "ns/op");
+    for (unsigned int threads : {1u, 2u, 4u, 8u}) {
+        struct Case {
+            const char* name;
+            double ns;
+        };
+        Case cases[] = {
+            {"shared_atomic", time_threads(threads, ops, [&](uint64_t n) {
+                 for (uint64_t i = 0; i < n; ++i) shared.fetch_add(1, std::memory_order_relaxed);
+             })},
+            {"counter_add", time_threads(threads, ops, [&](uint64_t n) {
+                 for (uint64_t i = 0; i < n; ++i) counter.add();
+             })},
+            {"histogram_observe", time_threads(threads, ops / 4, [&](uint64_t n) {
+                 // spread over the buckets so the bucket search is not always one step
+                 for (uint64_t i = 0; i < n; ++i) hist.observe(static_cast<double>(i & 63) * 0.25);
+             })},
+        };
+        for (const Case& c : cases) {
+            std::fprintf(human, "%-18s %-8u %-10.2f\n", c.name, threads, c.ns);
+            report.add(c.name, "threads=" + std::to_string(threads), "per_op", c.ns, "ns");
+        }
+    }
+
+    // a scrape of a registry about the size of netdemo's
+    for (int i = 0; i < 40; ++i) {
+        metrics().counter("bench_family_" + std::to_string(i % 10) + "_total", "filler", "n=\"" + std::to_string(i) + "\"");
+    }
+    const int kRenders = 2000;
+    size_t bytes = 0;
+    auto t0 = Clock::now();
+    for (int i = 0; i < kRenders; ++i) bytes = metrics().render().size();
+    double us = std::chrono::duration<double, std::micro>(Clock::now() - t0).count() / kRenders;
+    std::fprintf(human, "%-18s %.1f us for %zu bytes\n", "render", us, bytes);
+    report.add("render", "bytes=" + std::to_string(bytes), "per_scrape", us, "us");
+
+    report.write(format);
+    return 0;
+}
@@ -0,0 +1,277 @@
+// Loopback benchmark for the file transfer stack.
+//
+// Runs a FileTransfer receiver and sends to it over 127.0.0.1 with the same calls the UIs
+// use. A send counts as finished once the receiver has written the last byte. Cases:
+//   throughput   send_file for each size from 1 KB up to --max-size
+//   small_files  many 4 KB files back to back
+//   concurrent   1, 2, 4, 8 senders at once, 64 MB each
+//   control_rtt  request_send round trips against a receiver that accepts at once
+// Source files are sparse (reads cost no disk I/O); received files are written to recv/
+// in a scratch directory and deleted after each case. Usage:
+//   bench/transfer_bench [--max-size=1G] [--small-files=500] [--rtt-samples=200]
+//                        [--format=table|json|csv]
+// Sizes take K, M or G suffixes; --max-size=10G adds the 4 GB and 10 GB runs.
+#include "FileTransfer.hpp"
+#include "bench_report.hpp"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static const uint16_t kBenchDataPort = 41100;
+
+static uint64_t parse_size(const std::string& s) {
+    char* end = nullptr;
+    uint64_t v = std::strtoull(s.c_str(), &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return v << 10;
+        case 'm': case 'M': return v << 20;
+        case 'g': case 'G': return v << 30;
+        default: return v;
+    }
+}
+
+static std::string size_label(uint64_t bytes) {
+    if (bytes >= (1ull << 30) && bytes % (1ull << 30) == 0) return std::to_string(bytes >> 30) + "G";
+    if (bytes >= (1ull << 20) && bytes % (1ull << 20) == 0) return std::to_string(bytes >> 20) + "M";
+    if (bytes >= (1ull << 10) && bytes % (1ull << 10) == 0) return std::to_string(bytes >> 10) + "K";
+    return std::to_string(bytes);
+}
+
+// sparse source file of the given size
+static bool make_file(const std::string& path, uint64_t size) {
+    int fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) return false;
+    bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Counts receives the receiver has finished, woken by FileTransfer's change observer.
+// Finished entries are held so their addresses cannot be reused by new transfers.
+class ReceiveWaiter {
+public:
+    explicit ReceiveWaiter(FileTransfer& rx) : rx_(rx) {
+        rx_.set_change_observer([this]() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cv_.notify_all();
+        });
+    }
+    ~ReceiveWaiter() { rx_.set_change_observer(nullptr); }
+
+    // waits until `count` more receives finished; returns how many of them failed, or -1
+    // on timeout
+    int wait(size_t count, std::chrono::milliseconds timeout) {
+        auto deadline = Clock::now() + timeout;
+        size_t target = seen_.size() + count;
+        int failed = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            for (const auto& t : rx_.get_transfers()) {
+                if (t->outgoing || t->state.load() == 0) continue;
+                if (seen_.insert(t).second && t->state.load() < 0) ++failed;
+            }
+            if (seen_.size() >= target) return failed;
+            if (cv_.wait_until(lock, deadline) == std::cv_status::timeout) return -1;
+        }
+    }
+
+private:
+    FileTransfer& rx_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::set<std::shared_ptr<TransferProgress>> seen_;
+};
+
+static void remove_received(const std::string& name) {
+    ::unlink(("recv/" + name).c_str());
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t max_size = 1ull << 30;
+    unsigned int small_files = 500;
+    unsigned int rtt_samples = 200;
+    BenchFormat format = BenchFormat::Table;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a.rfind("--max-size=", 0) == 0) {
+            max_size = parse_size(a.substr(11));
+        } else if (a.rfind("--small-files=", 0) == 0) {
+            small_files = std::stoul(a.substr(14));
+        } else if (a.rfind("--rtt-samples=", 0) == 0) {
+            rtt_samples = std::stoul(a.substr(14));
+        } else if (!parse_bench_format(a, format)) {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--max-size=1G] [--small-files=500] [--rtt-samples=200] [--format=table|json|csv]\n";
+            return 1;
+        }
+    }
+
+    // everything happens in a scratch directory, the receiver writes to ./recv
+    char scratch[] = "/tmp/transfer_bench.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        perror("transfer_bench: scratch directory");
+        return 1;
+    }
+
+    FileTransfer rx(kBenchDataPort);
+    if (!rx.start_receiver()) {
+        std::cerr << "receiver start failed\n";
+        return 1;
+    }
+    FileTransfer tx;
+    ReceiveWaiter waiter(rx);
+    BenchReport report("transfer");
+    FILE* human = format == BenchFormat::Table ? stdout : stderr;
+    const std::string host = "127.0.0.1";
+    const auto kTimeout = std::chrono::minutes(10);
+
+    // throughput by size; small sizes are repeated so each case moves at least 64 MB
+    std::fprintf(human, "%-12s %-10s %-8s %-12s %-12s\n", "case", "size", "files", "MB/s", "ms/file");
+    std::vector<uint64_t> sizes = {1ull << 10, 64ull << 10, 1ull << 20, 16ull << 20, 256ull << 20, 1ull << 30,
+                                   4ull << 30, 10ull << 30};
+    for (uint64_t size : sizes) {
+        if (size > max_size) break;
+        std::string name = "tp-" + size_label(size);
+        if (!make_file(name, size)) {
+            perror("transfer_bench: source file");
+            return 1;
+        }
+        unsigned int reps = static_cast<unsigned int>(std::clamp<uint64_t>((64ull << 20) / size, 1, 1000));
+        unsigned int failed = 0;
+        auto t0 = Clock::now();
+        for (unsigned int i = 0; i < reps; ++i) {
+            bool sent = tx.send_file(host, rx.listen_port(), name);
+            if (!sent || waiter.wait(1, kTimeout) != 0) ++failed;
+        }
+        double dt = std::chrono::duration<double>(Clock::now() - t0).count();
+        double mbps = static_cast<double>(size) * reps / dt / (1 << 20);
+        std::fprintf(human, "%-12s %-10s %-8u %-12.1f %-12.3f\n", "throughput", size_label(size).c_str(), reps, mbps,
+                     dt * 1000 / reps);
+        std::string params = "size=" + std::to_string(size) + ";files=" + std::to_string(reps);
+        report.add("throughput", params, "throughput", mbps, "MB/s");
+        report.add("throughput", params, "per_file", dt * 1000 / reps, "ms");
+        report.add("throughput", params, "failed", failed, "files");
+        ::unlink(name.c_str());
+        remove_received(name);
+    }
+
+    // many small files, one after another (dominated by connection setup)
+    {
+        const uint64_t size = 4 << 10;
+        std::vector<std::string> names;
+        for (unsigned int i = 0; i < small_files; ++i) {
+            names.push_back("small-" + std::to_string(i));
+            make_file(names.back(), size);
+        }
+        unsigned int failed = 0;
+        auto t0 = Clock::now();
+        for (const auto& name : names) {
+            bool sent = tx.send_file(host, rx.listen_port(), name);
+            if (!sent || waiter.wait(1, kTimeout) != 0) ++failed;
+        }
+        double dt = std::chrono::duration<double>(Clock::now() - t0).count();
+        std::fprintf(human, "%-12s %-10s %-8u %-12.1f %-12.3f\n", "small_files", size_label(size).c_str(), small_files,
+                     size * small_files / dt / (1 << 20), dt * 1000 / small_files);
+        std::string params = "size=" + std::to_string(size) + ";files=" + std::to_string(small_files);
+        report.add("small_files", params, "files_per_s", small_files / dt, "files/s");
+        report.add("small_files", params, "failed", failed, "files");
+        for (const auto& name : names) {
+            ::unlink(name.c_str());
+            remove_received(name);
+        }
+    }
+
+    // concurrent senders, each with its own file; the receiver's pool bounds how many
+    // are written at once
+    for (unsigned int senders : {1u, 2u, 4u, 8u}) {
+        const uint64_t size = std::min<uint64_t>(64ull << 20, max_size);
+        std::vector<std::string> names;
+        for (unsigned int i = 0; i < senders; ++i) {
+            names.push_back("conc-" + std::to_string(i));
+            make_file(names.back(), size);
+        }
+        std::atomic<unsigned int> send_failed(0);
+        auto t0 = Clock::now();
+        std::vector<std::thread> threads;
+        for (const auto& name : names) {
+            threads.emplace_back([&, name]() {
+                if (!tx.send_file(host, rx.listen_port(), name)) ++send_failed;
+            });
+        }
+        for (auto& t : threads) t.join();
+        int rx_failed = waiter.wait(senders, kTimeout);
+        double dt = std::chrono::duration<double>(Clock::now() - t0).count();
+        double mbps = static_cast<double>(size) * senders / dt / (1 << 20);
+        std::fprintf(human, "%-12s %-10s %-8u %-12.1f %-12.3f\n", "concurrent", size_label(size).c_str(), senders, mbps,
+                     dt * 1000);
+        std::string params = "senders=" + std::to_string(senders) + ";size=" + std::to_string(size);
+        report.add("concurrent", params, "aggregate_throughput", mbps, "MB/s");
+        report.add("concurrent", params, "failed", send_failed.load() + (rx_failed < 0 ? senders : rx_failed), "files");
+        for (const auto& name : names) {
+            ::unlink(name.c_str());
+            remove_received(name);
+        }
+    }
+
+    // control plane: request -> pending list -> decision -> answer
+    {
+        std::atomic<bool> accepting(true);
+        std::thread acceptor([&]() {
+            while (accepting.load()) {
+                std::vector<uint64_t> undecided;
+                {
+                    std::unique_lock<std::mutex> lock(rx.pending_mutex_);
+                    rx.pending_cv_.wait_for(lock, std::chrono::milliseconds(10));
+                    for (const auto& req : rx.pending_) {
+                        if (req->decision.load() == -1) undecided.push_back(req->id);
+                    }
+                }
+                for (uint64_t id : undecided) rx.decide_request_by_id(id, true);
+            }
+        });
+        std::vector<double> rtts;
+        unsigned int failed = 0;
+        for (unsigned int i = 0; i < rtt_samples; ++i) {
+            auto t0 = Clock::now();
+            if (!tx.request_send(host, rx.control_port(), "rtt-" + std::to_string(i), 5000)) {
+                ++failed;
+                continue;
+            }
+            rtts.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+        }
+        accepting.store(false);
+        acceptor.join();
+        std::sort(rtts.begin(), rtts.end());
+        auto pct = [&rtts](double p) { return rtts.empty() ? 0.0 : rtts[static_cast<size_t>(p * (rtts.size() - 1))]; };
+        double mean = 0;
+        for (double r : rtts) mean += r;
+        if (!rtts.empty()) mean /= rtts.size();
+        std::fprintf(human, "%-12s p50 %.0f us, p99 %.0f us, mean %.0f us, %u failed\n", "control_rtt", pct(0.5),
+                     pct(0.99), mean, failed);
+        std::string params = "samples=" + std::to_string(rtt_samples);
+        report.add("control_rtt", params, "p50", pct(0.5), "us");
+        report.add("control_rtt", params, "p99", pct(0.99), "us");
+        report.add("control_rtt", params, "mean", mean, "us");
+        report.add("control_rtt", params, "failed", failed, "requests");
+    }
+
+    rx.stop_receiver();
+    ::rmdir("recv");
+    if (chdir("/") == 0) ::rmdir(scratch);
+    report.write(format);
+    return 0;
+}
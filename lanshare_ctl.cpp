@@ -0,0 +1,156 @@
+// Command-line client for lanshared's control socket: sends one command, prints the JSON
+// reply (or, for watch, every event until interrupted). Exits 1 unless the daemon said ok.
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static std::string default_socket_path() {
+    const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime) return std::string(runtime) + "/lanshare.sock";
+    return "/tmp/lanshare-" + std::to_string(getuid()) + ".sock";
+}
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [--socket=PATH] <command> [args]\n"
+              << "  devices | requests | transfers | jobs | watch\n"
+              << "  accept ID | reject ID\n"
+              << "  send [--wait] IP PATH\n"
+              << "  stream [--name=NAME] IP    (sends standard input until EOF, then waits)\n"
+              << "  wait ID\n"
+              << "  browse IP [AFTER] | pull IP PATH\n"
+              << "  search NAME\n";
+}
+
+// reads one newline-terminated line, keeping whatever follows it in buf
+static bool read_line(int fd, std::string& buf, std::string& line) {
+    size_t nl;
+    while ((nl = buf.find('\n')) == std::string::npos) {
+        char chunk[4096];
+        ssize_t r = read(fd, chunk, sizeof(chunk));
+        if (r <= 0) return false;
+        buf.append(chunk, r);
+    }
+    line = buf.substr(0, nl);
+    buf.erase(0, nl + 1);
+    return true;
+}
+
+static bool send_line(int fd, const std::string& line) {
+    std::string out = line + "\n";
+    size_t off = 0;
+    while (off < out.size()) {
+        ssize_t w = write(fd, out.data() + off, out.size() - off);
+        if (w <= 0) return false;
+        off += w;
+    }
+    return true;
+}
+
+// the line with our standard input attached, for the daemon to read from directly
+static bool send_line_with_stdin(int fd, const std::string& line) {
+    std::string out = line + "\n";
+    struct iovec iov = {&out[0], out.size()};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    int in = STDIN_FILENO;
+    std::memcpy(CMSG_DATA(cm), &in, sizeof(int));
+    // the line is short enough to go in one message, and must, to keep the fd with it
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(out.size());
+}
+
+static bool is_ok(const std::string& reply) {
+    return reply.rfind("{\"ok\":true", 0) == 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string socket_path = default_socket_path();
+    int i = 1;
+    if (i < argc && std::strncmp(argv[i], "--socket=", 9) == 0) socket_path = argv[i++] + 9;
+    if (i >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    std::string cmd = argv[i++];
+    bool wait = false;
+    if (cmd == "send" && i < argc && std::strcmp(argv[i], "--wait") == 0) {
+        wait = true;
+        ++i;
+    }
+    std::string line = cmd;
+    if (cmd == "stream") {
+        std::string name = "stdin";
+        if (i < argc && std::strncmp(argv[i], "--name=", 7) == 0) name = argv[i++] + 7;
+        if (argc - i != 1 || name.empty()) {
+            usage(argv[0]);
+            return 2;
+        }
+        line += std::string(" ") + argv[i] + " " + name;
+        // the reply only tells the job was queued
+        wait = true;
+    } else if (cmd == "send") {
+        if (argc - i != 2) {
+            usage(argv[0]);
+            return 2;
+        }
+        // the daemon has its own working directory
+        char resolved[PATH_MAX];
+        if (!realpath(argv[i + 1], resolved)) {
+            perror(argv[i + 1]);
+            return 1;
+        }
+        line += std::string(" ") + argv[i] + " " + resolved;
+    } else {
+        for (; i < argc; ++i) line += std::string(" ") + argv[i];
+    }
+
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long\n";
+        return 1;
+    }
+    std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "Cannot connect to " << socket_path << ": " << std::strerror(errno) << " (is lanshared running?)\n";
+        return 1;
+    }
+
+    std::string buf, reply;
+    bool sent = cmd == "stream" ? send_line_with_stdin(fd, line) : send_line(fd, line);
+    if (!sent || !read_line(fd, buf, reply)) {
+        std::cerr << "Connection to lanshared lost\n";
+        close(fd);
+        return 1;
+    }
+    std::cout << reply << std::endl;
+    bool ok = is_ok(reply);
+    if (ok && cmd == "watch") {
+        while (read_line(fd, buf, reply)) std::cout << reply << std::endl;
+    } else if (ok && wait) {
+        // {"ok":true,"id":N}
+        auto pos = reply.find("\"id\":");
+        std::string id = pos == std::string::npos ? "" : std::to_string(std::strtoull(reply.c_str() + pos + 5, nullptr, 10));
+        ok = !id.empty() && send_line(fd, "wait " + id) && read_line(fd, buf, reply);
+        if (ok) {
+            std::cout << reply << std::endl;
+            ok = is_ok(reply);
+        }
+    }
+    close(fd);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+// Headless LANShare node: discovery, receives and sends without a UI, driven through the
+// control socket (see ControlServer.hpp and lanshare-ctl).
+#include "Node.hpp"
+#include "ControlServer.hpp"
+#include <iostream>
+#include <csignal>
+#include <cstdlib>
+#include <unistd.h>
+
+static std::string default_socket_path() {
+    const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime) return std::string(runtime) + "/lanshare.sock";
+    return "/tmp/lanshare-" + std::to_string(getuid()) + ".sock";
+}
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " " << kNodeUsage << "\n"
+              << "       [--socket=PATH] [--dir=PATH] [--auto-accept]\n";
+}
+
+int main(int argc, char* argv[]) {
+    NodeOptions opts;
+    std::string socket_path = default_socket_path();
+    std::string dir;
+    bool auto_accept = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        int r = parse_node_option(arg, opts);
+        if (r == 1) continue;
+        if (r == 0 && arg.rfind("--socket=", 0) == 0) {
+            socket_path = arg.substr(9);
+        } else if (r == 0 && arg.rfind("--dir=", 0) == 0) {
+            dir = arg.substr(6);
+        } else if (r == 0 && arg == "--auto-accept") {
+            auto_accept = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // received files go to recv/ under the working directory
+    if (!dir.empty() && chdir(dir.c_str()) != 0) {
+        perror("chdir");
+        return 1;
+    }
+
+    // taken with sigwait below, so block them before any thread starts
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+    Node node(opts);
+    if (int rc = node.start()) return rc;
+    ControlServer control(node.loop(), node.listener(), node.transfers());
+    control.set_auto_accept(auto_accept);
+    if (!control.start(socket_path)) {
+        node.stop();
+        return 3;
+    }
+    std::cerr << "lanshared: control socket " << socket_path << "\n";
+
+    int sig = 0;
+    sigwait(&stop_signals, &sig);
+    std::cerr << "Stopping... sending shutdown to peers\n";
+    node.notify_peers();
+    control.stop();
+    node.stop();
+    return 0;
+}
@@ -1,18 +1,11 @@
-#include "SubnetBroadcaster.hpp"
-#include "SubnetListener.hpp"
-#include "MessageCodec.hpp"
-#include "FileTransfer.hpp"
+#include "Node.hpp"
 #include "UI.hpp"
 #include "UIQt.hpp"
 #include <QApplication>
 #include <iostream>
-#include <thread>
 #include <csignal>
 #include <atomic>
 
-static SubnetBroadcaster* g_broadcaster = nullptr;
-static SubnetListener* g_listener = nullptr;
-static FileTransfer* g_filetransfer = nullptr;
 static std::atomic<bool> g_terminate(false);
 
 // Signal handler sets a flag only (async-signal-safe)
@@ -20,37 +13,28 @@ void sigint_handler(int) {
     g_terminate.store(true);
 }
 
-int main(int argc, char* argv[]) {
-    std::string if_name;
-    if (argc > 1) if_name = argv[1];
-
-    SubnetBroadcaster bc(2000, 40000);
-    if (!bc.init(if_name)) {
-        std::cerr << "Init failed\n";
-        return 1;
-    }
-
-    SubnetListener listener(40000);
-    if (!listener.start()) {
-        std::cerr << "Listener start failed\n";
-        return 2;
-    }
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " " << kNodeUsage << "\n";
+}
 
-    FileTransfer ft(40001);
-    if (!ft.start_receiver()) {
-        std::cerr << "File receiver failed to start\n";
-        // continue anyway
+int main(int argc, char* argv[]) {
+    NodeOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        if (parse_node_option(argv[i], opts) != 1) {
+            usage(argv[0]);
+            return 1;
+        }
     }
 
-    g_broadcaster = &bc;
-    g_listener = &listener;
-    g_filetransfer = &ft;
+    Node node(opts);
+    if (int rc = node.start()) return rc;
     std::signal(SIGINT, sigint_handler);
     std::signal(SIGTERM, sigint_handler);
+    SubnetListener& listener = node.listener();
+    FileTransfer& ft = node.transfers();
+    SubnetBroadcaster& bc = node.broadcaster();
 
-    bc.start(MessageCodec::MSG_ALIVE, MessageCodec::MSG_SHUTDOWN);
-
-    std::cout << "Broadcasting and listening on port 40000. Starting UI...\n";
+    std::cout << "Announcing to " << bc.broadcast_address() << " and listening on port 40000. Starting UI...\n";
     // Try Qt UI first
     bool qtStarted = false;
     try {
@@ -72,20 +56,14 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    // if termination requested, attempt to notify peers
+    // if termination requested, attempt to notify peers; all notifications go out
+    // concurrently under one deadline so exit time stays bounded
     if (g_terminate.load()) {
         std::cerr << "\nStopping... sending shutdown to peers\n";
-        if (g_filetransfer && g_listener) {
-            auto devices = g_listener->get_devices();
-            for (const auto& [ip, info] : devices) {
-                g_filetransfer->send_shutdown(ip);
-            }
-        }
+        node.notify_peers();
     }
 
     // clean shutdown
-    if (g_broadcaster) g_broadcaster->stop();
-    if (g_listener) g_listener->stop();
-    if (g_filetransfer) g_filetransfer->stop_receiver();
+    node.stop();
     return 0;
 }
@@ -0,0 +1,570 @@
+// Synthetic peer load generator.
+//
+// Simulates N peers on 127.2.0.0/16. Each peer sends binary beacons with a realistic
+// hostname at its own jittered interval (all of them from one socket, with the source
+// address picked per message via IP_PKTINFO, so thousands of peers cost no file descriptors).
+// Worker threads open control connections from random peer addresses and send
+// MSG_FILE_REQUEST at a fixed rate. Halfway through the run a fraction of the peers goes
+// silent and another fraction shuts down, half by shutdown beacon and half over TCP.
+//
+// By default the tool runs its own SubnetListener and FileTransfer control server, which
+// decides every request at once. It then also measures:
+//   - device-table accuracy, sampled every second against what each peer should look like
+//   - discovery latency: first beacon sent to the Added event
+//   - expiry timeliness: Expired event time minus (last beacon + expiry window)
+//   - shutdown latency: shutdown sent to the ShutDown event
+// With --target=IP it loads a running netdemo instead. Only control latency is measured
+// then; undecided requests show up as timeouts.
+//
+// Usage:
+//   tools/loadgen [--peers=1000] [--beacon-interval-ms=2000] [--duration=20]
+//                 [--requests-per-s=50] [--concurrency=16] [--silence=0.1] [--shutdown=0.1]
+//                 [--expiry-ms=6000] [--decide=accept|reject] [--target=IP]
+//                 [--port=41200] [--control-port=40003] [--shutdown-port=40002]
+//                 [--format=table|json|csv]
+#include "SubnetListener.hpp"
+#include "FileTransfer.hpp"
+#include "MessageCodec.hpp"
+#include "bench_report.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+enum class PeerMode { Beaconing, Silent, ShutDown };
+
+struct Peer {
+    in_addr_t addr;  // network byte order
+    std::string ip;
+    std::string hostname;
+    uint32_t seq = 0;
+    uint16_t active_transfers = 0;
+    uint32_t free_disk_mb = 0;
+    // written by the beacon thread, read by the samplers
+    std::atomic<int64_t> first_beacon_ns{0};
+    std::atomic<int64_t> last_beacon_ns{0};
+    std::atomic<int> mode{static_cast<int>(PeerMode::Beaconing)};
+    std::atomic<int64_t> stopped_ns{0};
+};
+
+struct Options {
+    unsigned int peers = 1000;
+    unsigned int beacon_interval_ms = 2000;
+    unsigned int duration_s = 20;
+    unsigned int requests_per_s = 50;
+    unsigned int concurrency = 16;
+    double silence = 0.1;
+    double shutdown = 0.1;
+    unsigned int expiry_ms = 6000;
+    bool accept = true;
+    std::string target;
+    uint16_t port = 41200;
+    uint16_t control_port = 40003;
+    uint16_t shutdown_port = 40002;
+    unsigned int request_timeout_ms = 5000;
+    BenchFormat format = BenchFormat::Table;
+};
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static std::string make_hostname(std::mt19937& rng, unsigned int i) {
+    static const char* const roles[] = {"ws", "lt", "build", "nas", "kiosk", "lab", "srv", "mbp"};
+    static const char* const teams[] = {"eng", "ops", "fin", "hr", "qa", "design", "sales", "it"};
+    static const char* const sites[] = {"corp", "hq", "branch2", "lab", "dc1"};
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s-%s-%04u.%s.example.lan", roles[rng() % 8], teams[rng() % 8], i, sites[rng() % 5]);
+    return buf;
+}
+
+// percentile of an unsorted sample, 0 when empty
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[static_cast<size_t>(p * (v.size() - 1))];
+}
+
+class LoadGen {
+public:
+    LoadGen(const Options& opt, std::vector<std::unique_ptr<Peer>>& peers, in_addr_t dest)
+        : opt_(opt), peers_(peers), dest_(dest), running_(true) {}
+
+    // one thread for every peer's beacons, sent in sendmmsg batches as they fall due
+    void beacon_loop() {
+        int s = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (s < 0) {
+            perror("loadgen: socket");
+            return;
+        }
+        std::mt19937 rng(1);
+        using Due = std::pair<Clock::time_point, size_t>;
+        std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due;
+        auto start = Clock::now();
+        std::uniform_int_distribution<unsigned int> offset(0, opt_.beacon_interval_ms);
+        for (size_t i = 0; i < peers_.size(); ++i) due.push({start + std::chrono::milliseconds(offset(rng)), i});
+
+        constexpr size_t kBatch = 64;
+        constexpr size_t kControlLen = CMSG_SPACE(sizeof(struct in_pktinfo));
+        uint8_t payloads[kBatch][MessageCodec::BEACON_MAX_LEN];
+        char control[kBatch][kControlLen];
+        struct iovec iov[kBatch];
+        struct mmsghdr msgs[kBatch];
+        struct sockaddr_in dst{};
+        dst.sin_family = AF_INET;
+        dst.sin_port = htons(opt_.port);
+        dst.sin_addr.s_addr = dest_;
+        std::uniform_int_distribution<int> jitter(-static_cast<int>(opt_.beacon_interval_ms / 4),
+                                                  static_cast<int>(opt_.beacon_interval_ms / 4));
+
+        while (running_.load(std::memory_order_relaxed) && !due.empty()) {
+            auto next = due.top().first;
+            if (next > Clock::now()) {
+                std::this_thread::sleep_until(std::min(next, Clock::now() + std::chrono::milliseconds(50)));
+                continue;
+            }
+            size_t n = 0;
+            std::vector<size_t> sent_by;
+            while (n < kBatch && !due.empty() && due.top().first <= Clock::now()) {
+                size_t i = due.top().second;
+                due.pop();
+                Peer& p = *peers_[i];
+                PeerMode mode = static_cast<PeerMode>(p.mode.load());
+                if (mode == PeerMode::Silent) continue;
+                if (mode == PeerMode::ShutDown && p.stopped_ns.load() != 0) continue;
+                MessageCodec::Beacon b;
+                b.code = mode == PeerMode::ShutDown ? MessageCodec::MSG_SHUTDOWN : MessageCodec::MSG_ALIVE;
+                b.data_port = 40001;
+                b.control_port = 40003;
+                b.active_transfers = p.active_transfers;
+                b.free_disk_mb = p.free_disk_mb;
+                b.seq = p.seq++;
+                b.tx_ms = static_cast<uint32_t>(now_ns() / 1000000);
+                b.hostname = p.hostname.data();
+                b.hostname_len = static_cast<uint8_t>(p.hostname.size());
+                size_t len = MessageCodec::encode_beacon(b, payloads[n], sizeof(payloads[n]));
+                iov[n].iov_base = payloads[n];
+                iov[n].iov_len = len;
+                std::memset(&msgs[n], 0, sizeof(msgs[n]));
+                struct msghdr& hdr = msgs[n].msg_hdr;
+                hdr.msg_name = &dst;
+                hdr.msg_namelen = sizeof(dst);
+                hdr.msg_iov = &iov[n];
+                hdr.msg_iovlen = 1;
+                hdr.msg_control = control[n];
+                hdr.msg_controllen = kControlLen;
+                struct cmsghdr* c = CMSG_FIRSTHDR(&hdr);
+                c->cmsg_level = IPPROTO_IP;
+                c->cmsg_type = IP_PKTINFO;
+                c->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+                struct in_pktinfo pi{};
+                pi.ipi_spec_dst.s_addr = p.addr;
+                std::memcpy(CMSG_DATA(c), &pi, sizeof(pi));
+                sent_by.push_back(i);
+                ++n;
+                if (mode == PeerMode::ShutDown) {
+                    p.stopped_ns.store(now_ns());
+                } else {
+                    due.push({Clock::now() + std::chrono::milliseconds(opt_.beacon_interval_ms + jitter(rng)), i});
+                }
+            }
+            if (n == 0) continue;
+            int r = sendmmsg(s, msgs, n, 0);
+            int64_t t = now_ns();
+            for (int k = 0; k < r; ++k) {
+                Peer& p = *peers_[sent_by[k]];
+                int64_t zero = 0;
+                p.first_beacon_ns.compare_exchange_strong(zero, t);
+                p.last_beacon_ns.store(t);
+            }
+            beacons_sent_ += r > 0 ? r : 0;
+        }
+        ::close(s);
+    }
+
+    // a control worker: takes the next slot of the global request schedule, then asks
+    // from a random live peer's address and waits for the answer
+    void control_loop(unsigned int worker) {
+        std::mt19937 rng(100 + worker);
+        auto interval = std::chrono::nanoseconds(1000000000ll / std::max(1u, opt_.requests_per_s));
+        while (running_.load()) {
+            auto slot = Clock::time_point(Clock::duration(next_request_ns_.fetch_add(interval.count())));
+            if (slot > Clock::now()) std::this_thread::sleep_until(slot);
+            if (!running_.load()) break;
+            const Peer& p = *peers_[rng() % peers_.size()];
+            if (static_cast<PeerMode>(p.mode.load()) != PeerMode::Beaconing) continue;
+            request_once(p, worker);
+        }
+    }
+
+    void request_once(const Peer& p, unsigned int worker) {
+        auto t0 = Clock::now();
+        int s = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (s < 0) {
+            ++requests_failed_;
+            return;
+        }
+        struct timeval tv;
+        tv.tv_sec = opt_.request_timeout_ms / 1000;
+        tv.tv_usec = (opt_.request_timeout_ms % 1000) * 1000;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        struct sockaddr_in src{};
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = p.addr;
+        struct sockaddr_in dst{};
+        dst.sin_family = AF_INET;
+        dst.sin_port = htons(opt_.control_port);
+        dst.sin_addr.s_addr = dest_;
+        if (bind(s, reinterpret_cast<struct sockaddr*>(&src), sizeof(src)) < 0 ||
+            connect(s, reinterpret_cast<struct sockaddr*>(&dst), sizeof(dst)) < 0) {
+            ::close(s);
+            ++requests_failed_;
+            return;
+        }
+        std::string name = "loadgen-" + std::to_string(worker) + "-" + std::to_string(requests_sent_.fetch_add(1)) + ".bin";
+        std::vector<uint8_t> req;
+        req.push_back(MessageCodec::MSG_FILE_REQUEST);
+        req.push_back(static_cast<uint8_t>(name.size() >> 8));
+        req.push_back(static_cast<uint8_t>(name.size()));
+        req.insert(req.end(), name.begin(), name.end());
+        uint8_t resp = 0;
+        bool answered = send(s, req.data(), req.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(req.size()) &&
+                        recv(s, &resp, 1, MSG_WAITALL) == 1;
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+        ::close(s);
+        std::lock_guard<std::mutex> lock(results_mutex_);
+        if (!answered) {
+            ++requests_timed_out_;
+        } else {
+            request_ms_.push_back(ms);
+            if (resp == MessageCodec::MSG_FILE_ACCEPT) ++requests_accepted_;
+            else ++requests_rejected_;
+        }
+    }
+
+    // TCP shutdown notice from the peer's address, as FileTransfer::send_shutdown does
+    void tcp_shutdown(Peer& p) {
+        int s = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (s < 0) return;
+        struct sockaddr_in src{};
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = p.addr;
+        struct sockaddr_in dst{};
+        dst.sin_family = AF_INET;
+        dst.sin_port = htons(opt_.shutdown_port);
+        dst.sin_addr.s_addr = dest_;
+        uint8_t code = MessageCodec::MSG_SHUTDOWN;
+        p.stopped_ns.store(now_ns());
+        if (bind(s, reinterpret_cast<struct sockaddr*>(&src), sizeof(src)) == 0 &&
+            connect(s, reinterpret_cast<struct sockaddr*>(&dst), sizeof(dst)) == 0) {
+            send(s, &code, 1, MSG_NOSIGNAL);
+        }
+        ::close(s);
+    }
+
+    void start_requests() { next_request_ns_.store(Clock::now().time_since_epoch().count()); }
+    void stop() { running_.store(false); }
+
+    const Options& opt_;
+    std::vector<std::unique_ptr<Peer>>& peers_;
+    in_addr_t dest_;
+    std::atomic<bool> running_;
+    std::atomic<int64_t> next_request_ns_{0};
+    std::atomic<uint64_t> beacons_sent_{0};
+    std::atomic<uint64_t> requests_sent_{0};
+    std::atomic<uint64_t> requests_failed_{0};
+    std::mutex results_mutex_;
+    std::vector<double> request_ms_;
+    uint64_t requests_accepted_ = 0;
+    uint64_t requests_rejected_ = 0;
+    uint64_t requests_timed_out_ = 0;
+};
+
+static bool parse_args(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto val = [&a]() { return a.substr(a.find('=') + 1); };
+        if (a.rfind("--peers=", 0) == 0) opt.peers = std::stoul(val());
+        else if (a.rfind("--beacon-interval-ms=", 0) == 0) opt.beacon_interval_ms = std::stoul(val());
+        else if (a.rfind("--duration=", 0) == 0) opt.duration_s = std::stoul(val());
+        else if (a.rfind("--requests-per-s=", 0) == 0) opt.requests_per_s = std::stoul(val());
+        else if (a.rfind("--concurrency=", 0) == 0) opt.concurrency = std::stoul(val());
+        else if (a.rfind("--silence=", 0) == 0) opt.silence = std::stod(val());
+        else if (a.rfind("--shutdown=", 0) == 0) opt.shutdown = std::stod(val());
+        else if (a.rfind("--expiry-ms=", 0) == 0) opt.expiry_ms = std::stoul(val());
+        else if (a == "--decide=accept") opt.accept = true;
+        else if (a == "--decide=reject") opt.accept = false;
+        else if (a.rfind("--target=", 0) == 0) opt.target = val();
+        else if (a.rfind("--port=", 0) == 0) opt.port = std::stoul(val());
+        else if (a.rfind("--control-port=", 0) == 0) opt.control_port = std::stoul(val());
+        else if (a.rfind("--shutdown-port=", 0) == 0) opt.shutdown_port = std::stoul(val());
+        else if (!parse_bench_format(a, opt.format)) return false;
+    }
+    return opt.peers > 0 && opt.peers < 65535 && opt.silence + opt.shutdown <= 1.0;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    try {
+        if (!parse_args(argc, argv, opt)) throw std::invalid_argument("usage");
+    } catch (const std::exception&) {
+        std::cerr << "Usage: " << argv[0] << " [--peers=N] [--beacon-interval-ms=MS] [--duration=S] [--requests-per-s=N]"
+                  << " [--concurrency=N] [--silence=F] [--shutdown=F] [--expiry-ms=MS] [--decide=accept|reject]"
+                  << " [--target=IP] [--port=P] [--control-port=P] [--shutdown-port=P] [--format=table|json|csv]\n";
+        return 1;
+    }
+    FILE* human = opt.format == BenchFormat::Table ? stdout : stderr;
+    const bool embedded = opt.target.empty();
+    in_addr_t dest = inet_addr(embedded ? "127.0.0.1" : opt.target.c_str());
+
+    std::mt19937 rng(42);
+    std::vector<std::unique_ptr<Peer>> peers;
+    std::unordered_map<std::string, size_t> peer_index;
+    for (unsigned int i = 0; i < opt.peers; ++i) {
+        auto p = std::make_unique<Peer>();
+        p->addr = htonl(0x7F020000u + i + 1);
+        char buf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &p->addr, buf, sizeof(buf));
+        p->ip = buf;
+        p->hostname = make_hostname(rng, i);
+        p->active_transfers = rng() % 3;
+        p->free_disk_mb = 1000 + rng() % 500000;
+        peer_index[p->ip] = i;
+        peers.push_back(std::move(p));
+    }
+
+    // embedded target: listener + control server that decides every request at once
+    std::unique_ptr<SubnetListener> listener;
+    std::unique_ptr<FileTransfer> ft;
+    std::shared_ptr<DeviceSubscription> events;
+    if (embedded) {
+        listener.reset(new SubnetListener(opt.port));
+        listener->set_expiry_ms(opt.expiry_ms);
+        if (!listener->start()) {
+            std::cerr << "listener start failed\n";
+            return 1;
+        }
+        events = listener->subscribe();
+        ft.reset(new FileTransfer(opt.port + 1));
+        if (!ft->start_receiver()) {
+            std::cerr << "control server start failed\n";
+            return 1;
+        }
+        opt.control_port = ft->control_port();
+    }
+
+    LoadGen gen(opt, peers, dest);
+    std::atomic<bool> deciding(embedded);
+    std::thread decider;
+    if (embedded) {
+        decider = std::thread([&]() {
+            while (deciding.load()) {
+                std::vector<uint64_t> undecided;
+                {
+                    std::unique_lock<std::mutex> lock(ft->pending_mutex_);
+                    ft->pending_cv_.wait_for(lock, std::chrono::milliseconds(10));
+                    for (const auto& req : ft->pending_) {
+                        if (req->decision.load() == -1) undecided.push_back(req->id);
+                    }
+                }
+                for (uint64_t id : undecided) ft->decide_request_by_id(id, opt.accept);
+            }
+        });
+    }
+
+    // listener events, timestamped as they arrive
+    std::vector<double> discovery_ms, expiry_lag_ms, shutdown_ms;
+    std::vector<bool> expired_seen(peers.size(), false), shutdown_seen(peers.size(), false);
+    std::atomic<bool> watching(embedded);
+    std::thread watcher;
+    if (embedded) {
+        watcher = std::thread([&]() {
+            while (watching.load()) {
+                struct pollfd pfd{events->fd(), POLLIN, 0};
+                if (poll(&pfd, 1, 100) <= 0) continue;
+                int64_t t = now_ns();
+                for (const auto& e : events->drain()) {
+                    auto it = peer_index.find(e.info.ip);
+                    if (it == peer_index.end()) continue;
+                    Peer& p = *peers[it->second];
+                    if (e.type == DeviceEventType::Added) {
+                        int64_t first = p.first_beacon_ns.load();
+                        if (first) discovery_ms.push_back((t - first) / 1e6);
+                    } else if (e.type == DeviceEventType::Expired && !expired_seen[it->second] &&
+                               static_cast<PeerMode>(p.mode.load()) == PeerMode::Silent) {
+                        expired_seen[it->second] = true;
+                        double due = p.last_beacon_ns.load() / 1e6 + opt.expiry_ms;
+                        expiry_lag_ms.push_back(t / 1e6 - due);
+                    } else if (e.type == DeviceEventType::ShutDown && !shutdown_seen[it->second]) {
+                        shutdown_seen[it->second] = true;
+                        if (p.stopped_ns.load()) shutdown_ms.push_back((t - p.stopped_ns.load()) / 1e6);
+                    }
+                }
+            }
+        });
+    }
+
+    std::fprintf(human, "%u peers on 127.2.0.0/16, beacon every %u ms, %u requests/s -> %s\n", opt.peers,
+                 opt.beacon_interval_ms, opt.requests_per_s, embedded ? "embedded listener" : opt.target.c_str());
+    std::thread beacons(&LoadGen::beacon_loop, &gen);
+    gen.start_requests();
+    std::vector<std::thread> workers;
+    for (unsigned int w = 0; w < opt.concurrency; ++w) workers.emplace_back(&LoadGen::control_loop, &gen, w);
+
+    // churn halfway through; the run is stretched so silenced peers have time to expire
+    auto t0 = Clock::now();
+    auto churn_at = t0 + std::chrono::seconds(opt.duration_s) / 2;
+    auto end_at = std::max(t0 + std::chrono::seconds(opt.duration_s),
+                           churn_at + std::chrono::milliseconds(opt.expiry_ms + 2 * opt.beacon_interval_ms + 2000));
+    bool churned = false;
+    std::vector<double> accuracy;
+    uint64_t missing_total = 0, stale_total = 0, wrong_hostname_total = 0;
+    // peers are judged only once they had time to be seen (or forgotten)
+    const int64_t grace_ns = 500ll * 1000000;
+    while (Clock::now() < end_at) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        if (!churned && Clock::now() >= churn_at) {
+            churned = true;
+            size_t silent = static_cast<size_t>(opt.silence * peers.size());
+            size_t down = static_cast<size_t>(opt.shutdown * peers.size());
+            for (size_t i = 0; i < silent; ++i) {
+                peers[i]->mode.store(static_cast<int>(PeerMode::Silent));
+                peers[i]->stopped_ns.store(now_ns());
+            }
+            for (size_t i = silent; i < silent + down; ++i) {
+                // beacon shutdowns go out with the peer's next due beacon; TCP ones now,
+                // marked stopped first so the beacon thread does not send one as well
+                bool tcp = (i - silent) % 2;
+                if (tcp) peers[i]->stopped_ns.store(now_ns());
+                peers[i]->mode.store(static_cast<int>(PeerMode::ShutDown));
+                if (tcp) gen.tcp_shutdown(*peers[i]);
+            }
+            std::fprintf(human, "churn: %zu peers silenced, %zu shut down\n", silent, down);
+        }
+        if (!embedded) continue;
+
+        auto snap = listener->snapshot();
+        int64_t t = now_ns();
+        uint64_t judged = 0, correct = 0, missing = 0, stale = 0, wrong_hostname = 0;
+        for (const auto& pp : peers) {
+            const Peer& p = *pp;
+            int64_t first = p.first_beacon_ns.load();
+            if (!first || t - first < grace_ns) continue;
+            PeerMode mode = static_cast<PeerMode>(p.mode.load());
+            int64_t stopped = p.stopped_ns.load();
+            bool expect_present;
+            if (mode == PeerMode::Beaconing) expect_present = true;
+            else if (mode == PeerMode::ShutDown && stopped && t - stopped > grace_ns) expect_present = false;
+            else if (mode == PeerMode::Silent && t - p.last_beacon_ns.load() > opt.expiry_ms * 1000000ll + grace_ns) expect_present = false;
+            else continue; // in transition
+            ++judged;
+            auto it = snap->find(p.ip);
+            bool present = it != snap->end();
+            if (present != expect_present) {
+                if (expect_present) ++missing;
+                else ++stale;
+            } else if (present && it->second.hostname != p.hostname) {
+                ++wrong_hostname;
+            } else {
+                ++correct;
+            }
+        }
+        if (judged) accuracy.push_back(100.0 * correct / judged);
+        missing_total += missing;
+        stale_total += stale;
+        wrong_hostname_total += wrong_hostname;
+        std::fprintf(human, "  table: %zu entries, %llu/%llu correct, %llu missing, %llu stale, %llu wrong hostname\n",
+                     snap->size(), static_cast<unsigned long long>(correct), static_cast<unsigned long long>(judged),
+                     static_cast<unsigned long long>(missing), static_cast<unsigned long long>(stale),
+                     static_cast<unsigned long long>(wrong_hostname));
+    }
+
+    gen.stop();
+    beacons.join();
+    for (auto& w : workers) w.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+    if (embedded) {
+        watching.store(false);
+        watcher.join();
+        deciding.store(false);
+        decider.join();
+        ft->stop_receiver();
+        listener->stop();
+    }
+
+    BenchReport report("loadgen");
+    std::string params = "peers=" + std::to_string(opt.peers) + ";interval_ms=" + std::to_string(opt.beacon_interval_ms) +
+                         ";requests_per_s=" + std::to_string(opt.requests_per_s) + ";target=" +
+                         (embedded ? std::string("embedded") : opt.target);
+    report.add("beacons", params, "sent", gen.beacons_sent_.load() / elapsed, "beacons/s");
+    report.add("control", params, "answered", static_cast<double>(gen.request_ms_.size()), "requests");
+    report.add("control", params, "accepted", static_cast<double>(gen.requests_accepted_), "requests");
+    report.add("control", params, "rejected", static_cast<double>(gen.requests_rejected_), "requests");
+    report.add("control", params, "timed_out", static_cast<double>(gen.requests_timed_out_), "requests");
+    report.add("control", params, "connect_failed", static_cast<double>(gen.requests_failed_.load()), "requests");
+    report.add("control", params, "latency_p50", percentile(gen.request_ms_, 0.5), "ms");
+    report.add("control", params, "latency_p99", percentile(gen.request_ms_, 0.99), "ms");
+    report.add("control", params, "latency_max", percentile(gen.request_ms_, 1.0), "ms");
+    std::fprintf(human, "beacons: %.0f/s\n", gen.beacons_sent_.load() / elapsed);
+    std::fprintf(human, "control: %zu answered (%llu accepted, %llu rejected), %llu timed out, %llu failed;"
+                 " p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                 gen.request_ms_.size(), static_cast<unsigned long long>(gen.requests_accepted_),
+                 static_cast<unsigned long long>(gen.requests_rejected_),
+                 static_cast<unsigned long long>(gen.requests_timed_out_),
+                 static_cast<unsigned long long>(gen.requests_failed_.load()), percentile(gen.request_ms_, 0.5),
+                 percentile(gen.request_ms_, 0.99), percentile(gen.request_ms_, 1.0));
+    if (embedded) {
+        size_t silent = static_cast<size_t>(opt.silence * peers.size());
+        size_t down = static_cast<size_t>(opt.shutdown * peers.size());
+        double mean_accuracy = 0;
+        for (double a : accuracy) mean_accuracy += a;
+        if (!accuracy.empty()) mean_accuracy /= accuracy.size();
+        double min_accuracy = accuracy.empty() ? 0 : *std::min_element(accuracy.begin(), accuracy.end());
+        report.add("table", params, "accuracy_mean", mean_accuracy, "%");
+        report.add("table", params, "accuracy_min", min_accuracy, "%");
+        report.add("table", params, "missing", static_cast<double>(missing_total), "samples");
+        report.add("table", params, "stale", static_cast<double>(stale_total), "samples");
+        report.add("table", params, "wrong_hostname", static_cast<double>(wrong_hostname_total), "samples");
+        report.add("discovery", params, "latency_p50", percentile(discovery_ms, 0.5), "ms");
+        report.add("discovery", params, "latency_p99", percentile(discovery_ms, 0.99), "ms");
+        report.add("expiry", params, "expired", static_cast<double>(expiry_lag_ms.size()), "peers");
+        report.add("expiry", params, "silenced", static_cast<double>(silent), "peers");
+        report.add("expiry", params, "lag_p50", percentile(expiry_lag_ms, 0.5), "ms");
+        report.add("expiry", params, "lag_p99", percentile(expiry_lag_ms, 0.99), "ms");
+        report.add("expiry", params, "lag_max", percentile(expiry_lag_ms, 1.0), "ms");
+        report.add("shutdown", params, "seen", static_cast<double>(shutdown_ms.size()), "peers");
+        report.add("shutdown", params, "sent", static_cast<double>(down), "peers");
+        report.add("shutdown", params, "latency_p50", percentile(shutdown_ms, 0.5), "ms");
+        report.add("shutdown", params, "latency_p99", percentile(shutdown_ms, 0.99), "ms");
+        std::fprintf(human, "table accuracy: mean %.2f%%, min %.2f%% (%llu missing, %llu stale, %llu wrong hostname)\n",
+                     mean_accuracy, min_accuracy, static_cast<unsigned long long>(missing_total),
+                     static_cast<unsigned long long>(stale_total), static_cast<unsigned long long>(wrong_hostname_total));
+        std::fprintf(human, "discovery: p50 %.1f ms, p99 %.1f ms\n", percentile(discovery_ms, 0.5),
+                     percentile(discovery_ms, 0.99));
+        std::fprintf(human, "expiry: %zu/%zu expired, lag past the window p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+                     expiry_lag_ms.size(), silent, percentile(expiry_lag_ms, 0.5), percentile(expiry_lag_ms, 0.99),
+                     percentile(expiry_lag_ms, 1.0));
+        std::fprintf(human, "shutdown: %zu/%zu seen, p50 %.1f ms, p99 %.1f ms\n", shutdown_ms.size(), down,
+                     percentile(shutdown_ms, 0.5), percentile(shutdown_ms, 0.99));
+    }
+    report.write(opt.format);
+    return 0;
+}
@@ -0,0 +1,349 @@
+#!/usr/bin/env bash
+# Multi-node integration and performance harness: runs lanshared nodes in separate network
+# namespaces on one bridged /24, shapes each node's link with tc, then drives discovery,
+# request, transfer, warm-restart and shutdown scenarios through lanshare-ctl, checking
+# the results and timing them. Needs root, iproute2 and tc; no external network. Results
+# are printed as a table and written as JSON in the bench_report.hpp layout.
+#
+#   sudo tools/netns_harness.sh [--nodes=N] [--profile=lan,wifi,...|all] [--size-mb=MB]
+#                               [--out=FILE] [--bin=DIR] [--keep]
+#
+# Profiles (applied to every node's egress, so RTT between nodes is twice the delay):
+#   lan    no shaping
+#   wifi   3 ms +-1 ms, 0.5% loss, 100 mbit
+#   lossy  1 ms, 5% loss, 100 mbit
+#   wan    20 ms +-5 ms, 0.1% loss, 20 mbit
+# Without the sch_netem module only the rate is applied (tbf), and rows say netem=0.
+set -u
+
+NODES=4
+PROFILES=lan
+SIZE_MB=20
+OUT=bench/results/netns.json
+BIN=.
+KEEP=0
+for arg in "$@"; do
+    case "$arg" in
+        --nodes=*) NODES=${arg#*=} ;;
+        --profile=*) PROFILES=${arg#*=} ;;
+        --size-mb=*) SIZE_MB=${arg#*=} ;;
+        --out=*) OUT=${arg#*=} ;;
+        --bin=*) BIN=${arg#*=} ;;
+        --keep) KEEP=1 ;;
+        *) sed -n '8,9p' "$0" | sed 's/^# *//' >&2; exit 2 ;;
+    esac
+done
+[ "$PROFILES" = all ] && PROFILES=lan,wifi,lossy,wan
+if [ "$(id -u)" -ne 0 ]; then
+    echo "netns_harness: needs root (network namespaces, tc)" >&2
+    exit 2
+fi
+if [ "$NODES" -lt 3 ] || [ "$NODES" -gt 200 ]; then
+    echo "netns_harness: --nodes must be 3..200" >&2
+    exit 2
+fi
+for b in lanshared lanshare-ctl; do
+    [ -x "$BIN/$b" ] || { echo "netns_harness: $BIN/$b missing (make daemon)" >&2; exit 2; }
+done
+BIN=$(cd "$BIN" && pwd)
+
+HUB=lsh-hub
+SUBNET=10.200.0
+WORK=$(mktemp -d /tmp/lanshare-netns.XXXXXX)
+PIDS=()
+ROWS=()
+FAILED=0
+PASSED=0
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+ip_of() { echo "$SUBNET.$(($1 + 1))"; }
+ctl() { local n=$1; shift; "$BIN/lanshare-ctl" --socket="$WORK/$n.sock" "$@"; }
+
+# case params metric value unit
+row() { ROWS+=("$1|$2|$3|$4|$5"); }
+check() {
+    if [ "$2" = 0 ]; then
+        PASSED=$((PASSED + 1))
+        echo "PASS  $1"
+    else
+        FAILED=$((FAILED + 1))
+        echo "FAIL  $1"
+    fi
+}
+
+# wait_for TIMEOUT_MS COMMAND...: retries every 20 ms until COMMAND succeeds
+wait_for() {
+    local deadline=$(($(now_ms) + $1))
+    shift
+    until "$@"; do
+        [ "$(now_ms)" -ge "$deadline" ] && return 1
+        sleep 0.02
+    done
+}
+
+teardown() {
+    for pid in "${PIDS[@]}"; do kill -TERM "$pid" 2>/dev/null; done
+    for pid in "${PIDS[@]}"; do wait "$pid" 2>/dev/null; done
+    PIDS=()
+    for ns in $(ip netns list | awk '/^lsh-/ {print $1}'); do ip netns del "$ns"; done
+}
+cleanup() {
+    teardown
+    if [ "$KEEP" = 1 ]; then echo "logs and received files kept in $WORK"; else rm -rf "$WORK"; fi
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+NETEM=1
+# profile name -> netem arguments; the rate alone goes to tbf without netem
+profile_netem() {
+    case "$1" in
+        lan) echo "" ;;
+        wifi) echo "delay 3ms 1ms loss 0.5% rate 100mbit" ;;
+        lossy) echo "delay 1ms loss 5% rate 100mbit" ;;
+        wan) echo "delay 20ms 5ms loss 0.1% rate 20mbit" ;;
+        *) return 1 ;;
+    esac
+}
+
+shape() {
+    local ns=$1 args=$2
+    [ -z "$args" ] && return 0
+    if [ "$NETEM" = 1 ] && ip netns exec "$ns" tc qdisc replace dev eth0 root netem $args 2>/dev/null; then
+        return 0
+    fi
+    NETEM=0
+    local rate
+    rate=$(echo "$args" | sed -n 's/.*rate \([^ ]*\).*/\1/p')
+    [ -n "$rate" ] && ip netns exec "$ns" tc qdisc replace dev eth0 root tbf rate "$rate" burst 64kb latency 100ms
+}
+
+# a hub namespace holding the bridge, and one namespace per node with eth0 plugged into it
+setup_network() {
+    local profile=$1 args
+    args=$(profile_netem "$profile") || { echo "netns_harness: unknown profile $profile" >&2; exit 2; }
+    ip netns add "$HUB"
+    ip -n "$HUB" link add br0 type bridge
+    ip -n "$HUB" link set br0 up
+    for i in $(seq 1 "$NODES"); do
+        local ns=lsh-$i
+        ip netns add "$ns"
+        ip link add "lshv$i" type veth peer name "lshp$i"
+        ip link set "lshv$i" netns "$HUB"
+        ip link set "lshp$i" netns "$ns"
+        ip -n "$HUB" link set "lshv$i" master br0 up
+        ip -n "$ns" link set "lshp$i" name eth0
+        ip -n "$ns" addr add "$(ip_of "$i")/24" brd + dev eth0
+        ip -n "$ns" link set eth0 up
+        ip -n "$ns" link set lo up
+        shape "$ns" "$args"
+    done
+}
+
+# node 1 shares a folder; the last node decides requests by hand, the rest auto-accept
+start_node() {
+    local i=$1 extra=()
+    [ "$i" = 1 ] && extra+=("--share=$WORK/share")
+    [ "$i" != "$NODES" ] && extra+=("--auto-accept")
+    mkdir -p "$WORK/$i"
+    ip netns exec "lsh-$i" "$BIN/lanshared" eth0 --socket="$WORK/$i.sock" --dir="$WORK/$i" \
+        --device-cache="$WORK/$i.cache" "${extra[@]}" >> "$WORK/$i.log" 2>&1 &
+    PIDS[$((i - 1))]=$!
+}
+
+start_nodes() {
+    mkdir -p "$WORK/share"
+    head -c $((SIZE_MB * 1048576 / 4)) /dev/urandom > "$WORK/share/shared.bin"
+    for i in $(seq 1 "$NODES"); do
+        rm -rf "$WORK/$i" "$WORK/$i.cache" "$WORK/$i.log"
+        start_node "$i"
+    done
+    for i in $(seq 1 "$NODES"); do
+        wait_for 10000 test -S "$WORK/$i.sock" || { echo "node $i did not start, see $WORK/$i.log" >&2; return 1; }
+    done
+}
+
+sees_alive() { ctl "$1" devices 2>/dev/null | grep -q "\"ip\":\"$2\",[^}]*\"status\":\"alive\""; }
+sees_gone() { ! sees_alive "$1" "$2"; }
+sees_listed() { ctl "$1" devices 2>/dev/null | grep -q "\"ip\":\"$2\""; }
+
+# node N lists (listed) or has confirmed (alive) every other node
+lists_all() {
+    for j in $(seq 1 "$NODES"); do
+        [ "$1" = "$j" ] && continue
+        "$2" "$1" "$(ip_of "$j")" || return 1
+    done
+}
+
+all_converged() {
+    for i in $(seq 1 "$NODES"); do
+        for j in $(seq 1 "$NODES"); do
+            [ "$i" = "$j" ] && continue
+            sees_alive "$i" "$(ip_of "$j")" || return 1
+        done
+    done
+}
+
+# the file under node N's recv/ matches the original
+arrived() { cmp -s "$2" "$WORK/$1/recv/$3"; }
+
+# MB/s over ms milliseconds
+mbps() { awk -v b="$1" -v ms="$2" 'BEGIN { printf "%.2f", (ms > 0 ? b / 1048576 / (ms / 1000) : 0) }'; }
+
+pending_id() {
+    ctl "$1" requests | grep -o '"id":[0-9]*,[^}]*"file":"'"$2"'","decision":"pending"' | head -1 |
+        sed 's/"id":\([0-9]*\).*/\1/'
+}
+
+has_pending() { [ -n "$(pending_id "$1" "$2")" ]; }
+finds() { ctl "$1" search "$2" | grep -q "\"ip\":\"$3\""; }
+
+job_id() { sed -n 's/.*"id":\([0-9]*\).*/\1/p'; }
+
+run_profile() {
+    local profile=$1 p="profile=$profile;nodes=$NODES"
+    echo "== profile $profile"
+    setup_network "$profile"
+    # convergence counts from the first daemon's start
+    local started
+    started=$(now_ms)
+    start_nodes || { check "$profile: nodes start" 1; teardown; return; }
+    [ -n "$(profile_netem "$profile")" ] && p="$p;netem=$NETEM"
+
+    # every node lists every other as alive
+    if wait_for 30000 all_converged; then
+        local ms=$(($(now_ms) - started))
+        row discovery "$p" convergence "$ms" ms
+        check "$profile: discovery converged in $ms ms" 0
+    else
+        check "$profile: discovery did not converge within 30 s" 1
+    fi
+
+    local payload=$WORK/payload.bin bytes t0 ms
+    head -c $((SIZE_MB * 1048576)) /dev/urandom > "$payload"
+    bytes=$(stat -c %s "$payload")
+
+    # request, accept (auto) and data, until the file is complete at the receiver
+    t0=$(now_ms)
+    if ctl 1 send --wait "$(ip_of 2)" "$payload" > /dev/null && wait_for 60000 arrived 2 "$payload" payload.bin; then
+        ms=$(($(now_ms) - t0))
+        row send "$p;size_mb=$SIZE_MB" throughput "$(mbps "$bytes" "$ms")" MB/s
+        check "$profile: send $SIZE_MB MB in $ms ms" 0
+    else
+        check "$profile: send" 1
+    fi
+
+    t0=$(now_ms)
+    if ctl 1 stream --name=stream.bin "$(ip_of 3)" < "$payload" > /dev/null &&
+        wait_for 60000 arrived 3 "$payload" stream.bin; then
+        ms=$(($(now_ms) - t0))
+        row stream "$p;size_mb=$SIZE_MB" throughput "$(mbps "$bytes" "$ms")" MB/s
+        check "$profile: stream $SIZE_MB MB in $ms ms" 0
+    else
+        check "$profile: stream" 1
+    fi
+
+    # search finds node 1's shared file once the sketches are in; pull fetches it
+    t0=$(now_ms)
+    if wait_for 10000 finds 3 shared.bin "$(ip_of 1)"; then
+        row search "$p" first_hit "$(($(now_ms) - t0))" ms
+        check "$profile: search" 0
+    else
+        check "$profile: search" 1
+    fi
+    t0=$(now_ms)
+    if ctl 3 pull "$(ip_of 1)" shared.bin > /dev/null && wait_for 60000 arrived 3 "$WORK/share/shared.bin" shared.bin; then
+        ms=$(($(now_ms) - t0))
+        row pull "$p;size_mb=$((SIZE_MB / 4))" throughput "$(mbps "$(stat -c %s "$WORK/share/shared.bin")" "$ms")" MB/s
+        check "$profile: pull" 0
+    else
+        check "$profile: pull" 1
+    fi
+
+    # the manual node: a rejected request fails the job, an accepted one delivers the file
+    local last=$NODES id req state
+    t0=$(now_ms)
+    id=$(ctl 1 send "$(ip_of "$last")" "$payload" | job_id)
+    if wait_for 10000 has_pending "$last" payload.bin; then
+        row request "$p" delivered "$(($(now_ms) - t0))" ms
+    fi
+    req=$(pending_id "$last" payload.bin)
+    [ -n "$req" ] && ctl "$last" reject "$req" > /dev/null
+    state=$(ctl 1 wait "${id:-0}" | sed -n 's/.*"state":"\([a-z]*\)".*/\1/p')
+    check "$profile: reject ends the job as $state" "$([ "$state" = rejected ] && echo 0 || echo 1)"
+
+    id=$(ctl 1 send "$(ip_of "$last")" "$payload" | job_id)
+    wait_for 10000 has_pending "$last" payload.bin
+    req=$(pending_id "$last" payload.bin)
+    [ -n "$req" ] && ctl "$last" accept "$req" > /dev/null
+    if ctl 1 wait "${id:-0}" > /dev/null && wait_for 60000 arrived "$last" "$payload" payload.bin; then
+        check "$profile: accept" 0
+    else
+        check "$profile: accept" 1
+    fi
+
+    # node 2 restarts: its device cache lists the others at once, as unverified until their
+    # probe answers or beacons confirm them
+    kill -TERM "${PIDS[1]}"
+    wait "${PIDS[1]}" 2>/dev/null
+    rm -f "$WORK/2.sock"
+    t0=$(now_ms)
+    start_node 2
+    if wait_for 10000 test -S "$WORK/2.sock" && wait_for 10000 lists_all 2 sees_listed; then
+        ms=$(($(now_ms) - t0))
+        row warm_start "$p" peer_list "$ms" ms
+        if wait_for 30000 lists_all 2 sees_alive; then
+            row warm_start "$p" verified "$(($(now_ms) - t0))" ms
+            check "$profile: restart lists peers in $ms ms" 0
+        else
+            check "$profile: cached peers never confirmed after restart" 1
+        fi
+    else
+        check "$profile: restart did not list peers" 1
+    fi
+
+    # the last node leaves; everyone else should notice from its shutdown beacon
+    local gone_ip
+    gone_ip=$(ip_of "$last")
+    kill -TERM "${PIDS[$((last - 1))]}"
+    t0=$(now_ms)
+    local ok=0
+    for i in $(seq 1 $((NODES - 1))); do
+        wait_for 30000 sees_gone "$i" "$gone_ip" || ok=1
+    done
+    if [ "$ok" = 0 ]; then
+        ms=$(($(now_ms) - t0))
+        row shutdown "$p" propagation "$ms" ms
+        check "$profile: shutdown seen by all in $ms ms" 0
+    else
+        check "$profile: shutdown not seen by every node within 30 s" 1
+    fi
+
+    teardown
+}
+
+teardown
+IFS=, read -r -a profile_list <<< "$PROFILES"
+for profile in "${profile_list[@]}"; do run_profile "$profile"; done
+
+printf '\n%-10s %-42s %-12s %12s %s\n' case params metric value unit
+for r in "${ROWS[@]}"; do
+    IFS='|' read -r c params m v u <<< "$r"
+    printf '%-10s %-42s %-12s %12s %s\n' "$c" "$params" "$m" "$v" "$u"
+done
+
+mkdir -p "$(dirname "$OUT")"
+{
+    printf '{\n  "bench": "netns",\n  "host": "%s",\n  "timestamp": %s,\n  "results": [\n' "$(hostname)" "$(date +%s)"
+    n=${#ROWS[@]}
+    for k in "${!ROWS[@]}"; do
+        IFS='|' read -r c params m v u <<< "${ROWS[$k]}"
+        sep=,
+        [ $((k + 1)) = "$n" ] && sep=
+        printf '    {"case": "%s", "params": "%s", "metric": "%s", "value": %s, "unit": "%s"}%s\n' \
+            "$c" "$params" "$m" "$v" "$u" "$sep"
+    done
+    printf '  ]\n}\n'
+} > "$OUT"
+echo "$PASSED passed, $FAILED failed; results in $OUT"
+[ "$FAILED" = 0 ]